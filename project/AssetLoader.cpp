@@ -0,0 +1,186 @@
+#include "AssetLoader.h"
+#include "MeshCache.h"
+
+#include <algorithm>
+#include <iomanip>
+
+using namespace std;
+
+// Converts a file name to a narrow string for the timeline, the names are plain ASCII
+static std::string AssetName(const maybewchar *file_name)
+{
+	std::string name;
+	for (const maybewchar *c = file_name; *c; c++)
+		name += char(*c);
+	return name;
+}
+
+AssetLoader::AssetLoader(unsigned thread_count)
+	: start_time(chrono::steady_clock::now()), pending_assets(0), pool(thread_count)
+{
+}
+
+AssetLoader::~AssetLoader()
+{
+	Finish();
+}
+
+double AssetLoader::Now() const
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start_time).count();
+}
+
+size_t AssetLoader::BeginAsset(const std::string &name)
+{
+	AssetTiming timing;
+	timing.name = name;
+	timing.worker = 0;
+	timing.decode_start = timing.decode_end = timing.upload_start = timing.upload_end = 0.0;
+	timing.failed = false;
+
+	lock_guard<std::mutex> lock(state_mutex);
+	timeline.push_back(timing);
+	pending_assets++;
+	return timeline.size() - 1;
+}
+
+void AssetLoader::DecodeStarted(size_t index, unsigned worker)
+{
+	double now = Now();
+	lock_guard<std::mutex> lock(state_mutex);
+	timeline[index].worker = worker;
+	timeline[index].decode_start = now;
+}
+
+void AssetLoader::DecodeFinished(size_t index, bool success, std::function<void()> upload)
+{
+	double now = Now();
+	{
+		lock_guard<std::mutex> lock(state_mutex);
+		timeline[index].decode_end = now;
+		timeline[index].failed = !success;
+		uploads.push_back(make_pair(index, std::move(upload)));
+	}
+	upload_condition.notify_one();
+}
+
+void AssetLoader::ProcessUploads(bool wait)
+{
+	std::vector<std::pair<size_t, std::function<void()>>> ready;
+	{
+		unique_lock<std::mutex> lock(state_mutex);
+		if (wait)
+			upload_condition.wait(lock, [this] { return !uploads.empty() || pending_assets == 0; });
+		ready.swap(uploads);
+	}
+
+	for (size_t i = 0; i < ready.size(); i++)
+	{
+		double upload_start = Now();
+		ready[i].second();
+		double upload_end = Now();
+
+		lock_guard<std::mutex> lock(state_mutex);
+		timeline[ready[i].first].upload_start = upload_start;
+		timeline[ready[i].first].upload_end = upload_end;
+		pending_assets--;
+	}
+}
+
+void AssetLoader::Finish()
+{
+	for (;;)
+	{
+		{
+			lock_guard<std::mutex> lock(state_mutex);
+			if (pending_assets == 0)
+				return;
+		}
+		ProcessUploads(true);
+	}
+}
+
+void AssetLoader::PrintTimeline(std::ostream &out) const
+{
+	lock_guard<std::mutex> lock(state_mutex);
+
+	size_t name_width = 5;
+	for (size_t i = 0; i < timeline.size(); i++)
+		name_width = std::max(name_width, timeline[i].name.size());
+
+	out << "Asset loading timeline (" << pool.ThreadCount() << " workers, ms since start):" << endl;
+	out << "  " << left << setw(int(name_width)) << "asset" << "  worker      decode         upload" << endl;
+
+	double total = 0.0;
+	double sum = 0.0;
+	double slowest = 0.0;
+	std::string slowest_name;
+	out << fixed << setprecision(1);
+	for (size_t i = 0; i < timeline.size(); i++)
+	{
+		const AssetTiming &t = timeline[i];
+		out << "  " << left << setw(int(name_width)) << t.name << "  " << right << setw(6) << t.worker
+			<< "  " << setw(6) << t.decode_start << " - " << setw(6) << t.decode_end
+			<< "  " << setw(6) << t.upload_start << " - " << setw(6) << t.upload_end
+			<< (t.failed ? "  FAILED" : "") << endl;
+
+		double duration = (t.decode_end - t.decode_start) + (t.upload_end - t.upload_start);
+		sum += duration;
+		total = std::max(total, t.upload_end);
+		if (duration > slowest)
+		{
+			slowest = duration;
+			slowest_name = t.name;
+		}
+	}
+	out << "Loaded " << timeline.size() << " assets in " << total << " ms, sum of asset times " << sum
+		<< " ms, slowest asset " << slowest_name << " " << slowest << " ms" << endl;
+	out.unsetf(ios::floatfield);
+	out << setprecision(6);
+}
+
+//-----------------------------------------
+//----           ASSET TYPES           ----
+//-----------------------------------------
+
+Asset<PV112::Geometry> AssetLoader::LoadOBJ(const char *file_name, GLint position_location, GLint normal_location, GLint tex_coord_location)
+{
+	std::string name = file_name;
+	return Load<PV112::Geometry, MeshCacheData>(name,
+		[name](MeshCacheData &data) {
+			return PrepareMeshCache(name.c_str(), data);
+		},
+		[position_location, normal_location, tex_coord_location](const MeshCacheData &data) {
+			return CreateMeshCacheGeometry(data.header, position_location, normal_location, tex_coord_location);
+		});
+}
+
+Asset<GLuint> AssetLoader::LoadTexture(const maybewchar *file_name, TextureCompression compression)
+{
+	if (compression == TEXTURE_COMPRESS_COLOR)
+		compression = SupportedColorCompression();
+
+	// The mip chain of a texture that is not cached yet is built on the loader threads as well
+	std::basic_string<maybewchar> path = file_name;
+	ThreadPool *build_pool = &pool;
+	return Load<GLuint, TextureCacheData>(AssetName(file_name),
+		[path, compression, build_pool](TextureCacheData &data) {
+			return PrepareTextureCache(path.c_str(), compression, build_pool, data);
+		},
+		[](const TextureCacheData &data) {
+			return CreateCachedTexture(data.header);
+		});
+}
+
+Asset<Terrain> AssetLoader::LoadHeightmapTerrain(const maybewchar *file_name, GLint position_location, GLint normal_location, GLint tex_coord_location)
+{
+	std::basic_string<maybewchar> path = file_name;
+	return Load<Terrain, TerrainData>(AssetName(file_name),
+		[path](TerrainData &data) {
+			BuildHeightmapTerrain(path.c_str(), data);
+			return true;
+		},
+		[position_location, normal_location, tex_coord_location](const TerrainData &data) {
+			return CreateTerrain(data, position_location, normal_location, tex_coord_location);
+		});
+}
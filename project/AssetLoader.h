@@ -0,0 +1,172 @@
+#pragma once
+#ifndef INCLUDED_ASSET_LOADER_H
+#define INCLUDED_ASSET_LOADER_H
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "PV112.h"
+#include "HeightmapTerrain.h"
+#include "TextureCache.h"
+#include "ThreadPool.h"
+
+class AssetLoader;
+
+/// Handle of an asset requested from AssetLoader
+template<class T> class Asset
+{
+public:
+	Asset() : loader(nullptr) {}
+
+	/// Returns true when the asset is uploaded and Get will not block
+	bool IsReady() const
+	{
+		return future.valid() && future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}
+
+	/// Returns the asset, processes uploads of the loader until it is ready. Must be called on the GL thread.
+	/// Rethrows the exception thrown when the asset was decoded, if any.
+	const T &Get() const;
+
+private:
+	friend class AssetLoader;
+
+	AssetLoader *loader;
+	std::shared_future<T> future;
+};
+
+/// Loads assets in two stages: file reading, parsing and decoding run as jobs on a thread pool, and the decoded
+/// CPU side data are queued back to the GL thread, which creates the OpenGL objects in ProcessUploads. All assets
+/// can be requested up front, the total loading time is then bounded by the slowest asset instead of the sum.
+///
+/// All methods except the decode callbacks must be called on the GL thread.
+class AssetLoader
+{
+public:
+	explicit AssetLoader(unsigned thread_count = ThreadPool::DefaultThreadCount());
+
+	/// Finishes all requested assets
+	~AssetLoader();
+
+	/// Loads an OBJ file like PV112::LoadOBJ, the mesh cache is mapped or built on a worker
+	Asset<PV112::Geometry> LoadOBJ(const char *file_name, GLint position_location, GLint normal_location, GLint tex_coord_location);
+
+	/// Loads a GL_TEXTURE_2D texture with all mip levels from its texture cache (see PrepareTextureCache), the
+	/// cache is mapped, or the image decoded and the cache built, on a worker. TEXTURE_COMPRESS_COLOR falls back to
+	/// uncompressed levels when the context does not support S3TC.
+	Asset<GLuint> LoadTexture(const maybewchar *file_name, TextureCompression compression = TEXTURE_COMPRESS_COLOR);
+
+	/// Loads a terrain like LoadHeightmapTerrain, the heightmap is decoded and the vertices computed on a worker
+	Asset<Terrain> LoadHeightmapTerrain(const maybewchar *file_name, GLint position_location, GLint normal_location, GLint tex_coord_location);
+
+	/// Requests a general asset: 'decode' fills the CPU side data on a worker thread and returns false on failure,
+	/// 'upload' creates the asset from the data on the GL thread. Failed assets are default constructed.
+	template<class T, class Data>
+	Asset<T> Load(const std::string &name, std::function<bool(Data &)> decode, std::function<T(const Data &)> upload);
+
+	/// Runs the uploads of decoded assets on the calling (GL) thread. If 'wait' is true and some assets are still
+	/// being decoded, blocks until at least one upload is ready.
+	void ProcessUploads(bool wait);
+
+	/// Processes uploads until all requested assets are finished
+	void Finish();
+
+	/// Prints when each asset was decoded and uploaded, on which worker, and the total time compared with the
+	/// sum of the times of all assets
+	void PrintTimeline(std::ostream &out) const;
+
+private:
+	AssetLoader(const AssetLoader &);
+	AssetLoader &operator =(const AssetLoader &);
+
+	struct AssetTiming
+	{
+		std::string name;
+		unsigned worker;
+		double decode_start;
+		double decode_end;
+		double upload_start;
+		double upload_end;
+		bool failed;
+	};
+
+	// Milliseconds since the construction of the loader
+	double Now() const;
+
+	// Adds a record of a new asset and returns its index
+	size_t BeginAsset(const std::string &name);
+
+	// Called on a worker when decoding starts and ends
+	void DecodeStarted(size_t index, unsigned worker);
+	void DecodeFinished(size_t index, bool success, std::function<void()> upload);
+
+	std::chrono::steady_clock::time_point start_time;
+
+	// Guards everything below
+	mutable std::mutex state_mutex;
+	std::condition_variable upload_condition;
+	std::vector<std::pair<size_t, std::function<void()>>> uploads;
+	std::vector<AssetTiming> timeline;
+	size_t pending_assets;
+
+	// Destroyed first, joining the decode jobs, which still record their timing and queue their uploads above
+	ThreadPool pool;
+};
+
+template<class T>
+const T &Asset<T>::Get() const
+{
+	while (!IsReady() && loader)
+		loader->ProcessUploads(true);
+	return future.get();
+}
+
+template<class T, class Data>
+Asset<T> AssetLoader::Load(const std::string &name, std::function<bool(Data &)> decode, std::function<T(const Data &)> upload)
+{
+	std::shared_ptr<std::promise<T>> promise = std::make_shared<std::promise<T>>();
+	Asset<T> asset;
+	asset.loader = this;
+	asset.future = promise->get_future().share();
+
+	size_t index = BeginAsset(name);
+	pool.Submit([this, index, decode, upload, promise](unsigned worker) {
+		DecodeStarted(index, worker);
+
+		std::shared_ptr<Data> data = std::make_shared<Data>();
+		std::exception_ptr error;
+		bool success = false;
+		try
+		{
+			success = decode(*data);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		DecodeFinished(index, success, [data, success, error, upload, promise]() {
+			if (error)
+			{
+				promise->set_exception(error);
+				return;
+			}
+			try
+			{
+				promise->set_value(success ? upload(*data) : T());
+			}
+			catch (...)
+			{
+				promise->set_exception(std::current_exception());
+			}
+		});
+	});
+	return asset;
+}
+
+#endif	// INCLUDED_ASSET_LOADER_H
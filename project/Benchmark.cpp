@@ -0,0 +1,212 @@
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+BenchmarkSettings::BenchmarkSettings()
+	: enabled(false), warmup_frames(30), frames(300), width(1280), height(720), depth_prepass(false)
+{
+}
+
+bool ParseBenchmarkSize(const char *text, int &out_width, int &out_height)
+{
+	int width = 0, height = 0;
+	if (sscanf(text, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+		return false;
+	out_width = width;
+	out_height = height;
+	return true;
+}
+
+BenchmarkCameraPose BenchmarkCameraPath(float t)
+{
+	const float two_pi = 6.28318531f;
+	float angle = two_pi * t;
+
+	// A circle around the center of the terrain, looking inwards and turning to both sides
+	BenchmarkCameraPose pose;
+	pose.x = 25.0f * cosf(angle);
+	pose.z = 25.0f * sinf(angle);
+	pose.direction = angle + 0.5f * two_pi + 0.6f * sinf(2.0f * angle);
+	pose.elevation = 0.15f + 0.1f * sinf(3.0f * angle);
+	return pose;
+}
+
+void BenchmarkReport::Write(std::ostream &out, const BenchmarkSettings &settings, const std::string &renderer,
+	const std::vector<ProfileScopeStats> &scopes) const
+{
+	std::vector<double> times;
+	double total_time = 0.0;
+	double draw_calls = 0.0, instances = 0.0, triangles_all_passes = 0.0;
+	for (size_t i = 0; i < frames.size(); i++)
+	{
+		times.push_back(frames[i].frame_time * 1000.0);
+		total_time += frames[i].frame_time;
+		draw_calls += frames[i].draw_calls;
+		instances += double(frames[i].instances);
+		triangles_all_passes += double(frames[i].triangles_all_passes);
+	}
+	std::sort(times.begin(), times.end());
+	double count = std::max(double(frames.size()), 1.0);
+
+	out << std::fixed << std::setprecision(3);
+	out << "{" << std::endl;
+	out << "  \"renderer\": ";
+	WriteJSONString(out, renderer);
+	out << "," << std::endl;
+	out << "  \"width\": " << settings.width << "," << std::endl;
+	out << "  \"height\": " << settings.height << "," << std::endl;
+	out << "  \"warmup_frames\": " << settings.warmup_frames << "," << std::endl;
+	out << "  \"frames\": " << frames.size() << "," << std::endl;
+	if (!settings.replay_file.empty())
+	{
+		out << "  \"replay\": ";
+		WriteJSONString(out, settings.replay_file);
+		out << "," << std::endl;
+	}
+	out << "  \"depth_prepass\": " << (settings.depth_prepass ? "true" : "false") << "," << std::endl;
+	out << "  \"fps\": " << (total_time > 0.0 ? double(frames.size()) / total_time : 0.0) << "," << std::endl;
+	out << "  \"frame_time_ms\": { \"average\": " << (total_time * 1000.0 / count)
+		<< ", \"min\": " << (times.empty() ? 0.0 : times.front())
+		<< ", \"p50\": " << Percentile(times, 0.50)
+		<< ", \"p90\": " << Percentile(times, 0.90)
+		<< ", \"p95\": " << Percentile(times, 0.95)
+		<< ", \"p99\": " << Percentile(times, 0.99)
+		<< ", \"max\": " << (times.empty() ? 0.0 : times.back()) << " }," << std::endl;
+	out << "  \"draw_calls_per_frame\": " << draw_calls / count << "," << std::endl;
+	out << "  \"instances_per_frame\": " << instances / count << "," << std::endl;
+	out << "  \"triangles_all_passes_per_frame\": " << triangles_all_passes / count << "," << std::endl;
+
+	out << "  \"scopes\": [";
+	for (size_t i = 0; i < scopes.size(); i++)
+	{
+		out << (i == 0 ? "" : ",") << std::endl << "    { \"name\": ";
+		WriteJSONString(out, scopes[i].name);
+		out << ", \"gpu\": " << (scopes[i].gpu ? "true" : "false") << ", \"samples\": " << scopes[i].samples
+			<< ", \"p50\": " << scopes[i].p50 << ", \"p95\": " << scopes[i].p95 << ", \"p99\": " << scopes[i].p99 << " }";
+	}
+	out << std::endl << "  ]" << std::endl;
+	out << "}" << std::endl;
+}
+
+bool BenchmarkReport::WriteTrace(const std::string &file_name) const
+{
+	std::ofstream out(file_name.c_str());
+	out << "frame,frame_time_ms,draw_calls,instances,triangles_all_passes" << std::endl;
+	out << std::fixed << std::setprecision(4);
+	for (size_t i = 0; i < frames.size(); i++)
+		out << i << "," << frames[i].frame_time * 1000.0 << "," << frames[i].draw_calls << "," << frames[i].instances << ","
+			<< frames[i].triangles_all_passes << std::endl;
+	if (!out)
+	{
+		std::cout << "Cannot write the benchmark trace " << file_name << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool LoadBenchmarkTrace(const std::string &file_name, std::vector<BenchmarkFrame> &out_frames)
+{
+	std::ifstream in(file_name.c_str());
+	if (!in)
+	{
+		std::cout << "Cannot read the benchmark trace " << file_name << std::endl;
+		return false;
+	}
+
+	out_frames.clear();
+	std::string line;
+	std::getline(in, line);
+	while (std::getline(in, line))
+	{
+		unsigned int frame = 0;
+		double frame_time = 0.0;
+		BenchmarkFrame measured;
+		if (sscanf(line.c_str(), "%u,%lf,%u,%llu,%llu", &frame, &frame_time, &measured.draw_calls, &measured.instances,
+			&measured.triangles_all_passes) != 5)
+			continue;
+		measured.frame_time = frame_time / 1000.0;
+		out_frames.push_back(measured);
+	}
+	return true;
+}
+
+// Returns the frame times in milliseconds, sorted
+static std::vector<double> SortedFrameTimes(const std::vector<BenchmarkFrame> &frames, size_t count)
+{
+	std::vector<double> times;
+	for (size_t i = 0; i < count; i++)
+		times.push_back(frames[i].frame_time * 1000.0);
+	std::sort(times.begin(), times.end());
+	return times;
+}
+
+void CompareBenchmarkTraces(const std::vector<BenchmarkFrame> &baseline, const std::vector<BenchmarkFrame> &candidate,
+	std::ostream &out)
+{
+	size_t count = std::min(baseline.size(), candidate.size());
+	std::ostringstream log;
+	log << std::fixed << std::setprecision(3);
+	log << "Frames: " << baseline.size() << " baseline, " << candidate.size() << " candidate, " << count << " compared" << std::endl;
+	if (count == 0)
+	{
+		out << log.str();
+		return;
+	}
+
+	std::vector<double> baseline_times = SortedFrameTimes(baseline, count);
+	std::vector<double> candidate_times = SortedFrameTimes(candidate, count);
+	double baseline_total = 0.0, candidate_total = 0.0;
+	for (size_t i = 0; i < count; i++)
+	{
+		baseline_total += baseline_times[i];
+		candidate_total += candidate_times[i];
+	}
+
+	static const char *names[] = { "average", "p50", "p95", "p99", "max" };
+	double baseline_values[] = { baseline_total / count, Percentile(baseline_times, 0.50), Percentile(baseline_times, 0.95),
+		Percentile(baseline_times, 0.99), baseline_times.back() };
+	double candidate_values[] = { candidate_total / count, Percentile(candidate_times, 0.50), Percentile(candidate_times, 0.95),
+		Percentile(candidate_times, 0.99), candidate_times.back() };
+	log << "Frame times in ms (baseline -> candidate):" << std::endl;
+	for (int i = 0; i < 5; i++)
+		log << "  " << names[i] << ": " << baseline_values[i] << " -> " << candidate_values[i] << " ("
+			<< std::showpos << (baseline_values[i] > 0.0 ? (candidate_values[i] / baseline_values[i] - 1.0) * 100.0 : 0.0)
+			<< std::noshowpos << "%)" << std::endl;
+
+	// The same frame of both runs, so a regression of a part of the path is not hidden by the percentiles
+	unsigned int slower = 0, faster = 0, different_scene = 0;
+	std::vector<std::pair<double, size_t>> regressions;
+	for (size_t i = 0; i < count; i++)
+	{
+		double ratio = baseline[i].frame_time > 0.0 ? candidate[i].frame_time / baseline[i].frame_time - 1.0 : 0.0;
+		if (ratio > BENCHMARK_COMPARE_THRESHOLD)
+			slower++;
+		else if (ratio < -BENCHMARK_COMPARE_THRESHOLD)
+			faster++;
+		if (baseline[i].triangles_all_passes != candidate[i].triangles_all_passes)
+			different_scene++;
+		regressions.push_back(std::make_pair(ratio, i));
+	}
+	log << "Frames slower by more than " << int(BENCHMARK_COMPARE_THRESHOLD * 100.0 + 0.5) << "%: " << slower << ", faster: " << faster << std::endl;
+
+	size_t shown = std::min(regressions.size(), size_t(5));
+	std::partial_sort(regressions.begin(), regressions.begin() + shown, regressions.end(),
+		[](const std::pair<double, size_t> &a, const std::pair<double, size_t> &b) { return a.first > b.first; });
+	log << "Largest regressions:" << std::endl;
+	for (size_t i = 0; i < shown; i++)
+	{
+		size_t frame = regressions[i].second;
+		log << "  frame " << frame << ": " << baseline[frame].frame_time * 1000.0 << " -> " << candidate[frame].frame_time * 1000.0
+			<< " ms (" << std::showpos << regressions[i].first * 100.0 << std::noshowpos << "%)" << std::endl;
+	}
+
+	if (different_scene > 0)
+		log << "Warning: " << different_scene << " frames have different triangle counts, the builds draw different geometry or the runs did not replay the same frames" << std::endl;
+	out << log.str();
+}
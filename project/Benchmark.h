@@ -0,0 +1,94 @@
+#pragma once
+#ifndef INCLUDED_BENCHMARK_H
+#define INCLUDED_BENCHMARK_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Profiler.h"
+
+/// Seed of the scene in the benchmark unless another one is given, so all runs place the same trees
+static const unsigned int BENCHMARK_SCENE_SEED = 1;
+
+/// Frames slower or faster than the baseline by more than this fraction are counted by CompareBenchmarkTraces
+static const double BENCHMARK_COMPARE_THRESHOLD = 0.1;
+
+/// Settings of the headless benchmark, see the --benchmark options in main
+struct BenchmarkSettings
+{
+	BenchmarkSettings();
+
+	bool enabled;
+	// Frames rendered before the measured ones, while the caches warm up
+	int warmup_frames;
+	int frames;
+	int width;
+	int height;
+	// File the report is written to, the standard output if empty
+	std::string report_file;
+	// File the measurements of each frame are written to, for CompareBenchmarkTraces, none if empty
+	std::string trace_file;
+	// Input recording the camera follows instead of the scripted path, one frame per recorded step
+	std::string replay_file;
+	// Whether the renderer draws the depth pre-pass, copied to the report so runs with and without it can be told apart
+	bool depth_prepass;
+};
+
+/// Parses a resolution like "1280x720", returns false if it is not valid
+bool ParseBenchmarkSize(const char *text, int &out_width, int &out_height);
+
+/// Position of the eye on the terrain and the view angles in radians (see BlinkCamera::SetView)
+struct BenchmarkCameraPose
+{
+	float x;
+	float z;
+	float direction;
+	float elevation;
+};
+
+/// Returns the pose of the scripted camera path at 't' from 0 to 1. The path circles the lake looking over the
+/// water and the forest, it is the same in all runs so the reports can be compared.
+BenchmarkCameraPose BenchmarkCameraPath(float t);
+
+/// Measurements of one frame
+struct BenchmarkFrame
+{
+	double frame_time;
+	unsigned int draw_calls;
+	unsigned long long instances;
+	// Primitives generated by all passes of the frame together: the reflection, the depth pre-pass, the main pass
+	// and the overlay
+	unsigned long long triangles_all_passes;
+};
+
+/// Collects the measured frames and writes the report
+class BenchmarkReport
+{
+public:
+	void AddFrame(const BenchmarkFrame &frame) { frames.push_back(frame); }
+
+	/// Writes the report as one JSON object: the settings, the renderer, frame time percentiles in milliseconds,
+	/// the counters per frame and the percentiles of the profiler scopes
+	void Write(std::ostream &out, const BenchmarkSettings &settings, const std::string &renderer,
+		const std::vector<ProfileScopeStats> &scopes) const;
+
+	/// Writes the measurements of each frame as CSV. Returns false and prints an error if the file cannot be written.
+	bool WriteTrace(const std::string &file_name) const;
+
+	const std::vector<BenchmarkFrame> &Frames() const { return frames; }
+
+private:
+	std::vector<BenchmarkFrame> frames;
+};
+
+/// Reads the frames of a trace written by BenchmarkReport::WriteTrace. Returns false and prints an error if the file
+/// cannot be read.
+bool LoadBenchmarkTrace(const std::string &file_name, std::vector<BenchmarkFrame> &out_frames);
+
+/// Compares the frame times of two runs of the same frames, like two builds replaying one recording: the
+/// percentiles of both, the frames that got slower or faster and the frames with the largest regression. Frames
+/// with different triangle counts are reported, their scenes differ.
+void CompareBenchmarkTraces(const std::vector<BenchmarkFrame> &baseline, const std::vector<BenchmarkFrame> &candidate,
+	std::ostream &out);
+
+#endif	// INCLUDED_BENCHMARK_H
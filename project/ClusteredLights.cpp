@@ -0,0 +1,315 @@
+#include "ClusteredLights.h"
+#include "PerfCounters.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CLUSTERED_LIGHTS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+static const int CLUSTER_TILES = CLUSTER_TILES_X * CLUSTER_TILES_Y;
+
+// Arrays of the scratch buffer, each has one float per light padded to a multiple of 4
+enum ScratchArray
+{
+	SCRATCH_X,
+	SCRATCH_Y,
+	SCRATCH_Z,
+	SCRATCH_RANGE,
+	SCRATCH_NDC_X_MIN,
+	SCRATCH_NDC_X_MAX,
+	SCRATCH_NDC_Y_MIN,
+	SCRATCH_NDC_Y_MAX,
+	SCRATCH_DEPTH_MIN,
+	SCRATCH_DEPTH_MAX,
+	SCRATCH_ARRAY_COUNT
+};
+
+//-----------------------------------------
+//----           LIGHT GRID            ----
+//-----------------------------------------
+
+ClusterLightGrid::ClusterLightGrid()
+	: max_indices(~size_t(0)), slice_indices(CLUSTER_SLICES), grid(2 * CLUSTER_COUNT, 0)
+{
+	uniforms.cluster_scale = glm::vec4(0.0f);
+	uniforms.cluster_size = glm::ivec4(CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES, 0);
+	stats.visible_lights = 0;
+	stats.light_indices = 0;
+	stats.max_cluster_lights = 0;
+}
+
+// Converts a coordinate from -1 to 1 to a tile, clamped to the grid
+static short TileOf(float ndc, int tiles)
+{
+	int tile = int(floorf((std::min(std::max(ndc, -1.0f), 1.0f) * 0.5f + 0.5f) * float(tiles)));
+	return short(std::min(std::max(tile, 0), tiles - 1));
+}
+
+void ClusterLightGrid::ComputeBounds(const std::vector<PointLight> &lights, const glm::mat4 &view_matrix,
+	const glm::mat4 &projection_matrix, float near_plane, float far_plane)
+{
+	size_t count = std::min(lights.size(), size_t(CLUSTER_MAX_LIGHTS));
+	size_t padded = (count + 3) & ~size_t(3);
+	scratch.assign(padded * SCRATCH_ARRAY_COUNT, 0.0f);
+	float *arrays[SCRATCH_ARRAY_COUNT];
+	for (int i = 0; i < SCRATCH_ARRAY_COUNT; i++)
+		arrays[i] = scratch.data() + i * padded;
+	for (size_t i = 0; i < count; i++)
+	{
+		arrays[SCRATCH_X][i] = lights[i].position.x;
+		arrays[SCRATCH_Y][i] = lights[i].position.y;
+		arrays[SCRATCH_Z][i] = lights[i].position.z;
+		arrays[SCRATCH_RANGE][i] = lights[i].range;
+	}
+
+	// The view space position of each light and the bounds of its sphere in the view. The sphere is bounded by a box
+	// in the view space, its x and y are divided by the nearest and the farthest depth of the box, whichever gives
+	// the larger extent, which bounds the projection conservatively. Depths closer than the near plane are clamped
+	// to it, so lights around the eye cover the whole viewport.
+	const float p00 = projection_matrix[0][0];
+	const float p11 = projection_matrix[1][1];
+#if defined(CLUSTERED_LIGHTS_SSE2)
+	const __m128 row_x[4] = { _mm_set1_ps(view_matrix[0][0]), _mm_set1_ps(view_matrix[1][0]), _mm_set1_ps(view_matrix[2][0]), _mm_set1_ps(view_matrix[3][0]) };
+	const __m128 row_y[4] = { _mm_set1_ps(view_matrix[0][1]), _mm_set1_ps(view_matrix[1][1]), _mm_set1_ps(view_matrix[2][1]), _mm_set1_ps(view_matrix[3][1]) };
+	const __m128 row_z[4] = { _mm_set1_ps(view_matrix[0][2]), _mm_set1_ps(view_matrix[1][2]), _mm_set1_ps(view_matrix[2][2]), _mm_set1_ps(view_matrix[3][2]) };
+	const __m128 scale_x = _mm_set1_ps(p00);
+	const __m128 scale_y = _mm_set1_ps(p11);
+	const __m128 near_depth = _mm_set1_ps(near_plane);
+	for (size_t i = 0; i < padded; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(arrays[SCRATCH_X] + i);
+		__m128 y = _mm_loadu_ps(arrays[SCRATCH_Y] + i);
+		__m128 z = _mm_loadu_ps(arrays[SCRATCH_Z] + i);
+		__m128 range = _mm_loadu_ps(arrays[SCRATCH_RANGE] + i);
+
+		__m128 view_x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(row_x[0], x), _mm_mul_ps(row_x[1], y)), _mm_add_ps(_mm_mul_ps(row_x[2], z), row_x[3]));
+		__m128 view_y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(row_y[0], x), _mm_mul_ps(row_y[1], y)), _mm_add_ps(_mm_mul_ps(row_y[2], z), row_y[3]));
+		__m128 view_z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(row_z[0], x), _mm_mul_ps(row_z[1], y)), _mm_add_ps(_mm_mul_ps(row_z[2], z), row_z[3]));
+		__m128 depth = _mm_sub_ps(_mm_setzero_ps(), view_z);
+		__m128 depth_min = _mm_sub_ps(depth, range);
+		__m128 depth_max = _mm_add_ps(depth, range);
+		__m128 inverse_near = _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(depth_min, near_depth));
+		__m128 inverse_far = _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(depth_max, near_depth));
+
+		__m128 x_min = _mm_sub_ps(view_x, range);
+		__m128 x_max = _mm_add_ps(view_x, range);
+		__m128 y_min = _mm_sub_ps(view_y, range);
+		__m128 y_max = _mm_add_ps(view_y, range);
+		_mm_storeu_ps(arrays[SCRATCH_NDC_X_MIN] + i, _mm_mul_ps(scale_x, _mm_min_ps(_mm_mul_ps(x_min, inverse_near), _mm_mul_ps(x_min, inverse_far))));
+		_mm_storeu_ps(arrays[SCRATCH_NDC_X_MAX] + i, _mm_mul_ps(scale_x, _mm_max_ps(_mm_mul_ps(x_max, inverse_near), _mm_mul_ps(x_max, inverse_far))));
+		_mm_storeu_ps(arrays[SCRATCH_NDC_Y_MIN] + i, _mm_mul_ps(scale_y, _mm_min_ps(_mm_mul_ps(y_min, inverse_near), _mm_mul_ps(y_min, inverse_far))));
+		_mm_storeu_ps(arrays[SCRATCH_NDC_Y_MAX] + i, _mm_mul_ps(scale_y, _mm_max_ps(_mm_mul_ps(y_max, inverse_near), _mm_mul_ps(y_max, inverse_far))));
+		_mm_storeu_ps(arrays[SCRATCH_DEPTH_MIN] + i, depth_min);
+		_mm_storeu_ps(arrays[SCRATCH_DEPTH_MAX] + i, depth_max);
+	}
+#else
+	for (size_t i = 0; i < count; i++)
+	{
+		glm::vec4 view = view_matrix * glm::vec4(arrays[SCRATCH_X][i], arrays[SCRATCH_Y][i], arrays[SCRATCH_Z][i], 1.0f);
+		float range = arrays[SCRATCH_RANGE][i];
+		float depth_min = -view.z - range;
+		float depth_max = -view.z + range;
+		float inverse_near = 1.0f / std::max(depth_min, near_plane);
+		float inverse_far = 1.0f / std::max(depth_max, near_plane);
+		float x_min = view.x - range, x_max = view.x + range;
+		float y_min = view.y - range, y_max = view.y + range;
+		arrays[SCRATCH_NDC_X_MIN][i] = p00 * std::min(x_min * inverse_near, x_min * inverse_far);
+		arrays[SCRATCH_NDC_X_MAX][i] = p00 * std::max(x_max * inverse_near, x_max * inverse_far);
+		arrays[SCRATCH_NDC_Y_MIN][i] = p11 * std::min(y_min * inverse_near, y_min * inverse_far);
+		arrays[SCRATCH_NDC_Y_MAX][i] = p11 * std::max(y_max * inverse_near, y_max * inverse_far);
+		arrays[SCRATCH_DEPTH_MIN][i] = depth_min;
+		arrays[SCRATCH_DEPTH_MAX][i] = depth_max;
+	}
+#endif
+
+	// Clusters covered by the bounds, the slices need a logarithm, which SSE2 does not have
+	bounds.resize(count);
+	stats.visible_lights = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		LightBounds &light = bounds[i];
+		float depth_min = arrays[SCRATCH_DEPTH_MIN][i];
+		float depth_max = arrays[SCRATCH_DEPTH_MAX][i];
+		bool visible = depth_max > near_plane && depth_min < far_plane &&
+			arrays[SCRATCH_NDC_X_MIN][i] <= 1.0f && arrays[SCRATCH_NDC_X_MAX][i] >= -1.0f &&
+			arrays[SCRATCH_NDC_Y_MIN][i] <= 1.0f && arrays[SCRATCH_NDC_Y_MAX][i] >= -1.0f;
+		if (!visible)
+		{
+			light.slice_min = 1;
+			light.slice_max = 0;
+			continue;
+		}
+
+		stats.visible_lights++;
+		light.tile_min[0] = TileOf(arrays[SCRATCH_NDC_X_MIN][i], CLUSTER_TILES_X);
+		light.tile_max[0] = TileOf(arrays[SCRATCH_NDC_X_MAX][i], CLUSTER_TILES_X);
+		light.tile_min[1] = TileOf(arrays[SCRATCH_NDC_Y_MIN][i], CLUSTER_TILES_Y);
+		light.tile_max[1] = TileOf(arrays[SCRATCH_NDC_Y_MAX][i], CLUSTER_TILES_Y);
+		int slice_min = int(floorf(logf(std::max(depth_min, near_plane)) * uniforms.cluster_scale.z + uniforms.cluster_scale.w));
+		int slice_max = int(floorf(logf(std::min(depth_max, far_plane)) * uniforms.cluster_scale.z + uniforms.cluster_scale.w));
+		light.slice_min = short(std::min(std::max(slice_min, 0), CLUSTER_SLICES - 1));
+		light.slice_max = short(std::min(std::max(slice_max, 0), CLUSTER_SLICES - 1));
+	}
+}
+
+void ClusterLightGrid::FillSlices(size_t first_slice, size_t end_slice)
+{
+	unsigned int counts[CLUSTER_TILES];
+	for (size_t slice = first_slice; slice < end_slice; slice++)
+	{
+		// Counts the lights of each cluster, then places the lists of the clusters after each other
+		std::fill(counts, counts + CLUSTER_TILES, 0u);
+		for (size_t i = 0; i < bounds.size(); i++)
+		{
+			const LightBounds &light = bounds[i];
+			if (int(slice) < light.slice_min || int(slice) > light.slice_max)
+				continue;
+			for (int y = light.tile_min[1]; y <= light.tile_max[1]; y++)
+				for (int x = light.tile_min[0]; x <= light.tile_max[0]; x++)
+					counts[y * CLUSTER_TILES_X + x]++;
+		}
+
+		unsigned int *slice_grid = &grid[2 * slice * CLUSTER_TILES];
+		unsigned int offset = 0;
+		for (int tile = 0; tile < CLUSTER_TILES; tile++)
+		{
+			slice_grid[2 * tile] = offset;
+			slice_grid[2 * tile + 1] = counts[tile];
+			offset += counts[tile];
+		}
+
+		std::vector<unsigned short> &list = slice_indices[slice];
+		list.resize(offset);
+		for (size_t i = 0; i < bounds.size(); i++)
+		{
+			const LightBounds &light = bounds[i];
+			if (int(slice) < light.slice_min || int(slice) > light.slice_max)
+				continue;
+			for (int y = light.tile_min[1]; y <= light.tile_max[1]; y++)
+				for (int x = light.tile_min[0]; x <= light.tile_max[0]; x++)
+				{
+					unsigned int *cluster = &slice_grid[2 * (y * CLUSTER_TILES_X + x)];
+					list[cluster[0] + cluster[1] - counts[y * CLUSTER_TILES_X + x]--] = (unsigned short)i;
+				}
+		}
+	}
+}
+
+void ClusterLightGrid::Build(const std::vector<PointLight> &lights, const glm::mat4 &view_matrix, const glm::mat4 &projection_matrix,
+	float near_plane, float far_plane, int viewport_width, int viewport_height, ThreadPool *pool)
+{
+	PROFILE_SCOPE("light binning");
+
+	float slice_scale = float(CLUSTER_SLICES) / logf(far_plane / near_plane);
+	uniforms.cluster_scale = glm::vec4(float(CLUSTER_TILES_X) / float(std::max(viewport_width, 1)),
+		float(CLUSTER_TILES_Y) / float(std::max(viewport_height, 1)), slice_scale, -logf(near_plane) * slice_scale);
+
+	ComputeBounds(lights, view_matrix, projection_matrix, near_plane, far_plane);
+
+	// Slices do not share clusters, so they are filled in parallel without synchronization
+	ParallelFor(pool, CLUSTER_SLICES, [this](size_t first_slice, size_t end_slice) {
+		FillSlices(first_slice, end_slice);
+	});
+
+	// The lists of the slices are concatenated, the offsets of their clusters move by the lists before them
+	indices.clear();
+	stats.max_cluster_lights = 0;
+	for (int slice = 0; slice < CLUSTER_SLICES; slice++)
+	{
+		unsigned int base = unsigned(indices.size());
+		size_t available = max_indices > indices.size() ? max_indices - indices.size() : 0;
+		const std::vector<unsigned short> &list = slice_indices[slice];
+		indices.insert(indices.end(), list.begin(), list.begin() + std::min(list.size(), available));
+		for (int tile = 0; tile < CLUSTER_TILES; tile++)
+		{
+			unsigned int *cluster = &grid[2 * (slice * CLUSTER_TILES + tile)];
+			cluster[0] += base;
+			cluster[1] = std::min(cluster[1], unsigned(indices.size()) - std::min(cluster[0], unsigned(indices.size())));
+			stats.max_cluster_lights = std::max(stats.max_cluster_lights, cluster[1]);
+		}
+	}
+	stats.light_indices = unsigned(indices.size());
+}
+
+int ClusterLightGrid::ClusterIndex(float pixel_x, float pixel_y, float view_depth) const
+{
+	int x = int(pixel_x * uniforms.cluster_scale.x);
+	int y = int(pixel_y * uniforms.cluster_scale.y);
+	int slice = int(floorf(logf(std::max(view_depth, 1e-4f)) * uniforms.cluster_scale.z + uniforms.cluster_scale.w));
+	x = std::min(std::max(x, 0), CLUSTER_TILES_X - 1);
+	y = std::min(std::max(y, 0), CLUSTER_TILES_Y - 1);
+	slice = std::min(std::max(slice, 0), CLUSTER_SLICES - 1);
+	return (slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x;
+}
+
+//-----------------------------------------
+//----         BUFFER TEXTURES         ----
+//-----------------------------------------
+
+ClusteredLights::ClusteredLights(GLStateCache &state)
+	: max_texels(65536)
+{
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+	grid.SetMaxIndices(size_t(max_texels));
+
+	static const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R16UI };
+	glGenBuffers(3, buffers);
+	glGenTextures(3, textures);
+	for (int i = 0; i < 3; i++)
+	{
+		glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+		state.BindTexture(CLUSTER_LIGHTS_UNIT + i, GL_TEXTURE_BUFFER, textures[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+ClusteredLights::~ClusteredLights()
+{
+	glDeleteTextures(3, textures);
+	glDeleteBuffers(3, buffers);
+}
+
+// Orphans the buffer and uploads the data, an empty buffer keeps one texel so the texture stays valid
+static void UploadTextureBuffer(GLuint buffer, const void *data, size_t size)
+{
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferData(GL_TEXTURE_BUFFER, GLsizeiptr(std::max(size, size_t(16))), nullptr, GL_STREAM_DRAW);
+	if (size > 0)
+		Counted::BufferSubData(GL_TEXTURE_BUFFER, 0, GLsizeiptr(size), data);
+}
+
+void ClusteredLights::Update(const std::vector<PointLight> &lights, const glm::mat4 &view_matrix, const glm::mat4 &projection_matrix,
+	float near_plane, float far_plane, int viewport_width, int viewport_height, ThreadPool *pool)
+{
+	grid.Build(lights, view_matrix, projection_matrix, near_plane, far_plane, viewport_width, viewport_height, pool);
+
+	size_t count = std::min(lights.size(), size_t(CLUSTER_MAX_LIGHTS));
+	light_texels.resize(4 * count);
+	for (size_t i = 0; i < count; i++)
+	{
+		light_texels[4 * i + 0] = glm::vec4(lights[i].position, lights[i].range);
+		light_texels[4 * i + 1] = glm::vec4(lights[i].ambient_color, 1.0f);
+		light_texels[4 * i + 2] = glm::vec4(lights[i].diffuse_color, 1.0f);
+		light_texels[4 * i + 3] = glm::vec4(lights[i].specular_color, 1.0f);
+	}
+
+	UploadTextureBuffer(buffers[0], light_texels.data(), light_texels.size() * sizeof(glm::vec4));
+	UploadTextureBuffer(buffers[1], grid.Grid().data(), grid.Grid().size() * sizeof(unsigned int));
+	UploadTextureBuffer(buffers[2], grid.Indices().data(), grid.Indices().size() * sizeof(unsigned short));
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void ClusteredLights::Bind(GLStateCache &state) const
+{
+	state.BindTexture(CLUSTER_LIGHTS_UNIT, GL_TEXTURE_BUFFER, textures[0]);
+	state.BindTexture(CLUSTER_GRID_UNIT, GL_TEXTURE_BUFFER, textures[1]);
+	state.BindTexture(CLUSTER_INDICES_UNIT, GL_TEXTURE_BUFFER, textures[2]);
+}
@@ -0,0 +1,145 @@
+#pragma once
+#ifndef INCLUDED_CLUSTERED_LIGHTS_H
+#define INCLUDED_CLUSTERED_LIGHTS_H
+
+#include <vector>
+#include "PV112.h"
+#include "GLStateCache.h"
+#include "ThreadPool.h"
+
+/// Size of the cluster grid, tiles of the viewport in x and y and slices of the view depth
+static const int CLUSTER_TILES_X = 16;
+static const int CLUSTER_TILES_Y = 9;
+static const int CLUSTER_SLICES = 24;
+static const int CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+
+/// Lights beyond this count are dropped, the index lists store 16-bit light indices
+static const unsigned int CLUSTER_MAX_LIGHTS = 4096;
+
+/// Texture units of the buffer textures read by the shaders, above the units of the render packets
+static const unsigned int CLUSTER_LIGHTS_UNIT = 4;
+static const unsigned int CLUSTER_GRID_UNIT = 5;
+static const unsigned int CLUSTER_INDICES_UNIT = 6;
+
+/// Uniform buffer binding of ClusterUniforms
+static const GLuint CLUSTER_UNIFORMS_BINDING = 4;
+
+/// Light with a position and a range, its intensity falls linearly to zero at the range
+struct PointLight
+{
+	glm::vec3 position;
+	float range;
+	glm::vec3 ambient_color;
+	glm::vec3 diffuse_color;
+	glm::vec3 specular_color;
+};
+
+/// Block ClusterData of the shaders, std140
+struct ClusterUniforms
+{
+	// Tiles per pixel in x and y, slices per unit of the logarithm of the view depth and the slice of depth 1
+	glm::vec4 cluster_scale;
+	// Tiles in x and y, slices
+	glm::ivec4 cluster_size;
+};
+
+/// Counters of the last ClusterLightGrid::Build
+struct ClusterStats
+{
+	// Lights in the view, assigned to at least one cluster
+	unsigned int visible_lights;
+	// Entries of the index lists, the light evaluations a fragment could do summed over the clusters
+	unsigned int light_indices;
+	unsigned int max_cluster_lights;
+};
+
+/// Assigns point lights to the clusters of a view on the CPU. The view frustum is divided into CLUSTER_TILES_X x
+/// CLUSTER_TILES_Y tiles of the viewport and CLUSTER_SLICES slices of the view depth, which grow exponentially from
+/// the near to the far plane. Each cluster gets the list of the lights whose range may reach into it, so a fragment
+/// evaluates only the lights near it.
+///
+/// The lights are transformed and their screen bounds computed four at a time with SSE2 where available, the clusters
+/// are filled in parallel by slices.
+class ClusterLightGrid
+{
+public:
+	ClusterLightGrid();
+
+	/// Bins the lights for the view. 'projection_matrix' has to be a symmetric perspective projection with the near
+	/// and far planes given. Runs on the threads of 'pool' if it is not null.
+	void Build(const std::vector<PointLight> &lights, const glm::mat4 &view_matrix, const glm::mat4 &projection_matrix,
+		float near_plane, float far_plane, int viewport_width, int viewport_height, ThreadPool *pool);
+
+	/// Limits the entries of the index lists, the clusters whose lists do not fit lose their last lights
+	void SetMaxIndices(size_t count) { max_indices = count; }
+
+	/// Offset into Indices() and the count of each cluster, two values per cluster, x fastest and slices last
+	const std::vector<unsigned int> &Grid() const { return grid; }
+	const std::vector<unsigned short> &Indices() const { return indices; }
+
+	const ClusterUniforms &Uniforms() const { return uniforms; }
+	const ClusterStats &Stats() const { return stats; }
+
+	/// Returns the index of the cluster of a point in the view, for testing the binning against the shaders
+	int ClusterIndex(float pixel_x, float pixel_y, float view_depth) const;
+
+private:
+	// Clusters covered by a light, inclusive ranges, an empty slice range if the light is not in the view
+	struct LightBounds
+	{
+		short tile_min[2];
+		short tile_max[2];
+		short slice_min;
+		short slice_max;
+	};
+
+	void ComputeBounds(const std::vector<PointLight> &lights, const glm::mat4 &view_matrix, const glm::mat4 &projection_matrix,
+		float near_plane, float far_plane);
+	void FillSlices(size_t first_slice, size_t end_slice);
+
+	size_t max_indices;
+	std::vector<LightBounds> bounds;
+	// Positions and ranges of the lights and their bounds in the view, structure of arrays for SSE
+	std::vector<float> scratch;
+	// Index lists of each slice, concatenated into 'indices' after the slices are filled
+	std::vector<std::vector<unsigned short>> slice_indices;
+	std::vector<unsigned int> grid;
+	std::vector<unsigned short> indices;
+	ClusterUniforms uniforms;
+	ClusterStats stats;
+};
+
+/// Buffer textures with the lights and the clusters of one pass for the shaders: the lights as 4 RGBA32F texels
+/// each (position and range, ambient, diffuse and specular color), the grid as RG32UI and the index lists as R16UI.
+/// Each pass needs its own instance, the buffers are orphaned and filled again every frame.
+class ClusteredLights
+{
+public:
+	/// Creates the buffers and the textures, so the context must be current
+	explicit ClusteredLights(GLStateCache &state);
+
+	/// Deletes the buffers and the textures
+	~ClusteredLights();
+
+	/// Bins the lights for the view and uploads the lights, the grid and the index lists
+	void Update(const std::vector<PointLight> &lights, const glm::mat4 &view_matrix, const glm::mat4 &projection_matrix,
+		float near_plane, float far_plane, int viewport_width, int viewport_height, ThreadPool *pool);
+
+	/// Binds the buffer textures to CLUSTER_LIGHTS_UNIT, CLUSTER_GRID_UNIT and CLUSTER_INDICES_UNIT
+	void Bind(GLStateCache &state) const;
+
+	const ClusterLightGrid &Grid() const { return grid; }
+
+private:
+	ClusteredLights(const ClusteredLights &);
+	ClusteredLights &operator =(const ClusteredLights &);
+
+	ClusterLightGrid grid;
+	std::vector<glm::vec4> light_texels;
+	// Largest number of texels of a buffer texture, the index lists are cut to it
+	GLint max_texels;
+	GLuint buffers[3];
+	GLuint textures[3];
+};
+
+#endif	// INCLUDED_CLUSTERED_LIGHTS_H
@@ -0,0 +1,128 @@
+#include "DynamicUniformBuffer.h"
+#include "PerfCounters.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+// Waits until the fence is signaled and deletes it, returns true if it was not signaled yet
+static bool WaitAndDeleteFence(GLsync fence)
+{
+	GLenum status = glClientWaitSync(fence, 0, 0);
+	bool waited = status == GL_TIMEOUT_EXPIRED;
+	while (status == GL_TIMEOUT_EXPIRED)
+		status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+	glDeleteSync(fence);
+	return waited;
+}
+
+DynamicUniformBuffer::DynamicUniformBuffer(size_t frame_size, unsigned int frame_count)
+	: buffer(0), persistent_data(nullptr), fences(std::max(frame_count, 1u), nullptr), frame(0), frame_used(0),
+	reported_full(false)
+{
+	memset(&stats, 0, sizeof(stats));
+	memset(&last_stats, 0, sizeof(last_stats));
+
+	GLint offset_alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offset_alignment);
+	alignment = size_t(std::max(offset_alignment, 16));
+	this->frame_size = AlignSize(frame_size, alignment);
+	GLsizeiptr buffer_size = GLsizeiptr(this->frame_size * fences.size());
+
+	// The buffer is bound to the copy target, so the uniform buffer bindings known to the state cache stay valid
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	if (GLEW_ARB_buffer_storage)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_COPY_WRITE_BUFFER, buffer_size, nullptr, flags);
+		persistent_data = static_cast<unsigned char *>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, buffer_size, flags));
+	}
+	else
+		glBufferData(GL_COPY_WRITE_BUFFER, buffer_size, nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+DynamicUniformBuffer::~DynamicUniformBuffer()
+{
+	for (size_t i = 0; i < fences.size(); i++)
+		if (fences[i])
+			WaitAndDeleteFence(fences[i]);
+
+	if (persistent_data)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+	glDeleteBuffers(1, &buffer);
+}
+
+void DynamicUniformBuffer::BeginFrame()
+{
+	frame = (frame + 1) % unsigned(fences.size());
+	frame_used = 0;
+	if (fences[frame])
+	{
+		if (WaitAndDeleteFence(fences[frame]))
+			stats.fence_waits++;
+		fences[frame] = nullptr;
+	}
+}
+
+bool DynamicUniformBuffer::Allocate(const void *data, size_t size, DynamicUniformRange &out_range)
+{
+	size_t range_size = UniformBlockRangeSize(size);
+	if (frame_used + range_size > frame_size)
+	{
+		stats.failed_allocations++;
+		if (!reported_full)
+			cout << "Dynamic uniform buffer: the region of a frame is full (" << frame_size << " bytes)" << endl;
+		reported_full = true;
+		return false;
+	}
+
+	size_t offset = frame * frame_size + frame_used;
+	frame_used = std::min(AlignSize(frame_used + range_size, alignment), frame_size);
+
+	if (persistent_data)
+		memcpy(persistent_data + offset, data, size);
+	else
+	{
+		// The fence of the region was signaled in BeginFrame, so nothing reads the range
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		void *target = glMapBufferRange(GL_COPY_WRITE_BUFFER, GLintptr(offset), GLsizeiptr(range_size),
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if (target)
+		{
+			memcpy(target, data, size);
+			glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		}
+		else
+			glBufferSubData(GL_COPY_WRITE_BUFFER, GLintptr(offset), GLsizeiptr(size), data);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+
+	Counted::BufferWrite("dynamic uniforms", size);
+
+	out_range.offset = GLintptr(offset);
+	out_range.size = GLsizeiptr(range_size);
+	stats.bytes_allocated += range_size;
+	stats.allocations++;
+	return true;
+}
+
+void DynamicUniformBuffer::Bind(GLStateCache &state, GLuint binding, const DynamicUniformRange &range) const
+{
+	state.BindUniformBufferRange(binding, buffer, range.offset, range.size);
+}
+
+void DynamicUniformBuffer::EndFrame()
+{
+	fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	last_stats = stats;
+	memset(&stats, 0, sizeof(stats));
+}
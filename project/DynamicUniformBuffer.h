@@ -0,0 +1,86 @@
+#pragma once
+#ifndef INCLUDED_DYNAMIC_UNIFORM_BUFFER_H
+#define INCLUDED_DYNAMIC_UNIFORM_BUFFER_H
+
+#include <vector>
+#include "PV112.h"
+#include "GLStateCache.h"
+
+/// Default number of frames the GPU may be behind the CPU, each has its own region of the buffer
+static const unsigned int DYNAMIC_UNIFORM_FRAMES = 3;
+
+/// Default size of the region of one frame
+static const size_t DYNAMIC_UNIFORM_FRAME_SIZE = 64 << 10;
+
+/// Range of the buffer holding the data of one allocation
+struct DynamicUniformRange
+{
+	GLintptr offset;
+	GLsizeiptr size;
+};
+
+/// Counters of one frame of DynamicUniformBuffer
+struct DynamicUniformStats
+{
+	size_t bytes_allocated;
+	unsigned int allocations;
+	// Allocations that did not fit into the region of the frame
+	unsigned int failed_allocations;
+	// Times BeginFrame had to wait for the GPU to finish with the region
+	unsigned int fence_waits;
+};
+
+/// Uniform data that changes every frame or every pass, like the camera and the lights. One buffer is split into a
+/// region for each frame in flight and the data of a frame is sub-allocated linearly from its region, so each pass
+/// binds its own range instead of overwriting a buffer the GPU may still read.
+///
+/// A fence is placed after the last draw of each frame and the region is reused only after its fence is signaled,
+/// so the writes do not synchronize with the GPU. With ARB_buffer_storage the buffer is mapped once persistently,
+/// otherwise each allocation maps its range with GL_MAP_UNSYNCHRONIZED_BIT.
+class DynamicUniformBuffer
+{
+public:
+	/// Queries the offset alignment, so the context must be current
+	DynamicUniformBuffer(size_t frame_size = DYNAMIC_UNIFORM_FRAME_SIZE, unsigned int frame_count = DYNAMIC_UNIFORM_FRAMES);
+
+	/// Waits for the GPU and deletes the buffer
+	~DynamicUniformBuffer();
+
+	/// Starts the next frame, waits until the GPU finished reading its region
+	void BeginFrame();
+
+	/// Copies the data into the region of the frame. The range is padded to the std140 size of a block. Returns
+	/// false and prints an error if the region is full.
+	bool Allocate(const void *data, size_t size, DynamicUniformRange &out_range);
+
+	/// Binds the range to the uniform buffer binding point
+	void Bind(GLStateCache &state, GLuint binding, const DynamicUniformRange &range) const;
+
+	/// Ends the frame, places the fence of its region. Call after the last draw using the frame's data.
+	void EndFrame();
+
+	/// Returns the counters of the last ended frame
+	const DynamicUniformStats &LastStats() const { return last_stats; }
+
+private:
+	DynamicUniformBuffer(const DynamicUniformBuffer &);
+	DynamicUniformBuffer &operator =(const DynamicUniformBuffer &);
+
+	GLuint buffer;
+	// Start of the persistent mapping, null if the ranges are mapped by each allocation
+	unsigned char *persistent_data;
+	size_t frame_size;
+	size_t alignment;
+
+	// Fence of each region, null if the GPU does not use it
+	std::vector<GLsync> fences;
+	unsigned int frame;
+	size_t frame_used;
+	// The error of a full region is printed only once
+	bool reported_full;
+
+	DynamicUniformStats stats;
+	DynamicUniformStats last_stats;
+};
+
+#endif	// INCLUDED_DYNAMIC_UNIFORM_BUFFER_H
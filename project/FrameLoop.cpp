@@ -0,0 +1,135 @@
+#include "FrameLoop.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#if defined(_WIN32)
+#include <GL/wglew.h>
+#else
+#include <GL/glxew.h>
+#endif
+
+FrameLoop::FrameLoop(double step)
+	: step(step), accumulator(0.0), present_mode(PRESENT_VSYNC), target_fps(FRAME_LOOP_TARGET_FPS), started(false),
+	history(FRAME_TIME_HISTORY, 0.0f), history_next(0), history_count(0)
+{
+}
+
+void FrameLoop::SetPresentMode(PresentMode mode)
+{
+	present_mode = mode;
+	SetSwapInterval(mode == PRESENT_VSYNC ? 1 : 0);
+}
+
+void FrameLoop::SetTargetFrameRate(double frames_per_second)
+{
+	target_fps = std::max(frames_per_second, 1.0);
+}
+
+int FrameLoop::BeginFrame()
+{
+	Clock::time_point now = Clock::now();
+	if (!started)
+	{
+		started = true;
+		frame_start = now;
+		return 0;
+	}
+
+	if (present_mode == PRESENT_PACED)
+	{
+		// Sleeping is not precise, it stops a millisecond early and the rest is waited by yielding
+		Clock::time_point due = frame_start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / target_fps));
+		if (now + std::chrono::milliseconds(1) < due)
+			std::this_thread::sleep_until(due - std::chrono::milliseconds(1));
+		while ((now = Clock::now()) < due)
+			std::this_thread::yield();
+	}
+
+	double elapsed = std::chrono::duration<double>(now - frame_start).count();
+	frame_start = now;
+
+	history[history_next] = float(elapsed * 1000.0);
+	history_next = (history_next + 1) % history.size();
+	history_count = std::min(history_count + 1, history.size());
+
+	accumulator += std::min(elapsed, FRAME_LOOP_MAX_CATCH_UP);
+	int steps = int(accumulator / step);
+	accumulator -= steps * step;
+	return steps;
+}
+
+std::vector<float> FrameLoop::FrameTimes() const
+{
+	std::vector<float> times;
+	times.reserve(history_count);
+	size_t first = (history_next + history.size() - history_count) % history.size();
+	for (size_t i = 0; i < history_count; i++)
+		times.push_back(history[(first + i) % history.size()]);
+	return times;
+}
+
+FrameTimeStats FrameLoop::ComputeStats() const
+{
+	FrameTimeStats stats;
+	memset(&stats, 0, sizeof(stats));
+
+	std::vector<float> times = FrameTimes();
+	if (times.empty())
+		return stats;
+
+	std::sort(times.begin(), times.end());
+	stats.frame_count = unsigned(times.size());
+	stats.minimum = times.front();
+	stats.maximum = times.back();
+	for (size_t i = 0; i < times.size(); i++)
+		stats.average += times[i];
+	stats.average /= float(times.size());
+	stats.percentile_99 = times[std::min(times.size() * 99 / 100, times.size() - 1)];
+	return stats;
+}
+
+//-----------------------------------------
+//----          PRESENT MODES          ----
+//-----------------------------------------
+
+static const char *present_mode_names[PRESENT_MODE_COUNT] = { "vsync", "uncapped", "paced" };
+
+const char *PresentModeName(PresentMode mode)
+{
+	return present_mode_names[mode];
+}
+
+bool ParsePresentMode(const char *name, PresentMode &out_mode)
+{
+	for (int i = 0; i < PRESENT_MODE_COUNT; i++)
+	{
+		if (strcmp(name, present_mode_names[i]) == 0)
+		{
+			out_mode = PresentMode(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool SetSwapInterval(int interval)
+{
+#if defined(_WIN32)
+	if (WGLEW_EXT_swap_control)
+		return wglSwapIntervalEXT(interval) == TRUE;
+#else
+	if (GLXEW_EXT_swap_control)
+	{
+		glXSwapIntervalEXT(glXGetCurrentDisplay(), glXGetCurrentDrawable(), interval);
+		return true;
+	}
+	if (GLXEW_MESA_swap_control)
+		return glXSwapIntervalMESA(unsigned(interval)) == 0;
+	// The SGI extension cannot disable vsync
+	if (GLXEW_SGI_swap_control && interval > 0)
+		return glXSwapIntervalSGI(interval) == 0;
+#endif
+	return false;
+}
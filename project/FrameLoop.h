@@ -0,0 +1,108 @@
+#pragma once
+#ifndef INCLUDED_FRAME_LOOP_H
+#define INCLUDED_FRAME_LOOP_H
+
+#include <chrono>
+#include <vector>
+#include "PV112.h"
+
+/// Default length of one simulation step in seconds
+static const double FRAME_LOOP_STEP = 0.02;
+
+/// Longest time simulated in one frame, a longer stall (like loading or a breakpoint) is dropped instead of being
+/// caught up by many steps at once
+static const double FRAME_LOOP_MAX_CATCH_UP = 0.25;
+
+/// Default frame rate of PRESENT_PACED
+static const double FRAME_LOOP_TARGET_FPS = 60.0;
+
+/// Number of frames kept in the frame time history
+static const size_t FRAME_TIME_HISTORY = 240;
+
+/// How the frames are presented
+enum PresentMode
+{
+	// Swaps wait for the vertical blank
+	PRESENT_VSYNC,
+	// Frames are rendered as fast as possible, for measuring the throughput
+	PRESENT_UNCAPPED,
+	// Frames start at the target frame rate, without vsync
+	PRESENT_PACED,
+	PRESENT_MODE_COUNT
+};
+
+/// Statistics of the frame time history, in milliseconds
+struct FrameTimeStats
+{
+	unsigned int frame_count;
+	float average;
+	float minimum;
+	float maximum;
+	// 99th percentile, the frames slower than most of the others
+	float percentile_99;
+};
+
+/// Drives the frames of the application. The simulation advances in fixed steps, a frame runs the steps that
+/// elapsed since the previous frame and renders the state interpolated between the last two steps, so the speed of
+/// the simulation does not depend on the frame rate and the rendered motion stays smooth.
+///
+/// The loop also applies the present mode and records the time of each frame.
+class FrameLoop
+{
+public:
+	/// 'step' is the length of one simulation step in seconds
+	explicit FrameLoop(double step = FRAME_LOOP_STEP);
+
+	/// Sets the swap interval of the current context, so it must be current
+	void SetPresentMode(PresentMode mode);
+	PresentMode GetPresentMode() const { return present_mode; }
+
+	void SetTargetFrameRate(double frames_per_second);
+	double GetTargetFrameRate() const { return target_fps; }
+
+	/// Starts the next frame. In PRESENT_PACED waits until the frame is due. Records the time since the start of
+	/// the previous frame and returns the number of simulation steps to run before rendering.
+	int BeginFrame();
+
+	/// Position of the rendered frame between the last two simulation steps, from 0 to 1
+	float InterpolationAlpha() const { return float(accumulator / step); }
+
+	double Step() const { return step; }
+
+	/// Returns the recorded frame times in milliseconds, the oldest first
+	std::vector<float> FrameTimes() const;
+
+	FrameTimeStats ComputeStats() const;
+
+private:
+	FrameLoop(const FrameLoop &);
+	FrameLoop &operator =(const FrameLoop &);
+
+	typedef std::chrono::steady_clock Clock;
+
+	double step;
+	// Time not simulated yet, less than one step after BeginFrame
+	double accumulator;
+	PresentMode present_mode;
+	double target_fps;
+
+	bool started;
+	Clock::time_point frame_start;
+
+	// Ring of the frame times in milliseconds
+	std::vector<float> history;
+	size_t history_next;
+	size_t history_count;
+};
+
+/// Returns the name of the mode, as accepted by ParsePresentMode
+const char *PresentModeName(PresentMode mode);
+
+/// Parses "vsync", "uncapped" or "paced", returns false if the name is not known
+bool ParsePresentMode(const char *name, PresentMode &out_mode);
+
+/// Sets the swap interval of the current context, 0 disables vsync. Returns false if the platform does not
+/// support it.
+bool SetSwapInterval(int interval);
+
+#endif	// INCLUDED_FRAME_LOOP_H
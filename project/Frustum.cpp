@@ -0,0 +1,68 @@
+#include "Frustum.h"
+
+#include <algorithm>
+
+Frustum::Frustum()
+	: plane_count(0)
+{
+}
+
+Frustum::Frustum(const glm::mat4 &view_projection)
+	: plane_count(0)
+{
+	// glm matrices are column major, row i of the matrix is (m[0][i], m[1][i], m[2][i], m[3][i])
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; i++)
+		rows[i] = glm::vec4(view_projection[0][i], view_projection[1][i], view_projection[2][i], view_projection[3][i]);
+
+	// Left, right, bottom, top, near and far, -w <= x, y, z <= w in the clip space
+	for (int axis = 0; axis < 3; axis++)
+	{
+		AddPlane(rows[3] + rows[axis]);
+		AddPlane(rows[3] - rows[axis]);
+	}
+}
+
+bool Frustum::AddPlane(const glm::vec4 &plane)
+{
+	if (plane_count >= FRUSTUM_MAX_PLANES)
+		return false;
+
+	// Normalized, so the distance of a point from the plane can be compared with a radius
+	float length = glm::length(glm::vec3(plane));
+	planes[plane_count++] = length > 0.0f ? plane / length : plane;
+	return true;
+}
+
+bool Frustum::IntersectsSphere(const glm::vec4 &sphere) const
+{
+	glm::vec4 center(glm::vec3(sphere), 1.0f);
+	for (int i = 0; i < plane_count; i++)
+		if (glm::dot(planes[i], center) < -sphere.w)
+			return false;
+	return true;
+}
+
+bool Frustum::IntersectsBox(const glm::vec3 &box_min, const glm::vec3 &box_max) const
+{
+	for (int i = 0; i < plane_count; i++)
+	{
+		// The corner of the box farthest along the normal of the plane
+		glm::vec4 corner(
+			planes[i].x >= 0.0f ? box_max.x : box_min.x,
+			planes[i].y >= 0.0f ? box_max.y : box_min.y,
+			planes[i].z >= 0.0f ? box_max.z : box_min.z,
+			1.0f);
+		if (glm::dot(planes[i], corner) < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+glm::vec4 TransformBoundingSphere(const glm::mat4 &model_matrix, const glm::vec4 &sphere)
+{
+	glm::vec3 center = glm::vec3(model_matrix * glm::vec4(glm::vec3(sphere), 1.0f));
+	float scale = std::max(glm::length(glm::vec3(model_matrix[0])),
+		std::max(glm::length(glm::vec3(model_matrix[1])), glm::length(glm::vec3(model_matrix[2]))));
+	return glm::vec4(center, sphere.w * scale);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#ifndef INCLUDED_FRUSTUM_H
+#define INCLUDED_FRUSTUM_H
+
+#include "PV112.h"
+
+/// Six planes of a view frustum and up to two additional clip planes
+static const int FRUSTUM_MAX_PLANES = 8;
+
+/// Convex volume bounded by planes, used to reject objects on the CPU before they are submitted. A plane (a, b, c, d)
+/// keeps the points with a*x + b*y + c*z + d >= 0. A frustum without planes contains everything.
+class Frustum
+{
+public:
+	/// Contains everything
+	Frustum();
+
+	/// Frustum of the camera, extracted from the rows of 'view_projection' (Gribb and Hartmann 2001), so the planes
+	/// are in the space the matrix transforms from, usually world space
+	explicit Frustum(const glm::mat4 &view_projection);
+
+	/// Adds a plane, like a clip plane of the shaders. Returns false if there are already FRUSTUM_MAX_PLANES planes.
+	bool AddPlane(const glm::vec4 &plane);
+
+	/// Returns false if the sphere (center in xyz, radius in w) is entirely outside of some plane
+	bool IntersectsSphere(const glm::vec4 &sphere) const;
+
+	/// Returns false if the axis aligned box is entirely outside of some plane
+	bool IntersectsBox(const glm::vec3 &box_min, const glm::vec3 &box_max) const;
+
+	int PlaneCount() const { return plane_count; }
+
+private:
+	glm::vec4 planes[FRUSTUM_MAX_PLANES];
+	int plane_count;
+};
+
+/// Returns the bounding sphere of an instance, 'sphere' is in the object space of 'model_matrix', which may scale
+glm::vec4 TransformBoundingSphere(const glm::mat4 &model_matrix, const glm::vec4 &sphere);
+
+#endif	// INCLUDED_FRUSTUM_H
@@ -0,0 +1,267 @@
+#include "GLStateCache.h"
+#include "PerfCounters.h"
+
+#include <cstring>
+
+const char *StateCallKindName(StateCallKind kind)
+{
+	static const char *names[STATE_CALL_KIND_COUNT] = {
+		"programs", "vertex arrays", "active texture", "textures", "buffers", "enable/disable", "blend func", "restart index",
+		"depth func", "depth mask"
+	};
+	return kind < STATE_CALL_KIND_COUNT ? names[kind] : "unknown";
+}
+
+unsigned int GLStateStats::TotalIssued() const
+{
+	unsigned int total = 0;
+	for (int i = 0; i < STATE_CALL_KIND_COUNT; i++)
+		total += issued[i];
+	return total;
+}
+
+unsigned int GLStateStats::TotalFiltered() const
+{
+	unsigned int total = 0;
+	for (int i = 0; i < STATE_CALL_KIND_COUNT; i++)
+		total += filtered[i];
+	return total;
+}
+
+GLStateCache::GLStateCache()
+{
+	memset(&stats, 0, sizeof(stats));
+	memset(&last_stats, 0, sizeof(last_stats));
+	Invalidate();
+}
+
+int GLStateCache::CapabilityIndex(GLenum capability)
+{
+	switch (capability)
+	{
+	case GL_BLEND: return 0;
+	case GL_PRIMITIVE_RESTART: return 1;
+	case GL_DEPTH_TEST: return 2;
+	case GL_CLIP_DISTANCE0: return 3;
+	default: return -1;
+	}
+}
+
+int GLStateCache::TextureTargetIndex(GLenum target)
+{
+	switch (target)
+	{
+	case GL_TEXTURE_2D: return 0;
+	case GL_TEXTURE_2D_ARRAY: return 1;
+	case GL_TEXTURE_CUBE_MAP: return 2;
+	case GL_TEXTURE_BUFFER: return 3;
+	default: return -1;
+	}
+}
+
+bool GLStateCache::Change(StateCallKind kind, bool changed)
+{
+	if (changed)
+	{
+		stats.issued[kind]++;
+		if (PerfCounters::Instance().IsTracing())
+			PerfCounters::Instance().TraceCall(std::string("state change: ") + StateCallKindName(kind));
+	}
+	else
+		stats.filtered[kind]++;
+	return changed;
+}
+
+void GLStateCache::UseProgram(GLuint new_program)
+{
+	if (Change(STATE_CALL_PROGRAM, program != new_program))
+	{
+		glUseProgram(new_program);
+		program = new_program;
+	}
+}
+
+void GLStateCache::BindVertexArray(GLuint new_vertex_array)
+{
+	if (Change(STATE_CALL_VERTEX_ARRAY, vertex_array != new_vertex_array))
+	{
+		glBindVertexArray(new_vertex_array);
+		vertex_array = new_vertex_array;
+	}
+}
+
+void GLStateCache::BindTexture(unsigned int unit, GLenum target, GLuint texture)
+{
+	int target_index = TextureTargetIndex(target);
+	bool tracked = unit < GL_STATE_TEXTURE_UNITS && target_index >= 0;
+	if (tracked && !Change(STATE_CALL_TEXTURE, textures[unit][target_index] != texture))
+		return;
+
+	if (Change(STATE_CALL_ACTIVE_TEXTURE, active_texture_unit != unit))
+	{
+		glActiveTexture(GL_TEXTURE0 + unit);
+		active_texture_unit = unit;
+	}
+	glBindTexture(target, texture);
+	if (tracked)
+		textures[unit][target_index] = texture;
+	else
+		stats.issued[STATE_CALL_TEXTURE]++;
+}
+
+void GLStateCache::BindBuffer(GLenum target, GLuint buffer)
+{
+	if (target != GL_UNIFORM_BUFFER)
+	{
+		stats.issued[STATE_CALL_BUFFER]++;
+		glBindBuffer(target, buffer);
+		return;
+	}
+	if (Change(STATE_CALL_BUFFER, uniform_buffer != buffer))
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		uniform_buffer = buffer;
+	}
+}
+
+void GLStateCache::BindUniformBufferBase(GLuint index, GLuint buffer)
+{
+	if (index >= GL_STATE_UNIFORM_BUFFER_BINDINGS)
+	{
+		stats.issued[STATE_CALL_BUFFER]++;
+		glBindBufferBase(GL_UNIFORM_BUFFER, index, buffer);
+		uniform_buffer = buffer;
+		return;
+	}
+
+	// A skipped call leaves the generic binding as it is, so the cached generic binding stays valid
+	if (Change(STATE_CALL_BUFFER, uniform_buffer_bindings[index] != buffer || uniform_buffer_sizes[index] != 0))
+	{
+		glBindBufferBase(GL_UNIFORM_BUFFER, index, buffer);
+		uniform_buffer_bindings[index] = buffer;
+		uniform_buffer_offsets[index] = 0;
+		uniform_buffer_sizes[index] = 0;
+		uniform_buffer = buffer;
+	}
+}
+
+void GLStateCache::BindUniformBufferRange(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+	if (index >= GL_STATE_UNIFORM_BUFFER_BINDINGS)
+	{
+		stats.issued[STATE_CALL_BUFFER]++;
+		glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+		uniform_buffer = buffer;
+		return;
+	}
+
+	if (Change(STATE_CALL_BUFFER, uniform_buffer_bindings[index] != buffer || uniform_buffer_offsets[index] != offset ||
+		uniform_buffer_sizes[index] != size))
+	{
+		glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+		uniform_buffer_bindings[index] = buffer;
+		uniform_buffer_offsets[index] = offset;
+		uniform_buffer_sizes[index] = size;
+		uniform_buffer = buffer;
+	}
+}
+
+void GLStateCache::SetCapability(GLenum capability, bool enabled)
+{
+	int index = CapabilityIndex(capability);
+	if (index >= 0 && !Change(STATE_CALL_CAPABILITY, capabilities[index] != int(enabled)))
+		return;
+
+	if (enabled)
+		glEnable(capability);
+	else
+		glDisable(capability);
+	if (index >= 0)
+		capabilities[index] = int(enabled);
+	else
+		stats.issued[STATE_CALL_CAPABILITY]++;
+}
+
+void GLStateCache::Enable(GLenum capability)
+{
+	SetCapability(capability, true);
+}
+
+void GLStateCache::Disable(GLenum capability)
+{
+	SetCapability(capability, false);
+}
+
+void GLStateCache::BlendFunc(GLenum source_factor, GLenum destination_factor)
+{
+	if (Change(STATE_CALL_BLEND_FUNC, blend_source != source_factor || blend_destination != destination_factor))
+	{
+		glBlendFunc(source_factor, destination_factor);
+		blend_source = source_factor;
+		blend_destination = destination_factor;
+	}
+}
+
+void GLStateCache::PrimitiveRestartIndex(GLuint index)
+{
+	if (Change(STATE_CALL_RESTART_INDEX, !restart_index_known || restart_index != index))
+	{
+		glPrimitiveRestartIndex(index);
+		restart_index = index;
+		restart_index_known = true;
+	}
+}
+
+void GLStateCache::DepthFunc(GLenum function)
+{
+	if (Change(STATE_CALL_DEPTH_FUNC, depth_function != function))
+	{
+		glDepthFunc(function);
+		depth_function = function;
+	}
+}
+
+void GLStateCache::DepthMask(GLboolean write)
+{
+	if (Change(STATE_CALL_DEPTH_MASK, depth_mask != int(write != GL_FALSE)))
+	{
+		glDepthMask(write);
+		depth_mask = int(write != GL_FALSE);
+	}
+}
+
+void GLStateCache::Invalidate()
+{
+	program = UNKNOWN;
+	vertex_array = UNKNOWN;
+	uniform_buffer = UNKNOWN;
+	for (unsigned int i = 0; i < GL_STATE_UNIFORM_BUFFER_BINDINGS; i++)
+	{
+		uniform_buffer_bindings[i] = UNKNOWN;
+		uniform_buffer_offsets[i] = 0;
+		uniform_buffer_sizes[i] = 0;
+	}
+	for (int i = 0; i < TRACKED_CAPABILITIES; i++)
+		capabilities[i] = -1;
+	blend_source = UNKNOWN;
+	blend_destination = UNKNOWN;
+	restart_index = 0;
+	restart_index_known = false;
+	depth_function = UNKNOWN;
+	depth_mask = -1;
+	InvalidateTextures();
+}
+
+void GLStateCache::InvalidateTextures()
+{
+	active_texture_unit = UNKNOWN;
+	for (unsigned int unit = 0; unit < GL_STATE_TEXTURE_UNITS; unit++)
+		for (int target = 0; target < TRACKED_TEXTURE_TARGETS; target++)
+			textures[unit][target] = UNKNOWN;
+}
+
+void GLStateCache::EndFrame()
+{
+	last_stats = stats;
+	memset(&stats, 0, sizeof(stats));
+}
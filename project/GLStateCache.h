@@ -0,0 +1,149 @@
+#pragma once
+#ifndef INCLUDED_GL_STATE_CACHE_H
+#define INCLUDED_GL_STATE_CACHE_H
+
+#include "PV112.h"
+
+/// Number of texture units tracked by GLStateCache, binds to other units are always issued
+static const unsigned int GL_STATE_TEXTURE_UNITS = 16;
+
+/// Number of indexed uniform buffer binding points tracked by GLStateCache
+static const unsigned int GL_STATE_UNIFORM_BUFFER_BINDINGS = 16;
+
+/// Rounds the size up to a multiple of the alignment
+inline size_t AlignSize(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+/// Size of the range to bind for a uniform block of 'size' bytes. std140 blocks are padded to a vec4, the range
+/// covers the padding.
+inline size_t UniformBlockRangeSize(size_t size)
+{
+	return AlignSize(size, 16);
+}
+
+/// Kinds of state changes counted by GLStateCache
+enum StateCallKind
+{
+	STATE_CALL_PROGRAM,
+	STATE_CALL_VERTEX_ARRAY,
+	STATE_CALL_ACTIVE_TEXTURE,
+	STATE_CALL_TEXTURE,
+	STATE_CALL_BUFFER,
+	STATE_CALL_CAPABILITY,
+	STATE_CALL_BLEND_FUNC,
+	STATE_CALL_RESTART_INDEX,
+	STATE_CALL_DEPTH_FUNC,
+	STATE_CALL_DEPTH_MASK,
+	STATE_CALL_KIND_COUNT
+};
+
+/// Returns the name of the kind of state change, for the statistics and the call trace
+const char *StateCallKindName(StateCallKind kind);
+
+/// Counters of the state changes of one frame
+struct GLStateStats
+{
+	// Calls that reached OpenGL
+	unsigned int issued[STATE_CALL_KIND_COUNT];
+	// Calls skipped because they would not change the state
+	unsigned int filtered[STATE_CALL_KIND_COUNT];
+
+	unsigned int TotalIssued() const;
+	unsigned int TotalFiltered() const;
+};
+
+/// Wraps the OpenGL calls that change the binding and enable state used by the render passes and skips the calls
+/// that set the value OpenGL already has. The cache starts with all state unknown, so the first call of each kind
+/// is always issued.
+///
+/// All state changed through the cache must be changed only through it. Code that changes the same state directly
+/// (loaders, the texture streamer) must be followed by Invalidate or InvalidateTextures.
+class GLStateCache
+{
+public:
+	GLStateCache();
+
+	void UseProgram(GLuint program);
+	void BindVertexArray(GLuint vertex_array);
+
+	/// Binds the texture to the target of the given unit, switches the active texture unit only if needed
+	void BindTexture(unsigned int unit, GLenum target, GLuint texture);
+
+	/// glBindBuffer, only GL_UNIFORM_BUFFER is tracked, other targets are always issued
+	void BindBuffer(GLenum target, GLuint buffer);
+
+	/// glBindBufferBase for GL_UNIFORM_BUFFER, which also sets the generic uniform buffer binding
+	void BindUniformBufferBase(GLuint index, GLuint buffer);
+
+	/// glBindBufferRange for GL_UNIFORM_BUFFER, a change of the offset or size alone is also issued
+	void BindUniformBufferRange(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+	/// glEnable and glDisable of GL_BLEND, GL_PRIMITIVE_RESTART, GL_DEPTH_TEST and GL_CLIP_DISTANCE0, other
+	/// capabilities are always issued
+	void Enable(GLenum capability);
+	void Disable(GLenum capability);
+
+	void BlendFunc(GLenum source_factor, GLenum destination_factor);
+	void PrimitiveRestartIndex(GLuint index);
+	void DepthFunc(GLenum function);
+	void DepthMask(GLboolean write);
+
+	/// Forgets all state, the next call of each kind is issued
+	void Invalidate();
+
+	/// Forgets the texture bindings and the active texture unit
+	void InvalidateTextures();
+
+	/// Ends the frame, its counters become the last frame stats and the counters are reset
+	void EndFrame();
+
+	/// Returns the counters of the last ended frame
+	const GLStateStats &LastFrameStats() const { return last_stats; }
+
+	/// Returns the counters of the frame so far, the difference of two calls gives the changes of a pass
+	const GLStateStats &FrameStats() const { return stats; }
+
+private:
+	// Index of the capability in 'capabilities', -1 if it is not tracked
+	static int CapabilityIndex(GLenum capability);
+
+	// Index of the texture target in the bindings of a unit, -1 if it is not tracked
+	static int TextureTargetIndex(GLenum target);
+
+	void SetCapability(GLenum capability, bool enabled);
+
+	// Counts the call and returns true if it has to be issued
+	bool Change(StateCallKind kind, bool changed);
+
+	// Names are GLuint, the unknown value of a binding is a name no object gets in practice
+	static const GLuint UNKNOWN = ~GLuint(0);
+	static const int TRACKED_CAPABILITIES = 4;
+	static const int TRACKED_TEXTURE_TARGETS = 4;
+
+	GLuint program;
+	GLuint vertex_array;
+	GLuint active_texture_unit;
+	GLuint textures[GL_STATE_TEXTURE_UNITS][TRACKED_TEXTURE_TARGETS];
+	GLuint uniform_buffer;
+	GLuint uniform_buffer_bindings[GL_STATE_UNIFORM_BUFFER_BINDINGS];
+	// Range of each binding, the size is 0 for the whole buffer bound by BindUniformBufferBase
+	GLintptr uniform_buffer_offsets[GL_STATE_UNIFORM_BUFFER_BINDINGS];
+	GLsizeiptr uniform_buffer_sizes[GL_STATE_UNIFORM_BUFFER_BINDINGS];
+	// -1 unknown, 0 disabled, 1 enabled
+	int capabilities[TRACKED_CAPABILITIES];
+	GLenum blend_source;
+	GLenum blend_destination;
+	// Every index is valid, so the restart index has a separate flag
+	GLuint restart_index;
+	bool restart_index_known;
+	GLenum depth_function;
+	// -1 unknown, 0 no depth writes, 1 depth writes
+	int depth_mask;
+
+	GLStateStats stats;
+	GLStateStats last_stats;
+};
+
+#endif	// INCLUDED_GL_STATE_CACHE_H
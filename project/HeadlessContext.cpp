@@ -0,0 +1,126 @@
+#include "HeadlessContext.h"
+
+#include <iostream>
+
+#if !defined(_WIN32)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+#ifndef EGL_NO_CONFIG_KHR
+#define EGL_NO_CONFIG_KHR ((EGLConfig)0)
+#endif
+#endif
+
+using namespace std;
+
+HeadlessContext::HeadlessContext()
+	: display(nullptr), context(nullptr), framebuffer(0), color_buffer(0), depth_buffer(0)
+{
+}
+
+HeadlessContext::~HeadlessContext()
+{
+	if (framebuffer)
+	{
+		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteRenderbuffers(1, &color_buffer);
+		glDeleteRenderbuffers(1, &depth_buffer);
+	}
+
+#if !defined(_WIN32)
+	if (context)
+	{
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(display, context);
+	}
+	if (display)
+		eglTerminate(display);
+#endif
+}
+
+bool HeadlessContext::Create()
+{
+#if defined(_WIN32)
+	cout << "The headless mode needs EGL, which is not available on Windows" << endl;
+	return false;
+#else
+	// The surfaceless platform needs no display server, the default display is the fallback
+	EGLDisplay egl_display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+		reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+	if (get_platform_display)
+		egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	if (egl_display == EGL_NO_DISPLAY)
+		egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, nullptr, nullptr))
+	{
+		cout << "Cannot initialize an EGL display" << endl;
+		return false;
+	}
+	display = egl_display;
+
+	if (!eglBindAPI(EGL_OPENGL_API))
+	{
+		cout << "EGL does not support OpenGL" << endl;
+		return false;
+	}
+
+	const EGLint context_attributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+
+	// Without a surface no config is needed (EGL_KHR_no_config_context), otherwise any OpenGL config is used
+	EGLContext egl_context = eglCreateContext(egl_display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attributes);
+	if (egl_context == EGL_NO_CONTEXT)
+	{
+		const EGLint config_attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+		EGLConfig config;
+		EGLint config_count = 0;
+		if (eglChooseConfig(egl_display, config_attributes, &config, 1, &config_count) && config_count > 0)
+			egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attributes);
+	}
+	if (egl_context == EGL_NO_CONTEXT)
+	{
+		cout << "Cannot create an OpenGL 3.3 core context with EGL" << endl;
+		return false;
+	}
+	context = egl_context;
+
+	// EGL_KHR_surfaceless_context
+	if (!eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context))
+	{
+		cout << "Cannot make the EGL context current without a surface" << endl;
+		return false;
+	}
+	return true;
+#endif
+}
+
+bool HeadlessContext::CreateFramebuffer(int width, int height)
+{
+	glGenRenderbuffers(1, &color_buffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, color_buffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+	glGenRenderbuffers(1, &depth_buffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth_buffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_buffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_buffer);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		cout << "The headless framebuffer is not complete" << endl;
+		return false;
+	}
+	return true;
+}
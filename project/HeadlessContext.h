@@ -0,0 +1,42 @@
+#pragma once
+#ifndef INCLUDED_HEADLESS_CONTEXT_H
+#define INCLUDED_HEADLESS_CONTEXT_H
+
+#include "PV112.h"
+
+/// OpenGL 3.3 core context without a window or a display, so the application can run on build servers, also on a
+/// software implementation like Mesa llvmpipe. The context is created through EGL on the Mesa surfaceless
+/// platform, or on the default EGL display without a surface. Rendering goes to a framebuffer object.
+///
+/// EGL is not used on Windows, Create fails there.
+class HeadlessContext
+{
+public:
+	HeadlessContext();
+
+	/// Deletes the framebuffer and destroys the context
+	~HeadlessContext();
+
+	/// Creates the context and makes it current. Returns false and prints an error on failure.
+	bool Create();
+
+	/// Creates the framebuffer with color and depth renderbuffers and binds it. Call after GLEW is initialized.
+	/// Returns false and prints an error if the framebuffer is not complete.
+	bool CreateFramebuffer(int width, int height);
+
+	GLuint Framebuffer() const { return framebuffer; }
+
+private:
+	HeadlessContext(const HeadlessContext &);
+	HeadlessContext &operator =(const HeadlessContext &);
+
+	// EGLDisplay and EGLContext, so this header does not need EGL
+	void *display;
+	void *context;
+
+	GLuint framebuffer;
+	GLuint color_buffer;
+	GLuint depth_buffer;
+};
+
+#endif	// INCLUDED_HEADLESS_CONTEXT_H
@@ -1,39 +1,98 @@
 #include "HeightmapTerrain.h"
 
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
 //-----------------------------------------
 //----            TERRAIN              ----
 //-----------------------------------------
 
-Terrain LoadHeightmapTerrain(const maybewchar* filename, GLint position_location, GLint normal_location, GLint tex_coord_location) {
-	/*
-		Load texture data
-	*/
-	Terrain terrain;
-
-	// Create IL image
-	ILuint IL_tex;
-	ilGenImages(1, &IL_tex);
+static const unsigned int TERRAIN_RESTART_INDEX = 4294967295U;
+
+// Appends triangle strips over every 'step'-th row and column of the heightmap between the vertices [x0, x1] and
+// [y0, y1], one strip per row of quads. The last row and column are always included, the quads before them are
+// narrower if the range is not a multiple of 'step'.
+static void AppendTerrainStrips(int img_width, int x0, int x1, int y0, int y1, int step, std::vector<unsigned int> &indices) {
+	for (int y = y0; y < y1; y = std::min(y + step, y1)) {
+		int y_next = std::min(y + step, y1);
+		for (int x = x0; x < x1; x += step) {
+			indices.push_back(y_next * img_width + x);
+			indices.push_back(y * img_width + x);
+		}
+		indices.push_back(y_next * img_width + x1);
+		indices.push_back(y * img_width + x1);
+		// Restart triangle strips
+		indices.push_back(TERRAIN_RESTART_INDEX);
+	}
+}
 
-	ilBindImage(IL_tex);
+// Smallest and largest column and row of the vertices in the strips of 'range' as x0, x1, y0, y1
+static void TerrainStripsExtent(const std::vector<unsigned int> &indices, const PV112::GeometryLOD &range, int img_width, int extent[4]) {
+	extent[0] = extent[2] = std::numeric_limits<int>::max();
+	extent[1] = extent[3] = -1;
+	for (GLsizei i = range.FirstIndex; i < range.FirstIndex + range.Count; i++) {
+		if (indices[i] == TERRAIN_RESTART_INDEX)
+			continue;
+		int x = int(indices[i] % img_width);
+		int y = int(indices[i] / img_width);
+		extent[0] = std::min(extent[0], x);
+		extent[1] = std::max(extent[1], x);
+		extent[2] = std::min(extent[2], y);
+		extent[3] = std::max(extent[3], y);
+	}
+}
 
-	// Solve upside down textures
-	ilEnable(IL_ORIGIN_SET);
-	ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
+// Largest difference between the heights and the heights interpolated from the quads of AppendTerrainStrips over
+// the vertices [0, x1] and [0, y1]
+static float TerrainStripsError(const std::vector<std::vector<float>> &height, int x1, int y1, int step) {
+	float error = 0.0f;
+	for (int y = 0; y < y1; y = std::min(y + step, y1)) {
+		int y_next = std::min(y + step, y1);
+		for (int x = 0; x < x1; x = std::min(x + step, x1)) {
+			int x_next = std::min(x + step, x1);
+			for (int j = 0; j <= y_next - y; j++) {
+				for (int i = 0; i <= x_next - x; i++) {
+					float u = float(i) / float(x_next - x);
+					float v = float(j) / float(y_next - y);
+					float top = height[x][y] + (height[x_next][y] - height[x][y]) * u;
+					float bottom = height[x][y_next] + (height[x_next][y_next] - height[x][y_next]) * u;
+					error = std::max(error, std::abs(height[x + i][y + j] - (top + (bottom - top) * v)));
+				}
+			}
+		}
+	}
+	return error;
+}
 
-	// Load IL image
-	ILboolean success = ilLoadImage(filename);
-	if (!success)
+void BuildHeightmapTerrain(const maybewchar* filename, TerrainData& out_data) {
+	/*
+		Load texture data
+	*/
+	PV112::ImageData image;
+	if (!PV112::LoadImageData(filename, image))
 	{
-		ilBindImage(0);
-		ilDeleteImages(1, &IL_tex);
 		throw std::invalid_argument("Cannot load heightmap!");
 	}
 
-	// Get IL image parameters
-	int img_width = ilGetInteger(IL_IMAGE_WIDTH);
-	int img_height = ilGetInteger(IL_IMAGE_HEIGHT);
-	int img_format = ilGetInteger(IL_IMAGE_FORMAT);
-	int img_type = ilGetInteger(IL_IMAGE_TYPE);
+	int img_width = image.Width;
+	int img_height = image.Height;
+
+	int bl;
+	switch (image.Format)
+	{
+	case GL_RGB:
+	case GL_BGR:  bl = 3; break;
+	case GL_RGBA:
+	case GL_BGRA: bl = 4; break;
+	default:
+		// Unsupported format
+		throw std::invalid_argument("Cannot load heightmap, invalid format!");
+	}
+	if (image.Type != GL_UNSIGNED_BYTE)
+	{
+		throw std::invalid_argument("Cannot load heightmap, invalid format!");
+	}
 
 	/*
 		Load vectors
@@ -41,38 +100,23 @@ Terrain LoadHeightmapTerrain(const maybewchar* filename, GLint position_location
 	std::vector< std::vector< glm::vec3> > vertexes(img_width, std::vector<glm::vec3>(img_height));
 	std::vector< std::vector< glm::vec2> > coords(img_width, std::vector<glm::vec2>(img_height));
 
-	terrain.height = std::vector< std::vector<float> >(img_width, std::vector<float>(img_height));
+	out_data.height = std::vector< std::vector<float> >(img_width, std::vector<float>(img_height));
 
-	ILubyte * imageData = ilGetData();
+	const unsigned char * imageData = image.Pixels.data();
 
 	for (int x = 0; x < img_width; x++) {
 		for (int y = 0; y < img_height; y++) {
 			float s = float(x) / float(img_width);
 			float t = float(y) / float(img_height);
 			
-			int bl;
-			switch (img_format)
-			{
-			case IL_RGB:  bl = 3;  break;
-			case IL_RGBA: bl = 4; break;
-			default:
-				// Unsupported format
-				ilBindImage(0);
-				ilDeleteImages(1, &IL_tex);
-				throw std::invalid_argument("Cannot load heightmap, invalid format!");
-			}
-			
 			float height = float(imageData[(x*img_width + y) * bl]) / 255.0f;
 			
 			vertexes[x][y] = glm::vec3(-0.5f + s, height, -0.5f + t);
 			coords[x][y] = glm::vec2(s, t);
-			terrain.height[x][y] = height;
+			out_data.height[x][y] = height;
 		}
 	}
 
-	ilBindImage(0);
-	ilDeleteImages(1, &IL_tex);
-
 	/*
 		Calculate normals
 	*/
@@ -138,94 +182,104 @@ Terrain LoadHeightmapTerrain(const maybewchar* filename, GLint position_location
 	/*
 		Indices
 	*/
-	std::vector<unsigned int> indices;
-	for (int y = 0; y < img_height - 1; y++) {
-		for (int x = 0; x < img_width - 1; x++) {
-			for (int r = 0; r < 2; r++) {
-				int row = y + (1 - r);
-				int index = row * img_width + x;
-				indices.push_back(index);
+	// The terrain is split into chunks, their bounding boxes
+	out_data.chunks.clear();
+	for (int y0 = 0; y0 < img_height - 1; y0 += TERRAIN_CHUNK_QUADS) {
+		for (int x0 = 0; x0 < img_width - 2; x0 += TERRAIN_CHUNK_QUADS) {
+			int x1 = std::min(x0 + TERRAIN_CHUNK_QUADS, img_width - 2);
+			int y1 = std::min(y0 + TERRAIN_CHUNK_QUADS, img_height - 1);
+
+			TerrainChunk chunk;
+			chunk.bounds_min = vertexes[x0][y0];
+			chunk.bounds_max = vertexes[x1][y1];
+			chunk.bounds_min.y = chunk.bounds_max.y = out_data.height[x0][y0];
+			for (int x = x0; x <= x1; x++) {
+				for (int y = y0; y <= y1; y++) {
+					chunk.bounds_min.y = std::min(chunk.bounds_min.y, out_data.height[x][y]);
+					chunk.bounds_max.y = std::max(chunk.bounds_max.y, out_data.height[x][y]);
+				}
 			}
+			out_data.chunks.push_back(chunk);
 		}
-		// Restart triangle strips
-		indices.push_back(4294967295U);
 	}
 
-	/*
-		Normalize data
-	*/
-	std::vector<float> vertexData(img_width * img_height * 8);
-	for (int x = 0; x < img_width; x++) {
-		for (int y = 0; y < img_height; y++) {
-			vertexData[(x + y * img_width) * 8 + 0] = vertexes[x][y].x;
-			vertexData[(x + y * img_width) * 8 + 1] = vertexes[x][y].y;
-			vertexData[(x + y * img_width) * 8 + 2] = vertexes[x][y].z;
+	// Each level of detail has the strips of all chunks, so it can be drawn at once or by chunks
+	std::vector<unsigned int> &indices = out_data.indices;
+	indices.clear();
+	out_data.lods.clear();
+	for (int lod = 0; lod < TERRAIN_LOD_COUNT; lod++) {
+		int step = 1 << lod;
+		PV112::GeometryLOD level;
+		level.FirstIndex = GLsizei(indices.size());
+		level.Error = lod == 0 ? 0.0f : TerrainStripsError(out_data.height, img_width - 2, img_height - 1, step);
+
+		size_t chunk = 0;
+		for (int y0 = 0; y0 < img_height - 1; y0 += TERRAIN_CHUNK_QUADS) {
+			for (int x0 = 0; x0 < img_width - 2; x0 += TERRAIN_CHUNK_QUADS) {
+				PV112::GeometryLOD range;
+				range.FirstIndex = GLsizei(indices.size());
+				AppendTerrainStrips(img_width, x0, std::min(x0 + TERRAIN_CHUNK_QUADS, img_width - 2),
+					y0, std::min(y0 + TERRAIN_CHUNK_QUADS, img_height - 1), step, indices);
+				range.Count = GLsizei(indices.size()) - range.FirstIndex;
+				range.Error = level.Error;
+				out_data.chunks[chunk++].lods.push_back(range);
+			}
+		}
 
-			vertexData[(x + y * img_width) * 8 + 3] = finalNormals[x][y].x;
-			vertexData[(x + y * img_width) * 8 + 4] = finalNormals[x][y].y;
-			vertexData[(x + y * img_width) * 8 + 5] = finalNormals[x][y].z;
+		level.Count = GLsizei(indices.size()) - level.FirstIndex;
+		out_data.lods.push_back(level);
+	}
 
-			vertexData[(x + y * img_width) * 8 + 6] = coords[x][y].x;
-			vertexData[(x + y * img_width) * 8 + 7] = coords[x][y].y;
+	// Coarser levels must not leave gaps along the edges of the chunks, and so of the terrain
+	for (size_t i = 0; i < out_data.chunks.size(); i++) {
+		int base_extent[4];
+		TerrainStripsExtent(indices, out_data.chunks[i].lods[0], img_width, base_extent);
+		for (int lod = 1; lod < TERRAIN_LOD_COUNT; lod++) {
+			int extent[4];
+			TerrainStripsExtent(indices, out_data.chunks[i].lods[lod], img_width, extent);
+			if (!std::equal(extent, extent + 4, base_extent)) {
+				throw std::logic_error("Terrain level of detail does not cover the heightmap!");
+			}
 		}
 	}
 
 	/*
-		Load to opengl
+		Pack vertices
 	*/
-
-	// Create a single buffer for vertex data
-	glGenBuffers(1, &terrain.VertexBuffers[0]);
-	glBindBuffer(GL_ARRAY_BUFFER, terrain.VertexBuffers[0]);
-	glBufferData(GL_ARRAY_BUFFER, vertexData.size() * sizeof(float), &vertexData[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Create a buffer for indices
-	glGenBuffers(1, &terrain.IndexBuffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrain.IndexBuffer);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-	// Create a vertex array object for the geometry
-	glGenVertexArrays(1, &terrain.VAO);
-
-	// Set the parameters of the geometry
-	glBindVertexArray(terrain.VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, terrain.VertexBuffers[0]);
-	if (position_location >= 0)
-	{
-		glEnableVertexAttribArray(position_location);
-		glVertexAttribPointer(position_location, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, 0);
-	}
-	if (normal_location >= 0)
-	{
-		glEnableVertexAttribArray(normal_location);
-		glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void *)(sizeof(float) * 3));
-	}
-	if (tex_coord_location >= 0)
-	{
-		glEnableVertexAttribArray(tex_coord_location);
-		glVertexAttribPointer(tex_coord_location, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void *)(sizeof(float) * 6));
+	out_data.vertices.assign(img_width * img_height * TerrainVertexLayout::Stride, 0);
+	out_data.vertex_count = img_width * img_height;
+	for (int x = 0; x < img_width; x++) {
+		for (int y = 0; y < img_height; y++) {
+			TerrainVertexLayout::PackVertex(&out_data.vertices[(x + y * img_width) * TerrainVertexLayout::Stride], vertexes[x][y], finalNormals[x][y], coords[x][y]);
+		}
 	}
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrain.IndexBuffer);
+}
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+Terrain CreateTerrain(const TerrainData& data, GLint position_location, GLint normal_location, GLint tex_coord_location) {
+	Terrain terrain;
+	static_cast<PV112::Geometry &>(terrain) = CreateLayoutGeometry<TerrainVertexLayout>(data.vertices.data(), data.vertex_count,
+		data.indices.data(), data.indices.size(), GL_TRIANGLE_STRIP, position_location, normal_location, tex_coord_location);
+	terrain.height = data.height;
 
-	terrain.Mode = GL_TRIANGLE_STRIP;
-	terrain.DrawArraysCount = 0;
-	terrain.DrawElementsCount = indices.size();
+	// The first level is drawn by DrawGeometry
+	terrain.LODs = data.lods;
+	terrain.DrawElementsCount = data.lods[0].Count;
+	terrain.chunks = data.chunks;
 
 	return terrain;
 }
 
+Terrain LoadHeightmapTerrain(const maybewchar* filename, GLint position_location, GLint normal_location, GLint tex_coord_location) {
+	TerrainData data;
+	BuildHeightmapTerrain(filename, data);
+	return CreateTerrain(data, position_location, normal_location, tex_coord_location);
+}
+
 //-----------------------------------------
 //----      Random trees planting      ----
 //-----------------------------------------
 
-void RandomTrees(const Terrain& terrain_geometry, glm::mat4* tree_model_matrixes, int tree_count, std::function<float(float, float, float)> callable) {
-	std::random_device rd;
-	std::mt19937 gen(rd());
+void RandomTrees(const Terrain& terrain_geometry, glm::mat4* tree_model_matrixes, int tree_count, std::function<float(float, float, float)> callable, std::mt19937 &gen) {
 	std::uniform_real_distribution<> disArea(-50.0f, 50.0f - 1.0f);
 	std::uniform_real_distribution<> disAngle(0.0f, 6.28f);
 	std::uniform_real_distribution<> disGeneral(0.0f, 1.0f);
@@ -307,6 +361,16 @@ void BlinkCamera::OnMouseMoved(int dx, int dy)
 	update_look_pos();
 }
 
+void BlinkCamera::SetView(float x, float z, float direction, float elevation)
+{
+	eye_position.x = x;
+	eye_position.z = z;
+	eye_position.y = get_height(x, z);
+	angle_direction = direction;
+	angle_elevation = std::max(std::min(elevation, max_elevation), min_elevation);
+	update_look_pos();
+}
+
 void BlinkCamera::Move()
 {
 	float vv = vel_w ? 1.0 : 0.0 + vel_s ? -1.0 : 0.0;
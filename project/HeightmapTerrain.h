@@ -8,25 +8,66 @@
 #include <functional>
 #include <algorithm>
 #include "PV112.h"
+#include "VertexLayout.h"
 
 static const float TERRAIN_HEIGHT = 15.0f;
 
+/// Number of levels of detail of the terrain, level i uses every 2^i-th row and column of the heightmap
+static const int TERRAIN_LOD_COUNT = 3;
+
+/// Number of quads along each side of a terrain chunk, a multiple of the step of the coarsest level of detail
+static const int TERRAIN_CHUNK_QUADS = 32;
+
+/// Terrain positions are in [-0.5, 0.5] x [0, 1] x [-0.5, 0.5] before the model matrix and texture coordinates
+/// in [0, 1], so all attributes are normalized integers. Normals keep 16 bits, the slope drives the texturing.
+typedef VertexLayout<Position<snorm16x4>, Normal<snorm16x4>, TexCoord<unorm16x2>> TerrainVertexLayout;
+
+/// Square part of the terrain that can be culled on its own
+struct TerrainChunk {
+	// Bounding box in the object space of the terrain
+	glm::vec3 bounds_min;
+	glm::vec3 bounds_max;
+	// Range of the chunk in the indices of each level of detail, the chunks of a level follow each other
+	std::vector<PV112::GeometryLOD> lods;
+};
+
 class Terrain : public PV112::Geometry {
 public:
 	std::vector<std::vector<float>> height;
+	std::vector<TerrainChunk> chunks;
 };
 
 //-----------------------------------------
 //----            TERRAIN              ----
 //-----------------------------------------
 
+/// CPU side data of a terrain, vertices are in TerrainVertexLayout and indices form a triangle strip
+struct TerrainData {
+	std::vector<unsigned char> vertices;
+	size_t vertex_count = 0;
+	std::vector<unsigned int> indices;
+	// Levels of detail in 'indices', the error is in the units of the normalized height
+	std::vector<PV112::GeometryLOD> lods;
+	std::vector<TerrainChunk> chunks;
+	std::vector<std::vector<float>> height;
+};
+
+/// Loads the heightmap and computes the terrain vertices, does not use OpenGL. Throws std::invalid_argument if the
+/// heightmap fails to load and std::logic_error if a level of detail does not cover the heightmap.
+void BuildHeightmapTerrain(const maybewchar* filename, TerrainData& out_data);
+
+/// Uploads the terrain data to OpenGL
+Terrain CreateTerrain(const TerrainData& data, GLint position_location, GLint normal_location, GLint tex_coord_location);
+
+/// Builds and uploads the terrain at once
 Terrain LoadHeightmapTerrain(const maybewchar* filename, GLint position_location, GLint normal_location, GLint tex_coord_location);
 
 //-----------------------------------------
 //----      Random trees planting      ----
 //-----------------------------------------
 
-void RandomTrees(const Terrain& terrain_geometry, glm::mat4 *tree_model_matrixes, int tree_count, std::function<float(float, float, float)> callable);
+/// Places the instances on the terrain, drawing the positions from 'generator', so a seeded generator places them the same in each run
+void RandomTrees(const Terrain& terrain_geometry, glm::mat4 *tree_model_matrixes, int tree_count, std::function<float(float, float, float)> callable, std::mt19937 &generator);
 
 //-----------------------------------------
 //----        BLINK CAMERA CLASS        ----
@@ -77,11 +118,18 @@ public:
 	/// Call when the user moves with the mouse cursor (see glutMotionFunc)
 	void OnMouseMoved(int x, int y);
 
+	/// Places the eye on the terrain at [x, z] and sets the view angles in radians, for scripted camera paths
+	void SetView(float x, float z, float direction, float elevation);
+
 	/// Returns the position of the eye in world space coordinates
 	glm::vec3 GetEyePosition() const;
 
 	/// Returns the position for the eye to look at in world space coordinates
 	glm::vec3 GetLookPosition() const;
+
+	/// Returns the view angles in radians
+	float GetDirection() const { return angle_direction; }
+	float GetElevation() const { return angle_elevation; }
 };
 
 #endif	// INCLUDED_HEIGHTMAP_TERRAIN_H
\ No newline at end of file
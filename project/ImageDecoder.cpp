@@ -0,0 +1,763 @@
+#include "ImageDecoder.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+
+using namespace std;
+
+//-----------------------------------------
+//----             INFLATE             ----
+//-----------------------------------------
+
+// Reads bits of a DEFLATE stream (RFC 1951), least significant bit first
+class BitReader
+{
+public:
+	BitReader(const unsigned char *data, size_t size)
+		: data(data), end(data + size), buffer(0), count(0), overrun(0) { }
+
+	// Makes at least 57 bits available, bytes past the end read as zeros
+	void Refill()
+	{
+		while (count <= 56)
+		{
+			if (data < end)
+				buffer |= uint64_t(*data++) << count;
+			else
+				overrun++;
+			count += 8;
+		}
+	}
+
+	unsigned Peek(int bits) const
+	{
+		return unsigned(buffer & ((uint64_t(1) << bits) - 1));
+	}
+
+	void Consume(int bits)
+	{
+		buffer >>= bits;
+		count -= bits;
+	}
+
+	unsigned Read(int bits)
+	{
+		if (count < bits)
+			Refill();
+		unsigned value = Peek(bits);
+		Consume(bits);
+		return value;
+	}
+
+	void AlignToByte()
+	{
+		Consume(count % 8);
+	}
+
+	// True if more bits were consumed than the stream has
+	bool Overrun() const
+	{
+		return overrun * 8 > size_t(count);
+	}
+
+private:
+	const unsigned char *data;
+	const unsigned char *end;
+	uint64_t buffer;
+	int count;
+	size_t overrun;
+};
+
+// Canonical Huffman code. Codes up to FAST_BITS long are decoded by a single table lookup, longer ones
+// bit by bit from the code counts.
+class HuffmanCode
+{
+public:
+	static const int MAX_BITS = 15;
+	static const int FAST_BITS = 10;
+
+	// Builds the code from code lengths of 'symbol_count' symbols, returns false if the lengths are invalid
+	bool Build(const unsigned char *lengths, int symbol_count)
+	{
+		std::fill(counts, counts + MAX_BITS + 1, 0);
+		for (int i = 0; i < symbol_count; i++)
+			counts[lengths[i]]++;
+		counts[0] = 0;
+
+		// Reject over-subscribed codes, incomplete ones are allowed (a single distance code is valid)
+		int left = 1;
+		for (int len = 1; len <= MAX_BITS; len++)
+		{
+			left = (left << 1) - counts[len];
+			if (left < 0)
+				return false;
+		}
+
+		int offsets[MAX_BITS + 2];
+		offsets[1] = 0;
+		for (int len = 1; len <= MAX_BITS; len++)
+			offsets[len + 1] = offsets[len] + counts[len];
+		for (int i = 0; i < symbol_count; i++)
+			if (lengths[i])
+				symbols[offsets[lengths[i]]++] = uint16_t(i);
+
+		// Fill the lookup table, the codes are stored bit-reversed as they are read from the stream
+		std::fill(fast, fast + (1 << FAST_BITS), uint16_t(0));
+		int code = 0;
+		int index = 0;
+		for (int len = 1; len <= MAX_BITS; len++)
+		{
+			for (int i = 0; i < counts[len]; i++, code++, index++)
+			{
+				if (len > FAST_BITS)
+					continue;
+				int reversed = 0;
+				for (int b = 0; b < len; b++)
+					reversed |= ((code >> b) & 1) << (len - 1 - b);
+				for (int j = reversed; j < (1 << FAST_BITS); j += 1 << len)
+					fast[j] = uint16_t((len << 9) | symbols[index]);
+			}
+			code <<= 1;
+		}
+		return true;
+	}
+
+	// Returns the next symbol, or -1 for an invalid code
+	int Decode(BitReader &in) const
+	{
+		in.Refill();
+		uint16_t entry = fast[in.Peek(FAST_BITS)];
+		if (entry)
+		{
+			in.Consume(entry >> 9);
+			return entry & 511;
+		}
+
+		int code = 0;
+		int first = 0;
+		int index = 0;
+		for (int len = 1; len <= MAX_BITS; len++)
+		{
+			code |= int(in.Read(1));
+			int count = counts[len];
+			if (code - first < count)
+				return symbols[index + (code - first)];
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+
+private:
+	uint16_t fast[1 << FAST_BITS];
+	uint16_t counts[MAX_BITS + 1];
+	uint16_t symbols[288];
+};
+
+static const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Decodes the literals and matches of one compressed block
+static bool InflateBlock(BitReader &in, const HuffmanCode &lengths, const HuffmanCode &distances, unsigned char *out, size_t out_size, size_t &pos)
+{
+	for (;;)
+	{
+		int symbol = lengths.Decode(in);
+		if (symbol < 0)
+			return false;
+		if (symbol < 256)
+		{
+			if (pos >= out_size)
+				return false;
+			out[pos++] = (unsigned char)symbol;
+			continue;
+		}
+		if (symbol == 256)
+			return !in.Overrun();
+
+		symbol -= 257;
+		if (symbol >= 29)
+			return false;
+		size_t length = LENGTH_BASE[symbol] + in.Read(LENGTH_EXTRA[symbol]);
+
+		int distance_symbol = distances.Decode(in);
+		if (distance_symbol < 0 || distance_symbol >= 30)
+			return false;
+		size_t distance = DISTANCE_BASE[distance_symbol] + in.Read(DISTANCE_EXTRA[distance_symbol]);
+
+		if (distance > pos || length > out_size - pos)
+			return false;
+		// Byte by byte, the source may overlap the destination
+		const unsigned char *source = out + pos - distance;
+		for (size_t i = 0; i < length; i++)
+			out[pos + i] = source[i];
+		pos += length;
+	}
+}
+
+// Decompresses a zlib stream (RFC 1950) into exactly 'out_size' bytes. The Adler-32 checksum is not verified.
+static bool InflateZlib(const unsigned char *data, size_t size, unsigned char *out, size_t out_size)
+{
+	if (size < 2)
+		return false;
+	// Compression method 8 (deflate), no preset dictionary, valid header check
+	if ((data[0] & 0x0F) != 8 || (data[1] & 0x20) || ((data[0] << 8) | data[1]) % 31 != 0)
+		return false;
+
+	BitReader in(data + 2, size - 2);
+	size_t pos = 0;
+	HuffmanCode lengths;
+	HuffmanCode distances;
+
+	bool final_block = false;
+	while (!final_block)
+	{
+		final_block = in.Read(1) != 0;
+		unsigned type = in.Read(2);
+		if (type == 0)
+		{
+			// Stored block
+			in.AlignToByte();
+			unsigned len = in.Read(16);
+			unsigned nlen = in.Read(16);
+			if ((len ^ 0xFFFF) != nlen || len > out_size - pos)
+				return false;
+			for (unsigned i = 0; i < len; i++)
+				out[pos++] = (unsigned char)in.Read(8);
+			if (in.Overrun())
+				return false;
+		}
+		else if (type == 1)
+		{
+			// Fixed codes
+			unsigned char code_lengths[288 + 30];
+			std::fill(code_lengths, code_lengths + 144, 8);
+			std::fill(code_lengths + 144, code_lengths + 256, 9);
+			std::fill(code_lengths + 256, code_lengths + 280, 7);
+			std::fill(code_lengths + 280, code_lengths + 288, 8);
+			std::fill(code_lengths + 288, code_lengths + 318, 5);
+			if (!lengths.Build(code_lengths, 288) || !distances.Build(code_lengths + 288, 30))
+				return false;
+			if (!InflateBlock(in, lengths, distances, out, out_size, pos))
+				return false;
+		}
+		else if (type == 2)
+		{
+			// Dynamic codes, their lengths are compressed by another code
+			static const uint8_t ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+			int literal_count = int(in.Read(5)) + 257;
+			int distance_count = int(in.Read(5)) + 1;
+			int code_length_count = int(in.Read(4)) + 4;
+			if (literal_count > 286 || distance_count > 30)
+				return false;
+
+			unsigned char code_length_lengths[19] = { 0 };
+			for (int i = 0; i < code_length_count; i++)
+				code_length_lengths[ORDER[i]] = (unsigned char)in.Read(3);
+			HuffmanCode code_length_code;
+			if (!code_length_code.Build(code_length_lengths, 19))
+				return false;
+
+			unsigned char code_lengths[286 + 30];
+			int count = 0;
+			while (count < literal_count + distance_count)
+			{
+				int symbol = code_length_code.Decode(in);
+				if (symbol < 0)
+					return false;
+				if (symbol < 16)
+				{
+					code_lengths[count++] = (unsigned char)symbol;
+					continue;
+				}
+
+				unsigned char value = 0;
+				int repeat;
+				if (symbol == 16)
+				{
+					if (count == 0)
+						return false;
+					value = code_lengths[count - 1];
+					repeat = 3 + int(in.Read(2));
+				}
+				else if (symbol == 17)
+					repeat = 3 + int(in.Read(3));
+				else
+					repeat = 11 + int(in.Read(7));
+
+				if (count + repeat > literal_count + distance_count)
+					return false;
+				std::fill(code_lengths + count, code_lengths + count + repeat, value);
+				count += repeat;
+			}
+
+			if (code_lengths[256] == 0)
+				return false;
+			if (!lengths.Build(code_lengths, literal_count) || !distances.Build(code_lengths + literal_count, distance_count))
+				return false;
+			if (!InflateBlock(in, lengths, distances, out, out_size, pos))
+				return false;
+		}
+		else
+			return false;
+	}
+	return pos == out_size;
+}
+
+//-----------------------------------------
+//----               PNG               ----
+//-----------------------------------------
+
+static const unsigned char PNG_SIGNATURE[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+static uint32_t ReadBigEndian32(const unsigned char *p)
+{
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static int PaethPredictor(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// Reverses the filter of one scanline in place, 'previous' is the previous unfiltered line (zeros for the first)
+static bool UnfilterScanline(int filter, unsigned char *line, const unsigned char *previous, size_t length, size_t bpp)
+{
+	switch (filter)
+	{
+	case 0:
+		break;
+	case 1:
+		for (size_t i = bpp; i < length; i++)
+			line[i] = (unsigned char)(line[i] + line[i - bpp]);
+		break;
+	case 2:
+		for (size_t i = 0; i < length; i++)
+			line[i] = (unsigned char)(line[i] + previous[i]);
+		break;
+	case 3:
+		for (size_t i = 0; i < bpp && i < length; i++)
+			line[i] = (unsigned char)(line[i] + (previous[i] >> 1));
+		for (size_t i = bpp; i < length; i++)
+			line[i] = (unsigned char)(line[i] + ((line[i - bpp] + previous[i]) >> 1));
+		break;
+	case 4:
+		for (size_t i = 0; i < bpp && i < length; i++)
+			line[i] = (unsigned char)(line[i] + previous[i]);
+		for (size_t i = bpp; i < length; i++)
+			line[i] = (unsigned char)(line[i] + PaethPredictor(line[i - bpp], previous[i], previous[i - bpp]));
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+// Returns sample 'index' of an unfiltered scanline with the given bit depth, 16-bit samples are reduced to 8 bits
+static unsigned ReadSample(const unsigned char *line, size_t index, int depth)
+{
+	switch (depth)
+	{
+	case 8:  return line[index];
+	case 16: return line[index * 2];
+	default:
+	{
+		size_t bit = index * depth;
+		return (line[bit / 8] >> (8 - depth - int(bit % 8))) & ((1u << depth) - 1);
+	}
+	}
+}
+
+static ImageDecodeResult DecodePNG(const unsigned char *data, size_t size, PV112::ImageData &out_image, std::string &out_error)
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	int depth = 0;
+	int color_type = -1;
+	std::vector<unsigned char> compressed;
+	unsigned char palette[256][4];
+	int palette_size = 0;
+	bool palette_alpha = false;
+
+	// Read the chunks
+	size_t pos = 8;
+	bool end_found = false;
+	while (!end_found)
+	{
+		if (size - pos < 12)
+		{
+			out_error = "truncated PNG chunk";
+			return IMAGE_ERROR;
+		}
+		uint32_t length = ReadBigEndian32(data + pos);
+		const unsigned char *type = data + pos + 4;
+		const unsigned char *chunk = data + pos + 8;
+		if (length > size - pos - 12)
+		{
+			out_error = "truncated PNG chunk";
+			return IMAGE_ERROR;
+		}
+		pos += 12 + size_t(length);
+
+		if (memcmp(type, "IHDR", 4) == 0 && length >= 13)
+		{
+			width = ReadBigEndian32(chunk);
+			height = ReadBigEndian32(chunk + 4);
+			depth = chunk[8];
+			color_type = chunk[9];
+			if (chunk[10] != 0 || chunk[11] != 0)
+			{
+				out_error = "unknown PNG compression or filter method";
+				return IMAGE_ERROR;
+			}
+			if (chunk[12] != 0)
+			{
+				out_error = "interlaced PNG";
+				return IMAGE_UNSUPPORTED;
+			}
+		}
+		else if (memcmp(type, "PLTE", 4) == 0)
+		{
+			palette_size = std::min(int(length / 3), 256);
+			for (int i = 0; i < palette_size; i++)
+			{
+				palette[i][0] = chunk[i * 3 + 0];
+				palette[i][1] = chunk[i * 3 + 1];
+				palette[i][2] = chunk[i * 3 + 2];
+				palette[i][3] = 255;
+			}
+		}
+		else if (memcmp(type, "tRNS", 4) == 0 && color_type == 3)
+		{
+			// Alpha of the palette entries, other color types use a color key that is ignored here
+			for (uint32_t i = 0; i < length && i < 256; i++)
+				palette[i][3] = chunk[i];
+			palette_alpha = true;
+		}
+		else if (memcmp(type, "IDAT", 4) == 0)
+			compressed.insert(compressed.end(), chunk, chunk + length);
+		else if (memcmp(type, "IEND", 4) == 0)
+			end_found = true;
+		else if (!(type[0] & 0x20))
+		{
+			out_error = "unknown critical PNG chunk";
+			return IMAGE_UNSUPPORTED;
+		}
+	}
+
+	// Samples per pixel of the color types 0 (gray), 2 (RGB), 3 (palette), 4 (gray and alpha), 6 (RGBA)
+	int channels;
+	switch (color_type)
+	{
+	case 0: channels = 1; break;
+	case 2: channels = 3; break;
+	case 3: channels = 1; break;
+	case 4: channels = 2; break;
+	case 6: channels = 4; break;
+	default:
+		out_error = "missing PNG header or unknown color type";
+		return IMAGE_ERROR;
+	}
+	bool valid_depth = depth == 8 || depth == 16 ||
+		((color_type == 0 || color_type == 3) && (depth == 1 || depth == 2 || depth == 4));
+	if (!valid_depth || (color_type == 3 && depth == 16) || width == 0 || height == 0 || width > 32768 || height > 32768)
+	{
+		out_error = "invalid PNG header";
+		return IMAGE_ERROR;
+	}
+	if (color_type == 3 && palette_size == 0)
+	{
+		out_error = "missing PNG palette";
+		return IMAGE_ERROR;
+	}
+
+	// Decompress all scanlines, each starts with its filter type
+	size_t line_size = (size_t(width) * channels * depth + 7) / 8;
+	size_t bpp = std::max<size_t>(1, size_t(channels) * depth / 8);
+	std::vector<unsigned char> raw(size_t(height) * (line_size + 1));
+	if (!InflateZlib(compressed.data(), compressed.size(), raw.data(), raw.size()))
+	{
+		out_error = "corrupted PNG data";
+		return IMAGE_ERROR;
+	}
+
+	// Output RGB, or RGBA if the image has alpha
+	bool alpha = color_type == 4 || color_type == 6 || (color_type == 3 && palette_alpha);
+	int out_channels = alpha ? 4 : 3;
+	size_t out_line_size = size_t(width) * out_channels;
+	out_image.Width = int(width);
+	out_image.Height = int(height);
+	out_image.InternalFormat = alpha ? GL_RGBA : GL_RGB;
+	out_image.Format = alpha ? GL_RGBA : GL_RGB;
+	out_image.Type = GL_UNSIGNED_BYTE;
+	out_image.Pixels.resize(out_line_size * height);
+
+	std::vector<unsigned char> zero_line(line_size, 0);
+	const unsigned char *previous = zero_line.data();
+	for (uint32_t y = 0; y < height; y++)
+	{
+		unsigned char *line = &raw[y * (line_size + 1)];
+		if (!UnfilterScanline(line[0], line + 1, previous, line_size, bpp))
+		{
+			out_error = "invalid PNG filter";
+			return IMAGE_ERROR;
+		}
+		previous = line + 1;
+
+		// PNG rows go from the top, the output from the bottom
+		const unsigned char *in = line + 1;
+		unsigned char *out = &out_image.Pixels[(height - 1 - y) * out_line_size];
+		if (depth == 8 && (color_type == 2 || color_type == 6))
+		{
+			memcpy(out, in, out_line_size);
+			continue;
+		}
+		unsigned gray_scale = depth < 8 ? 255 / ((1u << depth) - 1) : 1;
+		for (uint32_t x = 0; x < width; x++, out += out_channels)
+		{
+			switch (color_type)
+			{
+			case 0:
+				out[0] = out[1] = out[2] = (unsigned char)(ReadSample(in, x, depth) * gray_scale);
+				break;
+			case 2:
+			case 6:
+				for (int c = 0; c < out_channels; c++)
+					out[c] = (unsigned char)ReadSample(in, size_t(x) * channels + c, depth);
+				break;
+			case 3:
+			{
+				unsigned index = ReadSample(in, x, depth);
+				if (index >= unsigned(palette_size))
+					index = 0;
+				for (int c = 0; c < out_channels; c++)
+					out[c] = palette[index][c];
+				break;
+			}
+			case 4:
+				out[0] = out[1] = out[2] = (unsigned char)ReadSample(in, size_t(x) * 2, depth);
+				out[3] = (unsigned char)ReadSample(in, size_t(x) * 2 + 1, depth);
+				break;
+			}
+		}
+	}
+	return IMAGE_DECODED;
+}
+
+//-----------------------------------------
+//----               TGA               ----
+//-----------------------------------------
+
+static ImageDecodeResult DecodeTGA(const unsigned char *data, size_t size, PV112::ImageData &out_image, std::string &out_error)
+{
+	if (size < 18)
+	{
+		out_error = "truncated TGA header";
+		return IMAGE_ERROR;
+	}
+	int id_length = data[0];
+	int color_map_type = data[1];
+	int image_type = data[2];
+	int width = data[12] | (data[13] << 8);
+	int height = data[14] | (data[15] << 8);
+	int bits = data[16];
+	int descriptor = data[17];
+
+	// True color (2) and grayscale (3) images, raw or RLE compressed (+8)
+	bool rle = image_type == 10 || image_type == 11;
+	bool gray = image_type == 3 || image_type == 11;
+	if (color_map_type != 0 || !(image_type == 2 || image_type == 3 || rle) ||
+		(gray ? bits != 8 : (bits != 24 && bits != 32)) || (descriptor & 0x10))
+	{
+		out_error = "unsupported TGA variant";
+		return IMAGE_UNSUPPORTED;
+	}
+	if (width == 0 || height == 0)
+	{
+		out_error = "invalid TGA header";
+		return IMAGE_ERROR;
+	}
+
+	// Grayscale is expanded to BGR, true color stays BGR or BGRA as stored
+	int in_channels = bits / 8;
+	int out_channels = gray ? 3 : in_channels;
+	size_t pixel_count = size_t(width) * height;
+	out_image.Width = width;
+	out_image.Height = height;
+	out_image.InternalFormat = out_channels == 4 ? GL_RGBA : GL_RGB;
+	out_image.Format = out_channels == 4 ? GL_BGRA : GL_BGR;
+	out_image.Type = GL_UNSIGNED_BYTE;
+	out_image.Pixels.resize(pixel_count * out_channels);
+
+	const unsigned char *in = data + 18 + id_length;
+	const unsigned char *end = data + size;
+	unsigned char *out = out_image.Pixels.data();
+	auto write_pixel = [&](const unsigned char *pixel) {
+		if (gray)
+		{
+			out[0] = out[1] = out[2] = pixel[0];
+			out += 3;
+		}
+		else
+		{
+			memcpy(out, pixel, in_channels);
+			out += in_channels;
+		}
+	};
+
+	size_t written = 0;
+	while (written < pixel_count)
+	{
+		size_t count = 1;
+		bool run = false;
+		if (rle)
+		{
+			if (in >= end)
+				break;
+			count = (*in & 0x7F) + 1;
+			run = (*in & 0x80) != 0;
+			in++;
+			count = std::min(count, pixel_count - written);
+		}
+		else
+			count = pixel_count;
+
+		size_t needed = run ? in_channels : count * in_channels;
+		if (size_t(end - in) < needed)
+			break;
+		for (size_t i = 0; i < count; i++)
+			write_pixel(run ? in : in + i * in_channels);
+		in += needed;
+		written += count;
+	}
+	if (written < pixel_count)
+	{
+		out_error = "truncated TGA data";
+		return IMAGE_ERROR;
+	}
+
+	// Descriptor bit 5 means the rows go from the top
+	if (descriptor & 0x20)
+	{
+		size_t line_size = size_t(width) * out_channels;
+		for (int y = 0; y < height / 2; y++)
+			std::swap_ranges(&out_image.Pixels[y * line_size], &out_image.Pixels[(y + 1) * line_size],
+				&out_image.Pixels[(height - 1 - y) * line_size]);
+	}
+	return IMAGE_DECODED;
+}
+
+//-----------------------------------------
+//----          IMAGE DECODER          ----
+//-----------------------------------------
+
+ImageDecodeResult DecodeImage(const unsigned char *data, size_t size, PV112::ImageData &out_image, std::string &out_error)
+{
+	if (size >= 8 && memcmp(data, PNG_SIGNATURE, 8) == 0)
+		return DecodePNG(data, size, out_image, out_error);
+
+	// TGA has no signature, it is recognized by the image type in its header
+	if (size >= 18 && (data[2] == 2 || data[2] == 3 || data[2] == 10 || data[2] == 11))
+		return DecodeTGA(data, size, out_image, out_error);
+
+	out_error = "unknown image format";
+	return IMAGE_UNSUPPORTED;
+}
+
+ImageDecodeResult DecodeImageFile(const maybewchar *filename, PV112::ImageData &out_image, std::string &out_error)
+{
+	ifstream file(filename, ios::binary | ios::ate);
+	if (!file.good())
+	{
+		out_error = "cannot open the file";
+		return IMAGE_ERROR;
+	}
+	std::vector<unsigned char> data(size_t(file.tellg()));
+	file.seekg(0);
+	file.read(reinterpret_cast<char *>(data.data()), data.size());
+	if (!file.good())
+	{
+		out_error = "cannot read the file";
+		return IMAGE_ERROR;
+	}
+	return DecodeImage(data.data(), data.size(), out_image, out_error);
+}
+
+void BenchmarkImageDecoding(const std::vector<std::string> &filenames, int repetitions, std::ostream &out)
+{
+	// Read all files first
+	std::vector<std::vector<unsigned char>> files;
+	double megapixels = 0.0;
+	for (size_t i = 0; i < filenames.size(); i++)
+	{
+		ifstream file(filenames[i].c_str(), ios::binary);
+		std::vector<unsigned char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+		PV112::ImageData image;
+		std::string error;
+		if (DecodeImage(data.data(), data.size(), image, error) != IMAGE_DECODED)
+		{
+			out << "Skipping " << filenames[i] << ": " << error << endl;
+			continue;
+		}
+		megapixels += double(image.Width) * image.Height / 1e6;
+		files.push_back(std::move(data));
+	}
+	if (files.empty())
+		return;
+
+	std::vector<unsigned> thread_counts;
+	unsigned hardware_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned count = 1; count < hardware_threads; count *= 2)
+		thread_counts.push_back(count);
+	thread_counts.push_back(hardware_threads);
+
+	out << "Decoding " << files.size() << " images (" << megapixels << " MP) " << repetitions << " times:" << endl;
+	double single_thread_rate = 0.0;
+	for (size_t t = 0; t < thread_counts.size(); t++)
+	{
+		std::atomic<int> failures(0);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		{
+			ThreadPool pool(thread_counts[t]);
+			for (int r = 0; r < repetitions; r++)
+			{
+				for (size_t i = 0; i < files.size(); i++)
+				{
+					const std::vector<unsigned char> *data = &files[i];
+					pool.Submit([data, &failures](unsigned) {
+						PV112::ImageData image;
+						std::string error;
+						if (DecodeImage(data->data(), data->size(), image, error) != IMAGE_DECODED)
+							failures++;
+					});
+				}
+			}
+			pool.WaitIdle();
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		double rate = megapixels * repetitions / seconds;
+		if (t == 0)
+			single_thread_rate = rate;
+
+		out << "  " << setw(3) << thread_counts[t] << " threads: " << fixed << setprecision(1) << setw(8) << rate << " MP/s, "
+			<< setprecision(2) << rate / single_thread_rate << "x" << (failures ? "  FAILED" : "") << endl;
+		out.unsetf(ios::floatfield);
+		out << setprecision(6);
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+#ifndef INCLUDED_IMAGE_DECODER_H
+#define INCLUDED_IMAGE_DECODER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "PV112.h"
+
+/// Result of DecodeImage
+enum ImageDecodeResult
+{
+	IMAGE_DECODED,
+	// The data is not a PNG or TGA image, or it uses a variant the decoder does not handle (interlaced PNG,
+	// color mapped TGA). Another decoder may be used.
+	IMAGE_UNSUPPORTED,
+	// The file cannot be read or the image is corrupted
+	IMAGE_ERROR
+};
+
+//-----------------------------------------
+//----          IMAGE DECODER          ----
+//-----------------------------------------
+
+// The decoder has no global state and all buffers are owned by the caller, so any number of images can be
+// decoded on different threads at once. The images are returned as 8-bit RGB or RGBA (BGR or BGRA for TGA)
+// with rows from the bottom to the top, the same as DevIL with IL_ORIGIN_LOWER_LEFT.
+
+/// Decodes a PNG (non-interlaced, any bit depth and color type) or TGA (true color or grayscale, raw or RLE)
+/// image from memory. On failure 'out_error' describes the problem.
+ImageDecodeResult DecodeImage(const unsigned char *data, size_t size, PV112::ImageData &out_image, std::string &out_error);
+
+/// Reads the whole file and decodes it by DecodeImage
+ImageDecodeResult DecodeImageFile(const maybewchar *filename, PV112::ImageData &out_image, std::string &out_error);
+
+/// Decodes the files repeatedly with 1, 2, 4, ... up to the number of hardware threads and prints the throughput
+/// in megapixels per second for each thread count. The files are read to memory first, so only decoding is measured.
+void BenchmarkImageDecoding(const std::vector<std::string> &filenames, int repetitions, std::ostream &out);
+
+#endif	// INCLUDED_IMAGE_DECODER_H
@@ -0,0 +1,158 @@
+#include "InputRecording.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+using namespace std;
+
+static const char INPUT_RECORDING_MAGIC[4] = { 'P', 'V', 'I', 'R' };
+
+// The file starts with this header, followed by the events and the samples
+struct InputRecordingHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int seed;
+	unsigned int event_count;
+	unsigned int sample_count;
+};
+
+// Size of an event in the file, without the padding of InputEvent
+static const size_t INPUT_EVENT_FILE_SIZE = 10;
+
+// Appends the bytes of the value to the data
+template <typename T>
+static void AppendValue(std::vector<unsigned char> &data, const T &value)
+{
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&value);
+	data.insert(data.end(), bytes, bytes + sizeof(T));
+}
+
+// Reads the value at the offset and advances it
+template <typename T>
+static void ReadValue(const std::vector<unsigned char> &data, size_t &offset, T &out_value)
+{
+	memcpy(&out_value, &data[offset], sizeof(T));
+	offset += sizeof(T);
+}
+
+//-----------------------------------------
+//----         RECORDING FILE          ----
+//-----------------------------------------
+
+bool InputRecording::Save(const std::string &file_name) const
+{
+	InputRecordingHeader header;
+	memcpy(header.magic, INPUT_RECORDING_MAGIC, sizeof(header.magic));
+	header.version = INPUT_RECORDING_VERSION;
+	header.seed = seed;
+	header.event_count = unsigned(events.size());
+	header.sample_count = unsigned(samples.size());
+
+	std::vector<unsigned char> data;
+	data.reserve(sizeof(header) + events.size() * INPUT_EVENT_FILE_SIZE + samples.size() * sizeof(CameraSample));
+	AppendValue(data, header);
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		AppendValue(data, events[i].tick);
+		AppendValue(data, events[i].type);
+		AppendValue(data, events[i].key);
+		AppendValue(data, events[i].dx);
+		AppendValue(data, events[i].dy);
+	}
+	if (!samples.empty())
+		data.insert(data.end(), reinterpret_cast<const unsigned char *>(samples.data()),
+			reinterpret_cast<const unsigned char *>(samples.data() + samples.size()));
+
+	ofstream file(file_name.c_str(), ios::binary | ios::trunc);
+	file.write(reinterpret_cast<const char *>(data.data()), data.size());
+	if (!file.good())
+	{
+		cout << "Cannot write input recording " << file_name << endl;
+		return false;
+	}
+	return true;
+}
+
+bool InputRecording::Load(const std::string &file_name)
+{
+	ifstream file(file_name.c_str(), ios::binary);
+	std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (!file.eof() && !file.good())
+	{
+		cout << "Cannot read input recording " << file_name << endl;
+		return false;
+	}
+
+	InputRecordingHeader header;
+	size_t offset = 0;
+	bool valid = data.size() >= sizeof(header);
+	if (valid)
+	{
+		ReadValue(data, offset, header);
+		valid = memcmp(header.magic, INPUT_RECORDING_MAGIC, sizeof(header.magic)) == 0 && header.version == INPUT_RECORDING_VERSION &&
+			data.size() == sizeof(header) + size_t(header.event_count) * INPUT_EVENT_FILE_SIZE + size_t(header.sample_count) * sizeof(CameraSample);
+	}
+	if (!valid)
+	{
+		cout << "Input recording " << file_name << " is not valid" << endl;
+		return false;
+	}
+
+	seed = header.seed;
+	events.resize(header.event_count);
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		ReadValue(data, offset, events[i].tick);
+		ReadValue(data, offset, events[i].type);
+		ReadValue(data, offset, events[i].key);
+		ReadValue(data, offset, events[i].dx);
+		ReadValue(data, offset, events[i].dy);
+	}
+	samples.resize(header.sample_count);
+	if (!samples.empty())
+		memcpy(samples.data(), &data[offset], samples.size() * sizeof(CameraSample));
+	return true;
+}
+
+//-----------------------------------------
+//----             REPLAY              ----
+//-----------------------------------------
+
+InputReplay::InputReplay(const InputRecording &recording)
+	: recording(recording), next_event(0), divergent_ticks(0), first_divergent_tick(0)
+{
+}
+
+bool InputReplay::NextEvent(unsigned int tick, InputEvent &out_event)
+{
+	while (next_event < recording.events.size() && recording.events[next_event].tick < tick)
+		next_event++;
+	if (next_event == recording.events.size() || recording.events[next_event].tick != tick)
+		return false;
+	out_event = recording.events[next_event++];
+	return true;
+}
+
+void InputReplay::CheckSample(unsigned int tick, const CameraSample &sample)
+{
+	if (tick >= recording.samples.size())
+		return;
+
+	const CameraSample &recorded = recording.samples[tick];
+	float difference = 0.0f;
+	for (int i = 0; i < 3; i++)
+		difference = std::max(difference, fabsf(sample.eye_position[i] - recorded.eye_position[i]));
+	difference = std::max(difference, fabsf(sample.direction - recorded.direction));
+	difference = std::max(difference, fabsf(sample.elevation - recorded.elevation));
+	if (difference <= INPUT_REPLAY_TOLERANCE)
+		return;
+
+	if (divergent_ticks == 0)
+		first_divergent_tick = tick;
+	divergent_ticks++;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#ifndef INCLUDED_INPUT_RECORDING_H
+#define INCLUDED_INPUT_RECORDING_H
+
+#include <string>
+#include <vector>
+#include "PV112.h"
+
+/// Version of the binary recording format, recordings of other versions are rejected
+static const unsigned int INPUT_RECORDING_VERSION = 1;
+
+/// Largest distance of the replayed eye from the recorded one that is not reported as a divergence
+static const float INPUT_REPLAY_TOLERANCE = 1e-3f;
+
+/// Kinds of InputEvent
+enum InputEventType
+{
+	INPUT_KEY_DOWN,
+	INPUT_KEY_UP,
+	INPUT_MOUSE_MOVED
+};
+
+/// Input that changes the simulation, without the keys that only change how the frames are drawn or printed
+struct InputEvent
+{
+	// Simulation step the event arrived before
+	unsigned int tick;
+	unsigned char type;
+	unsigned char key;
+	// Mouse movement from the center of the window in pixels
+	short dx;
+	short dy;
+};
+
+/// State of the camera after a simulation step, compared during the replay to detect divergence
+struct CameraSample
+{
+	float eye_position[3];
+	float direction;
+	float elevation;
+};
+
+//-----------------------------------------
+//----         RECORDING FILE          ----
+//-----------------------------------------
+
+/// Input events and camera states of a session, with the seed the scene was generated with.
+///
+/// The file is a header followed by the packed events and one camera sample per simulation step. The samples make
+/// the file grow by 20 bytes per step, which is 1 kB per second at the default step.
+class InputRecording
+{
+public:
+	InputRecording() : seed(0) {}
+
+	/// Number of recorded simulation steps
+	unsigned int TickCount() const { return unsigned(samples.size()); }
+
+	/// Writes the recording. Returns false and prints an error if the file cannot be written.
+	bool Save(const std::string &file_name) const;
+
+	/// Reads a recording written by Save. Returns false and prints an error if the file cannot be read or is not
+	/// a valid recording.
+	bool Load(const std::string &file_name);
+
+	// Seed of the random generator that placed the trees and the grass
+	unsigned int seed;
+	// Events in the order they arrived, the ticks do not decrease
+	std::vector<InputEvent> events;
+	std::vector<CameraSample> samples;
+};
+
+/// Feeds the events of a recording back step by step and compares the camera with the recorded one
+class InputReplay
+{
+public:
+	explicit InputReplay(const InputRecording &recording);
+
+	unsigned int TickCount() const { return recording.TickCount(); }
+
+	/// Returns the next event that arrived before the step 'tick', false if there is none. Events of earlier steps
+	/// that were not taken are skipped.
+	bool NextEvent(unsigned int tick, InputEvent &out_event);
+
+	/// Compares the camera after the step 'tick' with the recorded one
+	void CheckSample(unsigned int tick, const CameraSample &sample);
+
+	/// Number of steps the camera diverged from the recording
+	unsigned int DivergentTicks() const { return divergent_ticks; }
+
+	/// First step the camera diverged, valid if DivergentTicks() > 0
+	unsigned int FirstDivergentTick() const { return first_divergent_tick; }
+
+private:
+	InputReplay(const InputReplay &);
+	InputReplay &operator =(const InputReplay &);
+
+	const InputRecording &recording;
+	size_t next_event;
+	unsigned int divergent_ticks;
+	unsigned int first_divergent_tick;
+};
+
+#endif	// INCLUDED_INPUT_RECORDING_H
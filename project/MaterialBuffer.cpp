@@ -0,0 +1,45 @@
+#include "MaterialBuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+MaterialBuffer::MaterialBuffer(size_t material_size)
+	: material_size(material_size), buffer(0)
+{
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+
+	range_size = UniformBlockRangeSize(material_size);
+	stride = AlignSize(range_size, size_t(std::max(alignment, 1)));
+}
+
+MaterialBuffer::~MaterialBuffer()
+{
+	glDeleteBuffers(1, &buffer);
+}
+
+unsigned int MaterialBuffer::Add(const void *material)
+{
+	unsigned int id = MaterialCount();
+	data.resize(data.size() + stride, 0);
+	memcpy(&data[size_t(id) * stride], material, material_size);
+	return id;
+}
+
+void MaterialBuffer::Upload()
+{
+	glDeleteBuffers(1, &buffer);
+	// Uploaded through the copy target, so the uniform buffer binding known to the state cache stays valid
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	if (GLEW_ARB_buffer_storage)
+		glBufferStorage(GL_COPY_WRITE_BUFFER, GLsizeiptr(data.size()), data.data(), 0);
+	else
+		glBufferData(GL_COPY_WRITE_BUFFER, GLsizeiptr(data.size()), data.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void MaterialBuffer::Bind(GLStateCache &state, GLuint binding, unsigned int material) const
+{
+	state.BindUniformBufferRange(binding, buffer, Offset(material), GLsizeiptr(range_size));
+}
@@ -0,0 +1,50 @@
+#pragma once
+#ifndef INCLUDED_MATERIAL_BUFFER_H
+#define INCLUDED_MATERIAL_BUFFER_H
+
+#include <vector>
+#include "PV112.h"
+#include "GLStateCache.h"
+
+/// Materials of all objects in one uniform buffer, each at an offset aligned to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT.
+/// The materials are registered at load time and uploaded once, a draw selects its material by binding the range
+/// of it, so the buffer is never written while the GPU may read it.
+class MaterialBuffer
+{
+public:
+	/// 'material_size' is the size of one material, the size of the uniform block in the shaders. Queries the
+	/// offset alignment, so the context must be current.
+	explicit MaterialBuffer(size_t material_size);
+
+	/// Deletes the buffer
+	~MaterialBuffer();
+
+	/// Adds a material of the size given to the constructor, returns its id. Must be called before Upload.
+	unsigned int Add(const void *material);
+
+	/// Creates the buffer with all added materials, immutable if the context supports ARB_buffer_storage
+	void Upload();
+
+	/// Binds the range of the material to the uniform buffer binding point
+	void Bind(GLStateCache &state, GLuint binding, unsigned int material) const;
+
+	unsigned int MaterialCount() const { return unsigned(data.size() / stride); }
+	GLuint Buffer() const { return buffer; }
+
+	/// Offset of the material in the buffer
+	GLintptr Offset(unsigned int material) const { return GLintptr(material) * GLintptr(stride); }
+
+private:
+	MaterialBuffer(const MaterialBuffer &);
+	MaterialBuffer &operator =(const MaterialBuffer &);
+
+	size_t material_size;
+	// Size of the bound range and the distance of the materials, which is the range rounded up to the offset
+	// alignment
+	size_t range_size;
+	size_t stride;
+	std::vector<unsigned char> data;
+	GLuint buffer;
+};
+
+#endif	// INCLUDED_MATERIAL_BUFFER_H
@@ -0,0 +1,372 @@
+#include "MeshCache.h"
+#include "VertexLayout.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//-----------------------------------------
+//----        BINARY MESH FORMAT       ----
+//-----------------------------------------
+
+static const char MESH_CACHE_MAGIC[4] = { 'P', 'V', 'M', 'C' };
+
+MappedFile::MappedFile() : data(nullptr), size(0)
+#if defined(_WIN32)
+	, file(INVALID_HANDLE_VALUE), mapping(nullptr)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const char *file_name)
+{
+	Close();
+
+#if defined(_WIN32)
+	file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		Close();
+		return false;
+	}
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+	{
+		Close();
+		return false;
+	}
+
+	data = static_cast<const unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!data)
+	{
+		Close();
+		return false;
+	}
+	size = size_t(file_size.QuadPart);
+#else
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void *mapped = mmap(nullptr, size_t(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);		// The mapping stays valid after closing the descriptor
+	if (mapped == MAP_FAILED)
+		return false;
+
+	// The whole file is uploaded right away
+	madvise(mapped, size_t(file_stat.st_size), MADV_WILLNEED);
+
+	data = static_cast<const unsigned char *>(mapped);
+	size = size_t(file_stat.st_size);
+#endif
+	return true;
+}
+
+void MappedFile::Close()
+{
+#if defined(_WIN32)
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (data)
+		munmap(const_cast<unsigned char *>(data), size);
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+//-----------------------------------------
+//----      WRITING AND CONVERSION     ----
+//-----------------------------------------
+
+// Vertex layouts of the cache files, changing them changes the format
+typedef CompactVertexLayout MeshCacheQuantizedLayout;
+typedef FloatVertexLayout MeshCacheFloatLayout;
+static_assert(MeshCacheQuantizedLayout::Stride == 16 && MeshCacheFloatLayout::Stride == 32, "Update MESH_CACHE_VERSION");
+
+static size_t AlignTo16(size_t offset)
+{
+	return (offset + 15) & ~size_t(15);
+}
+
+bool GetFileStamp(const char *file_name, unsigned long long &out_size, long long &out_time)
+{
+	struct stat file_stat;
+	if (stat(file_name, &file_stat) != 0)
+		return false;
+	out_size = static_cast<unsigned long long>(file_stat.st_size);
+	out_time = static_cast<long long>(file_stat.st_mtime);
+	return true;
+}
+
+std::string MeshCacheFileName(const char *obj_file_name)
+{
+	return std::string(obj_file_name) + MESH_CACHE_EXTENSION;
+}
+
+void BuildMeshCache(const PV112::MeshData &mesh, const char *source_file_name, bool quantize, std::vector<unsigned char> &out_data)
+{
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+	header.version = MESH_CACHE_VERSION;
+	header.flags = quantize ? MESH_CACHE_QUANTIZED : 0;
+	header.vertex_count = unsigned(mesh.vertices.size());
+	header.vertex_stride = unsigned(quantize ? size_t(MeshCacheQuantizedLayout::Stride) : size_t(MeshCacheFloatLayout::Stride));
+	header.index_count = unsigned(mesh.indices.size());
+	header.lod_count = unsigned(std::max(mesh.lods.size(), size_t(1)));
+	if (source_file_name)
+		GetFileStamp(source_file_name, header.source_size, header.source_time);
+
+	header.lods_offset = unsigned(AlignTo16(sizeof(MeshCacheHeader)));
+	header.vertices_offset = unsigned(AlignTo16(header.lods_offset + header.lod_count * sizeof(MeshCacheLOD)));
+	header.indices_offset = unsigned(AlignTo16(header.vertices_offset + size_t(header.vertex_count) * header.vertex_stride));
+	size_t total_size = header.indices_offset + size_t(header.index_count) * sizeof(unsigned int);
+
+	// Bounds
+	glm::vec3 min_pos(0.0f);
+	glm::vec3 max_pos(0.0f);
+	if (!mesh.vertices.empty())
+	{
+		min_pos = max_pos = mesh.vertices[0];
+		for (size_t i = 1; i < mesh.vertices.size(); i++)
+		{
+			min_pos = glm::min(min_pos, mesh.vertices[i]);
+			max_pos = glm::max(max_pos, mesh.vertices[i]);
+		}
+	}
+	glm::vec3 center = (min_pos + max_pos) * 0.5f;
+	float radius = 0.0f;
+	for (size_t i = 0; i < mesh.vertices.size(); i++)
+		radius = std::max(radius, glm::distance(center, mesh.vertices[i]));
+	for (int i = 0; i < 3; i++)
+	{
+		header.bounding_sphere[i] = center[i];
+		header.bounds_min[i] = min_pos[i];
+		header.bounds_max[i] = max_pos[i];
+	}
+	header.bounding_sphere[3] = radius;
+
+	out_data.assign(total_size, 0);
+	memcpy(&out_data[0], &header, sizeof(header));
+
+	// LOD table
+	MeshCacheLOD *lods = reinterpret_cast<MeshCacheLOD *>(&out_data[header.lods_offset]);
+	if (mesh.lods.empty())
+	{
+		lods[0].first_index = 0;
+		lods[0].index_count = header.index_count;
+		lods[0].error = 0.0f;
+	}
+	for (size_t i = 0; i < mesh.lods.size(); i++)
+	{
+		lods[i].first_index = unsigned(mesh.lods[i].FirstIndex);
+		lods[i].index_count = unsigned(mesh.lods[i].Count);
+		lods[i].error = mesh.lods[i].Error;
+	}
+
+	// Interleaved vertices
+	unsigned char *vertex = &out_data[header.vertices_offset];
+	for (size_t i = 0; i < mesh.vertices.size(); i++, vertex += header.vertex_stride)
+	{
+		glm::vec3 normal = i < mesh.normals.size() ? mesh.normals[i] : glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::vec2 tex_coord = i < mesh.tex_coords.size() ? mesh.tex_coords[i] : glm::vec2(0.0f, 0.0f);
+		if (quantize)
+			MeshCacheQuantizedLayout::PackVertex(vertex, mesh.vertices[i], normal, tex_coord);
+		else
+			MeshCacheFloatLayout::PackVertex(vertex, mesh.vertices[i], normal, tex_coord);
+	}
+
+	// Indices
+	if (!mesh.indices.empty())
+		memcpy(&out_data[header.indices_offset], mesh.indices.data(), mesh.indices.size() * sizeof(unsigned int));
+}
+
+// Writes cache data to a file, prints an error and returns false on failure
+static bool WriteMeshCacheFile(const std::string &cache_name, const std::vector<unsigned char> &data)
+{
+	ofstream file(cache_name.c_str(), ios::binary | ios::trunc);
+	file.write(reinterpret_cast<const char *>(data.data()), data.size());
+	if (!file.good())
+	{
+		cout << "Cannot write mesh cache " + cache_name + "\n";
+		return false;
+	}
+	return true;
+}
+
+bool ConvertOBJToMeshCache(const char *obj_file_name, bool quantize)
+{
+	PV112::MeshData mesh;
+	if (!PV112::ProcessOBJFile(obj_file_name, mesh))
+		return false;
+
+	std::vector<unsigned char> data;
+	BuildMeshCache(mesh, obj_file_name, quantize, data);
+
+	std::string cache_name = MeshCacheFileName(obj_file_name);
+	if (!WriteMeshCacheFile(cache_name, data))
+		return false;
+	cout << "Wrote mesh cache " << cache_name << " (" << data.size() << " bytes)" << endl;
+	return true;
+}
+
+//-----------------------------------------
+//----             LOADING             ----
+//-----------------------------------------
+
+const MeshCacheHeader *ValidateMeshCache(const unsigned char *data, size_t size, const char *source_file_name)
+{
+	if (!data || size < sizeof(MeshCacheHeader))
+		return nullptr;
+
+	const MeshCacheHeader *header = reinterpret_cast<const MeshCacheHeader *>(data);
+	if (memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != MESH_CACHE_VERSION)
+		return nullptr;
+
+	// The vertices must be in the layout given by the flags
+	size_t stride = (header->flags & MESH_CACHE_QUANTIZED) ? size_t(MeshCacheQuantizedLayout::Stride) : size_t(MeshCacheFloatLayout::Stride);
+	if (header->vertex_stride != stride)
+		return nullptr;
+
+	// All sections must be aligned and inside the data
+	if (((header->lods_offset | header->vertices_offset | header->indices_offset) & 15) != 0 ||
+		size_t(header->lods_offset) + size_t(header->lod_count) * sizeof(MeshCacheLOD) > size ||
+		size_t(header->vertices_offset) + size_t(header->vertex_count) * header->vertex_stride > size ||
+		size_t(header->indices_offset) + size_t(header->index_count) * sizeof(unsigned int) > size ||
+		header->lod_count == 0)
+		return nullptr;
+
+	if (source_file_name)
+	{
+		unsigned long long source_size;
+		long long source_time;
+		if (GetFileStamp(source_file_name, source_size, source_time) &&
+			(source_size != header->source_size || source_time != header->source_time))
+			return nullptr;
+	}
+
+	// The meshes are uploaded straight from the data, so a damaged cache must not lead to draws out of range
+	const MeshCacheLOD *lods = reinterpret_cast<const MeshCacheLOD *>(data + header->lods_offset);
+	for (unsigned int i = 0; i < header->lod_count; i++)
+	{
+		if (size_t(lods[i].first_index) + size_t(lods[i].index_count) > header->index_count)
+			return nullptr;
+	}
+	const unsigned int *indices = reinterpret_cast<const unsigned int *>(data + header->indices_offset);
+	for (unsigned int i = 0; i < header->index_count; i++)
+	{
+		if (indices[i] >= header->vertex_count)
+			return nullptr;
+	}
+	return header;
+}
+
+PV112::Geometry CreateMeshCacheGeometry(const MeshCacheHeader *header, GLint position_location, GLint normal_location, GLint tex_coord_location)
+{
+	const unsigned char *data = reinterpret_cast<const unsigned char *>(header);
+	const void *vertices = data + header->vertices_offset;
+	const unsigned int *indices = reinterpret_cast<const unsigned int *>(data + header->indices_offset);
+
+	// The vertex and index data go to glBufferData straight from the cache data
+	PV112::Geometry geometry;
+	if (header->flags & MESH_CACHE_QUANTIZED)
+		geometry = CreateLayoutGeometry<MeshCacheQuantizedLayout>(vertices, header->vertex_count, indices, header->index_count,
+			GL_TRIANGLES, position_location, normal_location, tex_coord_location);
+	else
+		geometry = CreateLayoutGeometry<MeshCacheFloatLayout>(vertices, header->vertex_count, indices, header->index_count,
+			GL_TRIANGLES, position_location, normal_location, tex_coord_location);
+
+	const MeshCacheLOD *lods = reinterpret_cast<const MeshCacheLOD *>(data + header->lods_offset);
+	geometry.DrawElementsCount = GLsizei(lods[0].index_count);
+	if (header->lod_count > 1)
+	{
+		for (unsigned int i = 0; i < header->lod_count; i++)
+		{
+			PV112::GeometryLOD lod;
+			lod.FirstIndex = GLsizei(lods[i].first_index);
+			lod.Count = GLsizei(lods[i].index_count);
+			lod.Error = lods[i].error;
+			geometry.LODs.push_back(lod);
+		}
+	}
+	geometry.BoundingSphere = glm::vec4(header->bounding_sphere[0], header->bounding_sphere[1], header->bounding_sphere[2], header->bounding_sphere[3]);
+
+	return geometry;
+}
+
+bool PrepareMeshCache(const char *obj_file_name, MeshCacheData &out_data)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	auto elapsed_ms = [&start] {
+		return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	};
+
+	// Use the binary cache next to the OBJ file when it is up to date
+	std::string cache_name = MeshCacheFileName(obj_file_name);
+	if (out_data.file.Open(cache_name.c_str()))
+	{
+		out_data.header = ValidateMeshCache(out_data.file.Data(), out_data.file.Size(), obj_file_name);
+		if (out_data.header)
+		{
+			ostringstream log;
+			log << "OBJ " << obj_file_name << ": loaded from cache in " << elapsed_ms() << " ms" << endl;
+			cout << log.str();
+			return true;
+		}
+		out_data.file.Close();
+		cout << "Mesh cache " + cache_name + " is out of date or damaged\n";
+	}
+
+	PV112::MeshData mesh;
+	if (!PV112::ProcessOBJFile(obj_file_name, mesh))
+		return false;		// The error message was already printed
+
+	// Build the cache for the next run and use the same data now, so both runs upload the same vertices
+	BuildMeshCache(mesh, obj_file_name, MESH_CACHE_QUANTIZE, out_data.built_data);
+	WriteMeshCacheFile(cache_name, out_data.built_data);
+	out_data.header = ValidateMeshCache(out_data.built_data.data(), out_data.built_data.size(), nullptr);
+
+	ostringstream log;
+	log << "OBJ " << obj_file_name << ": parsed and processed in " << elapsed_ms() << " ms" << endl;
+	cout << log.str();
+	return true;
+}
@@ -0,0 +1,136 @@
+#pragma once
+#ifndef INCLUDED_MESH_CACHE_H
+#define INCLUDED_MESH_CACHE_H
+
+#include <string>
+#include <vector>
+#include "PV112.h"
+
+/// Version of the binary mesh format, cache files of other versions are rebuilt
+static const unsigned int MESH_CACHE_VERSION = 2;
+
+/// Extension appended to the name of the OBJ file to get the name of its cache file
+static const char MESH_CACHE_EXTENSION[] = ".pvmesh";
+
+/// Whether newly written cache files store quantized vertices (half float positions and texture coordinates,
+/// 10-10-10-2 normals, 16 bytes per vertex) or full floats (32 bytes per vertex)
+static const bool MESH_CACHE_QUANTIZE = true;
+
+//-----------------------------------------
+//----        BINARY MESH FORMAT       ----
+//-----------------------------------------
+
+/// The file starts with this header, followed by the LOD table, interleaved vertices and 32-bit indices at the
+/// given offsets. All offsets are aligned to 16 bytes, so the sections can be used directly from a mapped file.
+struct MeshCacheHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int flags;
+
+	unsigned int vertex_count;
+	unsigned int vertex_stride;
+	unsigned int index_count;
+	unsigned int lod_count;
+
+	unsigned int lods_offset;
+	unsigned int vertices_offset;
+	unsigned int indices_offset;
+
+	// Size and modification time of the source file, the cache is rebuilt when they change
+	unsigned long long source_size;
+	long long source_time;
+
+	// Sphere containing all vertices (center, radius) and the bounding box
+	float bounding_sphere[4];
+	float bounds_min[3];
+	float bounds_max[3];
+};
+
+/// Flags of MeshCacheHeader
+enum MeshCacheFlags
+{
+	MESH_CACHE_QUANTIZED = 1
+};
+
+/// One entry of the LOD table
+struct MeshCacheLOD
+{
+	unsigned int first_index;
+	unsigned int index_count;
+	float error;
+};
+
+/// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	/// Maps the file, returns false if it cannot be opened or is empty
+	bool Open(const char *file_name);
+	void Close();
+
+	const unsigned char *Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	MappedFile(const MappedFile &);
+	MappedFile &operator =(const MappedFile &);
+
+	const unsigned char *data;
+	size_t size;
+#if defined(_WIN32)
+	void *file;
+	void *mapping;
+#endif
+};
+
+/// Reads size and modification time of a file, returns false if it does not exist
+bool GetFileStamp(const char *file_name, unsigned long long &out_size, long long &out_time);
+
+//-----------------------------------------
+//----      WRITING AND CONVERSION     ----
+//-----------------------------------------
+
+/// Returns the name of the cache file of the given OBJ file
+std::string MeshCacheFileName(const char *obj_file_name);
+
+/// Serializes the mesh into the binary format. 'source_file_name' is the file the mesh was loaded from, its size
+/// and modification time are stored so that stale caches can be detected.
+void BuildMeshCache(const PV112::MeshData &mesh, const char *source_file_name, bool quantize, std::vector<unsigned char> &out_data);
+
+/// Loads, optimizes and simplifies the OBJ file (see PV112::ProcessOBJFile) and writes its cache file.
+/// This is the offline converter, LoadOBJ does the same on the first run. Returns false on failure.
+bool ConvertOBJToMeshCache(const char *obj_file_name, bool quantize = MESH_CACHE_QUANTIZE);
+
+//-----------------------------------------
+//----             LOADING             ----
+//-----------------------------------------
+
+/// Checks the header of cache data in memory, returns nullptr if it is not a valid cache of the current version.
+/// If 'source_file_name' is not null, the cache must also match the current size and time of that file.
+/// The LOD ranges must lie within the index list and all indices must refer to existing vertices.
+const MeshCacheHeader *ValidateMeshCache(const unsigned char *data, size_t size, const char *source_file_name);
+
+/// Creates a Geometry with a single interleaved vertex buffer from cache data. The data is passed to glBufferData
+/// directly, without any intermediate copy.
+PV112::Geometry CreateMeshCacheGeometry(const MeshCacheHeader *header, GLint position_location, GLint normal_location, GLint tex_coord_location);
+
+/// CPU side data of a mesh ready for CreateMeshCacheGeometry, either mapped from the cache file or built in memory
+struct MeshCacheData
+{
+	MeshCacheData() : header(nullptr) {}
+
+	MappedFile file;
+	std::vector<unsigned char> built_data;
+	const MeshCacheHeader *header;
+};
+
+/// Maps the cache file of the given OBJ file if it is up to date. Otherwise processes the OBJ file (see
+/// PV112::ProcessOBJFile), writes the cache file for the next run and keeps the built data in memory.
+/// Does not use OpenGL, so it can run on any thread. Returns false if the OBJ file cannot be loaded.
+bool PrepareMeshCache(const char *obj_file_name, MeshCacheData &out_data);
+
+#endif	// INCLUDED_MESH_CACHE_H
@@ -0,0 +1,557 @@
+#include "MeshLOD.h"
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+//-----------------------------------------
+//----        MESH SIMPLIFICATION      ----
+//-----------------------------------------
+
+// Borders are held in place by planes perpendicular to the triangles, weighted by this factor
+static const double BORDER_WEIGHT = 10.0;
+
+// Symmetric 4x4 matrix of a quadric error metric
+struct Quadric
+{
+	double a2, b2, c2, ab, ac, bc, ad, bd, cd, d2;
+	double w;
+
+	Quadric() : a2(0), b2(0), c2(0), ab(0), ac(0), bc(0), ad(0), bd(0), cd(0), d2(0), w(0) { }
+
+	// Squared distance from the plane a*x + b*y + c*z + d = 0 with the given weight
+	Quadric(double a, double b, double c, double d, double weight)
+		: a2(a * a * weight), b2(b * b * weight), c2(c * c * weight), ab(a * b * weight), ac(a * c * weight), bc(b * c * weight),
+		ad(a * d * weight), bd(b * d * weight), cd(c * d * weight), d2(d * d * weight), w(weight) { }
+
+	Quadric &operator +=(const Quadric &rhs)
+	{
+		a2 += rhs.a2;	b2 += rhs.b2;	c2 += rhs.c2;
+		ab += rhs.ab;	ac += rhs.ac;	bc += rhs.bc;
+		ad += rhs.ad;	bd += rhs.bd;	cd += rhs.cd;
+		d2 += rhs.d2;
+		w += rhs.w;
+		return *this;
+	}
+
+	// Weighted average of squared distances from the planes
+	double Error(const glm::vec3 &p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double e = x * (a2 * x + ab * y + ac * z) + y * (ab * x + b2 * y + bc * z) + z * (ac * x + bc * y + c2 * z)
+			+ 2.0 * (ad * x + bd * y + cd * z) + d2;
+		return w > 0.0 ? std::fabs(e) / w : 0.0;
+	}
+};
+
+enum VertexKind
+{
+	// All edges around the vertex are shared by two triangles, it may collapse anywhere
+	VERTEX_MANIFOLD,
+	// The vertex lies on an open edge, it may only collapse along it
+	VERTEX_BORDER,
+	// Two vertices share the position but not the attributes, they may only collapse together along the seam
+	VERTEX_SEAM,
+	// Anything more complex, never collapses
+	VERTEX_LOCKED
+};
+
+static unsigned long long EdgeKey(unsigned int a, unsigned int b)
+{
+	return (static_cast<unsigned long long>(a) << 32) | b;
+}
+
+struct Collapse
+{
+	unsigned int from;
+	unsigned int to;
+	double cost;
+};
+
+std::vector<unsigned int> SimplifyMesh(const PV112::MeshData &mesh, const std::vector<unsigned int> &source_indices,
+	size_t target_index_count, float max_error, float *out_error)
+{
+	const std::vector<glm::vec3> &positions = mesh.vertices;
+	const size_t vertex_count = positions.size();
+
+	// Double sided cards store each triangle twice with opposite winding. Only one copy is simplified, otherwise
+	// the edges of the cards would look closed and their silhouettes would not be preserved.
+	std::vector<unsigned int> indices;
+	std::vector<bool> double_sided;
+	indices.reserve(source_indices.size());
+	{
+		std::unordered_map<unsigned long long, size_t> triangles;
+		for (size_t t = 0; t < source_indices.size() / 3; t++)
+		{
+			unsigned int a = source_indices[t * 3 + 0];
+			unsigned int b = source_indices[t * 3 + 1];
+			unsigned int c = source_indices[t * 3 + 2];
+
+			// Key of the triangle with the opposite winding, rotated so that the smallest index is first
+			unsigned int r[3] = { c, b, a };
+			int first = int(std::min_element(r, r + 3) - r);
+			unsigned long long reversed_key = (static_cast<unsigned long long>(r[first]) << 42) |
+				(static_cast<unsigned long long>(r[(first + 1) % 3]) << 21) | r[(first + 2) % 3];
+
+			auto found = vertex_count < (1U << 21) ? triangles.find(reversed_key) : triangles.end();
+			if (found != triangles.end() && !double_sided[found->second])
+			{
+				double_sided[found->second] = true;
+				continue;
+			}
+
+			unsigned int f[3] = { a, b, c };
+			first = int(std::min_element(f, f + 3) - f);
+			unsigned long long key = (static_cast<unsigned long long>(f[first]) << 42) |
+				(static_cast<unsigned long long>(f[(first + 1) % 3]) << 21) | f[(first + 2) % 3];
+			triangles[key] = double_sided.size();
+
+			indices.push_back(a);
+			indices.push_back(b);
+			indices.push_back(c);
+			double_sided.push_back(false);
+		}
+	}
+
+	// The target counts double sided triangles twice, just like the result does
+	size_t double_sided_count = std::count(double_sided.begin(), double_sided.end(), true);
+	if (double_sided_count > 0)
+	{
+		double single_ratio = double(indices.size()) / double(indices.size() + double_sided_count * 3);
+		target_index_count = size_t(target_index_count * single_ratio) / 3 * 3;
+	}
+	double max_cost = double(max_error) * double(max_error);
+	double reached_cost = 0.0;
+
+	// Vertices with the same position refer to the first of them, 'wedges' links them into a cycle
+	std::vector<unsigned int> position_id(vertex_count);
+	std::vector<unsigned int> wedges(vertex_count);
+	{
+		std::unordered_map<unsigned long long, unsigned int> first_vertex;
+		std::vector<unsigned int> last_wedge(vertex_count);
+		for (unsigned int v = 0; v < vertex_count; v++)
+		{
+			// Positions are compared exactly, hash the bits of all three coordinates
+			unsigned int bits[3];
+			memcpy(bits, &positions[v], sizeof(bits));
+			unsigned long long hash = (static_cast<unsigned long long>(bits[0]) * 73856093ULL) ^
+				(static_cast<unsigned long long>(bits[1]) * 19349663ULL << 16) ^ (static_cast<unsigned long long>(bits[2]) * 83492791ULL << 32);
+
+			// Resolve hash collisions by probing
+			while (true)
+			{
+				auto found = first_vertex.find(hash);
+				if (found == first_vertex.end())
+				{
+					first_vertex[hash] = v;
+					position_id[v] = v;
+					wedges[v] = v;
+					last_wedge[v] = v;
+					break;
+				}
+				if (positions[found->second] == positions[v])
+				{
+					unsigned int p = found->second;
+					position_id[v] = p;
+					wedges[v] = p;
+					wedges[last_wedge[p]] = v;
+					last_wedge[p] = v;
+					break;
+				}
+				hash++;
+			}
+		}
+	}
+
+	auto wedge_count = [&](unsigned int v) {
+		int count = 1;
+		for (unsigned int w = wedges[v]; w != v; w = wedges[w])
+			count++;
+		return count;
+	};
+
+	// Quadrics of the planes of all triangles around each position, weighted by the triangle area
+	std::vector<Quadric> quadrics(vertex_count);
+	for (size_t t = 0; t < indices.size() / 3; t++)
+	{
+		glm::vec3 p0 = positions[indices[t * 3 + 0]];
+		glm::vec3 p1 = positions[indices[t * 3 + 1]];
+		glm::vec3 p2 = positions[indices[t * 3 + 2]];
+		glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+		float area = glm::length(n);
+		if (area == 0.0f)
+			continue;
+		n /= area;
+
+		Quadric q(n.x, n.y, n.z, -glm::dot(n, p0), area);
+		quadrics[position_id[indices[t * 3 + 0]]] += q;
+		quadrics[position_id[indices[t * 3 + 1]]] += q;
+		quadrics[position_id[indices[t * 3 + 2]]] += q;
+	}
+
+	// Border quadrics, planes through the open edges perpendicular to their triangles
+	{
+		std::unordered_set<unsigned long long> position_edges;
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			size_t next = (i % 3 == 2) ? i - 2 : i + 1;
+			position_edges.insert(EdgeKey(position_id[indices[i]], position_id[indices[next]]));
+		}
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			size_t t = i / 3;
+			size_t next = (i % 3 == 2) ? i - 2 : i + 1;
+			unsigned int a = position_id[indices[i]];
+			unsigned int b = position_id[indices[next]];
+			if (position_edges.count(EdgeKey(b, a)))
+				continue;
+
+			glm::vec3 p0 = positions[indices[t * 3 + 0]];
+			glm::vec3 p1 = positions[indices[t * 3 + 1]];
+			glm::vec3 p2 = positions[indices[t * 3 + 2]];
+			glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+			glm::vec3 edge = positions[b] - positions[a];
+			float edge_length = glm::length(edge);
+			if (glm::length(normal) == 0.0f || edge_length == 0.0f)
+				continue;
+
+			glm::vec3 n = glm::cross(edge, normal);
+			float n_length = glm::length(n);
+			if (n_length == 0.0f)
+				continue;
+			n /= n_length;
+
+			Quadric q(n.x, n.y, n.z, -glm::dot(n, positions[a]), edge_length * edge_length * BORDER_WEIGHT);
+			quadrics[a] += q;
+			quadrics[b] += q;
+		}
+	}
+
+	std::vector<VertexKind> kinds(vertex_count);
+	std::vector<unsigned int> remap(vertex_count);
+	std::vector<bool> touched(vertex_count);
+	std::vector<Collapse> collapses;
+	std::vector<std::vector<unsigned int>> position_triangles(vertex_count);
+
+	// Each pass collapses an independent set of the cheapest edges
+	while (indices.size() > target_index_count)
+	{
+		size_t triangle_count = indices.size() / 3;
+
+		// Edges of the current mesh, on the level of vertices and of positions
+		std::unordered_set<unsigned long long> edges;
+		std::unordered_set<unsigned long long> position_edges;
+		edges.reserve(indices.size());
+		position_edges.reserve(indices.size());
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			size_t next = (i % 3 == 2) ? i - 2 : i + 1;
+			edges.insert(EdgeKey(indices[i], indices[next]));
+			position_edges.insert(EdgeKey(position_id[indices[i]], position_id[indices[next]]));
+		}
+
+		auto is_open_position_edge = [&](unsigned int a, unsigned int b) {
+			unsigned int pa = position_id[a];
+			unsigned int pb = position_id[b];
+			return !position_edges.count(EdgeKey(pa, pb)) || !position_edges.count(EdgeKey(pb, pa));
+		};
+		auto is_seam_edge = [&](unsigned int a, unsigned int b) {
+			return !is_open_position_edge(a, b) && (!edges.count(EdgeKey(a, b)) || !edges.count(EdgeKey(b, a)));
+		};
+		auto has_edge = [&](unsigned int a, unsigned int b) {
+			return edges.count(EdgeKey(a, b)) || edges.count(EdgeKey(b, a));
+		};
+
+		// Classify positions by the open edges around them
+		std::vector<bool> open_position(vertex_count, false);
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			size_t next = (i % 3 == 2) ? i - 2 : i + 1;
+			if (is_open_position_edge(indices[i], indices[next]))
+			{
+				open_position[position_id[indices[i]]] = true;
+				open_position[position_id[indices[next]]] = true;
+			}
+		}
+		for (unsigned int v = 0; v < vertex_count; v++)
+		{
+			int count = wedge_count(v);
+			bool open = open_position[position_id[v]];
+			if (count == 1)
+				kinds[v] = open ? VERTEX_BORDER : VERTEX_MANIFOLD;
+			else if (count == 2)
+				kinds[v] = open ? VERTEX_LOCKED : VERTEX_SEAM;
+			else
+				kinds[v] = VERTEX_LOCKED;
+		}
+
+		// Candidate collapses along the edges of all triangles
+		collapses.clear();
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			size_t next = (i % 3 == 2) ? i - 2 : i + 1;
+			for (int direction = 0; direction < 2; direction++)
+			{
+				unsigned int from = direction == 0 ? indices[i] : indices[next];
+				unsigned int to = direction == 0 ? indices[next] : indices[i];
+				if (position_id[from] == position_id[to])
+					continue;
+
+				switch (kinds[from])
+				{
+				case VERTEX_MANIFOLD:
+					break;
+				case VERTEX_BORDER:
+					if (!is_open_position_edge(from, to))
+						continue;
+					break;
+				case VERTEX_SEAM:
+					// Both sides of the seam must have a matching edge
+					if (!is_seam_edge(from, to) || wedge_count(to) != 2 || !has_edge(wedges[from], wedges[to]))
+						continue;
+					break;
+				default:
+					continue;
+				}
+
+				Quadric q = quadrics[position_id[from]];
+				q += quadrics[position_id[to]];
+				Collapse collapse;
+				collapse.from = from;
+				collapse.to = to;
+				collapse.cost = q.Error(positions[to]);
+				collapses.push_back(collapse);
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse &a, const Collapse &b) {
+			return a.cost < b.cost;
+		});
+
+		// Triangles around each position for the flip test
+		for (unsigned int v = 0; v < vertex_count; v++)
+			position_triangles[v].clear();
+		for (size_t i = 0; i < indices.size(); i++)
+			position_triangles[position_id[indices[i]]].push_back(unsigned(i / 3));
+
+		// Returns true if moving all triangles around 'from' to the position of 'to' keeps their orientation
+		auto keeps_orientation = [&](unsigned int from, unsigned int to) {
+			unsigned int p_from = position_id[from];
+			unsigned int p_to = position_id[to];
+			const std::vector<unsigned int> &triangles = position_triangles[p_from];
+			for (size_t k = 0; k < triangles.size(); k++)
+			{
+				unsigned int t = triangles[k];
+				glm::vec3 p[3];
+				glm::vec3 moved[3];
+				bool degenerate = false;
+				for (int c = 0; c < 3; c++)
+				{
+					unsigned int v = indices[t * 3 + c];
+					p[c] = positions[v];
+					moved[c] = position_id[v] == p_from ? positions[to] : positions[v];
+					degenerate = degenerate || position_id[v] == p_to;
+				}
+				if (degenerate)
+					continue;
+
+				glm::vec3 n_old = glm::cross(p[1] - p[0], p[2] - p[0]);
+				glm::vec3 n_new = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+				float l_old = glm::length(n_old);
+				float l_new = glm::length(n_new);
+				if (l_new == 0.0f || glm::dot(n_old, n_new) < 1e-2f * l_old * l_new)
+					return false;
+			}
+			return true;
+		};
+
+		for (unsigned int v = 0; v < vertex_count; v++)
+			remap[v] = v;
+		std::fill(touched.begin(), touched.end(), false);
+
+		size_t triangles_to_remove = triangle_count - target_index_count / 3;
+		size_t triangles_removed = 0;
+		size_t collapse_count = 0;
+		for (size_t c = 0; c < collapses.size(); c++)
+		{
+			const Collapse &collapse = collapses[c];
+			if (collapse.cost > max_cost)
+				break;
+
+			unsigned int p_from = position_id[collapse.from];
+			unsigned int p_to = position_id[collapse.to];
+			if (touched[p_from] || touched[p_to])
+				continue;
+			if (!keeps_orientation(collapse.from, collapse.to))
+				continue;
+
+			// Lock the whole neighborhood, the flip test of other collapses in this pass would be wrong otherwise
+			const std::vector<unsigned int> &triangles = position_triangles[p_from];
+			for (size_t k = 0; k < triangles.size(); k++)
+			{
+				for (int i = 0; i < 3; i++)
+					touched[position_id[indices[triangles[k] * 3 + i]]] = true;
+			}
+
+			remap[collapse.from] = collapse.to;
+			if (kinds[collapse.from] == VERTEX_SEAM)
+			{
+				remap[wedges[collapse.from]] = wedges[collapse.to];
+			}
+
+			// The remaining vertex carries the planes of both, its edges are costed with them in the next pass
+			quadrics[p_to] += quadrics[p_from];
+
+			reached_cost = std::max(reached_cost, collapse.cost);
+			collapse_count++;
+			triangles_removed += kinds[collapse.from] == VERTEX_BORDER ? 1 : 2;
+			if (triangles_removed >= triangles_to_remove)
+				break;
+		}
+
+		if (collapse_count == 0)
+			break;
+
+		// Apply the collapses and remove degenerated triangles
+		size_t write = 0;
+		for (size_t t = 0; t < triangle_count; t++)
+		{
+			unsigned int a = remap[indices[t * 3 + 0]];
+			unsigned int b = remap[indices[t * 3 + 1]];
+			unsigned int c = remap[indices[t * 3 + 2]];
+			if (position_id[a] == position_id[b] || position_id[b] == position_id[c] || position_id[c] == position_id[a])
+				continue;
+			double_sided[write / 3] = double_sided[t];
+			indices[write++] = a;
+			indices[write++] = b;
+			indices[write++] = c;
+		}
+		indices.resize(write);
+		double_sided.resize(write / 3);
+	}
+
+	// Restore the back sides of the double sided triangles
+	size_t single_count = indices.size() / 3;
+	for (size_t t = 0; t < single_count; t++)
+	{
+		if (!double_sided[t])
+			continue;
+		unsigned int a = indices[t * 3 + 0];
+		unsigned int b = indices[t * 3 + 1];
+		unsigned int c = indices[t * 3 + 2];
+		indices.push_back(c);
+		indices.push_back(b);
+		indices.push_back(a);
+	}
+
+	if (out_error)
+		*out_error = float(std::sqrt(reached_cost));
+	return indices;
+}
+
+void GenerateLODChain(PV112::MeshData &mesh)
+{
+	mesh.lods.clear();
+	if (mesh.indices.empty())
+		return;
+
+	PV112::GeometryLOD base;
+	base.FirstIndex = 0;
+	base.Count = GLsizei(mesh.indices.size());
+	base.Error = 0.0f;
+	mesh.lods.push_back(base);
+
+	// Error limit relative to the size of the mesh
+	glm::vec3 min_pos = mesh.vertices[0];
+	glm::vec3 max_pos = mesh.vertices[0];
+	for (size_t i = 1; i < mesh.vertices.size(); i++)
+	{
+		min_pos = glm::min(min_pos, mesh.vertices[i]);
+		max_pos = glm::max(max_pos, mesh.vertices[i]);
+	}
+	float max_error = glm::length(max_pos - min_pos) * 0.5f * LOD_MAX_RELATIVE_ERROR;
+
+	// Each level is simplified from the original mesh, so its error is measured against the original surface and
+	// does not miss the error accumulated by the previous levels
+	const std::vector<unsigned int> original(mesh.indices.begin(), mesh.indices.end());
+	std::vector<unsigned int> previous = original;
+	float previous_error = 0.0f;
+	for (int lod = 1; lod < MAX_LOD_COUNT; lod++)
+	{
+		size_t target = size_t(base.Count / 3 * LOD_TRIANGLE_RATIOS[lod]) * 3;
+		float error = 0.0f;
+		std::vector<unsigned int> simplified = SimplifyMesh(mesh, original, target, max_error, &error);
+
+		// Not worth another level if less than 10 % of the triangles were removed
+		if (simplified.empty() || simplified.size() * 10 > previous.size() * 9)
+			break;
+
+		OptimizeVertexCache(simplified, mesh.vertices.size());
+
+		PV112::GeometryLOD level;
+		level.FirstIndex = GLsizei(mesh.indices.size());
+		level.Count = GLsizei(simplified.size());
+		// SelectLOD expects the errors to grow with the level
+		level.Error = std::max(error, previous_error);
+		mesh.lods.push_back(level);
+		mesh.indices.insert(mesh.indices.end(), simplified.begin(), simplified.end());
+
+		previous.swap(simplified);
+		previous_error = level.Error;
+	}
+}
+
+//-----------------------------------------
+//----          LOD SELECTION          ----
+//-----------------------------------------
+
+float PixelsPerUnit(float distance, float fovy, int viewport_height)
+{
+	return float(viewport_height) / (2.0f * tanf(fovy * 0.5f) * std::max(distance, 1e-3f));
+}
+
+int SelectLOD(const PV112::Geometry &geom, float pixels_per_unit)
+{
+	int lod = 0;
+	for (size_t i = 1; i < geom.LODs.size(); i++)
+	{
+		if (geom.LODs[i].Error * pixels_per_unit > LOD_MAX_PIXEL_ERROR)
+			break;
+		lod = int(i);
+	}
+	return lod;
+}
+
+void SortInstancesByLOD(const PV112::Geometry &geom, const std::vector<glm::mat4> &instances, const glm::mat4 &model_matrix,
+	glm::vec3 eye_position, float fovy, int viewport_height, std::vector<glm::mat4> &out_sorted, std::vector<int> &out_lod_counts,
+	int lod_bias, float max_distance, const Frustum *frustum)
+{
+	size_t lod_count = std::max(geom.LODs.size(), size_t(1));
+	out_lod_counts.assign(lod_count, 0);
+
+	// Instances left out have level -1
+	std::vector<int> lods(instances.size());
+	size_t kept = 0;
+	for (size_t i = 0; i < instances.size(); i++)
+	{
+		glm::vec4 sphere = TransformBoundingSphere(instances[i] * model_matrix, geom.BoundingSphere);
+		float distance = glm::distance(glm::vec3(sphere), eye_position) - sphere.w;
+		if (distance > max_distance || (frustum && !frustum->IntersectsSphere(sphere)))
+		{
+			lods[i] = -1;
+			continue;
+		}
+		lods[i] = std::min(SelectLOD(geom, PixelsPerUnit(distance, fovy, viewport_height)) + lod_bias, int(lod_count) - 1);
+		out_lod_counts[lods[i]]++;
+		kept++;
+	}
+
+	// Counting sort, instances of each level stay in their original order
+	out_sorted.resize(kept);
+	std::vector<int> offsets(lod_count, 0);
+	for (size_t l = 1; l < lod_count; l++)
+		offsets[l] = offsets[l - 1] + out_lod_counts[l - 1];
+	for (size_t i = 0; i < instances.size(); i++)
+		if (lods[i] >= 0)
+			out_sorted[offsets[lods[i]]++] = instances[i];
+}
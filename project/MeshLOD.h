@@ -0,0 +1,65 @@
+#pragma once
+#ifndef INCLUDED_MESH_LOD_H
+#define INCLUDED_MESH_LOD_H
+
+#include <limits>
+#include <vector>
+#include "PV112.h"
+#include "Frustum.h"
+
+/// Maximum number of levels of detail generated for a mesh, including the original one
+static const int MAX_LOD_COUNT = 4;
+
+/// Fractions of the original triangle count targeted by the levels of detail
+static const float LOD_TRIANGLE_RATIOS[MAX_LOD_COUNT] = { 1.0f, 0.5f, 0.25f, 0.125f };
+
+/// Largest allowed simplification error, relative to the radius of the mesh
+static const float LOD_MAX_RELATIVE_ERROR = 0.1f;
+
+/// A level of detail is used when its error projects to at most this many pixels
+static const float LOD_MAX_PIXEL_ERROR = 6.0f;
+
+//-----------------------------------------
+//----        MESH SIMPLIFICATION      ----
+//-----------------------------------------
+
+/// Simplifies the mesh using quadric error metrics (Garland and Heckbert 1997) with half-edge collapses, so the
+/// simplified triangles refer to the original vertices and only a new index list is returned.
+///
+/// UV seams (vertices sharing a position but not attributes) only collapse along the seam with both sides together,
+/// and open borders (edges of alpha cards) only collapse along the border and are held in place by additional
+/// quadrics, which keeps the silhouettes of the cards.
+///
+/// Simplification stops when the triangle count reaches 'target_index_count' / 3 or when the next collapse
+/// would exceed 'max_error' (in object space units). The reached error is stored to 'out_error'.
+std::vector<unsigned int> SimplifyMesh(const PV112::MeshData &mesh, const std::vector<unsigned int> &indices,
+	size_t target_index_count, float max_error, float *out_error = nullptr);
+
+/// Generates up to MAX_LOD_COUNT levels of detail using LOD_TRIANGLE_RATIOS. Indices of the simplified levels are
+/// appended to 'mesh.indices' and optimized for the vertex cache, 'mesh.lods' describes all levels. Levels that
+/// would not remove enough triangles are skipped.
+void GenerateLODChain(PV112::MeshData &mesh);
+
+//-----------------------------------------
+//----          LOD SELECTION          ----
+//-----------------------------------------
+
+/// Returns how many pixels one unit covers at the given distance from the eye, for a perspective projection
+/// with vertical field of view 'fovy' (in radians) and a viewport 'viewport_height' pixels high.
+float PixelsPerUnit(float distance, float fovy, int viewport_height);
+
+/// Returns the coarsest level of detail whose error projects to at most LOD_MAX_PIXEL_ERROR pixels, when one unit
+/// of the object space covers 'pixels_per_unit' pixels.
+int SelectLOD(const PV112::Geometry &geom, float pixels_per_unit);
+
+/// Selects a level of detail for each instance from its projected size and sorts the instances by it.
+///
+/// 'instances' are the model matrices of the instances, 'model_matrix' is applied before them (as in the shaders).
+/// 'out_sorted' receives the instances grouped by the level, 'out_lod_counts' the number of instances of each level.
+/// 'lod_bias' levels are added to the selected level (up to the coarsest one) and instances whose bounding sphere
+/// is farther than 'max_distance' from the eye or outside of 'frustum' (if not null) are left out.
+void SortInstancesByLOD(const PV112::Geometry &geom, const std::vector<glm::mat4> &instances, const glm::mat4 &model_matrix,
+	glm::vec3 eye_position, float fovy, int viewport_height, std::vector<glm::mat4> &out_sorted, std::vector<int> &out_lod_counts,
+	int lod_bias = 0, float max_distance = std::numeric_limits<float>::max(), const Frustum *frustum = nullptr);
+
+#endif	// INCLUDED_MESH_LOD_H
@@ -0,0 +1,409 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+
+//-----------------------------------------
+//----         MESH STATISTICS         ----
+//-----------------------------------------
+
+// Simple FIFO post-transform cache, returns true when the vertex had to be transformed
+class VertexCache
+{
+public:
+	VertexCache(size_t vertex_count, int cache_size)
+		: timestamps(vertex_count, 0), size(cache_size), time(cache_size + 1) { }
+
+	bool Use(unsigned int v)
+	{
+		if (time - timestamps[v] <= unsigned(size))
+			return false;
+		timestamps[v] = time++;
+		return true;
+	}
+
+	void Reset()
+	{
+		time += size + 1;
+	}
+
+private:
+	std::vector<unsigned int> timestamps;
+	int size;
+	unsigned int time;
+};
+
+// Rasterizes triangles into a square depth buffer and counts covered pixels and fragments passing the depth test
+class OverdrawBuffer
+{
+public:
+	static const int SIZE = 256;
+
+	OverdrawBuffer() : depth(SIZE * SIZE, 1.0f), covered(SIZE * SIZE, false), pixels_covered(0), pixels_shaded(0) { }
+
+	void Rasterize(glm::vec3 a, glm::vec3 b, glm::vec3 c)
+	{
+		// No face culling, the scene is drawn without it too
+		float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+		if (area == 0.0f)
+			return;
+		if (area < 0.0f)
+		{
+			std::swap(b, c);
+			area = -area;
+		}
+
+		int min_x = std::max(0, int(std::floor(std::min(a.x, std::min(b.x, c.x)))));
+		int max_x = std::min(SIZE - 1, int(std::ceil(std::max(a.x, std::max(b.x, c.x)))));
+		int min_y = std::max(0, int(std::floor(std::min(a.y, std::min(b.y, c.y)))));
+		int max_y = std::min(SIZE - 1, int(std::ceil(std::max(a.y, std::max(b.y, c.y)))));
+
+		for (int y = min_y; y <= max_y; y++)
+		{
+			for (int x = min_x; x <= max_x; x++)
+			{
+				float px = x + 0.5f;
+				float py = y + 0.5f;
+				float w0 = (c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x);
+				float w1 = (a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x);
+				float w2 = (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+				if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+					continue;
+
+				float z = (w0 * a.z + w1 * b.z + w2 * c.z) / area;
+				int pixel = y * SIZE + x;
+				if (!covered[pixel])
+				{
+					covered[pixel] = true;
+					pixels_covered++;
+				}
+				if (z < depth[pixel])
+				{
+					depth[pixel] = z;
+					pixels_shaded++;
+				}
+			}
+		}
+	}
+
+	std::vector<float> depth;
+	std::vector<bool> covered;
+	size_t pixels_covered;
+	size_t pixels_shaded;
+};
+
+MeshStats AnalyzeMesh(const PV112::MeshData &mesh, int cache_size)
+{
+	MeshStats stats;
+	stats.acmr = 0.0f;
+	stats.atvr = 0.0f;
+	stats.overdraw = 0.0f;
+
+	size_t triangle_count = mesh.indices.size() / 3;
+	if (triangle_count == 0)
+		return stats;
+
+	// Post-transform cache
+	VertexCache cache(mesh.vertices.size(), cache_size);
+	size_t misses = 0;
+	for (size_t i = 0; i < mesh.indices.size(); i++)
+	{
+		if (cache.Use(mesh.indices[i]))
+			misses++;
+	}
+	stats.acmr = float(misses) / float(triangle_count);
+	stats.atvr = float(misses) / float(mesh.vertices.size());
+
+	// Overdraw, the mesh is fitted into the buffer and looked at from each side of its bounding box
+	glm::vec3 min_pos = mesh.vertices[0];
+	glm::vec3 max_pos = mesh.vertices[0];
+	for (size_t i = 1; i < mesh.vertices.size(); i++)
+	{
+		min_pos = glm::min(min_pos, mesh.vertices[i]);
+		max_pos = glm::max(max_pos, mesh.vertices[i]);
+	}
+	glm::vec3 extent = max_pos - min_pos;
+	float scale = std::max(extent.x, std::max(extent.y, extent.z));
+	if (scale <= 0.0f)
+		return stats;
+
+	size_t pixels_covered = 0;
+	size_t pixels_shaded = 0;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		for (int side = 0; side < 2; side++)
+		{
+			OverdrawBuffer buffer;
+			auto project = [&](unsigned int index) {
+				glm::vec3 p = (mesh.vertices[index] - min_pos) / scale;
+				float depth = side == 0 ? p[axis] : 1.0f - p[axis];
+				return glm::vec3(p[(axis + 1) % 3] * (OverdrawBuffer::SIZE - 1), p[(axis + 2) % 3] * (OverdrawBuffer::SIZE - 1), depth);
+			};
+			for (size_t t = 0; t < triangle_count; t++)
+			{
+				buffer.Rasterize(project(mesh.indices[t * 3 + 0]), project(mesh.indices[t * 3 + 1]), project(mesh.indices[t * 3 + 2]));
+			}
+			pixels_covered += buffer.pixels_covered;
+			pixels_shaded += buffer.pixels_shaded;
+		}
+	}
+	stats.overdraw = pixels_covered > 0 ? float(pixels_shaded) / float(pixels_covered) : 0.0f;
+
+	return stats;
+}
+
+//-----------------------------------------
+//----        MESH OPTIMIZATION        ----
+//-----------------------------------------
+
+void OptimizeVertexCache(std::vector<unsigned int> &indices, size_t vertex_count, int cache_size, std::vector<unsigned int> *out_clusters)
+{
+	size_t triangle_count = indices.size() / 3;
+	if (out_clusters)
+		out_clusters->clear();
+	if (triangle_count == 0)
+		return;
+
+	// Triangles adjacent to each vertex, stored as offsets into one array
+	std::vector<unsigned int> live(vertex_count, 0);
+	for (size_t i = 0; i < indices.size(); i++)
+		live[indices[i]]++;
+
+	std::vector<unsigned int> offsets(vertex_count + 1, 0);
+	for (size_t v = 0; v < vertex_count; v++)
+		offsets[v + 1] = offsets[v] + live[v];
+
+	std::vector<unsigned int> adjacency(indices.size());
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < indices.size(); i++)
+		adjacency[fill[indices[i]]++] = unsigned(i / 3);
+
+	std::vector<unsigned int> cache_time(vertex_count, 0);
+	std::vector<bool> emitted(triangle_count, false);
+	std::vector<unsigned int> dead_end;
+	std::vector<unsigned int> candidates;
+	std::vector<unsigned int> result;
+	result.reserve(indices.size());
+
+	unsigned int time = cache_size + 1;
+	size_t next_vertex = 0;
+
+	// Returns a vertex that still has some triangles to emit, or -1 when all triangles are emitted
+	auto skip_dead_end = [&]() -> int {
+		while (!dead_end.empty())
+		{
+			unsigned int v = dead_end.back();
+			dead_end.pop_back();
+			if (live[v] > 0)
+				return int(v);
+		}
+		while (next_vertex < vertex_count)
+		{
+			if (live[next_vertex] > 0)
+				return int(next_vertex);
+			next_vertex++;
+		}
+		return -1;
+	};
+
+	int fanning = skip_dead_end();
+	if (out_clusters)
+		out_clusters->push_back(0);
+
+	while (fanning >= 0)
+	{
+		candidates.clear();
+
+		// Emit all remaining triangles around the fanning vertex
+		for (unsigned int a = offsets[fanning]; a < offsets[fanning + 1]; a++)
+		{
+			unsigned int t = adjacency[a];
+			if (emitted[t])
+				continue;
+
+			for (int k = 0; k < 3; k++)
+			{
+				unsigned int v = indices[t * 3 + k];
+				result.push_back(v);
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - cache_time[v] > unsigned(cache_size))
+					cache_time[v] = time++;
+			}
+			emitted[t] = true;
+		}
+
+		// Choose the next fanning vertex among the ones just used, preferring those that are still in the cache
+		// and will stay there for all their remaining triangles
+		int best = -1;
+		int best_priority = -1;
+		for (size_t c = 0; c < candidates.size(); c++)
+		{
+			unsigned int v = candidates[c];
+			if (live[v] == 0)
+				continue;
+
+			int priority = 0;
+			if (time - cache_time[v] + 2 * live[v] <= unsigned(cache_size))
+				priority = int(time - cache_time[v]);
+			if (priority > best_priority)
+			{
+				best_priority = priority;
+				best = int(v);
+			}
+		}
+
+		if (best < 0)
+		{
+			best = skip_dead_end();
+
+			// The new fanning vertex is not in the cache, the following triangles start a new cluster
+			if (best >= 0 && out_clusters && time - cache_time[best] > unsigned(cache_size))
+				out_clusters->push_back(unsigned(result.size() / 3));
+		}
+		fanning = best;
+	}
+
+	indices.swap(result);
+}
+
+void OptimizeOverdraw(std::vector<unsigned int> &indices, const std::vector<glm::vec3> &vertices,
+	const std::vector<unsigned int> &clusters, int cache_size, float threshold)
+{
+	size_t triangle_count = indices.size() / 3;
+	if (triangle_count == 0 || clusters.empty())
+		return;
+
+	// Split the hard clusters further wherever the cache miss ratio stays close to the one of the whole cluster
+	std::vector<unsigned int> soft_clusters;
+	VertexCache cache(vertices.size(), cache_size);
+	for (size_t c = 0; c < clusters.size(); c++)
+	{
+		unsigned int start = clusters[c];
+		unsigned int end = c + 1 < clusters.size() ? clusters[c + 1] : unsigned(triangle_count);
+
+		cache.Reset();
+		size_t cluster_misses = 0;
+		for (unsigned int t = start; t < end; t++)
+		{
+			for (int k = 0; k < 3; k++)
+				cluster_misses += cache.Use(indices[t * 3 + k]) ? 1 : 0;
+		}
+		float cluster_threshold = threshold * float(cluster_misses) / float(end - start);
+
+		soft_clusters.push_back(start);
+		cache.Reset();
+		size_t running_misses = 0;
+		size_t running_triangles = 0;
+		for (unsigned int t = start; t < end; t++)
+		{
+			for (int k = 0; k < 3; k++)
+				running_misses += cache.Use(indices[t * 3 + k]) ? 1 : 0;
+			running_triangles++;
+
+			if (t + 1 < end && float(running_misses) / float(running_triangles) <= cluster_threshold)
+			{
+				soft_clusters.push_back(t + 1);
+				cache.Reset();
+				running_misses = 0;
+				running_triangles = 0;
+			}
+		}
+	}
+
+	// Centroid of the whole mesh
+	glm::vec3 mesh_centroid(0.0f);
+	for (size_t i = 0; i < indices.size(); i++)
+		mesh_centroid += vertices[indices[i]];
+	mesh_centroid /= float(indices.size());
+
+	// Clusters facing away from the centroid are likely to occlude the others, so they are drawn first
+	struct ClusterOrder
+	{
+		unsigned int cluster;
+		float sort_key;
+	};
+	std::vector<ClusterOrder> order(soft_clusters.size());
+	for (size_t c = 0; c < soft_clusters.size(); c++)
+	{
+		unsigned int start = soft_clusters[c];
+		unsigned int end = c + 1 < soft_clusters.size() ? soft_clusters[c + 1] : unsigned(triangle_count);
+
+		glm::vec3 centroid(0.0f);
+		glm::vec3 normal(0.0f);
+		float area = 0.0f;
+		for (unsigned int t = start; t < end; t++)
+		{
+			glm::vec3 a = vertices[indices[t * 3 + 0]];
+			glm::vec3 b = vertices[indices[t * 3 + 1]];
+			glm::vec3 cc = vertices[indices[t * 3 + 2]];
+			glm::vec3 n = glm::cross(b - a, cc - a);
+			float triangle_area = glm::length(n);
+			centroid += (a + b + cc) * (triangle_area / 3.0f);
+			normal += n;
+			area += triangle_area;
+		}
+		if (area > 0.0f)
+			centroid /= area;
+		float normal_length = glm::length(normal);
+		if (normal_length > 0.0f)
+			normal /= normal_length;
+
+		order[c].cluster = unsigned(c);
+		order[c].sort_key = glm::dot(centroid - mesh_centroid, normal);
+	}
+	std::stable_sort(order.begin(), order.end(), [](const ClusterOrder &a, const ClusterOrder &b) {
+		return a.sort_key > b.sort_key;
+	});
+
+	std::vector<unsigned int> result;
+	result.reserve(indices.size());
+	for (size_t c = 0; c < order.size(); c++)
+	{
+		unsigned int cluster = order[c].cluster;
+		unsigned int start = soft_clusters[cluster];
+		unsigned int end = cluster + 1 < soft_clusters.size() ? soft_clusters[cluster + 1] : unsigned(triangle_count);
+		result.insert(result.end(), indices.begin() + start * 3, indices.begin() + end * 3);
+	}
+	indices.swap(result);
+}
+
+void OptimizeVertexFetch(PV112::MeshData &mesh)
+{
+	const unsigned int unused = 0xFFFFFFFFU;
+	std::vector<unsigned int> remap(mesh.vertices.size(), unused);
+
+	PV112::MeshData result;
+	result.vertices.reserve(mesh.vertices.size());
+	result.normals.reserve(mesh.normals.size());
+	result.tex_coords.reserve(mesh.tex_coords.size());
+	result.indices.reserve(mesh.indices.size());
+
+	for (size_t i = 0; i < mesh.indices.size(); i++)
+	{
+		unsigned int v = mesh.indices[i];
+		if (remap[v] == unused)
+		{
+			remap[v] = unsigned(result.vertices.size());
+			result.vertices.push_back(mesh.vertices[v]);
+			if (!mesh.normals.empty())
+				result.normals.push_back(mesh.normals[v]);
+			if (!mesh.tex_coords.empty())
+				result.tex_coords.push_back(mesh.tex_coords[v]);
+		}
+		result.indices.push_back(remap[v]);
+	}
+
+	mesh.vertices.swap(result.vertices);
+	mesh.normals.swap(result.normals);
+	mesh.tex_coords.swap(result.tex_coords);
+	mesh.indices.swap(result.indices);
+}
+
+void OptimizeMesh(PV112::MeshData &mesh, int cache_size)
+{
+	std::vector<unsigned int> clusters;
+	OptimizeVertexCache(mesh.indices, mesh.vertices.size(), cache_size, &clusters);
+	OptimizeOverdraw(mesh.indices, mesh.vertices, clusters, cache_size);
+	OptimizeVertexFetch(mesh);
+}
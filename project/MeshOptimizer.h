@@ -0,0 +1,56 @@
+#pragma once
+#ifndef INCLUDED_MESH_OPTIMIZER_H
+#define INCLUDED_MESH_OPTIMIZER_H
+
+#include <vector>
+#include "PV112.h"
+
+/// Size of the simulated FIFO post-transform cache used for optimizing and analyzing meshes
+static const int VERTEX_CACHE_SIZE = 16;
+
+/// Clusters within which the overdraw optimization may not change the triangle order are split when their
+/// cache miss ratio reaches this multiple of the miss ratio of the whole mesh
+static const float OVERDRAW_THRESHOLD = 1.05f;
+
+//-----------------------------------------
+//----         MESH STATISTICS         ----
+//-----------------------------------------
+
+struct MeshStats
+{
+	/// Average cache miss ratio, transformed vertices per triangle (0.5 is ideal, 3 is the worst)
+	float acmr;
+	/// Average transformed to vertex ratio, transformed vertices per unique vertex (1 is ideal)
+	float atvr;
+	/// Shaded fragments per covered pixel, averaged over views along the 6 axis directions (1 is ideal)
+	float overdraw;
+};
+
+/// Simulates the post-transform cache and rasterizes the mesh to estimate how efficiently it is drawn.
+MeshStats AnalyzeMesh(const PV112::MeshData &mesh, int cache_size = VERTEX_CACHE_SIZE);
+
+//-----------------------------------------
+//----        MESH OPTIMIZATION        ----
+//-----------------------------------------
+
+/// Reorders the triangles for the post-transform cache using the Tipsify algorithm (Sander et al. 2007).
+///
+/// If 'out_clusters' is not null, it receives the index of the first triangle of each run that starts with
+/// a cold cache. Triangles may be reordered across these boundaries without hurting the cache efficiency.
+void OptimizeVertexCache(std::vector<unsigned int> &indices, size_t vertex_count, int cache_size = VERTEX_CACHE_SIZE,
+	std::vector<unsigned int> *out_clusters = nullptr);
+
+/// Reorders clusters of triangles so that outward facing clusters are drawn first, which reduces overdraw.
+/// 'clusters' are boundaries returned by OptimizeVertexCache, they are further split as long as the cache
+/// miss ratio stays within 'threshold' times the miss ratio of the cluster.
+void OptimizeOverdraw(std::vector<unsigned int> &indices, const std::vector<glm::vec3> &vertices,
+	const std::vector<unsigned int> &clusters, int cache_size = VERTEX_CACHE_SIZE, float threshold = OVERDRAW_THRESHOLD);
+
+/// Reorders the vertices in the order they are first used by the indices, so that the vertex fetch reads
+/// memory sequentially. Unused vertices are removed.
+void OptimizeVertexFetch(PV112::MeshData &mesh);
+
+/// Runs all the optimizations above on the mesh.
+void OptimizeMesh(PV112::MeshData &mesh, int cache_size = VERTEX_CACHE_SIZE);
+
+#endif	// INCLUDED_MESH_OPTIMIZER_H
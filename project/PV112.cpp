@@ -1,4 +1,11 @@
 #include "PV112.h"
+#include "MeshOptimizer.h"
+#include "MeshLOD.h"
+#include "MeshCache.h"
+#include "VertexLayout.h"
+#include "ImageDecoder.h"
+#include "TextureCache.h"
+
 
 using namespace std;
 
@@ -183,6 +190,7 @@ Geometry::Geometry()
     Mode = GL_POINTS;
     DrawArraysCount = 0;
     DrawElementsCount = 0;
+    BoundingSphere = glm::vec4(0.0f);
 }
 
 Geometry::Geometry(const Geometry &rhs)
@@ -200,6 +208,8 @@ Geometry &Geometry::operator =(const Geometry &rhs)
     Mode = rhs.Mode;
     DrawArraysCount = rhs.DrawArraysCount;
     DrawElementsCount = rhs.DrawElementsCount;
+    LODs = rhs.LODs;
+    BoundingSphere = rhs.BoundingSphere;
     return *this;
 }
 
@@ -233,29 +243,60 @@ void DrawGeometryInstanced(const Geometry &geom, int primcount)
 		glDrawElementsInstanced(geom.Mode, geom.DrawElementsCount, GL_UNSIGNED_INT, (void *) 0, primcount);
 }
 
+void DrawGeometryLOD(const Geometry &geom, int lod)
+{
+	if (geom.LODs.empty())
+	{
+		DrawGeometry(geom);
+		return;
+	}
+	const GeometryLOD &level = geom.LODs[lod];
+	DrawGeometryRange(geom, level.FirstIndex, level.Count);
+}
+
+void DrawGeometryLODInstanced(const Geometry &geom, int lod, int primcount)
+{
+	if (geom.LODs.empty())
+	{
+		DrawGeometryInstanced(geom, primcount);
+		return;
+	}
+	const GeometryLOD &level = geom.LODs[lod];
+	glDrawElementsInstanced(geom.Mode, level.Count, GL_UNSIGNED_INT, (void *)(level.FirstIndex * sizeof(unsigned int)), primcount);
+}
+
+void DrawGeometryRange(const Geometry &geom, GLsizei first_index, GLsizei count)
+{
+	glDrawElements(geom.Mode, count, GL_UNSIGNED_INT, (void *)(first_index * sizeof(unsigned int)));
+}
+
 //--------------------------
 //----    OBJ LOADER    ----
 //--------------------------
 
-bool ParseOBJFile(const char *file_name, std::vector<glm::vec3> &out_vertices, std::vector<glm::vec3> &out_normals, std::vector<glm::vec2> &out_tex_coords)
+// One triangle of an OBJ file, all indices are already converted to start from 0
+struct OBJTriangle
+{
+    int v0, v1, v2;
+    int n0, n1, n2;
+    int t0, t1, t2;
+};
+
+// Reads raw positions, normals, texture coordinates and triangles from an OBJ file. Also checks that
+// all indices of the triangles are in range. Prints an error message and returns false on failure.
+static bool ReadOBJFile(const char *file_name, std::vector<glm::vec3> &raw_vertices, std::vector<glm::vec3> &raw_normals,
+    std::vector<glm::vec2> &raw_tex_coords, std::vector<OBJTriangle> &raw_triangles)
 {
     // I love lambda functions :-)
     auto error_msg = [file_name] {
         cout << "Failed to read OBJ file " << file_name << ", its format is not supported" << endl;
     };
 
-    struct OBJTriangle
-    {
-        int v0, v1, v2;
-        int n0, n1, n2;
-        int t0, t1, t2;
-    };
-
     // Prepare the arrays for the data from the file.
-    std::vector<glm::vec3> raw_vertices;        raw_vertices.reserve(1000);
-    std::vector<glm::vec3> raw_normals;            raw_normals.reserve(1000);
-    std::vector<glm::vec2> raw_tex_coords;        raw_tex_coords.reserve(1000);
-    std::vector<OBJTriangle> raw_triangles;        raw_triangles.reserve(1000);
+    raw_vertices.clear();        raw_vertices.reserve(1000);
+    raw_normals.clear();        raw_normals.reserve(1000);
+    raw_tex_coords.clear();        raw_tex_coords.reserve(1000);
+    raw_triangles.clear();        raw_triangles.reserve(1000);
 
     // Load OBJ file
     ifstream file(file_name);
@@ -354,11 +395,6 @@ bool ParseOBJFile(const char *file_name, std::vector<glm::vec3> &out_vertices, s
     }
     file.close();
 
-    // Indices in OBJ file cannot be used, we need to convert the geometry in a way we could draw it
-    // with glDrawArrays.
-    out_vertices.clear();        out_vertices.reserve(raw_triangles.size() * 3);
-    out_normals.clear();        out_normals.reserve(raw_triangles.size() * 3);
-    out_tex_coords.clear();        out_tex_coords.reserve(raw_triangles.size() * 3);
     for (size_t i = 0; i < raw_triangles.size(); i++)
     {
         if ((raw_triangles[i].v0 >= int(raw_vertices.size())) ||
@@ -375,7 +411,29 @@ bool ParseOBJFile(const char *file_name, std::vector<glm::vec3> &out_vertices, s
             error_msg();
             return false;
         }
+    }
+
+    return true;
+}
+
+bool ParseOBJFile(const char *file_name, std::vector<glm::vec3> &out_vertices, std::vector<glm::vec3> &out_normals, std::vector<glm::vec2> &out_tex_coords)
+{
+    std::vector<glm::vec3> raw_vertices;
+    std::vector<glm::vec3> raw_normals;
+    std::vector<glm::vec2> raw_tex_coords;
+    std::vector<OBJTriangle> raw_triangles;
+    if (!ReadOBJFile(file_name, raw_vertices, raw_normals, raw_tex_coords, raw_triangles))
+    {
+        return false;
+    }
 
+    // Indices in OBJ file cannot be used, we need to convert the geometry in a way we could draw it
+    // with glDrawArrays.
+    out_vertices.clear();        out_vertices.reserve(raw_triangles.size() * 3);
+    out_normals.clear();        out_normals.reserve(raw_triangles.size() * 3);
+    out_tex_coords.clear();        out_tex_coords.reserve(raw_triangles.size() * 3);
+    for (size_t i = 0; i < raw_triangles.size(); i++)
+    {
         out_vertices.push_back(raw_vertices[raw_triangles[i].v0]);
         out_vertices.push_back(raw_vertices[raw_triangles[i].v1]);
         out_vertices.push_back(raw_vertices[raw_triangles[i].v2]);
@@ -390,63 +448,194 @@ bool ParseOBJFile(const char *file_name, std::vector<glm::vec3> &out_vertices, s
     return true;
 }
 
-Geometry LoadOBJ(const char *file_name, GLint position_location, GLint normal_location, GLint tex_coord_location)
+// Key of one OBJ vertex used for deduplication, the raw bits of its position, normal, and texture coordinate
+struct OBJVertexKey
 {
-    Geometry geometry;
+    unsigned int bits[8];
+
+    bool operator ==(const OBJVertexKey &rhs) const
+    {
+        return memcmp(bits, rhs.bits, sizeof(bits)) == 0;
+    }
+};
+
+struct OBJVertexKeyHash
+{
+    size_t operator ()(const OBJVertexKey &key) const
+    {
+        // FNV-1a over the eight 32-bit words
+        size_t hash = 2166136261U;
+        for (int i = 0; i < 8; i++)
+        {
+            hash ^= key.bits[i];
+            hash *= 16777619U;
+        }
+        return hash;
+    }
+};
+
+bool ParseOBJFile(const char *file_name, std::vector<glm::vec3> &out_vertices, std::vector<glm::vec3> &out_normals, std::vector<glm::vec2> &out_tex_coords,
+    std::vector<unsigned int> &out_indices)
+{
+    std::vector<glm::vec3> raw_vertices;
+    std::vector<glm::vec3> raw_normals;
+    std::vector<glm::vec2> raw_tex_coords;
+    std::vector<OBJTriangle> raw_triangles;
+    if (!ReadOBJFile(file_name, raw_vertices, raw_normals, raw_tex_coords, raw_triangles))
+    {
+        return false;
+    }
+
+    out_vertices.clear();        out_vertices.reserve(raw_vertices.size());
+    out_normals.clear();        out_normals.reserve(raw_vertices.size());
+    out_tex_coords.clear();        out_tex_coords.reserve(raw_vertices.size());
+    out_indices.clear();        out_indices.reserve(raw_triangles.size() * 3);
+
+    // Each distinct (position, normal, tex coord) triple becomes one vertex, the triangles only refer to it.
+    // The values themselves are compared, so the same vertex is shared even if the file repeats its data.
+    unordered_map<OBJVertexKey, unsigned int, OBJVertexKeyHash> unique_vertices;
+    unique_vertices.reserve(raw_triangles.size() * 3);
+
+    auto add_vertex = [&](int v, int n, int t) {
+        OBJVertexKey key;
+        memcpy(&key.bits[0], &raw_vertices[v], sizeof(float) * 3);
+        memcpy(&key.bits[3], &raw_normals[n], sizeof(float) * 3);
+        memcpy(&key.bits[6], &raw_tex_coords[t], sizeof(float) * 2);
 
-    std::vector<glm::vec3> vertices;
-    std::vector<glm::vec3> normals;
-    std::vector<glm::vec2> tex_coords;
-    if (!ParseOBJFile(file_name, vertices, normals, tex_coords))
+        auto inserted = unique_vertices.insert(make_pair(key, static_cast<unsigned int>(out_vertices.size())));
+        if (inserted.second)
+        {
+            out_vertices.push_back(raw_vertices[v]);
+            out_normals.push_back(raw_normals[n]);
+            out_tex_coords.push_back(raw_tex_coords[t]);
+        }
+        out_indices.push_back(inserted.first->second);
+    };
+
+    for (size_t i = 0; i < raw_triangles.size(); i++)
     {
-        return geometry;        // Return empty geometry, the error message was already printed
+        const OBJTriangle &t = raw_triangles[i];
+        add_vertex(t.v0, t.n0, t.t0);
+        add_vertex(t.v1, t.n1, t.t1);
+        add_vertex(t.v2, t.n2, t.t2);
     }
 
-    // Create buffers for vertex data
-    glGenBuffers(3, geometry.VertexBuffers);
+    return true;
+}
+
+Geometry CreateInterleavedGeometry(const void *vertex_data, size_t vertex_data_size, const unsigned int *indices, size_t index_count,
+    GLenum mode, void (*setup_attributes)(GLint, GLint, GLint), GLint position_location, GLint normal_location, GLint tex_coord_location)
+{
+    Geometry geometry;
+
+    // Create a single buffer for vertex data
+    glGenBuffers(1, &geometry.VertexBuffers[0]);
     glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float) * 3, vertices.data(), GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[1]);
-    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float) * 3, normals.data(), GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[2]);
-    glBufferData(GL_ARRAY_BUFFER, tex_coords.size() * sizeof(float) * 2, tex_coords.data(), GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, vertex_data_size, vertex_data, GL_STATIC_DRAW);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    // No indices
-    geometry.IndexBuffer = 0;
+    // Create a buffer for indices
+    glGenBuffers(1, &geometry.IndexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_count * sizeof(unsigned int), indices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
     // Create a vertex array object for the geometry
     glGenVertexArrays(1, &geometry.VAO);
 
     // Set the parameters of the geometry
     glBindVertexArray(geometry.VAO);
-    if (position_location >= 0)
-    {
-        glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-        glEnableVertexAttribArray(position_location);
-        glVertexAttribPointer(position_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    }
-    if (normal_location >= 0)
+    glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
+    setup_attributes(position_location, normal_location, tex_coord_location);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    geometry.Mode = mode;
+    geometry.DrawArraysCount = 0;
+    geometry.DrawElementsCount = GLsizei(index_count);
+
+    return geometry;
+}
+
+Geometry CreateMeshGeometry(const MeshData &mesh, GLint position_location, GLint normal_location, GLint tex_coord_location)
+{
+    std::vector<unsigned char> vertex_data = FloatVertexLayout::PackVertices(mesh.vertices, mesh.normals, mesh.tex_coords);
+    Geometry geometry = CreateLayoutGeometry<FloatVertexLayout>(vertex_data.data(), mesh.vertices.size(),
+        mesh.indices.data(), mesh.indices.size(), GL_TRIANGLES, position_location, normal_location, tex_coord_location);
+
+    if (!mesh.lods.empty())
+        geometry.DrawElementsCount = mesh.lods[0].Count;
+    geometry.LODs = mesh.lods;
+
+    // Bounding sphere around the center of the bounding box
+    if (!mesh.vertices.empty())
     {
-        glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[1]);
-        glEnableVertexAttribArray(normal_location);
-        glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glm::vec3 min_pos = mesh.vertices[0];
+        glm::vec3 max_pos = mesh.vertices[0];
+        for (size_t i = 1; i < mesh.vertices.size(); i++)
+        {
+            min_pos = glm::min(min_pos, mesh.vertices[i]);
+            max_pos = glm::max(max_pos, mesh.vertices[i]);
+        }
+        glm::vec3 center = (min_pos + max_pos) * 0.5f;
+        float radius = 0.0f;
+        for (size_t i = 0; i < mesh.vertices.size(); i++)
+            radius = std::max(radius, glm::distance(center, mesh.vertices[i]));
+        geometry.BoundingSphere = glm::vec4(center, radius);
     }
-    if (tex_coord_location >= 0)
+
+    return geometry;
+}
+
+bool ProcessOBJFile(const char *file_name, MeshData &mesh)
+{
+    if (!ParseOBJFile(file_name, mesh.vertices, mesh.normals, mesh.tex_coords, mesh.indices))
     {
-        glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[2]);
-        glEnableVertexAttribArray(tex_coord_location);
-        glVertexAttribPointer(tex_coord_location, 2, GL_FLOAT, GL_FALSE, 0, 0);
+        return false;        // The error message was already printed
     }
 
-    glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // The report is printed at once, meshes may be processed on several threads
+    ostringstream log;
+
+    // Report how much the deduplication saved compared to one vertex per triangle corner
+    const size_t vertex_size = sizeof(float) * (3 + 3 + 2);
+    const size_t expanded_bytes = mesh.indices.size() * vertex_size;
+    const size_t indexed_bytes = mesh.vertices.size() * vertex_size + mesh.indices.size() * sizeof(unsigned int);
+    log << "OBJ " << file_name << ": " << mesh.vertices.size() << " unique vertices of " << mesh.indices.size()
+        << " (ratio " << (mesh.indices.empty() ? 0.0 : double(mesh.vertices.size()) / double(mesh.indices.size())) << "), "
+        << expanded_bytes << " -> " << indexed_bytes << " bytes, saved "
+        << (expanded_bytes > indexed_bytes ? expanded_bytes - indexed_bytes : 0) << " bytes" << endl;
+
+    // Reorder triangles and vertices for the post-transform cache, overdraw and vertex fetch
+    MeshStats before = AnalyzeMesh(mesh);
+    OptimizeMesh(mesh);
+    MeshStats after = AnalyzeMesh(mesh);
+    log << "OBJ " << file_name << ": ACMR " << before.acmr << " -> " << after.acmr
+        << ", ATVR " << before.atvr << " -> " << after.atvr
+        << ", overdraw " << before.overdraw << " -> " << after.overdraw << endl;
+
+    // Simplified levels of detail share the vertices, only their indices are appended
+    GenerateLODChain(mesh);
+    log << "OBJ " << file_name << ": LOD triangles";
+    for (size_t i = 0; i < mesh.lods.size(); i++)
+        log << " " << mesh.lods[i].Count / 3 << " (error " << mesh.lods[i].Error << ")";
+    log << endl;
+    cout << log.str();
 
-    geometry.Mode = GL_TRIANGLES;
-    geometry.DrawArraysCount = vertices.size();
-    geometry.DrawElementsCount = 0;
+    return true;
+}
 
-    return geometry;
+Geometry LoadOBJ(const char *file_name, GLint position_location, GLint normal_location, GLint tex_coord_location)
+{
+    MeshCacheData data;
+    if (!PrepareMeshCache(file_name, data))
+    {
+        return Geometry();        // Return empty geometry, the error message was already printed
+    }
+    return CreateMeshCacheGeometry(data.header, position_location, normal_location, tex_coord_location);
 }
 
 
@@ -456,52 +645,16 @@ Geometry LoadOBJ(const char *file_name, GLint position_location, GLint normal_lo
 
 Geometry CreateCube(GLint position_location, GLint normal_location, GLint tex_coord_location)
 {
-	Geometry geometry;
-
-	// Create a single buffer for vertex data
-	glGenBuffers(1, &geometry.VertexBuffers[0]);
-	glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-	glBufferData(GL_ARRAY_BUFFER, cube_vertices_count * sizeof(float) * 8, cube_vertices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Create a buffer for indices
-	glGenBuffers(1, &geometry.IndexBuffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, cube_indices_count * sizeof(unsigned int), cube_indices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-	// Create a vertex array object for the geometry
-	glGenVertexArrays(1, &geometry.VAO);
-
-	// Set the parameters of the geometry
-	glBindVertexArray(geometry.VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-	if (position_location >= 0)
+	// The cube fits into the unit cube, so normalized integers are precise enough
+	std::vector<unsigned char> vertex_data(cube_vertices_count * UnitVertexLayout::Stride);
+	for (int i = 0; i < cube_vertices_count; i++)
 	{
-		glEnableVertexAttribArray(position_location);
-		glVertexAttribPointer(position_location, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, 0);
+		const float *v = &cube_vertices[i * 8];
+		UnitVertexLayout::PackVertex(&vertex_data[i * UnitVertexLayout::Stride], glm::vec3(v[0], v[1], v[2]), glm::vec3(v[3], v[4], v[5]), glm::vec2(v[6], v[7]));
 	}
-	if (normal_location >= 0)
-	{
-		glEnableVertexAttribArray(normal_location);
-		glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void *)(sizeof(float) * 3));
-	}
-	if (tex_coord_location >= 0)
-	{
-		glEnableVertexAttribArray(tex_coord_location);
-		glVertexAttribPointer(tex_coord_location, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void *)(sizeof(float) * 6));
-	}
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-	geometry.Mode = GL_TRIANGLES;
-	geometry.DrawArraysCount = 0;
-	geometry.DrawElementsCount = cube_indices_count;
-
-	return geometry;
+	return CreateLayoutGeometry<UnitVertexLayout>(vertex_data.data(), cube_vertices_count, cube_indices, cube_indices_count,
+		GL_TRIANGLES, position_location, normal_location, tex_coord_location);
 }
 
 Geometry CreateGrid(int size, GLint position_location, GLint normal_location, GLint tex_coord_location) {
@@ -543,72 +696,17 @@ Geometry CreateGrid(int size, GLint position_location, GLint normal_location, GL
 	}
 
 	/*
-	Normalize data
+	Pack and load to opengl
 	*/
-	std::vector<float> vertexData(size * size * 8);
+	std::vector<unsigned char> vertexData(size * size * UnitVertexLayout::Stride);
 	for (int x = 0; x < size; x++) {
 		for (int y = 0; y < size; y++) {
-			vertexData[(x + y * size) * 8 + 0] = vertexes[x][y].x;
-			vertexData[(x + y * size) * 8 + 1] = vertexes[x][y].y;
-			vertexData[(x + y * size) * 8 + 2] = vertexes[x][y].z;
-
-			vertexData[(x + y * size) * 8 + 3] = normals[x][y].x;
-			vertexData[(x + y * size) * 8 + 4] = normals[x][y].y;
-			vertexData[(x + y * size) * 8 + 5] = normals[x][y].z;
-
-			vertexData[(x + y * size) * 8 + 6] = coords[x][y].x;
-			vertexData[(x + y * size) * 8 + 7] = coords[x][y].y;
+			UnitVertexLayout::PackVertex(&vertexData[(x + y * size) * UnitVertexLayout::Stride], vertexes[x][y], normals[x][y], coords[x][y]);
 		}
 	}
 
-	/*
-	Load to opengl
-	*/
-	Geometry grid;
-
-	// Create a single buffer for vertex data
-	glGenBuffers(1, &grid.VertexBuffers[0]);
-	glBindBuffer(GL_ARRAY_BUFFER, grid.VertexBuffers[0]);
-	glBufferData(GL_ARRAY_BUFFER, vertexData.size() * sizeof(float), &vertexData[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Create a buffer for indices
-	glGenBuffers(1, &grid.IndexBuffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, grid.IndexBuffer);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-	// Create a vertex array object for the geometry
-	glGenVertexArrays(1, &grid.VAO);
-
-	// Set the parameters of the geometry
-	glBindVertexArray(grid.VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, grid.VertexBuffers[0]);
-	if (position_location >= 0)
-	{
-		glEnableVertexAttribArray(position_location);
-		glVertexAttribPointer(position_location, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, 0);
-	}
-	if (normal_location >= 0)
-	{
-		glEnableVertexAttribArray(normal_location);
-		glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void *)(sizeof(float) * 3));
-	}
-	if (tex_coord_location >= 0)
-	{
-		glEnableVertexAttribArray(tex_coord_location);
-		glVertexAttribPointer(tex_coord_location, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void *)(sizeof(float) * 6));
-	}
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, grid.IndexBuffer);
-
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	grid.Mode = GL_TRIANGLE_STRIP;
-	grid.DrawArraysCount = 0;
-	grid.DrawElementsCount = indices.size();
-
-	return grid;
+	return CreateLayoutGeometry<UnitVertexLayout>(vertexData.data(), size * size, indices.data(), indices.size(),
+		GL_TRIANGLE_STRIP, position_location, normal_location, tex_coord_location);
 }
 
 
@@ -696,10 +794,19 @@ glm::vec3 Camera::GetEyePosition() const
 //----         TEXTURE LOADING         ----
 //-----------------------------------------
 
-// Loads a texture from file and calls glTexImage2D to se its data.
-// Returns true on success or false on failure.
-bool LoadAndSetTexture(const maybewchar *filename, GLenum target)
+// DevIL keeps the bound image and its settings in global state
+static std::mutex devil_mutex;
+
+bool LoadImageData(const maybewchar *filename, ImageData &out_image)
 {
+	// PNG and TGA files are decoded without DevIL, so they can be loaded on several threads at once
+	std::string decode_error;
+	if (DecodeImageFile(filename, out_image, decode_error) == IMAGE_DECODED)
+		return true;
+
+	// Other formats go through DevIL
+	std::lock_guard<std::mutex> lock(devil_mutex);
+
 	// Create IL image
 	ILuint IL_tex;
 	ilGenImages(1, &IL_tex);
@@ -747,10 +854,14 @@ bool LoadAndSetTexture(const maybewchar *filename, GLenum target)
 		return false;
 	}
 
-	// Set the data to OpenGL (assumes texture object is already bound)
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glTexImage2D(target, 0, internal_format, img_width, img_height, 0, format,
-		type, ilGetData());
+	// Copy the data out of DevIL
+	const ILubyte *data = ilGetData();
+	out_image.Width = img_width;
+	out_image.Height = img_height;
+	out_image.InternalFormat = internal_format;
+	out_image.Format = format;
+	out_image.Type = type;
+	out_image.Pixels.assign(data, data + ilGetInteger(IL_IMAGE_SIZE_OF_DATA));
 
 	// Unset and delete IL texture
 	ilBindImage(0);
@@ -759,25 +870,48 @@ bool LoadAndSetTexture(const maybewchar *filename, GLenum target)
 	return true;
 }
 
-GLuint CreateAndLoadTexture(const maybewchar *filename)
+void SetTextureImage(const ImageData &image, GLenum target)
+{
+	// Set the data to OpenGL (assumes texture object is already bound)
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(target, 0, image.InternalFormat, image.Width, image.Height, 0, image.Format,
+		image.Type, image.Pixels.data());
+}
+
+GLuint CreateTexture(const ImageData &image)
 {
 	// Create OpenGL texture object
 	GLuint tex_obj;
 	glGenTextures(1, &tex_obj);
 	glBindTexture(GL_TEXTURE_2D, tex_obj);
-
-	// Load the data into OpenGL texture object
-	if (!LoadAndSetTexture(filename, GL_TEXTURE_2D))
-	{
-		glBindTexture(GL_TEXTURE_2D, 0);
-		glDeleteTextures(1, &tex_obj);
-		return 0;
-	}
+	SetTextureImage(image, GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
 	return tex_obj;
 }
 
+// Loads a texture from file and calls glTexImage2D to se its data.
+// Returns true on success or false on failure.
+bool LoadAndSetTexture(const maybewchar *filename, GLenum target)
+{
+	ImageData image;
+	if (!LoadImageData(filename, image))
+		return false;
+
+	SetTextureImage(image, target);
+	return true;
+}
+
+GLuint CreateAndLoadTexture(const maybewchar *filename)
+{
+	// The mip levels come precomputed (and compressed if supported) from the texture cache next to the image
+	TextureCacheData data;
+	if (!PrepareTextureCache(filename, SupportedColorCompression(), nullptr, data))
+		return 0;
+
+	return CreateCachedTexture(data.header);
+}
+
 GLuint CreateAndLoadTextureCube(
 	const maybewchar *filename_px, const maybewchar *filename_nx,
 	const maybewchar *filename_py, const maybewchar *filename_ny,
@@ -8,6 +8,9 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <cstring>
+#include <mutex>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -107,6 +110,18 @@ namespace PV112
 	/// When drawing the geometry, bind its VAO and call the draw command. The whole geometry is always
 	/// drawn using a single draw call. Use glDrawArrays if DrawArraysCount > 0, or use glDrawElements
 	/// if DrawElementsCount > 0.
+	///
+	/// Indexed geometries may contain several levels of detail in their index buffer, see LODs.
+	struct GeometryLOD
+	{
+		// First index of the level in the index buffer
+		GLsizei FirstIndex;
+		// Number of indices of the level
+		GLsizei Count;
+		// Maximum distance of the simplified surface from the original one, in object space units
+		float Error;
+	};
+
 	class Geometry
 	{
 	public:
@@ -123,8 +138,8 @@ namespace PV112
 		// To make it short, all OpenGL objects must be destroyed BEFORE the main window is closed
 		// (or left alive, as in our case).
 
-		// Up to three buffers with the data of the geometry (positions, normals, texture coordinates).
-		// If the data is only in one buffer, other buffers are 0
+		// Buffers with the data of the geometry. All geometries created here use a single buffer with
+		// interleaved vertices (see VertexLayout.h), the other buffers are 0
 		GLuint VertexBuffers[3];
 
 		// Buffer with the indices of the geometry
@@ -139,6 +154,13 @@ namespace PV112
 		GLsizei DrawArraysCount;
 		// Number of vertices to be drawn using glDrawElements
 		GLsizei DrawElementsCount;
+
+		// Levels of detail, from the finest to the coarsest. The first one is drawn by DrawGeometry,
+		// it is empty for geometries with only one level.
+		std::vector<GeometryLOD> LODs;
+
+		// Sphere containing all vertices, center in xyz and radius in w (object space)
+		glm::vec4 BoundingSphere;
 	};
 
 	/// Deletes OpenGL objects of the geometry.
@@ -150,6 +172,15 @@ namespace PV112
 	/// Chooses glDrawArraysInstanced or glDrawElementsInstanced to draw the geometry.
 	void DrawGeometryInstanced(const Geometry &geom, int primcount);
 
+	/// Draws the given level of detail of an indexed geometry using glDrawElements.
+	void DrawGeometryLOD(const Geometry &geom, int lod);
+
+	/// Draws the given level of detail of an indexed geometry using glDrawElementsInstanced.
+	void DrawGeometryLODInstanced(const Geometry &geom, int lod, int primcount);
+
+	/// Draws 'count' indices of an indexed geometry starting at 'first_index' using glDrawElements.
+	void DrawGeometryRange(const Geometry &geom, GLsizei first_index, GLsizei count);
+
 
 	//--------------------------
 	//----    OBJ LOADER    ----
@@ -167,7 +198,50 @@ namespace PV112
 	/// If something goes wrong, error messsage is printed and this function returns false.
 	bool ParseOBJFile(const char *file_name, std::vector<glm::vec3> &out_vertices, std::vector<glm::vec3> &out_normals, std::vector<glm::vec2> &out_tex_coords);
 
-	/// Loads an OBJ file and creates a corresponding Geometry object.
+	/// Parses an OBJ file the same way as above, but shares vertices between triangles.
+	///
+	/// Every distinct (position, normal, texture coordinate) triple is stored only once in 'out_vertices',
+	/// 'out_normals' and 'out_tex_coords', and 'out_indices' contains three indices into them for each
+	/// triangle (use glDrawElements with GL_TRIANGLES).
+	bool ParseOBJFile(const char *file_name, std::vector<glm::vec3> &out_vertices, std::vector<glm::vec3> &out_normals, std::vector<glm::vec2> &out_tex_coords,
+		std::vector<unsigned int> &out_indices);
+
+	/// CPU side data of an indexed triangle mesh. Attributes of vertex i are vertices[i], normals[i] and
+	/// tex_coords[i], each three consecutive indices form one triangle.
+	struct MeshData
+	{
+		std::vector<glm::vec3> vertices;
+		std::vector<glm::vec3> normals;
+		std::vector<glm::vec2> tex_coords;
+		std::vector<unsigned int> indices;
+
+		/// Levels of detail stored in 'indices', empty when all indices form a single level
+		std::vector<GeometryLOD> lods;
+	};
+
+	/// Creates an indexed Geometry with a single interleaved vertex buffer of 'vertex_data_size' bytes and
+	/// 'index_count' indices drawn as 'mode'. 'setup_attributes' is called with the VAO and the vertex buffer
+	/// bound to set the attribute pointers, use CreateLayoutGeometry (see VertexLayout.h) to pass the one of a layout.
+	Geometry CreateInterleavedGeometry(const void *vertex_data, size_t vertex_data_size, const unsigned int *indices, size_t index_count,
+		GLenum mode, void (*setup_attributes)(GLint, GLint, GLint), GLint position_location, GLint normal_location, GLint tex_coord_location);
+
+	/// Creates an indexed Geometry object (GL_TRIANGLES drawn with glDrawElements) from the mesh data.
+	/// The vertices are interleaved in FloatVertexLayout (see VertexLayout.h).
+	///
+	/// 'position_location', 'normal_location', and 'tex_coord_location' are locations of vertex attributes,
+	/// obtained by glGetAttribLocation. Use -1 if not necessary.
+	Geometry CreateMeshGeometry(const MeshData &mesh, GLint position_location, GLint normal_location = -1, GLint tex_coord_location = -1);
+
+	/// Parses an OBJ file into indexed mesh data (see the indexed ParseOBJFile), reorders its triangles and
+	/// vertices for the GPU by OptimizeMesh (see MeshOptimizer.h) and generates simplified levels of detail
+	/// by GenerateLODChain (see MeshLOD.h). The number of unique vertices, the memory saved by the
+	/// deduplication, the cache and overdraw statistics, and the LOD triangle counts are printed.
+	bool ProcessOBJFile(const char *file_name, MeshData &mesh);
+
+	/// Loads an OBJ file and creates a corresponding Geometry object with a single interleaved vertex buffer.
+	///
+	/// If an up-to-date binary cache of the file exists (see MeshCache.h), it is mapped and uploaded directly.
+	/// Otherwise the file is processed by ProcessOBJFile and the cache is written for the next run.
 	///
 	/// 'position_location', 'normal_location', and 'tex_coord_location' are locations of vertex attributes,
 	/// obtained by glGetAttribLocation. Use -1 if not necessary.
@@ -261,8 +335,33 @@ namespace PV112
 	//----         TEXTURE LOADING         ----
 	//-----------------------------------------
 
+	/// Decoded image in memory, with the arguments of glTexImage2D
+	struct ImageData
+	{
+		int Width;
+		int Height;
+		GLint InternalFormat;
+		GLenum Format;
+		GLenum Type;
+		// Rows from the bottom to the top, tightly packed
+		std::vector<unsigned char> Pixels;
+	};
+
+	/// Loads and decodes an image file. PNG and TGA files are decoded by DecodeImageFile (see ImageDecoder.h),
+	/// which has no global state. Other formats, and files the decoder rejects, fall back to DevIL, whose calls are
+	/// serialized. The function can be used from any thread. Prints an error and returns false on failure.
+	bool LoadImageData(const maybewchar *filename, ImageData &out_image);
+
+	/// Sets the image data to the bound texture object at 'target' by glTexImage2D.
+	void SetTextureImage(const ImageData &image, GLenum target);
+
+	/// Creates a GL_TEXTURE_2D texture object with the image data.
+	GLuint CreateTexture(const ImageData &image);
+
 	bool LoadAndSetTexture(const maybewchar *filename, GLenum target);
 
+	/// Creates a GL_TEXTURE_2D texture with all mip levels from the texture cache of the file (see TextureCache.h),
+	/// which is built on the first run. The levels are BC1 or BC3 compressed when the context supports S3TC.
 	GLuint CreateAndLoadTexture(const maybewchar *filename);
 
 	GLuint CreateAndLoadTextureCube(
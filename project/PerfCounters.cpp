@@ -0,0 +1,270 @@
+#include "PerfCounters.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+static const char *builtin_names[PERF_BUILTIN_COUNT] = {
+	"draw calls", "instanced draws", "triangles", "vertices", "instances opaque", "instances alpha tested",
+	"instances transparent", "buffer upload bytes", "texture upload bytes"
+};
+
+//-----------------------------------------
+//----            REGISTRY             ----
+//-----------------------------------------
+
+PerfCounters &PerfCounters::Instance()
+{
+	static PerfCounters counters;
+	return counters;
+}
+
+PerfCounters::PerfCounters()
+	: history_next(0), frame_count(0), tracing(false)
+{
+	for (int i = 0; i < PERF_BUILTIN_COUNT; i++)
+		Register(builtin_names[i]);
+}
+
+PerfCounterId PerfCounters::Register(const std::string &name)
+{
+	for (size_t i = 0; i < names.size(); i++)
+		if (names[i] == name)
+			return PerfCounterId(i);
+	names.push_back(name);
+	values.push_back(0);
+	return PerfCounterId(names.size() - 1);
+}
+
+void PerfCounters::EndFrame()
+{
+	if (history.size() < PERF_COUNTER_HISTORY)
+		history.push_back(values);
+	else
+		history[history_next] = values;
+	history_next = (history_next + 1) % PERF_COUNTER_HISTORY;
+	frame_count++;
+	std::fill(values.begin(), values.end(), 0);
+
+	if (tracing)
+	{
+		ofstream out(trace_file.c_str());
+		for (size_t i = 0; i < trace.size(); i++)
+			out << trace[i] << endl;
+		if (out)
+			cout << "OpenGL calls of frame " << frame_count << " written to " << trace_file << endl;
+		else
+			cout << "Cannot write the OpenGL call trace " << trace_file << endl;
+		tracing = false;
+		trace.clear();
+		trace_file.clear();
+	}
+	else if (!trace_file.empty())
+	{
+		// The frame that starts now is traced
+		tracing = true;
+	}
+}
+
+unsigned long long PerfCounters::LastValue(PerfCounterId counter) const
+{
+	if (history.empty())
+		return 0;
+	const std::vector<unsigned long long> &last = history[(history_next + history.size() - 1) % history.size()];
+	return counter < last.size() ? last[counter] : 0;
+}
+
+bool PerfCounters::ExportCSV(const std::string &file_name) const
+{
+	ofstream out(file_name.c_str());
+	out << "frame";
+	for (size_t i = 0; i < names.size(); i++)
+		out << "," << names[i];
+	out << endl;
+
+	// The oldest frame first
+	size_t first = history.size() < PERF_COUNTER_HISTORY ? 0 : history_next;
+	unsigned long long first_frame = frame_count - history.size();
+	for (size_t f = 0; f < history.size(); f++)
+	{
+		const std::vector<unsigned long long> &frame = history[(first + f) % history.size()];
+		out << first_frame + f;
+		for (size_t i = 0; i < names.size(); i++)
+			out << "," << (i < frame.size() ? frame[i] : 0);
+		out << endl;
+	}
+
+	if (!out)
+	{
+		cout << "Cannot write the performance counters " << file_name << endl;
+		return false;
+	}
+	return true;
+}
+
+bool PerfCounters::ExportJSON(const std::string &file_name) const
+{
+	ofstream out(file_name.c_str());
+	out << "{" << endl << "  \"counters\": [";
+	for (size_t i = 0; i < names.size(); i++)
+		out << (i == 0 ? "" : ", ") << "\"" << names[i] << "\"";
+	out << "]," << endl;
+
+	size_t first = history.size() < PERF_COUNTER_HISTORY ? 0 : history_next;
+	out << "  \"first_frame\": " << frame_count - history.size() << "," << endl;
+	out << "  \"frames\": [";
+	for (size_t f = 0; f < history.size(); f++)
+	{
+		const std::vector<unsigned long long> &frame = history[(first + f) % history.size()];
+		out << (f == 0 ? "" : ",") << endl << "    [";
+		for (size_t i = 0; i < names.size(); i++)
+			out << (i == 0 ? "" : ", ") << (i < frame.size() ? frame[i] : 0);
+		out << "]";
+	}
+	out << endl << "  ]" << endl << "}" << endl;
+
+	if (!out)
+	{
+		cout << "Cannot write the performance counters " << file_name << endl;
+		return false;
+	}
+	return true;
+}
+
+std::string PerfCounters::FormatLastFrame() const
+{
+	std::ostringstream text;
+	for (size_t i = 0; i < names.size(); i++)
+		text << names[i] << ": " << LastValue(PerfCounterId(i)) << endl;
+	return text.str();
+}
+
+void PerfCounters::TraceNextFrame(const std::string &file_name)
+{
+	trace_file = file_name;
+}
+
+void PerfCounters::TraceCall(const std::string &call)
+{
+	if (tracing)
+		trace.push_back(call);
+}
+
+//-----------------------------------------
+//----          COUNTED CALLS          ----
+//-----------------------------------------
+
+// Returns the number of triangles drawn from the vertices in the mode
+static unsigned long long TriangleCount(GLenum mode, GLsizei vertex_count)
+{
+	switch (mode)
+	{
+	case GL_TRIANGLES:
+		return static_cast<unsigned long long>(vertex_count / 3);
+	case GL_TRIANGLE_STRIP:
+	case GL_TRIANGLE_FAN:
+		return vertex_count > 2 ? static_cast<unsigned long long>(vertex_count - 2) : 0;
+	default:
+		return 0;
+	}
+}
+
+// Adds the draw to the counters and the trace
+static void CountDraw(const char *call, const PV112::Geometry &geom, GLsizei vertex_count, int instance_count)
+{
+	PerfCounters &counters = PerfCounters::Instance();
+	unsigned long long instances = instance_count > 0 ? static_cast<unsigned long long>(instance_count) : 1;
+	counters.Add(PERF_DRAW_CALLS, 1);
+	if (instance_count > 0)
+		counters.Add(PERF_INSTANCED_DRAWS, 1);
+	counters.Add(PERF_TRIANGLES, TriangleCount(geom.Mode, vertex_count) * instances);
+	counters.Add(PERF_VERTICES, static_cast<unsigned long long>(vertex_count) * instances);
+
+	if (counters.IsTracing())
+	{
+		std::ostringstream line;
+		line << call << " vao " << geom.VAO << " mode 0x" << std::hex << geom.Mode << std::dec << " count " << vertex_count;
+		if (instance_count > 0)
+			line << " instances " << instance_count;
+		counters.TraceCall(line.str());
+	}
+}
+
+// Number of vertices of the whole geometry
+static GLsizei GeometryVertexCount(const PV112::Geometry &geom)
+{
+	return geom.DrawElementsCount > 0 ? geom.DrawElementsCount : geom.DrawArraysCount;
+}
+
+namespace Counted
+{
+	void DrawGeometry(const PV112::Geometry &geom)
+	{
+		PV112::DrawGeometry(geom);
+		CountDraw("DrawGeometry", geom, GeometryVertexCount(geom), 0);
+	}
+
+	void DrawGeometryInstanced(const PV112::Geometry &geom, int primcount)
+	{
+		PV112::DrawGeometryInstanced(geom, primcount);
+		CountDraw("DrawGeometryInstanced", geom, GeometryVertexCount(geom), primcount);
+	}
+
+	void DrawGeometryLOD(const PV112::Geometry &geom, int lod)
+	{
+		PV112::DrawGeometryLOD(geom, lod);
+		CountDraw("DrawGeometryLOD", geom, geom.LODs.empty() ? GeometryVertexCount(geom) : geom.LODs[lod].Count, 0);
+	}
+
+	void DrawGeometryLODInstanced(const PV112::Geometry &geom, int lod, int primcount)
+	{
+		PV112::DrawGeometryLODInstanced(geom, lod, primcount);
+		CountDraw("DrawGeometryLODInstanced", geom, geom.LODs.empty() ? GeometryVertexCount(geom) : geom.LODs[lod].Count, primcount);
+	}
+
+	void DrawGeometryRange(const PV112::Geometry &geom, GLsizei first_index, GLsizei count)
+	{
+		PV112::DrawGeometryRange(geom, first_index, count);
+		CountDraw("DrawGeometryRange", geom, count, 0);
+	}
+
+	void BufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void *data)
+	{
+		glBufferSubData(target, offset, size, data);
+		PerfCounters &counters = PerfCounters::Instance();
+		counters.Add(PERF_BUFFER_UPLOAD_BYTES, static_cast<unsigned long long>(size));
+		if (counters.IsTracing())
+		{
+			std::ostringstream line;
+			line << "glBufferSubData target 0x" << std::hex << target << std::dec << " offset " << offset << " size " << size;
+			counters.TraceCall(line.str());
+		}
+	}
+
+	void BufferWrite(const char *what, size_t size)
+	{
+		PerfCounters &counters = PerfCounters::Instance();
+		counters.Add(PERF_BUFFER_UPLOAD_BYTES, size);
+		if (counters.IsTracing())
+		{
+			std::ostringstream line;
+			line << what << " size " << size;
+			counters.TraceCall(line.str());
+		}
+	}
+
+	void TextureUpload(const char *what, size_t size)
+	{
+		PerfCounters &counters = PerfCounters::Instance();
+		counters.Add(PERF_TEXTURE_UPLOAD_BYTES, size);
+		if (counters.IsTracing())
+		{
+			std::ostringstream line;
+			line << what << " size " << size;
+			counters.TraceCall(line.str());
+		}
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+#ifndef INCLUDED_PERF_COUNTERS_H
+#define INCLUDED_PERF_COUNTERS_H
+
+#include <string>
+#include <vector>
+#include "PV112.h"
+
+/// Number of the last frames whose counters are kept for the export
+static const unsigned int PERF_COUNTER_HISTORY = 600;
+
+/// Index of a counter in the registry
+typedef unsigned int PerfCounterId;
+
+/// Counters every frame has, registered by the registry in this order
+enum PerfCounterBuiltin
+{
+	PERF_DRAW_CALLS,
+	PERF_INSTANCED_DRAWS,
+	// Triangles of the submitted indices, strips with primitive restarts are counted as one strip
+	PERF_TRIANGLES,
+	// Indices of indexed draws, vertices of the others, for each instance
+	PERF_VERTICES,
+	// Instances drawn in each RenderLayer, a draw that is not instanced counts as one
+	PERF_INSTANCES_OPAQUE,
+	PERF_INSTANCES_ALPHA_TESTED,
+	PERF_INSTANCES_TRANSPARENT,
+	PERF_BUFFER_UPLOAD_BYTES,
+	PERF_TEXTURE_UPLOAD_BYTES,
+	PERF_BUILTIN_COUNT
+};
+
+/// Named counters sampled once per frame, for the numbers of a frame rather than the averages.
+///
+/// The counters are incremented during the frame and EndFrame moves their values into the history, which can be
+/// exported as CSV or JSON. Code that draws or uploads data feeds the counters through the Counted functions. The
+/// registry can also trace the OpenGL calls of one frame into a text file.
+///
+/// The counters are not synchronized, use them only from the thread with the OpenGL context.
+class PerfCounters
+{
+public:
+	/// The registry of the application
+	static PerfCounters &Instance();
+
+	/// Returns the counter with the name, registers it if it does not exist yet. Counters registered later read
+	/// 0 in the earlier frames.
+	PerfCounterId Register(const std::string &name);
+
+	void Add(PerfCounterId counter, unsigned long long value) { values[counter] += value; }
+
+	/// Ends the frame, adds the values of the counters to the history and resets them
+	void EndFrame();
+
+	/// Number of frames ended since the start
+	unsigned long long FrameCount() const { return frame_count; }
+
+	/// Returns the value of the counter in the last ended frame
+	unsigned long long LastValue(PerfCounterId counter) const;
+
+	const std::vector<std::string> &Names() const { return names; }
+
+	/// Writes the history, one line per frame with a column for each counter. Returns false and prints an error if
+	/// the file cannot be written.
+	bool ExportCSV(const std::string &file_name) const;
+
+	/// Writes the history as a JSON object with the counter names and an array of values for each frame. Returns
+	/// false and prints an error if the file cannot be written.
+	bool ExportJSON(const std::string &file_name) const;
+
+	/// Returns the counters of the last ended frame, one per line, for the overlay and the console
+	std::string FormatLastFrame() const;
+
+	/// Traces the OpenGL calls of the next frame, the trace is written to the file when the frame ends
+	void TraceNextFrame(const std::string &file_name);
+
+	/// Whether the calls of this frame are traced, check before building the text of a call
+	bool IsTracing() const { return tracing; }
+
+	/// Adds a line to the trace of the frame, does nothing if the frame is not traced
+	void TraceCall(const std::string &call);
+
+private:
+	PerfCounters();
+	PerfCounters(const PerfCounters &);
+	PerfCounters &operator =(const PerfCounters &);
+
+	std::vector<std::string> names;
+	std::vector<unsigned long long> values;
+
+	// Values of the last frames, the oldest first once the history is full
+	std::vector<std::vector<unsigned long long>> history;
+	size_t history_next;
+	unsigned long long frame_count;
+
+	// File the trace of the next frame goes to, the frame being traced and its calls
+	std::string trace_file;
+	bool tracing;
+	std::vector<std::string> trace;
+};
+
+//-----------------------------------------
+//----          COUNTED CALLS          ----
+//-----------------------------------------
+
+/// The draws of PV112 and the uploads, which also add to the counters and the trace
+namespace Counted
+{
+	void DrawGeometry(const PV112::Geometry &geom);
+	void DrawGeometryInstanced(const PV112::Geometry &geom, int primcount);
+	void DrawGeometryLOD(const PV112::Geometry &geom, int lod);
+	void DrawGeometryLODInstanced(const PV112::Geometry &geom, int lod, int primcount);
+	void DrawGeometryRange(const PV112::Geometry &geom, GLsizei first_index, GLsizei count);
+
+	/// glBufferSubData counted as a buffer upload
+	void BufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void *data);
+
+	/// Counts the bytes written to a buffer without glBufferSubData, like a mapped range
+	void BufferWrite(const char *what, size_t size);
+
+	/// Counts the bytes uploaded to a texture by a glTexSubImage or glCompressedTexSubImage call
+	void TextureUpload(const char *what, size_t size);
+}
+
+#endif	// INCLUDED_PERF_COUNTERS_H
@@ -0,0 +1,325 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+using namespace std;
+
+// Ring buffer of the events of one thread. Only the thread writes to it, EndFrame reads the events written since
+// the last read.
+struct ProfileThreadBuffer
+{
+	explicit ProfileThreadBuffer(unsigned int thread)
+		: events(PROFILER_THREAD_EVENTS), written(0), read(0), thread(thread) {}
+
+	std::vector<ProfileEvent> events;
+	// Number of events ever written, the next event goes to written % size
+	std::atomic<size_t> written;
+	// Number of events ever read, only used by the reader
+	size_t read;
+	unsigned int thread;
+};
+
+static thread_local ProfileThreadBuffer *thread_buffer = nullptr;
+static thread_local unsigned int thread_depth = 0;
+
+static unsigned long long ClockNanoseconds()
+{
+	return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//-----------------------------------------
+//----           CPU PROFILER          ----
+//-----------------------------------------
+
+Profiler &Profiler::Instance()
+{
+	static Profiler profiler;
+	return profiler;
+}
+
+Profiler::Profiler()
+	: enabled(true), origin(ClockNanoseconds()), trace_next(0), dropped_events(0)
+{
+	trace.reserve(PROFILER_TRACE_EVENTS);
+}
+
+unsigned long long Profiler::Now() const
+{
+	return ClockNanoseconds() - origin;
+}
+
+ProfileThreadBuffer &Profiler::ThreadBuffer()
+{
+	if (!thread_buffer)
+	{
+		std::lock_guard<std::mutex> lock(buffers_mutex);
+		buffers.emplace_back(new ProfileThreadBuffer(unsigned(buffers.size())));
+		thread_buffer = buffers.back().get();
+	}
+	return *thread_buffer;
+}
+
+void Profiler::Record(const char *name, unsigned long long start, unsigned long long end, unsigned int depth)
+{
+	ProfileThreadBuffer &buffer = ThreadBuffer();
+	size_t index = buffer.written.load(std::memory_order_relaxed);
+	ProfileEvent &event = buffer.events[index % buffer.events.size()];
+	event.name = name;
+	event.start = start;
+	event.end = end;
+	event.thread = buffer.thread;
+	event.depth = depth;
+	buffer.written.store(index + 1, std::memory_order_release);
+}
+
+void Profiler::RecordGpu(const char *name, unsigned long long start, unsigned long long duration)
+{
+	ProfileEvent event;
+	event.name = name;
+	event.start = start;
+	event.end = start + duration;
+	event.thread = PROFILER_GPU_THREAD;
+	event.depth = 0;
+	AddEvent(event);
+}
+
+void Profiler::AddEvent(const ProfileEvent &event)
+{
+	if (trace.size() < PROFILER_TRACE_EVENTS)
+		trace.push_back(event);
+	else
+		trace[trace_next] = event;
+	trace_next = (trace_next + 1) % PROFILER_TRACE_EVENTS;
+
+	std::map<std::string, ScopeHistory> &scopes = event.thread == PROFILER_GPU_THREAD ? gpu_scopes : cpu_scopes;
+	ScopeHistory &history = scopes[event.name];
+	float duration = float(event.end - event.start) * 1e-6f;
+	if (history.durations.size() < PROFILER_SCOPE_HISTORY)
+		history.durations.push_back(duration);
+	else
+		history.durations[history.next] = duration;
+	history.next = (history.next + 1) % PROFILER_SCOPE_HISTORY;
+}
+
+void Profiler::EndFrame()
+{
+	std::vector<ProfileThreadBuffer *> threads;
+	{
+		std::lock_guard<std::mutex> lock(buffers_mutex);
+		for (size_t i = 0; i < buffers.size(); i++)
+			threads.push_back(buffers[i].get());
+	}
+
+	std::vector<ProfileEvent> events;
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		ProfileThreadBuffer &buffer = *threads[t];
+		size_t size = buffer.events.size();
+		size_t end = buffer.written.load(std::memory_order_acquire);
+		size_t begin = std::max(buffer.read, end > size ? end - size : size_t(0));
+
+		events.clear();
+		for (size_t i = begin; i < end; i++)
+			events.push_back(buffer.events[i % size]);
+
+		// Events the thread overwrote while they were copied are not valid
+		size_t written = buffer.written.load(std::memory_order_acquire);
+		size_t valid_begin = std::max(begin, written > size ? written - size : size_t(0));
+		for (size_t i = valid_begin; i < end; i++)
+			AddEvent(events[i - begin]);
+
+		dropped_events += valid_begin - buffer.read;
+		buffer.read = end;
+	}
+}
+
+std::vector<ProfileScopeStats> Profiler::ComputeStats() const
+{
+	std::vector<ProfileScopeStats> result;
+	for (int gpu = 0; gpu < 2; gpu++)
+	{
+		const std::map<std::string, ScopeHistory> &scopes = gpu ? gpu_scopes : cpu_scopes;
+		for (std::map<std::string, ScopeHistory>::const_iterator it = scopes.begin(); it != scopes.end(); ++it)
+		{
+			std::vector<float> sorted = it->second.durations;
+			std::sort(sorted.begin(), sorted.end());
+
+			ProfileScopeStats stats;
+			stats.name = it->first;
+			stats.gpu = gpu != 0;
+			stats.samples = unsigned(sorted.size());
+			stats.p50 = Percentile(sorted, 0.50);
+			stats.p95 = Percentile(sorted, 0.95);
+			stats.p99 = Percentile(sorted, 0.99);
+			result.push_back(stats);
+		}
+	}
+	return result;
+}
+
+void WriteJSONString(std::ostream &out, const std::string &text)
+{
+	out << '"';
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		if (text[i] == '"' || text[i] == '\\')
+			out << '\\';
+		out << text[i];
+	}
+	out << '"';
+}
+
+bool Profiler::ExportChromeTrace(const std::string &file_name) const
+{
+	std::ofstream out(file_name.c_str());
+	if (!out)
+	{
+		cout << "Cannot write the profiler trace " << file_name << endl;
+		return false;
+	}
+
+	// Times in microseconds
+	out << std::fixed << std::setprecision(3);
+	out << "{\"traceEvents\":[" << endl;
+
+	size_t thread_count;
+	{
+		std::lock_guard<std::mutex> lock(buffers_mutex);
+		thread_count = buffers.size();
+	}
+	for (size_t t = 0; t < thread_count; t++)
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t << ",\"args\":{\"name\":\"CPU thread " << t << "\"}}," << endl;
+	out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread_count << ",\"args\":{\"name\":\"GPU\"}}";
+
+	// The oldest events first
+	size_t first = trace.size() < PROFILER_TRACE_EVENTS ? 0 : trace_next;
+	for (size_t i = 0; i < trace.size(); i++)
+	{
+		const ProfileEvent &event = trace[(first + i) % trace.size()];
+		unsigned int thread = event.thread == PROFILER_GPU_THREAD ? unsigned(thread_count) : event.thread;
+		out << "," << endl << "{\"name\":";
+		WriteJSONString(out, event.name);
+		out << ",\"cat\":\"" << (event.thread == PROFILER_GPU_THREAD ? "gpu" : "cpu") << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+			<< ",\"ts\":" << double(event.start) * 1e-3 << ",\"dur\":" << double(event.end - event.start) * 1e-3 << "}";
+	}
+	out << endl << "]}" << endl;
+
+	if (!out)
+	{
+		cout << "Cannot write the profiler trace " << file_name << endl;
+		return false;
+	}
+	return true;
+}
+
+ProfileScope::ProfileScope(const char *name)
+	: name(name), start(0)
+{
+	if (!Profiler::Instance().IsEnabled())
+	{
+		this->name = nullptr;
+		return;
+	}
+	thread_depth++;
+	start = Profiler::Instance().Now();
+}
+
+ProfileScope::~ProfileScope()
+{
+	if (!name)
+		return;
+	thread_depth--;
+	Profiler &profiler = Profiler::Instance();
+	profiler.Record(name, start, profiler.Now(), thread_depth);
+}
+
+//-----------------------------------------
+//----           GPU PROFILER          ----
+//-----------------------------------------
+
+GpuProfiler::GpuProfiler()
+	: frame(0), open(false), dropped_results(0)
+{
+	for (unsigned int f = 0; f < GPU_PROFILER_FRAMES; f++)
+	{
+		FrameQueries &queries = frames[f];
+		queries.queries.resize(GPU_PROFILER_MAX_SCOPES);
+		queries.names.resize(GPU_PROFILER_MAX_SCOPES);
+		queries.starts.resize(GPU_PROFILER_MAX_SCOPES);
+		queries.count = 0;
+		glGenQueries(GLsizei(GPU_PROFILER_MAX_SCOPES), queries.queries.data());
+	}
+}
+
+GpuProfiler::~GpuProfiler()
+{
+	End();
+	for (unsigned int f = 0; f < GPU_PROFILER_FRAMES; f++)
+		glDeleteQueries(GLsizei(GPU_PROFILER_MAX_SCOPES), frames[f].queries.data());
+}
+
+void GpuProfiler::BeginFrame()
+{
+	frame = (frame + 1) % GPU_PROFILER_FRAMES;
+	FrameQueries &queries = frames[frame];
+	for (unsigned int i = 0; i < queries.count; i++)
+	{
+		GLint available = GL_FALSE;
+		glGetQueryObjectiv(queries.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+		{
+			dropped_results++;
+			continue;
+		}
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(queries.queries[i], GL_QUERY_RESULT, &elapsed);
+		Profiler::Instance().RecordGpu(queries.names[i], queries.starts[i], elapsed);
+	}
+	queries.count = 0;
+}
+
+void GpuProfiler::Begin(const char *name)
+{
+	End();
+
+	FrameQueries &queries = frames[frame];
+	if (!Profiler::Instance().IsEnabled() || queries.count >= GPU_PROFILER_MAX_SCOPES)
+		return;
+
+	glBeginQuery(GL_TIME_ELAPSED, queries.queries[queries.count]);
+	queries.names[queries.count] = name;
+	queries.starts[queries.count] = Profiler::Instance().Now();
+	queries.count++;
+	open = true;
+}
+
+void GpuProfiler::End()
+{
+	if (!open)
+		return;
+	glEndQuery(GL_TIME_ELAPSED);
+	open = false;
+}
+
+void GpuProfiler::EndFrame()
+{
+	End();
+}
+
+GpuProfileScope::GpuProfileScope(GpuProfiler *profiler, const char *name)
+	: profiler(profiler)
+{
+	if (profiler)
+		profiler->Begin(name);
+}
+
+GpuProfileScope::~GpuProfileScope()
+{
+	if (profiler)
+		profiler->End();
+}
@@ -0,0 +1,226 @@
+#pragma once
+#ifndef INCLUDED_PROFILER_H
+#define INCLUDED_PROFILER_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "PV112.h"
+
+/// Number of events in the ring buffer of each thread, the events of a frame must fit into it
+static const size_t PROFILER_THREAD_EVENTS = 1 << 14;
+
+/// Number of events kept for the Chrome trace
+static const size_t PROFILER_TRACE_EVENTS = 1 << 16;
+
+/// Number of the last durations of each scope the percentiles are computed from
+static const size_t PROFILER_SCOPE_HISTORY = 256;
+
+/// Number of frames with their own timer queries, the results of a frame are read when its queries are reused
+static const unsigned int GPU_PROFILER_FRAMES = 2;
+
+/// Largest number of GPU scopes in one frame
+static const unsigned int GPU_PROFILER_MAX_SCOPES = 32;
+
+/// Thread of the GPU events in the trace
+static const unsigned int PROFILER_GPU_THREAD = ~0u;
+
+/// One measured scope. Times are in nanoseconds since the profiler was created.
+struct ProfileEvent
+{
+	// The name must outlive the profiler, usually a string literal
+	const char *name;
+	unsigned long long start;
+	unsigned long long end;
+	// Index of the thread in the order the threads recorded their first event, PROFILER_GPU_THREAD for the GPU
+	unsigned int thread;
+	// Number of the scopes the event is nested in
+	unsigned int depth;
+};
+
+/// Rolling statistics of one scope, in milliseconds
+struct ProfileScopeStats
+{
+	std::string name;
+	bool gpu;
+	unsigned int samples;
+	float p50;
+	float p95;
+	float p99;
+};
+
+/// Returns the value at the percentile (0 to 1) of the sorted values, zero if there are none
+template <typename T>
+T Percentile(const std::vector<T> &sorted, double percentile)
+{
+	if (sorted.empty())
+		return T(0);
+	size_t index = size_t(double(sorted.size() - 1) * percentile + 0.5);
+	return sorted[index < sorted.size() ? index : sorted.size() - 1];
+}
+
+/// Writes the text as a JSON string literal, escaping the quotes and backslashes
+void WriteJSONString(std::ostream &out, const std::string &text);
+
+struct ProfileThreadBuffer;
+
+/// Collects the CPU scopes of all threads and the GPU scopes of GpuProfiler.
+///
+/// Each thread records its scopes into its own ring buffer without locking. Once per frame EndFrame collects the
+/// events of all threads into the trace and the rolling statistics of the scopes. The trace can be exported for
+/// chrome://tracing or Perfetto.
+class Profiler
+{
+public:
+	/// The profiler shared by all threads
+	static Profiler &Instance();
+
+	void SetEnabled(bool enabled) { this->enabled.store(enabled, std::memory_order_relaxed); }
+	bool IsEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+	/// Returns the current time in nanoseconds since the profiler was created
+	unsigned long long Now() const;
+
+	/// Records a finished scope of the calling thread, see ProfileScope
+	void Record(const char *name, unsigned long long start, unsigned long long end, unsigned int depth);
+
+	/// Adds a GPU scope measured by GpuProfiler
+	void RecordGpu(const char *name, unsigned long long start, unsigned long long duration);
+
+	/// Collects the events recorded by all threads since the last call. Call once per frame.
+	void EndFrame();
+
+	/// Returns the statistics of all scopes, sorted by name, CPU scopes first
+	std::vector<ProfileScopeStats> ComputeStats() const;
+
+	/// Writes the collected events in the Chrome trace event format. Returns false and prints an error if the file
+	/// cannot be written.
+	bool ExportChromeTrace(const std::string &file_name) const;
+
+	/// Events lost because a thread buffer was full before EndFrame
+	unsigned long long DroppedEvents() const { return dropped_events; }
+
+private:
+	Profiler();
+	Profiler(const Profiler &);
+	Profiler &operator =(const Profiler &);
+
+	// Buffer of the calling thread, registered on the first call
+	ProfileThreadBuffer &ThreadBuffer();
+
+	void AddEvent(const ProfileEvent &event);
+
+	// Durations of one scope in milliseconds
+	struct ScopeHistory
+	{
+		std::vector<float> durations;
+		size_t next;
+	};
+
+	std::atomic<bool> enabled;
+	unsigned long long origin;
+
+	// Buffers of all threads that recorded an event
+	mutable std::mutex buffers_mutex;
+	std::vector<std::unique_ptr<ProfileThreadBuffer>> buffers;
+
+	// Only accessed by the thread calling EndFrame
+	std::vector<ProfileEvent> trace;
+	size_t trace_next;
+	std::map<std::string, ScopeHistory> cpu_scopes;
+	std::map<std::string, ScopeHistory> gpu_scopes;
+	unsigned long long dropped_events;
+};
+
+/// Measures the CPU time of the enclosing block, use PROFILE_SCOPE
+class ProfileScope
+{
+public:
+	explicit ProfileScope(const char *name);
+	~ProfileScope();
+
+private:
+	ProfileScope(const ProfileScope &);
+	ProfileScope &operator =(const ProfileScope &);
+
+	const char *name;
+	unsigned long long start;
+};
+
+#define PROFILE_SCOPE_CONCAT_(a, b) a##b
+#define PROFILE_SCOPE_CONCAT(a, b) PROFILE_SCOPE_CONCAT_(a, b)
+
+/// Measures the CPU time from here to the end of the block, 'name' must be a string literal
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_SCOPE_CONCAT(profile_scope_, __LINE__)(name)
+
+//-----------------------------------------
+//----           GPU PROFILER          ----
+//-----------------------------------------
+
+/// Measures the GPU time of scopes with GL_TIME_ELAPSED queries. The scopes do not nest, beginning a scope ends the
+/// open one.
+///
+/// Each frame has its own queries. The results of a frame are read when its queries are reused GPU_PROFILER_FRAMES
+/// frames later, and only if they are available, so reading never stalls. Results that are not available yet are
+/// dropped. The scopes are added to Profiler, in the trace they start at the CPU time the query began.
+class GpuProfiler
+{
+public:
+	/// Creates the queries, so the context must be current
+	GpuProfiler();
+
+	/// Deletes the queries
+	~GpuProfiler();
+
+	/// Reads the results of the queries of the frame about to be reused
+	void BeginFrame();
+
+	/// Begins a scope, ends the open one. 'name' must outlive the profiler.
+	void Begin(const char *name);
+
+	/// Ends the open scope, if any
+	void End();
+
+	/// Ends the open scope of the frame
+	void EndFrame();
+
+	/// Results that were not available when their queries were reused
+	unsigned long long DroppedResults() const { return dropped_results; }
+
+private:
+	GpuProfiler(const GpuProfiler &);
+	GpuProfiler &operator =(const GpuProfiler &);
+
+	struct FrameQueries
+	{
+		std::vector<GLuint> queries;
+		std::vector<const char *> names;
+		std::vector<unsigned long long> starts;
+		unsigned int count;
+	};
+
+	FrameQueries frames[GPU_PROFILER_FRAMES];
+	unsigned int frame;
+	bool open;
+	unsigned long long dropped_results;
+};
+
+/// Measures the GPU time of the enclosing block, does nothing if the profiler is null
+class GpuProfileScope
+{
+public:
+	GpuProfileScope(GpuProfiler *profiler, const char *name);
+	~GpuProfileScope();
+
+private:
+	GpuProfileScope(const GpuProfileScope &);
+	GpuProfileScope &operator =(const GpuProfileScope &);
+
+	GpuProfiler *profiler;
+};
+
+#endif	// INCLUDED_PROFILER_H
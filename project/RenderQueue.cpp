@@ -0,0 +1,245 @@
+#include "RenderQueue.h"
+#include "PerfCounters.h"
+
+#include <algorithm>
+
+RenderPacket::RenderPacket()
+	: layer(RENDER_LAYER_OPAQUE), program(0), depth_program(0), vertex_array(0), material(0), instance_buffer(0), primitive_restart(false),
+	geometry(nullptr), lod(-1), first_index(0), index_count(0), first_instance(0), instance_count(0), depth(0.0f),
+	set_uniforms(nullptr), set_depth_uniforms(nullptr), object(0), gpu_scope(nullptr)
+{
+	for (unsigned int i = 0; i < RENDER_TEXTURE_UNITS; i++)
+	{
+		texture_targets[i] = GL_TEXTURE_2D;
+		textures[i] = 0;
+	}
+}
+
+float PacketDepth(const glm::vec4 &bounding_sphere, const glm::vec3 &eye_position)
+{
+	return std::max(glm::distance(glm::vec3(bounding_sphere), eye_position) - bounding_sphere.w, 0.0f);
+}
+
+//-----------------------------------------
+//----            SORT KEY             ----
+//-----------------------------------------
+
+static const int KEY_STATE_BITS = 8;
+static const int KEY_DEPTH_BITS = 24;
+static const int KEY_UNUSED_BITS = 14;
+
+unsigned long long RenderQueue::SortKey(const RenderPacket &packet)
+{
+	const unsigned long long state_mask = (1ull << KEY_STATE_BITS) - 1;
+	const unsigned long long depth_max = (1ull << KEY_DEPTH_BITS) - 1;
+
+	float depth = std::min(std::max(packet.depth / RENDER_QUEUE_FAR_DEPTH, 0.0f), 1.0f);
+	unsigned long long depth_bits = static_cast<unsigned long long>(depth * float(depth_max));
+
+	unsigned long long state = ((packet.program & state_mask) << (2 * KEY_STATE_BITS)) |
+		((packet.material & state_mask) << KEY_STATE_BITS) |
+		(packet.textures[0] & state_mask);
+
+	unsigned long long key = static_cast<unsigned long long>(packet.layer) << (3 * KEY_STATE_BITS + KEY_DEPTH_BITS);
+	if (packet.layer == RENDER_LAYER_TRANSPARENT)
+		key |= ((depth_max - depth_bits) << (3 * KEY_STATE_BITS)) | state;
+	else
+		key |= (state << KEY_DEPTH_BITS) | depth_bits;
+	return key << KEY_UNUSED_BITS;
+}
+
+//-----------------------------------------
+//----         QUEUE AND SORT          ----
+//-----------------------------------------
+
+RenderQueue::RenderQueue()
+	: depth_pre_pass(false)
+{
+	stats.draw_calls = 0;
+	stats.instances = 0;
+	stats.depth_draw_calls = 0;
+}
+
+void RenderQueue::Clear()
+{
+	packets.clear();
+	keys.clear();
+	order.clear();
+	depth_pre_pass = false;
+	stats.depth_draw_calls = 0;
+}
+
+void RenderQueue::Submit(const RenderPacket &packet)
+{
+	packets.push_back(packet);
+	keys.push_back(SortKey(packet));
+	order.push_back(unsigned(order.size()));
+}
+
+void RenderQueue::Sort()
+{
+	size_t count = keys.size();
+	keys_scratch.resize(count);
+	order_scratch.resize(count);
+
+	// Least significant digit radix sort on bytes, stable, so equal keys keep the order of submission. Bytes that
+	// are the same in all keys, like the unused low bits, skip their pass.
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t histogram[256] = { 0 };
+		for (size_t i = 0; i < count; i++)
+			histogram[(keys[i] >> shift) & 0xFF]++;
+		if (count == 0 || histogram[(keys[0] >> shift) & 0xFF] == count)
+			continue;
+
+		size_t offset = 0;
+		for (int digit = 0; digit < 256; digit++)
+		{
+			size_t digit_count = histogram[digit];
+			histogram[digit] = offset;
+			offset += digit_count;
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t target = histogram[(keys[i] >> shift) & 0xFF]++;
+			keys_scratch[target] = keys[i];
+			order_scratch[target] = order[i];
+		}
+		keys.swap(keys_scratch);
+		order.swap(order_scratch);
+	}
+}
+
+// Binds the geometry state of the packet, without the program, the material and the blending
+static void BindPacketGeometry(GLStateCache &state, const RenderPacket &packet)
+{
+	state.BindVertexArray(packet.vertex_array);
+	for (unsigned int unit = 0; unit < RENDER_TEXTURE_UNITS; unit++)
+		if (packet.textures[unit] != 0)
+			state.BindTexture(unit, packet.texture_targets[unit], packet.textures[unit]);
+	if (packet.instance_buffer != 0)
+		state.BindUniformBufferBase(RENDER_INSTANCE_BINDING, packet.instance_buffer);
+	if (packet.primitive_restart)
+	{
+		state.Enable(GL_PRIMITIVE_RESTART);
+		state.PrimitiveRestartIndex(4294967295U);
+	}
+	else
+		state.Disable(GL_PRIMITIVE_RESTART);
+}
+
+// Draws the geometry of the packet
+static void DrawPacket(const RenderPacket &packet)
+{
+	const PV112::Geometry &geometry = *packet.geometry;
+	if (packet.instance_count > 0)
+	{
+		if (packet.lod >= 0)
+			Counted::DrawGeometryLODInstanced(geometry, packet.lod, packet.instance_count);
+		else
+			Counted::DrawGeometryInstanced(geometry, packet.instance_count);
+	}
+	else
+	{
+		if (packet.index_count > 0)
+			Counted::DrawGeometryRange(geometry, packet.first_index, packet.index_count);
+		else if (packet.lod >= 0)
+			Counted::DrawGeometryLOD(geometry, packet.lod);
+		else
+			Counted::DrawGeometry(geometry);
+	}
+}
+
+void RenderQueue::ExecuteDepthPrePass(GLStateCache &state)
+{
+	stats.depth_draw_calls = 0;
+	depth_pre_pass = true;
+
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	state.Disable(GL_BLEND);
+	state.DepthFunc(GL_LESS);
+	state.DepthMask(GL_TRUE);
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		const RenderPacket &packet = packets[order[i]];
+		if (packet.layer == RENDER_LAYER_TRANSPARENT || packet.depth_program == 0)
+			continue;
+
+		state.UseProgram(packet.depth_program);
+		BindPacketGeometry(state, packet);
+		if (packet.set_depth_uniforms)
+			packet.set_depth_uniforms(packet);
+
+		stats.depth_draw_calls++;
+		DrawPacket(packet);
+	}
+
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
+void RenderQueue::Execute(GLStateCache &state, RenderMaterialFunction set_material, GpuProfiler *gpu_profiler)
+{
+	stats.draw_calls = stats.depth_draw_calls;
+	stats.instances = 0;
+
+	const unsigned int no_material = ~0u;
+	unsigned int current_material = no_material;
+	const char *current_scope = nullptr;
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		const RenderPacket &packet = packets[order[i]];
+
+		if (gpu_profiler && packet.gpu_scope != current_scope)
+		{
+			if (packet.gpu_scope)
+				gpu_profiler->Begin(packet.gpu_scope);
+			else
+				gpu_profiler->End();
+			current_scope = packet.gpu_scope;
+		}
+
+		state.UseProgram(packet.program);
+		BindPacketGeometry(state, packet);
+		if (packet.material != current_material)
+		{
+			set_material(packet.material);
+			current_material = packet.material;
+		}
+
+		if (packet.layer == RENDER_LAYER_OPAQUE)
+			state.Disable(GL_BLEND);
+		else
+		{
+			state.Enable(GL_BLEND);
+			state.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		}
+		if (depth_pre_pass && packet.depth_program != 0 && packet.layer == RENDER_LAYER_OPAQUE)
+		{
+			state.DepthFunc(GL_EQUAL);
+			state.DepthMask(GL_FALSE);
+		}
+		else
+		{
+			state.DepthFunc(depth_pre_pass && packet.depth_program != 0 ? GL_LEQUAL : GL_LESS);
+			state.DepthMask(GL_TRUE);
+		}
+
+		if (packet.set_uniforms)
+			packet.set_uniforms(packet);
+
+		unsigned int instances = packet.instance_count > 0 ? unsigned(packet.instance_count) : 1u;
+		stats.draw_calls++;
+		stats.instances += instances;
+		PerfCounters::Instance().Add(PerfCounterId(PERF_INSTANCES_OPAQUE + packet.layer), instances);
+		DrawPacket(packet);
+	}
+
+	if (gpu_profiler)
+		gpu_profiler->End();
+
+	// The clears of the next pass are masked by the depth mask
+	state.DepthFunc(GL_LESS);
+	state.DepthMask(GL_TRUE);
+}
@@ -0,0 +1,148 @@
+#pragma once
+#ifndef INCLUDED_RENDER_QUEUE_H
+#define INCLUDED_RENDER_QUEUE_H
+
+#include <vector>
+#include "PV112.h"
+#include "GLStateCache.h"
+#include "Profiler.h"
+
+/// Number of texture units a packet can bind, starting from unit 0
+static const unsigned int RENDER_TEXTURE_UNITS = 2;
+
+/// Uniform buffer binding of the instance data of instanced packets
+static const GLuint RENDER_INSTANCE_BINDING = 3;
+
+/// Distance mapped to the largest depth of the sort key, farther packets share it
+static const float RENDER_QUEUE_FAR_DEPTH = 1000.0f;
+
+/// Layers of the queue, drawn in this order
+enum RenderLayer
+{
+	// Without blending, sorted by state and then front to back
+	RENDER_LAYER_OPAQUE,
+	// Alpha tested and blended at the edges, sorted like the opaque layer since the test keeps the depth correct
+	RENDER_LAYER_ALPHA_TESTED,
+	// Blended, sorted back to front and then by state
+	RENDER_LAYER_TRANSPARENT
+};
+
+struct RenderPacket;
+
+/// Sets the uniforms of the packet that are not part of its sort key, called after its state is bound
+typedef void (*RenderUniformsFunction)(const RenderPacket &packet);
+
+/// Makes the material with the given id current, called when the material changes between packets
+typedef void (*RenderMaterialFunction)(unsigned int material);
+
+/// One draw call with all the state it needs
+struct RenderPacket
+{
+	RenderPacket();
+
+	RenderLayer layer;
+	GLuint program;
+	// Program of the depth pre-pass, the packet is not drawn by the pre-pass if 0. Its vertex shader has to compute
+	// the same positions as the one of 'program'.
+	GLuint depth_program;
+	GLuint vertex_array;
+	unsigned int material;
+
+	// Textures bound to units 0 and 1, units with texture 0 are left as they are
+	GLenum texture_targets[RENDER_TEXTURE_UNITS];
+	GLuint textures[RENDER_TEXTURE_UNITS];
+
+	// Uniform buffer bound to RENDER_INSTANCE_BINDING, none if 0
+	GLuint instance_buffer;
+
+	// Draws with primitive restart at index 0xFFFFFFFF
+	bool primitive_restart;
+
+	const PV112::Geometry *geometry;
+	// Level of detail (see PV112::DrawGeometryLOD), -1 draws the whole geometry
+	int lod;
+	// Range of the indices drawn instead of the level of detail when the count is not 0, not instanced
+	GLsizei first_index;
+	GLsizei index_count;
+	// Instances of the draw, 0 is a non-instanced draw. The first instance is for the uniforms function, the
+	// shaders offset gl_InstanceID by it.
+	int first_instance;
+	int instance_count;
+
+	// Distance of the packet from the eye, see PacketDepth
+	float depth;
+
+	RenderUniformsFunction set_uniforms;
+	// Sets the uniforms of 'depth_program'
+	RenderUniformsFunction set_depth_uniforms;
+	// Identifies the object of the packet for the uniforms function
+	int object;
+
+	// GPU profiler scope of the packet, consecutive packets with the same name are measured together, null for none
+	const char *gpu_scope;
+};
+
+/// Counters of the last RenderQueue::Execute
+struct RenderQueueStats
+{
+	unsigned int draw_calls;
+	// Instances of all draws, a draw that is not instanced counts as one
+	unsigned long long instances;
+	// Draws of the depth pre-pass, included in draw_calls
+	unsigned int depth_draw_calls;
+};
+
+/// Returns the depth of a bounding sphere (center in xyz, radius in w) for the sort key, the distance of its
+/// nearest point from the eye, zero if the eye is inside
+float PacketDepth(const glm::vec4 &bounding_sphere, const glm::vec3 &eye_position);
+
+/// Collects the draws of a pass, sorts them by a 64-bit key and executes them through the state cache, so the
+/// order of the draws follows the state they need rather than the order of the code submitting them.
+///
+/// The key has the layer in the top 2 bits. Opaque and alpha tested packets continue with the program, material
+/// and texture (8 bits each, the low bits of the names) and the depth (24 bits). Transparent packets have the
+/// inverted depth before the state. The low 14 bits are zero.
+class RenderQueue
+{
+public:
+	RenderQueue();
+
+	/// Removes all packets, keeps the allocated memory
+	void Clear();
+
+	void Submit(const RenderPacket &packet);
+
+	/// Sorts the packets by their keys, packets with equal keys keep the order of submission
+	void Sort();
+
+	/// Draws the depth of the opaque and alpha tested packets that have a depth program, in the sorted order and
+	/// without writing the color. Call after Sort and before Execute.
+	void ExecuteDepthPrePass(GLStateCache &state);
+
+	/// Binds the state of each packet through 'state' and draws it, in the sorted order. The GPU time of the packets
+	/// is measured by 'gpu_profiler' if it is not null.
+	///
+	/// After the depth pre-pass, opaque packets drawn by it are shaded only where their depth is equal and without
+	/// writing it, so each pixel is shaded once. Alpha tested packets are shaded with GL_LEQUAL and write the depth,
+	/// because their depth programs leave out the blended edges.
+	void Execute(GLStateCache &state, RenderMaterialFunction set_material, GpuProfiler *gpu_profiler = nullptr);
+
+	size_t PacketCount() const { return packets.size(); }
+
+	const RenderQueueStats &LastStats() const { return stats; }
+
+	static unsigned long long SortKey(const RenderPacket &packet);
+
+private:
+	std::vector<RenderPacket> packets;
+	std::vector<unsigned long long> keys;
+	// Indices of the packets in the sorted order, and the scratch buffers of the radix sort
+	std::vector<unsigned int> order;
+	std::vector<unsigned int> order_scratch;
+	std::vector<unsigned long long> keys_scratch;
+	RenderQueueStats stats;
+	// Whether ExecuteDepthPrePass ran since the last Clear
+	bool depth_pre_pass;
+};
+
+#endif	// INCLUDED_RENDER_QUEUE_H
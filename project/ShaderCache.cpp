@@ -0,0 +1,418 @@
+#include "ShaderCache.h"
+#include "MeshCache.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <locale>
+#include <map>
+#include <memory>
+#include <sstream>
+
+using namespace std;
+
+static const char PROGRAM_CACHE_MAGIC[4] = { 'P', 'V', 'P', 'B' };
+
+//-----------------------------------------
+//----          PERMUTATIONS           ----
+//-----------------------------------------
+
+ShaderDefines &ShaderDefines::Set(const std::string &name, int value)
+{
+	ostringstream text;
+	text << value;
+	SetText(name, text.str());
+	return *this;
+}
+
+ShaderDefines &ShaderDefines::Set(const std::string &name, float value)
+{
+	// The classic locale writes a decimal point whatever the locale of the user is
+	ostringstream text;
+	text.imbue(locale::classic());
+	text << showpoint << setprecision(9) << value;
+	SetText(name, text.str());
+	return *this;
+}
+
+void ShaderDefines::SetText(const std::string &name, const std::string &value)
+{
+	for (size_t i = 0; i < definitions.size(); i++)
+	{
+		if (definitions[i].first == name)
+		{
+			definitions[i].second = value;
+			return;
+		}
+	}
+	definitions.push_back(make_pair(name, value));
+}
+
+std::string ShaderDefines::Text() const
+{
+	string text;
+	for (size_t i = 0; i < definitions.size(); i++)
+		text += "#define " + definitions[i].first + " " + definitions[i].second + "\n";
+	return text;
+}
+
+std::string InjectShaderDefines(const std::string &source, const ShaderDefines &defines)
+{
+	// The #version directive has to stay the first one, the definitions go after its line
+	size_t version = source.find("#version");
+	size_t insert = 0;
+	int line = 1;
+	if (version != string::npos)
+	{
+		size_t end = source.find('\n', version);
+		insert = end == string::npos ? source.size() : end + 1;
+		for (size_t i = 0; i < insert; i++)
+			if (source[i] == '\n')
+				line++;
+	}
+
+	ostringstream line_directive;
+	line_directive << "#line " << line << "\n";
+	string text = source.substr(0, insert);
+	if (!text.empty() && text[text.size() - 1] != '\n')
+		text += "\n";
+	return text + defines.Text() + line_directive.str() + source.substr(insert);
+}
+
+bool ExpandShaderIncludes(const std::string &source, const std::string &file_name, std::string &out_source)
+{
+	size_t slash = file_name.find_last_of("/\\");
+	string directory = slash == string::npos ? string() : file_name.substr(0, slash + 1);
+
+	out_source.clear();
+	int line = 1;
+	int included = 0;
+	size_t begin = 0;
+	while (begin < source.size())
+	{
+		size_t end = source.find('\n', begin);
+		end = end == string::npos ? source.size() : end + 1;
+		string text = source.substr(begin, end - begin);
+		begin = end;
+
+		size_t directive = text.find_first_not_of(" \t");
+		if (directive == string::npos || text.compare(directive, 8, "#include") != 0)
+		{
+			out_source += text;
+			line++;
+			continue;
+		}
+
+		size_t open = text.find('"', directive + 8);
+		size_t close = open == string::npos ? string::npos : text.find('"', open + 1);
+		if (close == string::npos)
+		{
+			cout << file_name << "(" << line << "): #include expects a \"file\"" << endl;
+			return false;
+		}
+		string include_name = directory + text.substr(open + 1, close - open - 1);
+		string include_source = PV112::LoadFileToString(include_name.c_str());
+		if (include_source.empty())
+		{
+			cout << "File " << include_name << " included by " << file_name << " is empty or failed to load" << endl;
+			return false;
+		}
+		if (include_source[include_source.size() - 1] != '\n')
+			include_source += "\n";
+
+		// The shader continues with its own numbering after the included lines
+		included++;
+		ostringstream include_line, return_line;
+		include_line << "#line 1 " << included << "\n";
+		return_line << "#line " << line + 1 << " 0\n";
+		out_source += include_line.str() + include_source + return_line.str();
+		line++;
+	}
+	return true;
+}
+
+ProgramVariant::ProgramVariant(const char *vertex_shader, const char *fragment_shader, const ShaderDefines &defines)
+	: vertex_shader(vertex_shader), fragment_shader(fragment_shader), defines(defines)
+{
+}
+
+ProgramVariant &ProgramVariant::BindAttribute(GLint location, const char *name)
+{
+	attributes.push_back(make_pair(location, string(name)));
+	return *this;
+}
+
+//-----------------------------------------
+//----          PROGRAM CACHE          ----
+//-----------------------------------------
+
+// FNV-1a over the bytes of the text, continuing from 'hash'
+static unsigned long long HashText(const std::string &text, unsigned long long hash)
+{
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		hash ^= static_cast<unsigned char>(text[i]);
+		hash *= 1099511628211ULL;
+	}
+	// Separates the texts, so moving characters between them changes the hash
+	hash ^= 0xff;
+	hash *= 1099511628211ULL;
+	return hash;
+}
+
+static std::string GLString(GLenum name)
+{
+	const GLubyte *text = glGetString(name);
+	return text ? reinterpret_cast<const char *>(text) : "";
+}
+
+// Prints the compile errors of the shader
+static void PrintShaderLog(GLuint shader, GLenum shader_type, const std::string &file_name, const ShaderDefines &defines)
+{
+	cout << "Failed to compile " << (shader_type == GL_VERTEX_SHADER ? "vertex" : "fragment") << " shader " << file_name << endl;
+	cout << defines.Text();
+
+	int log_len = 0;
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_len);
+	if (log_len > 0)
+	{
+		unique_ptr<char []> log(new char[log_len]);
+		glGetShaderInfoLog(shader, log_len, nullptr, log.get());
+		cout << log.get() << endl;
+	}
+}
+
+ShaderCache::ShaderCache()
+	: binary_cache_enabled(true), built_count(0)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+size_t ShaderCache::Add(const ProgramVariant &variant)
+{
+	Entry entry = { variant, string(), string(), 0, 0 };
+	entries.push_back(entry);
+	return entries.size() - 1;
+}
+
+std::string ShaderCache::CacheFileName(const Entry &entry) const
+{
+	ostringstream name;
+	name << entry.variant.vertex_shader << "." << hex << setw(16) << setfill('0') << entry.key << PROGRAM_CACHE_EXTENSION;
+	return name.str();
+}
+
+bool ShaderCache::LoadBinary(Entry &entry)
+{
+	MappedFile file;
+	if (!file.Open(CacheFileName(entry).c_str()) || file.Size() < sizeof(ProgramCacheHeader))
+		return false;
+
+	const ProgramCacheHeader *header = reinterpret_cast<const ProgramCacheHeader *>(file.Data());
+	if (memcmp(header->magic, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC)) != 0 || header->version != PROGRAM_CACHE_VERSION ||
+		header->key != entry.key || file.Size() < sizeof(ProgramCacheHeader) + header->binary_size)
+		return false;
+
+	// The driver may reject the binary even with the same version strings, the program is compiled then
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header->binary_format, file.Data() + sizeof(ProgramCacheHeader), GLsizei(header->binary_size));
+	int link_status = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+	if (GL_FALSE == link_status)
+	{
+		glDeleteProgram(program);
+		return false;
+	}
+	entry.program = program;
+	return true;
+}
+
+void ShaderCache::StoreBinary(const Entry &entry)
+{
+	int binary_size = 0;
+	glGetProgramiv(entry.program, GL_PROGRAM_BINARY_LENGTH, &binary_size);
+	if (binary_size <= 0)
+		return;
+
+	vector<unsigned char> data(sizeof(ProgramCacheHeader) + binary_size);
+	GLenum binary_format = 0;
+	GLsizei length = 0;
+	glGetProgramBinary(entry.program, binary_size, &length, &binary_format, &data[sizeof(ProgramCacheHeader)]);
+	if (length <= 0)
+		return;
+
+	ProgramCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC));
+	header.version = PROGRAM_CACHE_VERSION;
+	header.binary_format = binary_format;
+	header.binary_size = unsigned(length);
+	header.key = entry.key;
+	memcpy(&data[0], &header, sizeof(header));
+
+	// A failed write only costs the compilation in the next run
+	string cache_name = CacheFileName(entry);
+	ofstream file(cache_name.c_str(), ios::binary | ios::trunc);
+	file.write(reinterpret_cast<const char *>(&data[0]), sizeof(ProgramCacheHeader) + length);
+	if (!file)
+		cout << "Cannot write the program cache " << cache_name << endl;
+}
+
+bool ShaderCache::Build()
+{
+	auto start = chrono::steady_clock::now();
+
+	GLint binary_format_count = 0;
+	if (GLEW_ARB_get_program_binary)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binary_format_count);
+	bool use_binaries = binary_cache_enabled && binary_format_count > 0;
+
+	// Let the driver use all its compiler threads
+	if (GLEW_KHR_parallel_shader_compile)
+		glMaxShaderCompilerThreadsKHR(0xffffffffU);
+	else if (GLEW_ARB_parallel_shader_compile)
+		glMaxShaderCompilerThreadsARB(0xffffffffU);
+
+	// Sources with the includes and the definitions, and the keys
+	string driver = GLString(GL_VENDOR) + "\n" + GLString(GL_RENDERER) + "\n" + GLString(GL_VERSION) + "\n" +
+		GLString(GL_SHADING_LANGUAGE_VERSION);
+	map<string, string> files;
+	for (size_t i = built_count; i < entries.size(); i++)
+	{
+		Entry &entry = entries[i];
+		const string *names[2] = { &entry.variant.vertex_shader, &entry.variant.fragment_shader };
+		string *sources[2] = { &entry.vertex_source, &entry.fragment_source };
+		for (int s = 0; s < 2; s++)
+		{
+			// The includes are expanded before the key is hashed, so changing an included file compiles again
+			auto file = files.find(*names[s]);
+			if (file == files.end())
+			{
+				string source = PV112::LoadFileToString(names[s]->c_str());
+				if (source.empty())
+				{
+					cout << "File " << *names[s] << " is empty or failed to load" << endl;
+					return false;
+				}
+				string expanded;
+				if (!ExpandShaderIncludes(source, *names[s], expanded))
+					return false;
+				file = files.insert(make_pair(*names[s], expanded)).first;
+			}
+			*sources[s] = InjectShaderDefines(file->second, entry.variant.defines);
+		}
+
+		unsigned long long key = HashText(driver, 14695981039346656037ULL);
+		key = HashText(entry.vertex_source, key);
+		key = HashText(entry.fragment_source, key);
+		for (size_t a = 0; a < entry.variant.attributes.size(); a++)
+		{
+			ostringstream attribute;
+			attribute << entry.variant.attributes[a].first << " " << entry.variant.attributes[a].second;
+			key = HashText(attribute.str(), key);
+		}
+		entry.key = key;
+	}
+
+	// Programs from the cache
+	vector<size_t> compiled;
+	for (size_t i = built_count; i < entries.size(); i++)
+	{
+		if (use_binaries && LoadBinary(entries[i]))
+			stats.programs_loaded++;
+		else
+			compiled.push_back(i);
+	}
+
+	// Compile all shaders and link all programs first, the status queries wait for the driver. Shaders with the same
+	// source are shared by the programs.
+	map<string, GLuint> shaders;
+	struct Pending
+	{
+		GLuint shaders[2];
+	};
+	vector<Pending> pending(compiled.size());
+	for (size_t c = 0; c < compiled.size(); c++)
+	{
+		Entry &entry = entries[compiled[c]];
+		const string *sources[2] = { &entry.vertex_source, &entry.fragment_source };
+		const GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+		for (int s = 0; s < 2; s++)
+		{
+			string shader_key = string(1, char('0' + s)) + *sources[s];
+			auto shader = shaders.find(shader_key);
+			if (shader == shaders.end())
+			{
+				GLuint object = glCreateShader(types[s]);
+				const char *source = sources[s]->c_str();
+				glShaderSource(object, 1, &source, nullptr);
+				glCompileShader(object);
+				shader = shaders.insert(make_pair(shader_key, object)).first;
+				stats.shaders_compiled++;
+			}
+			pending[c].shaders[s] = shader->second;
+		}
+
+		entry.program = glCreateProgram();
+		glAttachShader(entry.program, pending[c].shaders[0]);
+		glAttachShader(entry.program, pending[c].shaders[1]);
+		for (size_t a = 0; a < entry.variant.attributes.size(); a++)
+			glBindAttribLocation(entry.program, entry.variant.attributes[a].first, entry.variant.attributes[a].second.c_str());
+		if (use_binaries)
+			glProgramParameteri(entry.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(entry.program);
+	}
+
+	bool success = true;
+	for (size_t c = 0; c < compiled.size(); c++)
+	{
+		Entry &entry = entries[compiled[c]];
+		int link_status = GL_FALSE;
+		glGetProgramiv(entry.program, GL_LINK_STATUS, &link_status);
+		if (GL_FALSE == link_status)
+		{
+			// The errors of the shaders explain most failures, the link log the rest
+			const string *names[2] = { &entry.variant.vertex_shader, &entry.variant.fragment_shader };
+			const GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+			for (int s = 0; s < 2; s++)
+			{
+				int compile_status = GL_FALSE;
+				glGetShaderiv(pending[c].shaders[s], GL_COMPILE_STATUS, &compile_status);
+				if (GL_FALSE == compile_status)
+					PrintShaderLog(pending[c].shaders[s], types[s], *names[s], entry.variant.defines);
+			}
+
+			cout << "Failed to link program with vertex shader " << entry.variant.vertex_shader << " and fragment shader " <<
+				entry.variant.fragment_shader << endl;
+			int log_len = 0;
+			glGetProgramiv(entry.program, GL_INFO_LOG_LENGTH, &log_len);
+			if (log_len > 0)
+			{
+				unique_ptr<char []> log(new char[log_len]);
+				glGetProgramInfoLog(entry.program, log_len, nullptr, log.get());
+				cout << log.get() << endl;
+			}
+
+			glDeleteProgram(entry.program);
+			entry.program = 0;
+			success = false;
+			continue;
+		}
+
+		glDetachShader(entry.program, pending[c].shaders[0]);
+		glDetachShader(entry.program, pending[c].shaders[1]);
+		stats.programs_compiled++;
+		if (use_binaries)
+			StoreBinary(entry);
+	}
+
+	// The shaders are deleted with the last program they are attached to
+	for (auto shader = shaders.begin(); shader != shaders.end(); ++shader)
+		glDeleteShader(shader->second);
+
+	built_count = entries.size();
+	stats.build_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	return success;
+}
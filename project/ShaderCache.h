@@ -0,0 +1,144 @@
+#pragma once
+#ifndef INCLUDED_SHADER_CACHE_H
+#define INCLUDED_SHADER_CACHE_H
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "PV112.h"
+
+/// Version of the program cache format, cache files of other versions are compiled again
+static const unsigned int PROGRAM_CACHE_VERSION = 1;
+
+/// Extension of the program cache files, they are named after the vertex shader and the key of the program
+static const char PROGRAM_CACHE_EXTENSION[] = ".pvprog";
+
+//-----------------------------------------
+//----          PERMUTATIONS           ----
+//-----------------------------------------
+
+/// Preprocessor definitions that specialize a shader, a variant is compiled for each set of values. The shaders
+/// give the defaults of the definitions with #ifndef, so they also compile without them.
+class ShaderDefines
+{
+public:
+	/// Sets the definition, replaces the value if the name is already defined
+	ShaderDefines &Set(const std::string &name, int value);
+	/// Floats are written with a decimal point, so they are float literals in GLSL
+	ShaderDefines &Set(const std::string &name, float value);
+
+	/// The #define lines in the order the names were first set
+	std::string Text() const;
+
+private:
+	void SetText(const std::string &name, const std::string &value);
+
+	std::vector<std::pair<std::string, std::string>> definitions;
+};
+
+/// Inserts the definitions after the #version line of the source. A #line directive follows them, so the compile
+/// errors refer to the lines of the file.
+std::string InjectShaderDefines(const std::string &source, const ShaderDefines &defines);
+
+/// Replaces the lines #include "file" of the source by the file, which is relative to the directory of 'file_name'.
+/// GLSL 330 has no includes, the shaders share code this way. The lines of the n-th included file are numbered
+/// in source string n by #line directives, so the compile errors give the file and its line. Included files are
+/// not expanded further. Returns false and prints an error if an included file fails to load.
+bool ExpandShaderIncludes(const std::string &source, const std::string &file_name, std::string &out_source);
+
+/// Shaders, definitions and attribute locations of one program variant
+struct ProgramVariant
+{
+	ProgramVariant(const char *vertex_shader, const char *fragment_shader, const ShaderDefines &defines);
+
+	/// Binds the attribute to the location before linking, like the arguments of PV112::CreateAndLinkProgram
+	ProgramVariant &BindAttribute(GLint location, const char *name);
+
+	std::string vertex_shader;
+	std::string fragment_shader;
+	ShaderDefines defines;
+	std::vector<std::pair<GLint, std::string>> attributes;
+};
+
+//-----------------------------------------
+//----          PROGRAM CACHE          ----
+//-----------------------------------------
+
+/// The cache file starts with this header, followed by the program binary
+struct ProgramCacheHeader
+{
+	char magic[4];
+	unsigned int version;
+	// Format and size of the binary from glGetProgramBinary
+	unsigned int binary_format;
+	unsigned int binary_size;
+	// Hash of the driver and the sources, also in the name of the file
+	unsigned long long key;
+};
+
+/// Counters of ShaderCache::Build
+struct ShaderCacheStats
+{
+	unsigned int programs_loaded;
+	unsigned int programs_compiled;
+	// Shaders with the same source and definitions are compiled once for all programs
+	unsigned int shaders_compiled;
+	double build_ms;
+};
+
+/// Creates the program variants of the application. Build loads the programs from binaries stored by
+/// glGetProgramBinary in earlier runs, which skips compiling and linking. The binaries are keyed by the driver
+/// (vendor, renderer and version strings) and the sources with the definitions, so a changed shader or driver
+/// compiles the program again and writes a new cache file.
+///
+/// The programs that are not cached are compiled together: all shaders are compiled and all programs linked before
+/// any status is queried, so drivers with KHR_parallel_shader_compile (or the ARB version) compile them on their
+/// threads in parallel.
+///
+/// The programs are kept until the process exits, like the programs of PV112::CreateAndLinkProgram.
+class ShaderCache
+{
+public:
+	ShaderCache();
+
+	/// Whether Build loads and stores program binaries, enabled by default. Binaries are never used if the driver
+	/// has no binary formats.
+	void SetBinaryCacheEnabled(bool enabled) { binary_cache_enabled = enabled; }
+
+	/// Adds a variant to the next Build, returns its index for Program
+	size_t Add(const ProgramVariant &variant);
+
+	/// Creates the programs added since the last Build, so the context must be current. Returns false and prints
+	/// the errors if a shader cannot be loaded or a program fails to compile or link.
+	bool Build();
+
+	/// Returns the program of the variant, 0 before it is built or if it failed
+	GLuint Program(size_t index) const { return entries[index].program; }
+
+	const ShaderCacheStats &Stats() const { return stats; }
+
+private:
+	ShaderCache(const ShaderCache &);
+	ShaderCache &operator =(const ShaderCache &);
+
+	struct Entry
+	{
+		ProgramVariant variant;
+		std::string vertex_source;
+		std::string fragment_source;
+		unsigned long long key;
+		GLuint program;
+	};
+
+	bool LoadBinary(Entry &entry);
+	void StoreBinary(const Entry &entry);
+	std::string CacheFileName(const Entry &entry) const;
+
+	bool binary_cache_enabled;
+	std::vector<Entry> entries;
+	// Entries before this one are built
+	size_t built_count;
+	ShaderCacheStats stats;
+};
+
+#endif	// INCLUDED_SHADER_CACHE_H
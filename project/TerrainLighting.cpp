@@ -0,0 +1,289 @@
+#include "TerrainLighting.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <memory>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TERRAIN_LIGHTING_SSE2 1
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+//-----------------------------------------
+//----          HEIGHT GRID            ----
+//-----------------------------------------
+
+// Samples of the heightmap contributing to one texel of the grid along one axis
+struct SplineTaps
+{
+	int first;
+	float weights[4];
+};
+
+// Catmull-Rom taps of each texel along an axis, the padding texels outside of the heightmap repeat its edge
+static std::vector<SplineTaps> ComputeSplineTaps(int texel_count, int padding, int scale, int sample_count)
+{
+	std::vector<SplineTaps> taps(texel_count + 2 * padding);
+	for (size_t i = 0; i < taps.size(); i++)
+	{
+		float position = glm::clamp(float(int(i) - padding) / float(scale), 0.0f, float(sample_count - 1));
+		float base = floor(position);
+		float t = position - base;
+		float t2 = t * t;
+		float t3 = t2 * t;
+		taps[i].first = int(base) - 1;
+		taps[i].weights[0] = 0.5f * (-t3 + 2.0f * t2 - t);
+		taps[i].weights[1] = 0.5f * (3.0f * t3 - 5.0f * t2 + 2.0f);
+		taps[i].weights[2] = 0.5f * (-3.0f * t3 + 4.0f * t2 + t);
+		taps[i].weights[3] = 0.5f * (t3 - t2);
+	}
+	return taps;
+}
+
+// Heights at the texels of the map with a border for the horizon scans, rows along z
+struct HeightGrid
+{
+	int padding;
+	int stride;
+	std::vector<float> data;
+
+	// Height of the texel [x, z] of the map, the border is at negative indices and past the size of the map
+	const float *At(int x, int z) const { return &data[size_t(z + padding) * stride + x + padding]; }
+};
+
+static void BuildHeightGrid(const std::vector<std::vector<float>> &height, int width, int depth, int scale, int padding,
+	ThreadPool *pool, HeightGrid &out_grid)
+{
+	int sample_width = int(height.size());
+	int sample_depth = int(height[0].size());
+	std::vector<SplineTaps> x_taps = ComputeSplineTaps(width, padding, scale, sample_width);
+	std::vector<SplineTaps> z_taps = ComputeSplineTaps(depth, padding, scale, sample_depth);
+
+	out_grid.padding = padding;
+	out_grid.stride = width + 2 * padding;
+	out_grid.data.resize(size_t(out_grid.stride) * (depth + 2 * padding));
+
+	ParallelFor(pool, z_taps.size(), [&](size_t begin, size_t end) {
+		for (size_t z = begin; z < end; z++)
+		{
+			const SplineTaps &z_tap = z_taps[z];
+			int samples_z[4];
+			for (int k = 0; k < 4; k++)
+				samples_z[k] = glm::clamp(z_tap.first + k, 0, sample_depth - 1);
+
+			float *row = &out_grid.data[z * out_grid.stride];
+			for (size_t x = 0; x < x_taps.size(); x++)
+			{
+				const SplineTaps &x_tap = x_taps[x];
+				float value = 0.0f;
+				for (int i = 0; i < 4; i++)
+				{
+					const std::vector<float> &column = height[glm::clamp(x_tap.first + i, 0, sample_width - 1)];
+					float column_value = 0.0f;
+					for (int k = 0; k < 4; k++)
+						column_value += z_tap.weights[k] * column[samples_z[k]];
+					value += x_tap.weights[i] * column_value;
+				}
+				row[x] = value;
+			}
+		}
+	});
+}
+
+//-----------------------------------------
+//----             BAKING              ----
+//-----------------------------------------
+
+// One step of a horizon scan, the offset in the height grid and the rise of the height per unit of the height
+// difference, the height scale divided by the horizontal distance
+struct HorizonStep
+{
+	ptrdiff_t offset;
+	float slope_scale;
+};
+
+// Steps of all directions, 'first[d]' to 'first[d + 1]' are the steps of the direction d
+struct HorizonTable
+{
+	std::vector<HorizonStep> steps;
+	std::vector<size_t> first;
+};
+
+// The steps reach up to 'radius' texels, 'stride' is the stride of the rows of the height grid
+static void BuildHorizonTable(int radius, int stride, float texel_size, float height_scale, HorizonTable &out_table)
+{
+	out_table.steps.clear();
+	out_table.first.assign(1, 0);
+	for (int d = 0; d < TERRAIN_OCCLUSION_DIRECTIONS; d++)
+	{
+		float angle = 6.28318531f * (float(d) + 0.5f) / float(TERRAIN_OCCLUSION_DIRECTIONS);
+		int last_x = 0;
+		int last_z = 0;
+		for (int s = 1; s <= TERRAIN_OCCLUSION_STEPS; s++)
+		{
+			// Dense near the texel, where the terrain occludes the most of the sky
+			float distance = float(radius) * float(s * s) / float(TERRAIN_OCCLUSION_STEPS * TERRAIN_OCCLUSION_STEPS);
+			int x = int(floor(cos(angle) * distance + 0.5f));
+			int z = int(floor(sin(angle) * distance + 0.5f));
+			if ((x == 0 && z == 0) || (x == last_x && z == last_z))
+				continue;
+			last_x = x;
+			last_z = z;
+
+			HorizonStep step;
+			step.offset = ptrdiff_t(z) * stride + x;
+			step.slope_scale = height_scale / (sqrt(float(x * x + z * z)) * texel_size);
+			out_table.steps.push_back(step);
+		}
+		out_table.first.push_back(out_table.steps.size());
+	}
+}
+
+// Writes the normal from the central differences of the heights around the texel and the occlusion
+static void StoreTexel(const float *center, ptrdiff_t stride, float normal_scale, float occlusion, unsigned char *out_texel)
+{
+	glm::vec3 normal = glm::normalize(glm::vec3((center[-1] - center[1]) * normal_scale, 1.0f,
+		(center[-stride] - center[stride]) * normal_scale));
+	out_texel[0] = (unsigned char)(glm::clamp(normal.x * 0.5f + 0.5f, 0.0f, 1.0f) * 255.0f + 0.5f);
+	out_texel[1] = (unsigned char)(glm::clamp(normal.y * 0.5f + 0.5f, 0.0f, 1.0f) * 255.0f + 0.5f);
+	out_texel[2] = (unsigned char)(glm::clamp(normal.z * 0.5f + 0.5f, 0.0f, 1.0f) * 255.0f + 0.5f);
+	out_texel[3] = (unsigned char)(glm::clamp(occlusion, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// Bakes the texels [x0, x1) x [z0, z1)
+static void BakeTile(const HeightGrid &grid, const HorizonTable &table, float normal_scale, int width,
+	int x0, int z0, int x1, int z1, unsigned char *out_texels)
+{
+	const float inverse_directions = 1.0f / float(TERRAIN_OCCLUSION_DIRECTIONS);
+	for (int z = z0; z < z1; z++)
+	{
+		int x = x0;
+#if defined(TERRAIN_LIGHTING_SSE2)
+		// Four neighbouring texels scan the same steps, so each step is one unaligned load
+		const __m128 one = _mm_set1_ps(1.0f);
+		for (; x + 4 <= x1; x += 4)
+		{
+			const float *center = grid.At(x, z);
+			__m128 center_height = _mm_loadu_ps(center);
+			__m128 visibility = _mm_setzero_ps();
+			for (int d = 0; d < TERRAIN_OCCLUSION_DIRECTIONS; d++)
+			{
+				// The tangent of the highest horizon, the sky below the horizontal plane is not counted
+				__m128 horizon = _mm_setzero_ps();
+				for (size_t s = table.first[d]; s < table.first[d + 1]; s++)
+				{
+					__m128 rise = _mm_sub_ps(_mm_loadu_ps(center + table.steps[s].offset), center_height);
+					horizon = _mm_max_ps(horizon, _mm_mul_ps(rise, _mm_set1_ps(table.steps[s].slope_scale)));
+				}
+				// Cosine weighted sky above the horizon angle a is cos^2(a) = 1 / (1 + tan^2(a))
+				visibility = _mm_add_ps(visibility, _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(horizon, horizon))));
+			}
+
+			float occlusion[4];
+			_mm_storeu_ps(occlusion, _mm_mul_ps(visibility, _mm_set1_ps(inverse_directions)));
+			for (int i = 0; i < 4; i++)
+				StoreTexel(center + i, grid.stride, normal_scale, occlusion[i], &out_texels[(size_t(z) * width + x + i) * 4]);
+		}
+#endif
+		for (; x < x1; x++)
+		{
+			const float *center = grid.At(x, z);
+			float visibility = 0.0f;
+			for (int d = 0; d < TERRAIN_OCCLUSION_DIRECTIONS; d++)
+			{
+				float horizon = 0.0f;
+				for (size_t s = table.first[d]; s < table.first[d + 1]; s++)
+					horizon = std::max(horizon, (center[table.steps[s].offset] - center[0]) * table.steps[s].slope_scale);
+				visibility += 1.0f / (1.0f + horizon * horizon);
+			}
+			StoreTexel(center, grid.stride, normal_scale, visibility * inverse_directions, &out_texels[(size_t(z) * width + x) * 4]);
+		}
+	}
+}
+
+void BakeTerrainLighting(const std::vector<std::vector<float>> &height, const glm::vec3 &terrain_size, int scale,
+	ThreadPool *pool, TerrainLightingMap &out_map)
+{
+	scale = std::max(scale, 1);
+	out_map.width = int(height.size()) * scale;
+	out_map.height = height.empty() ? 0 : int(height[0].size()) * scale;
+	out_map.texels.assign(size_t(out_map.width) * out_map.height * 4, 0);
+	if (out_map.width == 0 || out_map.height == 0)
+		return;
+
+	// The horizon scans assume square texels, the terrain is square
+	float texel_size = terrain_size.x / float(out_map.width);
+	int radius = std::max(int(ceil(TERRAIN_OCCLUSION_RADIUS / texel_size)), 1);
+
+	// The border also covers the neighbours of the edge texels for the normals
+	HeightGrid grid;
+	BuildHeightGrid(height, out_map.width, out_map.height, scale, radius + 1, pool, grid);
+	HorizonTable table;
+	BuildHorizonTable(radius, grid.stride, texel_size, terrain_size.y, table);
+
+	// The vertex normals are computed with the heightmap in a unit cube, a texel is 1 / width of it
+	float normal_scale = float(out_map.width) * 0.5f;
+
+	int tiles_x = (out_map.width + TERRAIN_BAKE_TILE - 1) / TERRAIN_BAKE_TILE;
+	int tiles_z = (out_map.height + TERRAIN_BAKE_TILE - 1) / TERRAIN_BAKE_TILE;
+	ParallelFor(pool, size_t(tiles_x) * tiles_z, [&](size_t begin, size_t end) {
+		for (size_t tile = begin; tile < end; tile++)
+		{
+			int x0 = int(tile % tiles_x) * TERRAIN_BAKE_TILE;
+			int z0 = int(tile / tiles_x) * TERRAIN_BAKE_TILE;
+			BakeTile(grid, table, normal_scale, out_map.width, x0, z0, std::min(x0 + TERRAIN_BAKE_TILE, out_map.width),
+				std::min(z0 + TERRAIN_BAKE_TILE, out_map.height), &out_map.texels[0]);
+		}
+	});
+}
+
+GLuint CreateTerrainLightingTexture(const TerrainLightingMap &map)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, map.width, map.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, map.texels.data());
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return texture;
+}
+
+void BenchmarkTerrainBake(const std::vector<std::vector<float>> &height, const glm::vec3 &terrain_size, int scale,
+	int repetitions, std::ostream &out)
+{
+	std::vector<unsigned> thread_counts;
+	unsigned hardware_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned count = 1; count < hardware_threads; count *= 2)
+		thread_counts.push_back(count);
+	thread_counts.push_back(hardware_threads);
+
+	TerrainLightingMap map;
+	out << "Baking the terrain lighting " << int(height.size()) * scale << "x" << (height.empty() ? 0 : int(height[0].size()) * scale) <<
+		" (" << TERRAIN_OCCLUSION_DIRECTIONS << " directions, " << TERRAIN_OCCLUSION_STEPS << " steps) " << repetitions << " times:" << endl;
+	double single_thread_ms = 0.0;
+	for (size_t t = 0; t < thread_counts.size(); t++)
+	{
+		// The calling thread bakes as well, so the pool has one thread less
+		std::unique_ptr<ThreadPool> pool(thread_counts[t] > 1 ? new ThreadPool(thread_counts[t] - 1) : nullptr);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (int r = 0; r < repetitions; r++)
+			BakeTerrainLighting(height, terrain_size, scale, pool.get(), map);
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repetitions;
+		if (t == 0)
+			single_thread_ms = ms;
+
+		out << "  " << setw(3) << thread_counts[t] << " threads: " << fixed << setprecision(1) << setw(8) << ms << " ms, "
+			<< setprecision(2) << single_thread_ms / ms << "x" << endl;
+		out.unsetf(ios::floatfield);
+		out << setprecision(6);
+	}
+}
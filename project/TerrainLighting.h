@@ -0,0 +1,50 @@
+#pragma once
+#ifndef INCLUDED_TERRAIN_LIGHTING_H
+#define INCLUDED_TERRAIN_LIGHTING_H
+
+#include <ostream>
+#include <vector>
+#include "PV112.h"
+#include "ThreadPool.h"
+
+/// Texels of the baked maps per sample of the heightmap along each side, the heights between the samples are
+/// interpolated by Catmull-Rom splines
+static const int TERRAIN_BAKE_SCALE = 2;
+
+/// Directions of the horizon scans of the ambient occlusion and the steps along each of them, the steps grow
+/// quadratically up to TERRAIN_OCCLUSION_RADIUS world units
+static const int TERRAIN_OCCLUSION_DIRECTIONS = 16;
+static const int TERRAIN_OCCLUSION_STEPS = 16;
+static const float TERRAIN_OCCLUSION_RADIUS = 12.0f;
+
+/// Size of the square tiles the bake is split into for the threads, in texels
+static const int TERRAIN_BAKE_TILE = 32;
+
+/// Normal map and ambient occlusion of a terrain as RGBA8 texels, rows along the second index of the heights
+/// (the t texture coordinate). The normal in RGB is in the space of the vertex normals of the terrain, where the
+/// heightmap spans a unit cube. The occlusion in alpha is 1 for a fully visible sky.
+struct TerrainLightingMap
+{
+	int width;
+	int height;
+	std::vector<unsigned char> texels;
+};
+
+/// Bakes the lighting maps from the heights of a terrain ('height[x][z]' in [0, 1]). The texel [x * scale, z * scale]
+/// is at the sample [x, z]. 'terrain_size' is the size of the terrain in the world, the occlusion is the visible
+/// part of the sky, cosine weighted, from the horizons found in TERRAIN_OCCLUSION_DIRECTIONS directions.
+///
+/// The map is baked by tiles on the threads of 'pool' and the calling thread, or only on the calling thread if
+/// 'pool' is null. The horizon scans process four texels of a row at once with SSE2 where available.
+void BakeTerrainLighting(const std::vector<std::vector<float>> &height, const glm::vec3 &terrain_size, int scale,
+	ThreadPool *pool, TerrainLightingMap &out_map);
+
+/// Creates a mipmapped GL_TEXTURE_2D with the map, clamped to the edges
+GLuint CreateTerrainLightingTexture(const TerrainLightingMap &map);
+
+/// Bakes the map repeatedly with 1, 2, 4, ... up to the number of hardware threads and prints the time of a bake and
+/// the speedup over one thread for each thread count
+void BenchmarkTerrainBake(const std::vector<std::vector<float>> &height, const glm::vec3 &terrain_size, int scale,
+	int repetitions, std::ostream &out);
+
+#endif	// INCLUDED_TERRAIN_LIGHTING_H
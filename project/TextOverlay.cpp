@@ -0,0 +1,190 @@
+#include "TextOverlay.h"
+
+// Glyphs of the characters from ' ' to '_', 7 rows of 5 pixels each, the highest of the 5 bits is the left pixel
+static const int FONT_FIRST_CHARACTER = 32;
+static const int FONT_GLYPH_COUNT = 64;
+static const unsigned char font_glyphs[FONT_GLYPH_COUNT][7] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },	// space
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 },	// !
+	{ 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00 },	// "
+	{ 0x0A, 0x0A, 0x1F, 0x0A, 0x1F, 0x0A, 0x0A },	// #
+	{ 0x04, 0x0F, 0x14, 0x0E, 0x05, 0x1E, 0x04 },	// $
+	{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 },	// %
+	{ 0x0C, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0D },	// &
+	{ 0x04, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00 },	// '
+	{ 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 },	// (
+	{ 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 },	// )
+	{ 0x00, 0x04, 0x15, 0x0E, 0x15, 0x04, 0x00 },	// *
+	{ 0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00 },	// +
+	{ 0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08 },	// ,
+	{ 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 },	// -
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C },	// .
+	{ 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 },	// /
+	{ 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E },	// 0
+	{ 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E },	// 1
+	{ 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F },	// 2
+	{ 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E },	// 3
+	{ 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 },	// 4
+	{ 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E },	// 5
+	{ 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E },	// 6
+	{ 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },	// 7
+	{ 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E },	// 8
+	{ 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C },	// 9
+	{ 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00 },	// :
+	{ 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x04, 0x08 },	// ;
+	{ 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 },	// <
+	{ 0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00 },	// =
+	{ 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 },	// >
+	{ 0x0E, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 },	// ?
+	{ 0x0E, 0x11, 0x01, 0x0D, 0x15, 0x15, 0x0E },	// @
+	{ 0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 },	// A
+	{ 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E },	// B
+	{ 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E },	// C
+	{ 0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C },	// D
+	{ 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F },	// E
+	{ 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 },	// F
+	{ 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F },	// G
+	{ 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 },	// H
+	{ 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E },	// I
+	{ 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C },	// J
+	{ 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },	// K
+	{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F },	// L
+	{ 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 },	// M
+	{ 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },	// N
+	{ 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },	// O
+	{ 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 },	// P
+	{ 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D },	// Q
+	{ 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 },	// R
+	{ 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E },	// S
+	{ 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },	// T
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },	// U
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 },	// V
+	{ 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A },	// W
+	{ 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 },	// X
+	{ 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04 },	// Y
+	{ 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F },	// Z
+	{ 0x0E, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0E },	// [
+	{ 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 },	// backslash
+	{ 0x0E, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0E },	// ]
+	{ 0x04, 0x0A, 0x11, 0x00, 0x00, 0x00, 0x00 },	// ^
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F },	// _
+};
+
+// Attribute locations of the overlay program
+static const GLint OVERLAY_POSITION_LOC = 0;
+static const GLint OVERLAY_TEX_COORD_LOC = 1;
+
+TextOverlay::TextOverlay(GLStateCache &state)
+	: program(0), viewport_size_loc(-1), offset_loc(-1), color_loc(-1), font_tex_loc(-1), font_texture(0), vertex_array(0), vertex_buffer(0)
+{
+	program = PV112::CreateAndLinkProgram("shaders/overlay_vertex.glsl", "shaders/overlay_fragment.glsl",
+		OVERLAY_POSITION_LOC, "position", OVERLAY_TEX_COORD_LOC, "tex_coord", -1, nullptr);
+	viewport_size_loc = glGetUniformLocation(program, "viewport_size");
+	offset_loc = glGetUniformLocation(program, "offset");
+	color_loc = glGetUniformLocation(program, "color");
+	font_tex_loc = glGetUniformLocation(program, "font_tex");
+
+	// All glyphs in one row of cells, one byte per pixel
+	int width = FONT_GLYPH_COUNT * TEXT_OVERLAY_CELL_WIDTH;
+	std::vector<unsigned char> pixels(size_t(width) * TEXT_OVERLAY_CELL_HEIGHT, 0);
+	for (int glyph = 0; glyph < FONT_GLYPH_COUNT; glyph++)
+		for (int row = 0; row < 7; row++)
+			for (int column = 0; column < 5; column++)
+				if (font_glyphs[glyph][row] & (0x10 >> column))
+					pixels[size_t(row) * width + glyph * TEXT_OVERLAY_CELL_WIDTH + column] = 255;
+
+	glGenTextures(1, &font_texture);
+	state.BindTexture(0, GL_TEXTURE_2D, font_texture);
+	GLint unpack_alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, TEXT_OVERLAY_CELL_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, pixels.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	// Two triangles per character with a position in pixels and texture coordinates in the font texture
+	glGenVertexArrays(1, &vertex_array);
+	glGenBuffers(1, &vertex_buffer);
+	state.BindVertexArray(vertex_array);
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	glEnableVertexAttribArray(OVERLAY_POSITION_LOC);
+	glVertexAttribPointer(OVERLAY_POSITION_LOC, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), nullptr);
+	glEnableVertexAttribArray(OVERLAY_TEX_COORD_LOC);
+	glVertexAttribPointer(OVERLAY_TEX_COORD_LOC, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)(2 * sizeof(float)));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	state.BindVertexArray(0);
+}
+
+TextOverlay::~TextOverlay()
+{
+	glDeleteProgram(program);
+	glDeleteTextures(1, &font_texture);
+	glDeleteVertexArrays(1, &vertex_array);
+	glDeleteBuffers(1, &vertex_buffer);
+}
+
+void TextOverlay::Draw(GLStateCache &state, const std::string &text, int x, int y, int scale, int viewport_width, int viewport_height)
+{
+	if (text.empty() || program == 0)
+		return;
+
+	float cell_width = float(TEXT_OVERLAY_CELL_WIDTH * scale);
+	float cell_height = float(TEXT_OVERLAY_CELL_HEIGHT * scale);
+	float font_width = float(FONT_GLYPH_COUNT * TEXT_OVERLAY_CELL_WIDTH);
+
+	vertices.clear();
+	float left = float(x), top = float(y);
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		int character = (unsigned char)text[i];
+		if (character == '\n')
+		{
+			left = float(x);
+			top += cell_height;
+			continue;
+		}
+		if (character >= 'a' && character <= 'z')
+			character -= 'a' - 'A';
+		int glyph = character - FONT_FIRST_CHARACTER;
+		if (glyph < 0 || glyph >= FONT_GLYPH_COUNT)
+			glyph = '?' - FONT_FIRST_CHARACTER;
+
+		float u0 = float(glyph * TEXT_OVERLAY_CELL_WIDTH) / font_width;
+		float u1 = float((glyph + 1) * TEXT_OVERLAY_CELL_WIDTH) / font_width;
+		const float quad[6][4] = {
+			{ left, top, u0, 0.0f }, { left + cell_width, top, u1, 0.0f }, { left, top + cell_height, u0, 1.0f },
+			{ left + cell_width, top, u1, 0.0f }, { left + cell_width, top + cell_height, u1, 1.0f }, { left, top + cell_height, u0, 1.0f }
+		};
+		vertices.insert(vertices.end(), &quad[0][0], &quad[0][0] + 24);
+		left += cell_width;
+	}
+	GLsizei vertex_count = GLsizei(vertices.size() / 4);
+
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(vertices.size() * sizeof(float)), vertices.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	state.UseProgram(program);
+	state.BindVertexArray(vertex_array);
+	state.BindTexture(0, GL_TEXTURE_2D, font_texture);
+	state.Disable(GL_DEPTH_TEST);
+	state.Disable(GL_BLEND);
+	glUniform1i(font_tex_loc, 0);
+
+	glUniform2f(viewport_size_loc, float(viewport_width), float(viewport_height));
+
+	// A dark shadow one font pixel to the bottom right keeps the text readable over the bright sky and water
+	glUniform2f(offset_loc, float(scale), float(scale));
+	glUniform4f(color_loc, 0.0f, 0.0f, 0.0f, 1.0f);
+	glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+
+	glUniform2f(offset_loc, 0.0f, 0.0f);
+	glUniform4f(color_loc, 1.0f, 1.0f, 0.6f, 1.0f);
+	glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+
+	state.Enable(GL_DEPTH_TEST);
+}
@@ -0,0 +1,50 @@
+#pragma once
+#ifndef INCLUDED_TEXT_OVERLAY_H
+#define INCLUDED_TEXT_OVERLAY_H
+
+#include <string>
+#include <vector>
+#include "PV112.h"
+#include "GLStateCache.h"
+
+/// Size of a character cell in the font texture in pixels, the glyphs are 5x7 with a gap on the right and below
+static const int TEXT_OVERLAY_CELL_WIDTH = 6;
+static const int TEXT_OVERLAY_CELL_HEIGHT = 8;
+
+/// Draws lines of text over the frame with a built-in bitmap font, for the statistics on the screen. The font has
+/// the ASCII characters from the space to the underscore, lowercase letters are drawn as uppercase and other
+/// characters as '?'.
+///
+/// The text is drawn with its own program and vertex buffer, its draws are not counted by the performance
+/// counters, so the overlay does not change the numbers it shows.
+class TextOverlay
+{
+public:
+	/// Creates the font texture, the program and the vertex buffer, so the context must be current. The shaders
+	/// are loaded from shaders/overlay_vertex.glsl and shaders/overlay_fragment.glsl.
+	explicit TextOverlay(GLStateCache &state);
+
+	/// Deletes the OpenGL objects
+	~TextOverlay();
+
+	/// Draws the text with its top left corner at [x, y] pixels from the top left corner of the viewport. Lines are
+	/// separated by '\n', each cell is 'scale' pixels per font pixel. Draws into the bound framebuffer.
+	void Draw(GLStateCache &state, const std::string &text, int x, int y, int scale, int viewport_width, int viewport_height);
+
+private:
+	TextOverlay(const TextOverlay &);
+	TextOverlay &operator =(const TextOverlay &);
+
+	GLuint program;
+	GLint viewport_size_loc;
+	GLint offset_loc;
+	GLint color_loc;
+	GLint font_tex_loc;
+	GLuint font_texture;
+	GLuint vertex_array;
+	GLuint vertex_buffer;
+	// Vertices of the text, reused between the draws
+	std::vector<float> vertices;
+};
+
+#endif	// INCLUDED_TEXT_OVERLAY_H
@@ -0,0 +1,157 @@
+#include "TextureArray.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+
+using namespace std;
+
+// Converts a file name to a narrow string, the names are plain ASCII
+static std::string NarrowFileName(const std::basic_string<maybewchar> &file_name)
+{
+	return std::string(file_name.begin(), file_name.end());
+}
+
+static bool HasAlpha(const TextureCacheHeader *header)
+{
+	return header->internal_format == GL_RGBA || header->internal_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+}
+
+// Size of the whole cache data, the levels are the last sections
+static size_t TextureCacheSize(const TextureCacheHeader *header)
+{
+	const TextureCacheLevel *levels = TextureCacheLevels(header);
+	size_t size = 0;
+	for (unsigned int i = 0; i < header->level_count; i++)
+		size = std::max(size, size_t(levels[i].offset) + levels[i].size);
+	return size;
+}
+
+// Resizes an 8-bit image by bilinear filtering and adds an opaque alpha channel if 'add_alpha' is true
+static void ConvertArrayLayer(const PV112::ImageData &image, int width, int height, bool add_alpha, PV112::ImageData &out_image)
+{
+	int channels = (image.Format == GL_RGBA || image.Format == GL_BGRA) ? 4 : 3;
+	int out_channels = add_alpha ? 4 : channels;
+
+	out_image.Width = width;
+	out_image.Height = height;
+	out_image.InternalFormat = out_channels == 4 ? GL_RGBA : GL_RGB;
+	out_image.Format = out_channels == channels ? image.Format : (image.Format == GL_BGR ? GL_BGRA : GL_RGBA);
+	out_image.Type = GL_UNSIGNED_BYTE;
+	out_image.Pixels.assign(size_t(width) * height * out_channels, 255);
+
+	float scale_x = float(image.Width) / float(width);
+	float scale_y = float(image.Height) / float(height);
+	for (int y = 0; y < height; y++)
+	{
+		float source_y = std::max((float(y) + 0.5f) * scale_y - 0.5f, 0.0f);
+		int y0 = std::min(int(source_y), image.Height - 1);
+		int y1 = std::min(y0 + 1, image.Height - 1);
+		float fy = source_y - float(y0);
+		for (int x = 0; x < width; x++)
+		{
+			float source_x = std::max((float(x) + 0.5f) * scale_x - 0.5f, 0.0f);
+			int x0 = std::min(int(source_x), image.Width - 1);
+			int x1 = std::min(x0 + 1, image.Width - 1);
+			float fx = source_x - float(x0);
+
+			const unsigned char *p00 = &image.Pixels[(size_t(y0) * image.Width + x0) * channels];
+			const unsigned char *p10 = &image.Pixels[(size_t(y0) * image.Width + x1) * channels];
+			const unsigned char *p01 = &image.Pixels[(size_t(y1) * image.Width + x0) * channels];
+			const unsigned char *p11 = &image.Pixels[(size_t(y1) * image.Width + x1) * channels];
+			unsigned char *target = &out_image.Pixels[(size_t(y) * width + x) * out_channels];
+			for (int c = 0; c < channels; c++)
+			{
+				float top = float(p00[c]) + (float(p10[c]) - float(p00[c])) * fx;
+				float bottom = float(p01[c]) + (float(p11[c]) - float(p01[c])) * fx;
+				target[c] = static_cast<unsigned char>(top + (bottom - top) * fy + 0.5f);
+			}
+		}
+	}
+}
+
+bool PrepareTextureArray(const std::vector<std::basic_string<maybewchar>> &file_names, TextureCompression compression,
+	ThreadPool *pool, TextureArrayData &out_data)
+{
+	size_t layer_count = file_names.size();
+	out_data.header = nullptr;
+	out_data.layers.clear();
+	for (size_t i = 0; i < layer_count; i++)
+		out_data.layers.push_back(std::unique_ptr<TextureCacheData>(new TextureCacheData()));
+
+	std::vector<char> loaded(layer_count, 0);
+	ParallelFor(pool, layer_count, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			loaded[i] = PrepareTextureCache(file_names[i].c_str(), compression, pool, *out_data.layers[i]);
+	});
+
+	// The largest layer gives the size of the array
+	const TextureCacheHeader *reference = nullptr;
+	bool has_alpha = false;
+	for (size_t i = 0; i < layer_count; i++)
+	{
+		if (!loaded[i])
+			continue;
+		const TextureCacheHeader *header = out_data.layers[i]->header;
+		has_alpha = has_alpha || HasAlpha(header);
+		if (!reference || size_t(header->width) * header->height > size_t(reference->width) * reference->height)
+			reference = header;
+	}
+	if (!reference)
+		return false;
+	unsigned int width = reference->width;
+	unsigned int height = reference->height;
+
+	// Rebuild the layers that do not match the array
+	ParallelFor(pool, layer_count, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			TextureCacheData &layer = *out_data.layers[i];
+			if (!loaded[i] || (layer.header->width == width && layer.header->height == height && HasAlpha(layer.header) == has_alpha))
+				continue;
+
+			PV112::ImageData image, converted;
+			if (!PV112::LoadImageData(file_names[i].c_str(), image))
+			{
+				loaded[i] = 0;
+				continue;
+			}
+			ConvertArrayLayer(image, int(width), int(height), has_alpha, converted);
+			layer.file.Close();
+			if (!BuildTextureCache(converted, compression, nullptr, pool, layer.built_data))
+			{
+				loaded[i] = 0;
+				continue;
+			}
+			layer.header = ValidateTextureCache(layer.built_data.data(), layer.built_data.size(), compression, nullptr);
+
+			ostringstream log;
+			log << "Texture " << NarrowFileName(file_names[i]) << ": converted to " << width << "x" << height
+				<< (has_alpha ? " RGBA" : " RGB") << " for the texture array" << endl;
+			cout << log.str();
+		}
+	});
+
+	// The first loaded layer that matches describes the array, missing layers are its copy with zero levels
+	for (size_t i = 0; i < layer_count && !out_data.header; i++)
+		if (loaded[i])
+			out_data.header = out_data.layers[i]->header;
+	if (!out_data.header)
+		return false;
+
+	for (size_t i = 0; i < layer_count; i++)
+	{
+		if (loaded[i])
+			continue;
+		TextureCacheData &layer = *out_data.layers[i];
+		const unsigned char *source = reinterpret_cast<const unsigned char *>(out_data.header);
+		const TextureCacheLevel *levels = TextureCacheLevels(out_data.header);
+		size_t data_offset = levels[0].offset;
+		layer.file.Close();
+		layer.built_data.assign(TextureCacheSize(out_data.header), 0);
+		memcpy(&layer.built_data[0], source, data_offset);
+		layer.header = reinterpret_cast<const TextureCacheHeader *>(layer.built_data.data());
+	}
+	return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#ifndef INCLUDED_TEXTURE_ARRAY_H
+#define INCLUDED_TEXTURE_ARRAY_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "PV112.h"
+#include "TextureCache.h"
+#include "ThreadPool.h"
+
+/// CPU side data of the layers of a GL_TEXTURE_2D_ARRAY, all layers have the same size, format and levels
+struct TextureArrayData
+{
+	TextureArrayData() : header(nullptr) {}
+
+	std::vector<std::unique_ptr<TextureCacheData>> layers;
+	// Header of the first layer, describes all of them
+	const TextureCacheHeader *header;
+};
+
+/// Prepares the texture cache of each file (see PrepareTextureCache) as one layer of a texture array. The array
+/// has the size of the largest layer and has alpha if any layer has it. Layers of a different size or format are
+/// resized (bilinear) and converted from the image and rebuilt in memory on every run, so the material textures
+/// of one array should have the same size. Layers whose file cannot be loaded are zero (black, transparent if the
+/// array has alpha). The layers are prepared on 'pool'. Does not use OpenGL. Returns false if no layer can be
+/// loaded.
+bool PrepareTextureArray(const std::vector<std::basic_string<maybewchar>> &file_names, TextureCompression compression,
+	ThreadPool *pool, TextureArrayData &out_data);
+
+#endif	// INCLUDED_TEXTURE_ARRAY_H
@@ -0,0 +1,311 @@
+#include "TextureCache.h"
+#include "TextureCompression.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+//-----------------------------------------
+//----       TEXTURE CACHE FORMAT      ----
+//-----------------------------------------
+
+static const char TEXTURE_CACHE_MAGIC[4] = { 'P', 'V', 'T', 'X' };
+
+static size_t AlignTo16(size_t offset)
+{
+	return (offset + 15) & ~size_t(15);
+}
+
+// Converts a file name to a narrow string, the names are plain ASCII
+static std::string NarrowFileName(const maybewchar *file_name)
+{
+	std::string name;
+	for (const maybewchar *c = file_name; *c; c++)
+		name += char(*c);
+	return name;
+}
+
+//-----------------------------------------
+//----      WRITING AND CONVERSION     ----
+//-----------------------------------------
+
+std::string TextureCacheFileName(const maybewchar *image_file_name)
+{
+	return NarrowFileName(image_file_name) + TEXTURE_CACHE_EXTENSION;
+}
+
+bool BuildTextureCache(const PV112::ImageData &image, TextureCompression compression, const maybewchar *source_file_name,
+	ThreadPool *pool, std::vector<unsigned char> &out_data)
+{
+	bool has_alpha = image.Format == GL_RGBA || image.Format == GL_BGRA;
+	bool normal_map = compression == TEXTURE_COMPRESS_NORMAL_MAP;
+
+	std::vector<MipLevel> levels;
+	if (!GenerateMipChain(image, normal_map, normal_map ? 0.0f : TEXTURE_CACHE_ALPHA_TEST_REFERENCE, pool, levels))
+		return false;
+
+	TextureCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TEXTURE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = TEXTURE_CACHE_VERSION;
+	header.compression = compression;
+	header.width = unsigned(image.Width);
+	header.height = unsigned(image.Height);
+	header.level_count = unsigned(levels.size());
+	if (source_file_name)
+		GetFileStamp(NarrowFileName(source_file_name).c_str(), header.source_size, header.source_time);
+
+	TextureBlockFormat block_format = TEXTURE_BLOCKS_BC1;
+	switch (compression)
+	{
+	case TEXTURE_UNCOMPRESSED:
+		header.internal_format = has_alpha ? GL_RGBA : GL_RGB;
+		header.format = has_alpha ? GL_RGBA : GL_RGB;
+		header.type = GL_UNSIGNED_BYTE;
+		break;
+	case TEXTURE_COMPRESS_COLOR:
+		block_format = has_alpha ? TEXTURE_BLOCKS_BC3 : TEXTURE_BLOCKS_BC1;
+		header.internal_format = has_alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		break;
+	case TEXTURE_COMPRESS_NORMAL_MAP:
+		block_format = TEXTURE_BLOCKS_BC5;
+		header.internal_format = GL_COMPRESSED_RG_RGTC2;
+		break;
+	}
+
+	// Level table and the offsets of the levels
+	std::vector<TextureCacheLevel> table(levels.size());
+	size_t offset = AlignTo16(sizeof(TextureCacheHeader));
+	header.levels_offset = unsigned(offset);
+	offset = AlignTo16(offset + table.size() * sizeof(TextureCacheLevel));
+	size_t channels = has_alpha ? 4 : 3;
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		table[i].width = unsigned(levels[i].width);
+		table[i].height = unsigned(levels[i].height);
+		table[i].offset = unsigned(offset);
+		table[i].size = unsigned(compression == TEXTURE_UNCOMPRESSED
+			? size_t(levels[i].width) * levels[i].height * channels
+			: CompressedImageSize(block_format, levels[i].width, levels[i].height));
+		offset = AlignTo16(offset + table[i].size);
+	}
+
+	out_data.assign(offset, 0);
+	memcpy(&out_data[0], &header, sizeof(header));
+	memcpy(&out_data[header.levels_offset], table.data(), table.size() * sizeof(TextureCacheLevel));
+
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		unsigned char *target = &out_data[table[i].offset];
+		if (compression != TEXTURE_UNCOMPRESSED)
+		{
+			CompressImage(block_format, levels[i], pool, target);
+			continue;
+		}
+
+		// The levels are RGBA, images without alpha are stored as RGB
+		size_t pixel_count = size_t(levels[i].width) * levels[i].height;
+		for (size_t p = 0; p < pixel_count; p++)
+			for (size_t c = 0; c < channels; c++)
+				target[p * channels + c] = levels[i].pixels[p * 4 + c];
+	}
+	return true;
+}
+
+// Writes cache data to a file, prints an error and returns false on failure
+static bool WriteTextureCacheFile(const std::string &cache_name, const std::vector<unsigned char> &data)
+{
+	ofstream file(cache_name.c_str(), ios::binary | ios::trunc);
+	file.write(reinterpret_cast<const char *>(data.data()), data.size());
+	if (!file.good())
+	{
+		cout << "Cannot write texture cache " + cache_name + "\n";
+		return false;
+	}
+	return true;
+}
+
+bool ConvertTextureToCache(const maybewchar *image_file_name, TextureCompression compression, ThreadPool *pool)
+{
+	PV112::ImageData image;
+	if (!PV112::LoadImageData(image_file_name, image))
+		return false;
+
+	std::vector<unsigned char> data;
+	if (!BuildTextureCache(image, compression, image_file_name, pool, data))
+	{
+		cout << "Texture " + NarrowFileName(image_file_name) + " has unsupported format for the texture cache\n";
+		return false;
+	}
+
+	std::string cache_name = TextureCacheFileName(image_file_name);
+	if (!WriteTextureCacheFile(cache_name, data))
+		return false;
+	cout << "Wrote texture cache " << cache_name << " (" << data.size() << " bytes)" << endl;
+	return true;
+}
+
+//-----------------------------------------
+//----             LOADING             ----
+//-----------------------------------------
+
+// Returns the size of a level with the formats of the header, zero if the formats do not match its compression
+static size_t CacheLevelSize(const TextureCacheHeader *header, unsigned int width, unsigned int height)
+{
+	switch (header->compression)
+	{
+	case TEXTURE_UNCOMPRESSED:
+		if ((header->format != GL_RGB && header->format != GL_RGBA) || header->internal_format != header->format ||
+			header->type != GL_UNSIGNED_BYTE)
+			return 0;
+		return size_t(width) * height * (header->format == GL_RGBA ? 4 : 3);
+	case TEXTURE_COMPRESS_COLOR:
+		if (header->format != 0 || header->type != 0)
+			return 0;
+		if (header->internal_format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT)
+			return CompressedImageSize(TEXTURE_BLOCKS_BC1, int(width), int(height));
+		if (header->internal_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+			return CompressedImageSize(TEXTURE_BLOCKS_BC3, int(width), int(height));
+		return 0;
+	case TEXTURE_COMPRESS_NORMAL_MAP:
+		if (header->format != 0 || header->type != 0 || header->internal_format != GL_COMPRESSED_RG_RGTC2)
+			return 0;
+		return CompressedImageSize(TEXTURE_BLOCKS_BC5, int(width), int(height));
+	}
+	return 0;
+}
+
+const TextureCacheHeader *ValidateTextureCache(const unsigned char *data, size_t size, TextureCompression compression,
+	const maybewchar *source_file_name)
+{
+	if (!data || size < sizeof(TextureCacheHeader))
+		return nullptr;
+
+	const TextureCacheHeader *header = reinterpret_cast<const TextureCacheHeader *>(data);
+	if (memcmp(header->magic, TEXTURE_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != TEXTURE_CACHE_VERSION ||
+		header->compression != unsigned(compression))
+		return nullptr;
+
+	// No GL implementation supports larger textures, which also keeps the sizes below from overflowing
+	if (header->width == 0 || header->height == 0 || header->width > 65536 || header->height > 65536)
+		return nullptr;
+
+	// The level table and all levels must be inside the data
+	if (header->level_count == 0 || (header->levels_offset & 15) != 0 ||
+		size_t(header->levels_offset) + size_t(header->level_count) * sizeof(TextureCacheLevel) > size)
+		return nullptr;
+
+	// The levels are uploaded straight from the data, so each one must be the next level of the full mip chain and
+	// have the size its format needs
+	const TextureCacheLevel *levels = reinterpret_cast<const TextureCacheLevel *>(data + header->levels_offset);
+	unsigned int width = header->width;
+	unsigned int height = header->height;
+	for (unsigned int i = 0; i < header->level_count; i++)
+	{
+		size_t level_size = CacheLevelSize(header, width, height);
+		if (levels[i].width != width || levels[i].height != height || level_size == 0 || levels[i].size != level_size ||
+			(levels[i].offset & 15) != 0 || size_t(levels[i].offset) + levels[i].size > size)
+			return nullptr;
+
+		if (i + 1 < header->level_count)
+		{
+			if (width == 1 && height == 1)
+				return nullptr;
+			width = std::max(width / 2, 1U);
+			height = std::max(height / 2, 1U);
+		}
+	}
+	// The chain goes down to 1x1
+	if (width != 1 || height != 1)
+		return nullptr;
+
+	if (source_file_name)
+	{
+		unsigned long long source_size;
+		long long source_time;
+		if (GetFileStamp(NarrowFileName(source_file_name).c_str(), source_size, source_time) &&
+			(source_size != header->source_size || source_time != header->source_time))
+			return nullptr;
+	}
+	return header;
+}
+
+GLuint CreateCachedTexture(const TextureCacheHeader *header)
+{
+	const unsigned char *data = reinterpret_cast<const unsigned char *>(header);
+	const TextureCacheLevel *levels = TextureCacheLevels(header);
+
+	GLuint tex_obj;
+	glGenTextures(1, &tex_obj);
+	glBindTexture(GL_TEXTURE_2D, tex_obj);
+
+	// Rows of the RGB levels are not padded
+	GLint unpack_alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (unsigned int i = 0; i < header->level_count; i++)
+	{
+		const TextureCacheLevel &level = levels[i];
+		if (header->format == 0)
+			glCompressedTexImage2D(GL_TEXTURE_2D, GLint(i), header->internal_format, GLsizei(level.width), GLsizei(level.height),
+				0, GLsizei(level.size), data + level.offset);
+		else
+			glTexImage2D(GL_TEXTURE_2D, GLint(i), GLint(header->internal_format), GLsizei(level.width), GLsizei(level.height),
+				0, header->format, header->type, data + level.offset);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, GLint(header->level_count - 1));
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return tex_obj;
+}
+
+bool PrepareTextureCache(const maybewchar *image_file_name, TextureCompression compression, ThreadPool *pool, TextureCacheData &out_data)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	auto elapsed_ms = [&start] {
+		return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	};
+
+	// Use the cache file next to the image when it is up to date
+	std::string cache_name = TextureCacheFileName(image_file_name);
+	if (out_data.file.Open(cache_name.c_str()))
+	{
+		out_data.header = ValidateTextureCache(out_data.file.Data(), out_data.file.Size(), compression, image_file_name);
+		if (out_data.header)
+		{
+			ostringstream log;
+			log << "Texture " << NarrowFileName(image_file_name) << ": loaded from cache in " << elapsed_ms() << " ms" << endl;
+			cout << log.str();
+			return true;
+		}
+		out_data.file.Close();
+		cout << "Texture cache " + cache_name + " is out of date\n";
+	}
+
+	PV112::ImageData image;
+	if (!PV112::LoadImageData(image_file_name, image))
+		return false;		// The error message was already printed
+
+	if (!BuildTextureCache(image, compression, image_file_name, pool, out_data.built_data))
+	{
+		cout << "Texture " + NarrowFileName(image_file_name) + " has unsupported format for the texture cache\n";
+		return false;
+	}
+	WriteTextureCacheFile(cache_name, out_data.built_data);
+	out_data.header = ValidateTextureCache(out_data.built_data.data(), out_data.built_data.size(), compression, nullptr);
+
+	ostringstream log;
+	log << "Texture " << NarrowFileName(image_file_name) << ": decoded, filtered and compressed in " << elapsed_ms() << " ms" << endl;
+	cout << log.str();
+	return true;
+}
+
+TextureCompression SupportedColorCompression()
+{
+	return GLEW_EXT_texture_compression_s3tc ? TEXTURE_COMPRESS_COLOR : TEXTURE_UNCOMPRESSED;
+}
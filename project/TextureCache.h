@@ -0,0 +1,126 @@
+#pragma once
+#ifndef INCLUDED_TEXTURE_CACHE_H
+#define INCLUDED_TEXTURE_CACHE_H
+
+#include <string>
+#include <vector>
+#include "PV112.h"
+#include "MeshCache.h"
+#include "ThreadPool.h"
+
+/// Version of the texture cache format, cache files of other versions are rebuilt
+static const unsigned int TEXTURE_CACHE_VERSION = 1;
+
+/// Extension appended to the name of the image file to get the name of its cache file
+static const char TEXTURE_CACHE_EXTENSION[] = ".pvtex";
+
+/// Alpha test reference of the alpha tested textures (see tree_fragment.glsl), their mip levels keep the fraction
+/// of pixels passing the test
+static const float TEXTURE_CACHE_ALPHA_TEST_REFERENCE = 0.1f;
+
+/// How the levels of a cached texture are stored
+enum TextureCompression
+{
+	// 8-bit RGB or RGBA
+	TEXTURE_UNCOMPRESSED,
+	// BC1 for images without alpha, BC3 for images with alpha
+	TEXTURE_COMPRESS_COLOR,
+	// BC5 with the X and Z of the normal in red and green, the Y (blue) is reconstructed in the shader
+	TEXTURE_COMPRESS_NORMAL_MAP
+};
+
+//-----------------------------------------
+//----       TEXTURE CACHE FORMAT      ----
+//-----------------------------------------
+
+/// The file starts with this header, followed by the level table and the data of the levels at the offsets in
+/// the table. All offsets are aligned to 16 bytes.
+struct TextureCacheHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int compression;
+
+	// Arguments of glTexImage2D, 'format' and 'type' are zero when the levels are compressed and go to
+	// glCompressedTexImage2D
+	unsigned int internal_format;
+	unsigned int format;
+	unsigned int type;
+
+	unsigned int width;
+	unsigned int height;
+	unsigned int level_count;
+	unsigned int levels_offset;
+
+	// Size and modification time of the source file, the cache is rebuilt when they change
+	unsigned long long source_size;
+	long long source_time;
+};
+
+/// One entry of the level table
+struct TextureCacheLevel
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned int offset;
+	unsigned int size;
+};
+
+/// Returns the level table of a texture cache header
+inline const TextureCacheLevel *TextureCacheLevels(const TextureCacheHeader *header)
+{
+	return reinterpret_cast<const TextureCacheLevel *>(reinterpret_cast<const unsigned char *>(header) + header->levels_offset);
+}
+
+//-----------------------------------------
+//----      WRITING AND CONVERSION     ----
+//-----------------------------------------
+
+/// Returns the name of the cache file of the given image file
+std::string TextureCacheFileName(const maybewchar *image_file_name);
+
+/// Generates the mip chain of the image (see GenerateMipChain), compresses the levels and serializes them into
+/// the cache format. Normal maps are filtered as vectors. The work is split on 'pool' if it is not null.
+/// Returns false if the image format is not supported.
+bool BuildTextureCache(const PV112::ImageData &image, TextureCompression compression, const maybewchar *source_file_name,
+	ThreadPool *pool, std::vector<unsigned char> &out_data);
+
+/// Loads the image file and writes its cache file. This is the offline converter, LoadTexture does the same on
+/// the first run. Returns false on failure.
+bool ConvertTextureToCache(const maybewchar *image_file_name, TextureCompression compression, ThreadPool *pool);
+
+//-----------------------------------------
+//----             LOADING             ----
+//-----------------------------------------
+
+/// Checks the header of cache data in memory, returns nullptr if it is not a valid cache of the current version
+/// built with the given compression. If 'source_file_name' is not null, the cache must also match the current
+/// size and time of that file. The levels must form the full mip chain of the texture, each with the size its
+/// format needs.
+const TextureCacheHeader *ValidateTextureCache(const unsigned char *data, size_t size, TextureCompression compression,
+	const maybewchar *source_file_name);
+
+/// Creates a GL_TEXTURE_2D texture with all levels of the cache data, compressed levels are set by
+/// glCompressedTexImage2D straight from the data. GL_TEXTURE_MAX_LEVEL is set to the last level.
+GLuint CreateCachedTexture(const TextureCacheHeader *header);
+
+/// CPU side data of a texture ready for CreateCachedTexture, either mapped from the cache file or built in memory
+struct TextureCacheData
+{
+	TextureCacheData() : header(nullptr) {}
+
+	MappedFile file;
+	std::vector<unsigned char> built_data;
+	const TextureCacheHeader *header;
+};
+
+/// Maps the cache file of the given image if it is up to date and built with the same compression. Otherwise
+/// loads the image (see PV112::LoadImageData), builds the cache on 'pool', writes the cache file for the next run
+/// and keeps the built data in memory. Does not use OpenGL, so it can run on any thread. Returns false if the
+/// image cannot be loaded.
+bool PrepareTextureCache(const maybewchar *image_file_name, TextureCompression compression, ThreadPool *pool, TextureCacheData &out_data);
+
+/// Returns TEXTURE_COMPRESS_COLOR if the context supports S3TC (BC1 and BC3), TEXTURE_UNCOMPRESSED otherwise
+TextureCompression SupportedColorCompression();
+
+#endif	// INCLUDED_TEXTURE_CACHE_H
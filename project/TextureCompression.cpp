@@ -0,0 +1,599 @@
+#include "TextureCompression.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TEXTURE_COMPRESSION_SSE2 1
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+//-----------------------------------------
+//----            MIP CHAIN            ----
+//-----------------------------------------
+
+static float SRGBToLinear(float c)
+{
+	return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static float LinearToSRGB(float c)
+{
+	return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+static unsigned char ToByte(float value)
+{
+	return static_cast<unsigned char>(std::min(std::max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+// Mip level being filtered, 4 floats per texel: linear RGB and alpha, or the normal vector and alpha
+struct FloatLevel
+{
+	int width;
+	int height;
+	std::vector<float> texels;
+};
+
+// Source texels of one output texel along one axis. Even sizes use a 2 texel box, odd sizes 3 texels with the
+// weights of a box filter stretched over the whole level (polyphase box), so no source texel is skipped.
+struct MipTaps
+{
+	int index[3];
+	float weight[3];
+	int count;
+};
+
+static MipTaps ComputeTaps(int i, int source_size, int target_size)
+{
+	MipTaps taps;
+	if (source_size == 1)
+	{
+		taps.count = 1;
+		taps.index[0] = 0;
+		taps.weight[0] = 1.0f;
+	}
+	else if (source_size % 2 == 0)
+	{
+		taps.count = 2;
+		taps.index[0] = 2 * i;
+		taps.index[1] = 2 * i + 1;
+		taps.weight[0] = taps.weight[1] = 0.5f;
+	}
+	else
+	{
+		float n = float(target_size);
+		taps.count = 3;
+		taps.index[0] = 2 * i;
+		taps.index[1] = 2 * i + 1;
+		taps.index[2] = 2 * i + 2;
+		taps.weight[0] = (n - float(i)) / (2.0f * n + 1.0f);
+		taps.weight[1] = n / (2.0f * n + 1.0f);
+		taps.weight[2] = (float(i) + 1.0f) / (2.0f * n + 1.0f);
+	}
+	return taps;
+}
+
+static void DownsampleLevel(const FloatLevel &source, bool normal_map, ThreadPool *pool, FloatLevel &out)
+{
+	out.width = std::max(source.width / 2, 1);
+	out.height = std::max(source.height / 2, 1);
+	out.texels.resize(size_t(out.width) * out.height * 4);
+
+	ParallelFor(pool, size_t(out.height), [&](size_t begin, size_t end) {
+		for (int y = int(begin); y < int(end); y++)
+		{
+			MipTaps taps_y = ComputeTaps(y, source.height, out.height);
+			for (int x = 0; x < out.width; x++)
+			{
+				MipTaps taps_x = ComputeTaps(x, source.width, out.width);
+
+				// Colors are weighted by alpha, the plain average is used only if all texels are transparent
+				float weighted[3] = { 0.0f, 0.0f, 0.0f };
+				float plain[3] = { 0.0f, 0.0f, 0.0f };
+				float alpha = 0.0f;
+				for (int j = 0; j < taps_y.count; j++)
+				{
+					const float *row = &source.texels[size_t(taps_y.index[j]) * source.width * 4];
+					for (int i = 0; i < taps_x.count; i++)
+					{
+						const float *texel = row + size_t(taps_x.index[i]) * 4;
+						float weight = taps_x.weight[i] * taps_y.weight[j];
+						for (int c = 0; c < 3; c++)
+						{
+							weighted[c] += texel[c] * texel[3] * weight;
+							plain[c] += texel[c] * weight;
+						}
+						alpha += texel[3] * weight;
+					}
+				}
+
+				float *result = &out.texels[(size_t(y) * out.width + x) * 4];
+				for (int c = 0; c < 3; c++)
+					result[c] = (!normal_map && alpha > 1e-6f) ? weighted[c] / alpha : plain[c];
+				result[3] = alpha;
+
+				if (normal_map)
+				{
+					float length = sqrtf(result[0] * result[0] + result[1] * result[1] + result[2] * result[2]);
+					if (length > 1e-6f)
+						for (int c = 0; c < 3; c++)
+							result[c] /= length;
+				}
+			}
+		}
+	});
+}
+
+// Fraction of texels whose scaled alpha passes the alpha test
+static float AlphaCoverage(const FloatLevel &level, float reference, float scale)
+{
+	size_t passed = 0;
+	size_t count = size_t(level.width) * level.height;
+	for (size_t i = 0; i < count; i++)
+		if (level.texels[i * 4 + 3] * scale >= reference)
+			passed++;
+	return float(passed) / float(count);
+}
+
+// Finds the alpha scale of a level that keeps the given coverage, the coverage grows with the scale
+static float FindAlphaScale(const FloatLevel &level, float reference, float coverage)
+{
+	float low = 0.0f;
+	float high = 16.0f;
+	for (int i = 0; i < 16; i++)
+	{
+		float middle = (low + high) * 0.5f;
+		if (AlphaCoverage(level, reference, middle) < coverage)
+			low = middle;
+		else
+			high = middle;
+	}
+	return high;
+}
+
+static void EncodeLevel(const FloatLevel &level, bool normal_map, float alpha_scale, ThreadPool *pool, MipLevel &out)
+{
+	out.width = level.width;
+	out.height = level.height;
+	out.pixels.resize(size_t(level.width) * level.height * 4);
+
+	ParallelFor(pool, size_t(level.height), [&](size_t begin, size_t end) {
+		for (size_t i = begin * level.width; i < end * level.width; i++)
+		{
+			const float *texel = &level.texels[i * 4];
+			for (int c = 0; c < 3; c++)
+				out.pixels[i * 4 + c] = ToByte(normal_map ? texel[c] * 0.5f + 0.5f : LinearToSRGB(texel[c]));
+			out.pixels[i * 4 + 3] = ToByte(texel[3] * alpha_scale);
+		}
+	});
+}
+
+bool GenerateMipChain(const PV112::ImageData &image, bool normal_map, float alpha_test_reference, ThreadPool *pool, std::vector<MipLevel> &out_levels)
+{
+	if (image.Type != GL_UNSIGNED_BYTE || image.Width <= 0 || image.Height <= 0)
+		return false;
+
+	int channels;
+	bool swap_red_blue;
+	switch (image.Format)
+	{
+	case GL_RGB:  channels = 3; swap_red_blue = false; break;
+	case GL_RGBA: channels = 4; swap_red_blue = false; break;
+	case GL_BGR:  channels = 3; swap_red_blue = true;  break;
+	case GL_BGRA: channels = 4; swap_red_blue = true;  break;
+	default: return false;
+	}
+	size_t texel_count = size_t(image.Width) * image.Height;
+	if (image.Pixels.size() < texel_count * channels)
+		return false;
+
+	// Level 0 is the image itself in RGBA
+	out_levels.assign(1, MipLevel());
+	MipLevel &base = out_levels[0];
+	base.width = image.Width;
+	base.height = image.Height;
+	base.pixels.resize(texel_count * 4);
+	for (size_t i = 0; i < texel_count; i++)
+	{
+		const unsigned char *source = &image.Pixels[i * channels];
+		unsigned char *target = &base.pixels[i * 4];
+		target[0] = source[swap_red_blue ? 2 : 0];
+		target[1] = source[1];
+		target[2] = source[swap_red_blue ? 0 : 2];
+		target[3] = channels == 4 ? source[3] : 255;
+	}
+
+	float to_float[256];
+	for (int i = 0; i < 256; i++)
+		to_float[i] = normal_map ? float(i) / 127.5f - 1.0f : SRGBToLinear(float(i) / 255.0f);
+
+	FloatLevel level;
+	level.width = base.width;
+	level.height = base.height;
+	level.texels.resize(texel_count * 4);
+	for (size_t i = 0; i < texel_count * 4; i++)
+		level.texels[i] = (i % 4 == 3) ? float(base.pixels[i]) / 255.0f : to_float[base.pixels[i]];
+
+	bool preserve_coverage = channels == 4 && alpha_test_reference > 0.0f;
+	float coverage = preserve_coverage ? AlphaCoverage(level, alpha_test_reference, 1.0f) : 0.0f;
+
+	// Each level is filtered from the previous one before its alpha is scaled
+	while (level.width > 1 || level.height > 1)
+	{
+		FloatLevel next;
+		DownsampleLevel(level, normal_map, pool, next);
+
+		float alpha_scale = preserve_coverage ? FindAlphaScale(next, alpha_test_reference, coverage) : 1.0f;
+		out_levels.push_back(MipLevel());
+		EncodeLevel(next, normal_map, alpha_scale, pool, out_levels.back());
+
+		level.width = next.width;
+		level.height = next.height;
+		level.texels.swap(next.texels);
+	}
+	return true;
+}
+
+//-----------------------------------------
+//----        BLOCK COMPRESSION        ----
+//-----------------------------------------
+
+// Pixels of a 4x4 block, one array per channel, so that four pixels can be processed at once
+struct BlockPixels
+{
+	float channel[4][16];
+};
+
+static void FetchBlock(const MipLevel &level, int block_x, int block_y, BlockPixels &out)
+{
+	for (int y = 0; y < 4; y++)
+	{
+		int source_y = std::min(block_y * 4 + y, level.height - 1);
+		for (int x = 0; x < 4; x++)
+		{
+			int source_x = std::min(block_x * 4 + x, level.width - 1);
+			const unsigned char *pixel = &level.pixels[(size_t(source_y) * level.width + source_x) * 4];
+			for (int c = 0; c < 4; c++)
+				out.channel[c][y * 4 + x] = float(pixel[c]);
+		}
+	}
+}
+
+// Finds the nearest of the 4 palette colors for each pixel, returns the sum of squared errors
+static float SelectColorIndices(const BlockPixels &block, const float palette[4][3], unsigned char out_indices[16])
+{
+	float total_error = 0.0f;
+#if defined(TEXTURE_COMPRESSION_SSE2)
+	for (int i = 0; i < 16; i += 4)
+	{
+		__m128 r = _mm_loadu_ps(&block.channel[0][i]);
+		__m128 g = _mm_loadu_ps(&block.channel[1][i]);
+		__m128 b = _mm_loadu_ps(&block.channel[2][i]);
+		__m128 best_error = _mm_set1_ps(FLT_MAX);
+		__m128i best_index = _mm_setzero_si128();
+		for (int p = 0; p < 4; p++)
+		{
+			__m128 dr = _mm_sub_ps(r, _mm_set1_ps(palette[p][0]));
+			__m128 dg = _mm_sub_ps(g, _mm_set1_ps(palette[p][1]));
+			__m128 db = _mm_sub_ps(b, _mm_set1_ps(palette[p][2]));
+			__m128 error = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+			__m128i closer = _mm_castps_si128(_mm_cmplt_ps(error, best_error));
+			best_error = _mm_min_ps(error, best_error);
+			best_index = _mm_or_si128(_mm_andnot_si128(closer, best_index), _mm_and_si128(closer, _mm_set1_epi32(p)));
+		}
+
+		int indices[4];
+		float errors[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(indices), best_index);
+		_mm_storeu_ps(errors, best_error);
+		for (int j = 0; j < 4; j++)
+		{
+			out_indices[i + j] = static_cast<unsigned char>(indices[j]);
+			total_error += errors[j];
+		}
+	}
+#else
+	for (int i = 0; i < 16; i++)
+	{
+		float best_error = FLT_MAX;
+		for (int p = 0; p < 4; p++)
+		{
+			float dr = block.channel[0][i] - palette[p][0];
+			float dg = block.channel[1][i] - palette[p][1];
+			float db = block.channel[2][i] - palette[p][2];
+			float error = dr * dr + dg * dg + db * db;
+			if (error < best_error)
+			{
+				best_error = error;
+				out_indices[i] = static_cast<unsigned char>(p);
+			}
+		}
+		total_error += best_error;
+	}
+#endif
+	return total_error;
+}
+
+// Finds the nearest of the 8 palette values for each pixel
+static void SelectValueIndices(const float values[16], const float palette[8], unsigned char out_indices[16])
+{
+#if defined(TEXTURE_COMPRESSION_SSE2)
+	for (int i = 0; i < 16; i += 4)
+	{
+		__m128 v = _mm_loadu_ps(&values[i]);
+		__m128 best_error = _mm_set1_ps(FLT_MAX);
+		__m128i best_index = _mm_setzero_si128();
+		for (int p = 0; p < 8; p++)
+		{
+			__m128 d = _mm_sub_ps(v, _mm_set1_ps(palette[p]));
+			__m128 error = _mm_mul_ps(d, d);
+			__m128i closer = _mm_castps_si128(_mm_cmplt_ps(error, best_error));
+			best_error = _mm_min_ps(error, best_error);
+			best_index = _mm_or_si128(_mm_andnot_si128(closer, best_index), _mm_and_si128(closer, _mm_set1_epi32(p)));
+		}
+
+		int indices[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(indices), best_index);
+		for (int j = 0; j < 4; j++)
+			out_indices[i + j] = static_cast<unsigned char>(indices[j]);
+	}
+#else
+	for (int i = 0; i < 16; i++)
+	{
+		float best_error = FLT_MAX;
+		for (int p = 0; p < 8; p++)
+		{
+			float error = (values[i] - palette[p]) * (values[i] - palette[p]);
+			if (error < best_error)
+			{
+				best_error = error;
+				out_indices[i] = static_cast<unsigned char>(p);
+			}
+		}
+	}
+#endif
+}
+
+static unsigned short PackRGB565(const float color[3])
+{
+	int r = int(std::min(std::max(color[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+	int g = int(std::min(std::max(color[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+	int b = int(std::min(std::max(color[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+	return static_cast<unsigned short>((r << 11) | (g << 5) | b);
+}
+
+static void UnpackRGB565(unsigned short packed, float out[3])
+{
+	int r = (packed >> 11) & 31;
+	int g = (packed >> 5) & 63;
+	int b = packed & 31;
+	out[0] = float((r << 3) | (r >> 2));
+	out[1] = float((g << 2) | (g >> 4));
+	out[2] = float((b << 3) | (b >> 2));
+}
+
+// Quantizes the endpoints and selects the indices. The endpoints are ordered so that the block is decoded in the
+// 4 color mode (color 0 greater than color 1), equal endpoints give index 0 for all pixels.
+static float EvaluateColorEndpoints(const BlockPixels &block, const float endpoint0[3], const float endpoint1[3],
+	unsigned short &out_color0, unsigned short &out_color1, unsigned char out_indices[16])
+{
+	out_color0 = PackRGB565(endpoint0);
+	out_color1 = PackRGB565(endpoint1);
+	if (out_color0 < out_color1)
+		std::swap(out_color0, out_color1);
+
+	float palette[4][3];
+	UnpackRGB565(out_color0, palette[0]);
+	UnpackRGB565(out_color1, palette[1]);
+	for (int c = 0; c < 3; c++)
+	{
+		palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+		palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+	}
+	return SelectColorIndices(block, palette, out_indices);
+}
+
+// Encodes the RGB channels as a BC1 color block. The endpoints start at the extremes of the pixels projected on
+// the principal axis of the colors and are refined by least squares fitting to the selected indices.
+static void EncodeColorBlock(const BlockPixels &block, unsigned char out[8])
+{
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	float minimum[3] = { 255.0f, 255.0f, 255.0f };
+	float maximum[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 3; c++)
+		{
+			mean[c] += block.channel[c][i] / 16.0f;
+			minimum[c] = std::min(minimum[c], block.channel[c][i]);
+			maximum[c] = std::max(maximum[c], block.channel[c][i]);
+		}
+
+	float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++)
+	{
+		float r = block.channel[0][i] - mean[0];
+		float g = block.channel[1][i] - mean[1];
+		float b = block.channel[2][i] - mean[2];
+		covariance[0] += r * r;
+		covariance[1] += r * g;
+		covariance[2] += r * b;
+		covariance[3] += g * g;
+		covariance[4] += g * b;
+		covariance[5] += b * b;
+	}
+
+	// Principal axis by power iteration, starting from the diagonal of the bounding box
+	float axis[3] = { maximum[0] - minimum[0], maximum[1] - minimum[1], maximum[2] - minimum[2] };
+	for (int iteration = 0; iteration < 4; iteration++)
+	{
+		float next[3] = {
+			covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+			covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+			covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+		};
+		float scale = std::max(std::max(fabsf(next[0]), fabsf(next[1])), fabsf(next[2]));
+		if (scale < 1e-6f)
+			break;
+		for (int c = 0; c < 3; c++)
+			axis[c] = next[c] / scale;
+	}
+	float axis_length = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+
+	float endpoint0[3] = { mean[0], mean[1], mean[2] };
+	float endpoint1[3] = { mean[0], mean[1], mean[2] };
+	if (axis_length > 1e-6f)
+	{
+		for (int c = 0; c < 3; c++)
+			axis[c] /= axis_length;
+		float lowest = FLT_MAX;
+		float highest = -FLT_MAX;
+		for (int i = 0; i < 16; i++)
+		{
+			float t = (block.channel[0][i] - mean[0]) * axis[0] + (block.channel[1][i] - mean[1]) * axis[1] + (block.channel[2][i] - mean[2]) * axis[2];
+			lowest = std::min(lowest, t);
+			highest = std::max(highest, t);
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			endpoint0[c] = mean[c] + axis[c] * highest;
+			endpoint1[c] = mean[c] + axis[c] * lowest;
+		}
+	}
+
+	unsigned short color0, color1;
+	unsigned char indices[16];
+	float error = EvaluateColorEndpoints(block, endpoint0, endpoint1, color0, color1, indices);
+
+	// Weights of color 0 for the indices, color 1 has the rest
+	static const float index_weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+	for (int iteration = 0; iteration < 2 && error > 0.0f; iteration++)
+	{
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+		float ax[3] = { 0.0f, 0.0f, 0.0f };
+		float bx[3] = { 0.0f, 0.0f, 0.0f };
+		for (int i = 0; i < 16; i++)
+		{
+			float a = index_weights[indices[i]];
+			float b = 1.0f - a;
+			aa += a * a;
+			ab += a * b;
+			bb += b * b;
+			for (int c = 0; c < 3; c++)
+			{
+				ax[c] += a * block.channel[c][i];
+				bx[c] += b * block.channel[c][i];
+			}
+		}
+		float determinant = aa * bb - ab * ab;
+		if (fabsf(determinant) < 1e-6f)
+			break;
+
+		for (int c = 0; c < 3; c++)
+		{
+			endpoint0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+			endpoint1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+		}
+
+		unsigned short refined_color0, refined_color1;
+		unsigned char refined_indices[16];
+		float refined_error = EvaluateColorEndpoints(block, endpoint0, endpoint1, refined_color0, refined_color1, refined_indices);
+		if (refined_error >= error)
+			break;
+		error = refined_error;
+		color0 = refined_color0;
+		color1 = refined_color1;
+		std::copy(refined_indices, refined_indices + 16, indices);
+	}
+
+	unsigned int index_bits = 0;
+	for (int i = 0; i < 16; i++)
+		index_bits |= unsigned(indices[i]) << (2 * i);
+
+	out[0] = static_cast<unsigned char>(color0 & 0xFF);
+	out[1] = static_cast<unsigned char>(color0 >> 8);
+	out[2] = static_cast<unsigned char>(color1 & 0xFF);
+	out[3] = static_cast<unsigned char>(color1 >> 8);
+	for (int i = 0; i < 4; i++)
+		out[4 + i] = static_cast<unsigned char>(index_bits >> (8 * i));
+}
+
+// Encodes one channel as a BC3 alpha / BC4 block with 8 values between the minimum and the maximum
+static void EncodeValueBlock(const float values[16], unsigned char out[8])
+{
+	float minimum = 255.0f;
+	float maximum = 0.0f;
+	for (int i = 0; i < 16; i++)
+	{
+		minimum = std::min(minimum, values[i]);
+		maximum = std::max(maximum, values[i]);
+	}
+
+	int value0 = int(maximum + 0.5f);
+	int value1 = int(minimum + 0.5f);
+	unsigned char indices[16] = { 0 };
+	if (value0 != value1)
+	{
+		float palette[8];
+		palette[0] = float(value0);
+		palette[1] = float(value1);
+		for (int i = 1; i < 7; i++)
+			palette[i + 1] = (float(7 - i) * value0 + float(i) * value1) / 7.0f;
+		SelectValueIndices(values, palette, indices);
+	}
+
+	unsigned long long index_bits = 0;
+	for (int i = 0; i < 16; i++)
+		index_bits |= static_cast<unsigned long long>(indices[i]) << (3 * i);
+
+	out[0] = static_cast<unsigned char>(value0);
+	out[1] = static_cast<unsigned char>(value1);
+	for (int i = 0; i < 6; i++)
+		out[2 + i] = static_cast<unsigned char>(index_bits >> (8 * i));
+}
+
+static size_t BlockSize(TextureBlockFormat format)
+{
+	return format == TEXTURE_BLOCKS_BC1 ? 8 : 16;
+}
+
+size_t CompressedImageSize(TextureBlockFormat format, int width, int height)
+{
+	return size_t((width + 3) / 4) * size_t((height + 3) / 4) * BlockSize(format);
+}
+
+void CompressImage(TextureBlockFormat format, const MipLevel &level, ThreadPool *pool, unsigned char *out)
+{
+	int blocks_x = (level.width + 3) / 4;
+	int blocks_y = (level.height + 3) / 4;
+	size_t block_size = BlockSize(format);
+
+	ParallelFor(pool, size_t(blocks_y), [&](size_t begin, size_t end) {
+		BlockPixels block;
+		for (int y = int(begin); y < int(end); y++)
+		{
+			for (int x = 0; x < blocks_x; x++)
+			{
+				FetchBlock(level, x, y, block);
+				unsigned char *target = out + (size_t(y) * blocks_x + x) * block_size;
+				switch (format)
+				{
+				case TEXTURE_BLOCKS_BC1:
+					EncodeColorBlock(block, target);
+					break;
+				case TEXTURE_BLOCKS_BC3:
+					EncodeValueBlock(block.channel[3], target);
+					EncodeColorBlock(block, target + 8);
+					break;
+				case TEXTURE_BLOCKS_BC5:
+					EncodeValueBlock(block.channel[0], target);
+					EncodeValueBlock(block.channel[1], target + 8);
+					break;
+				}
+			}
+		}
+	});
+}
@@ -0,0 +1,53 @@
+#pragma once
+#ifndef INCLUDED_TEXTURE_COMPRESSION_H
+#define INCLUDED_TEXTURE_COMPRESSION_H
+
+#include <vector>
+#include "PV112.h"
+#include "ThreadPool.h"
+
+/// Block compressed encodings, all of them store 4x4 pixel blocks
+enum TextureBlockFormat
+{
+	// RGB with 4 colors per block interpolated between two RGB565 endpoints, 8 bytes per block
+	TEXTURE_BLOCKS_BC1,
+	// BC1 colors with a separate alpha block of 8 interpolated values, 16 bytes per block
+	TEXTURE_BLOCKS_BC3,
+	// Red and green channels, each one encoded as the alpha block of BC3, 16 bytes per block
+	TEXTURE_BLOCKS_BC5
+};
+
+/// One level of a mip chain, 8-bit RGBA pixels with rows from the bottom to the top
+struct MipLevel
+{
+	int width;
+	int height;
+	std::vector<unsigned char> pixels;
+};
+
+//-----------------------------------------
+//----            MIP CHAIN            ----
+//-----------------------------------------
+
+/// Generates all mip levels of an 8-bit RGB, RGBA, BGR or BGRA image down to 1x1, level 0 is the image itself
+/// converted to RGBA. Color images are filtered in linear space (the pixels are assumed to be sRGB) with colors
+/// weighted by alpha, so transparent pixels do not bleed into the edges. Normal maps (XYZ stored as RGB * 2 - 1)
+/// are averaged as vectors and renormalized. If 'alpha_test_reference' is not zero, the alpha of each level is
+/// scaled so that the same fraction of pixels passes the alpha test as in level 0, otherwise alpha tested
+/// textures fade out in the distance. The rows of each level are filtered on 'pool' (null for the calling
+/// thread only). Returns false if the image is not in one of the supported formats.
+bool GenerateMipChain(const PV112::ImageData &image, bool normal_map, float alpha_test_reference, ThreadPool *pool, std::vector<MipLevel> &out_levels);
+
+//-----------------------------------------
+//----        BLOCK COMPRESSION        ----
+//-----------------------------------------
+
+/// Returns the size of a compressed image in bytes
+size_t CompressedImageSize(TextureBlockFormat format, int width, int height);
+
+/// Compresses the level into 'out', which must have CompressedImageSize bytes. Blocks on the right and top edge
+/// of images that are not a multiple of 4 repeat the last column and row. The block rows are encoded on 'pool'.
+/// With SSE2 the nearest palette entries of four pixels are selected at once.
+void CompressImage(TextureBlockFormat format, const MipLevel &level, ThreadPool *pool, unsigned char *out);
+
+#endif	// INCLUDED_TEXTURE_COMPRESSION_H
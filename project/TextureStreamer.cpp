@@ -0,0 +1,338 @@
+#include "TextureStreamer.h"
+#include "PerfCounters.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+using namespace std;
+
+TextureStreamer::TextureStreamer(unsigned int slot_count, size_t slot_size, unsigned int thread_count)
+	: slot_size(slot_size), pool(thread_count)
+{
+	memset(&last_stats, 0, sizeof(last_stats));
+
+	slots.resize(std::max(slot_count, 1u));
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		glGenBuffers(1, &slots[i].buffer);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slots[i].buffer);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, slot_size, nullptr, GL_STREAM_DRAW);
+		slots[i].state = SLOT_FREE;
+		slots[i].fence = nullptr;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+TextureStreamer::~TextureStreamer()
+{
+	// No worker may write into a mapped slot after it is deleted
+	pool.WaitIdle();
+
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		if (slots[i].state == SLOT_FILLING)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slots[i].buffer);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		if (slots[i].fence)
+			glDeleteSync(slots[i].fence);
+		glDeleteBuffers(1, &slots[i].buffer);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+GLuint TextureStreamer::StreamTexture(const maybewchar *file_name, TextureCompression compression)
+{
+	return Stream(GL_TEXTURE_2D, std::vector<std::basic_string<maybewchar>>(1, file_name), compression);
+}
+
+GLuint TextureStreamer::StreamTextureArray(const std::vector<std::basic_string<maybewchar>> &file_names, TextureCompression compression)
+{
+	return Stream(GL_TEXTURE_2D_ARRAY, file_names, compression);
+}
+
+GLuint TextureStreamer::Stream(GLenum target, const std::vector<std::basic_string<maybewchar>> &file_names, TextureCompression compression)
+{
+	std::shared_ptr<StreamedTexture> texture = std::make_shared<StreamedTexture>();
+	glGenTextures(1, &texture->texture);
+	texture->target = target;
+	texture->file_names = file_names;
+	texture->compression = compression == TEXTURE_COMPRESS_COLOR ? SupportedColorCompression() : compression;
+	texture->prepared = false;
+	texture->failed = false;
+	texture->started = false;
+	texture->base_level = 0;
+	textures.push_back(texture);
+
+	ThreadPool *build_pool = &pool;
+	pool.Submit([this, texture, build_pool](unsigned) {
+		bool success = PrepareTextureArray(texture->file_names, texture->compression, build_pool, texture->data);
+
+		lock_guard<std::mutex> lock(state_mutex);
+		texture->prepared = success;
+		texture->failed = !success;
+	});
+	return texture->texture;
+}
+
+void TextureStreamer::StartTexture(const std::shared_ptr<StreamedTexture> &texture)
+{
+	const TextureCacheHeader *header = texture->data.header;
+	const TextureCacheLevel *levels = TextureCacheLevels(header);
+	GLenum target = texture->target;
+	GLsizei layer_count = GLsizei(texture->data.layers.size());
+	bool compressed = header->format == 0;
+
+	// Allocate all levels without data, the texture stays incomplete until the smallest level is resident
+	glBindTexture(target, texture->texture);
+	for (unsigned int i = 0; i < header->level_count; i++)
+	{
+		GLsizei width = GLsizei(levels[i].width);
+		GLsizei height = GLsizei(levels[i].height);
+		if (target == GL_TEXTURE_2D_ARRAY && compressed)
+			glCompressedTexImage3D(target, GLint(i), header->internal_format, width, height, layer_count, 0, GLsizei(levels[i].size) * layer_count, nullptr);
+		else if (target == GL_TEXTURE_2D_ARRAY)
+			glTexImage3D(target, GLint(i), GLint(header->internal_format), width, height, layer_count, 0, header->format, header->type, nullptr);
+		else if (compressed)
+			glCompressedTexImage2D(target, GLint(i), header->internal_format, width, height, 0, GLsizei(levels[i].size), nullptr);
+		else
+			glTexImage2D(target, GLint(i), GLint(header->internal_format), width, height, 0, header->format, header->type, nullptr);
+	}
+	texture->base_level = header->level_count;
+	glTexParameteri(target, GL_TEXTURE_BASE_LEVEL, GLint(texture->base_level));
+	glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, GLint(header->level_count - 1));
+	glBindTexture(target, 0);
+
+	// Split the levels of each layer into bands of whole rows (rows of blocks when compressed) that fit into a slot
+	texture->remaining_bands.assign(header->level_count, 0);
+	for (unsigned int i = header->level_count; i-- > 0;)
+	{
+		unsigned int row_height = compressed ? 4 : 1;
+		size_t row_count = (levels[i].height + row_height - 1) / row_height;
+		size_t row_size = levels[i].size / row_count;
+		size_t rows_per_band = std::max<size_t>(slot_size / row_size, 1);
+
+		for (unsigned int layer = 0; layer < unsigned(layer_count); layer++)
+		{
+			for (size_t row = 0; row < row_count; row += rows_per_band)
+			{
+				size_t band_rows = std::min(rows_per_band, row_count - row);
+				UploadBand band;
+				band.texture = texture;
+				band.layer = layer;
+				band.level = i;
+				band.y = unsigned(row * row_height);
+				band.height = std::min(unsigned(band_rows * row_height), levels[i].height - band.y);
+				band.offset = levels[i].offset + row * row_size;
+				band.size = band_rows * row_size;
+				waiting_bands.push_back(band);
+				texture->remaining_bands[i]++;
+			}
+		}
+	}
+	texture->started = true;
+}
+
+void TextureStreamer::SetBandData(const UploadBand &band, const void *pixels)
+{
+	const StreamedTexture &texture = *band.texture;
+	const TextureCacheHeader *header = texture.data.header;
+	const TextureCacheLevel &level = TextureCacheLevels(header)[band.level];
+	GLenum target = texture.target;
+
+	glBindTexture(target, texture.texture);
+	GLint unpack_alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (target == GL_TEXTURE_2D_ARRAY && header->format == 0)
+		glCompressedTexSubImage3D(target, GLint(band.level), 0, GLint(band.y), GLint(band.layer), GLsizei(level.width), GLsizei(band.height), 1,
+			header->internal_format, GLsizei(band.size), pixels);
+	else if (target == GL_TEXTURE_2D_ARRAY)
+		glTexSubImage3D(target, GLint(band.level), 0, GLint(band.y), GLint(band.layer), GLsizei(level.width), GLsizei(band.height), 1,
+			header->format, header->type, pixels);
+	else if (header->format == 0)
+		glCompressedTexSubImage2D(target, GLint(band.level), 0, GLint(band.y), GLsizei(level.width), GLsizei(band.height),
+			header->internal_format, GLsizei(band.size), pixels);
+	else
+		glTexSubImage2D(target, GLint(band.level), 0, GLint(band.y), GLsizei(level.width), GLsizei(band.height),
+			header->format, header->type, pixels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+	glBindTexture(target, 0);
+	Counted::TextureUpload("texture band", band.size);
+}
+
+void TextureStreamer::FinishBand(const UploadBand &band)
+{
+	StreamedTexture &texture = *band.texture;
+	texture.remaining_bands[band.level]--;
+
+	unsigned int base_level = texture.base_level;
+	while (base_level > 0 && texture.remaining_bands[base_level - 1] == 0)
+		base_level--;
+	if (base_level != texture.base_level)
+	{
+		texture.base_level = base_level;
+		glBindTexture(texture.target, texture.texture);
+		glTexParameteri(texture.target, GL_TEXTURE_BASE_LEVEL, GLint(base_level));
+		glBindTexture(texture.target, 0);
+	}
+}
+
+void TextureStreamer::Update(size_t byte_budget)
+{
+	TextureStreamStats stats;
+	memset(&stats, 0, sizeof(stats));
+
+	// Textures whose cache was prepared since the last update
+	std::vector<std::shared_ptr<StreamedTexture>> ready;
+	{
+		lock_guard<std::mutex> lock(state_mutex);
+		for (size_t i = 0; i < textures.size(); i++)
+			if (textures[i]->prepared && !textures[i]->started)
+				ready.push_back(textures[i]);
+	}
+	for (size_t i = 0; i < ready.size(); i++)
+		StartTexture(ready[i]);
+
+	// Recycle slots whose uploads the GPU has finished
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		Slot &slot = slots[i];
+		if (slot.state != SLOT_IN_FLIGHT)
+			continue;
+		GLenum status = glClientWaitSync(slot.fence, 0, 0);
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+		{
+			glDeleteSync(slot.fence);
+			slot.fence = nullptr;
+			slot.band.texture.reset();
+			slot.state = SLOT_FREE;
+		}
+	}
+
+	// Map the free slots and let the workers copy the waiting bands into them. The fence of the slot is signaled,
+	// so the mapping does not need to synchronize with the GPU.
+	size_t free_slot = 0;
+	while (!waiting_bands.empty())
+	{
+		UploadBand band = waiting_bands.front();
+		const unsigned char *source = reinterpret_cast<const unsigned char *>(band.texture->data.layers[band.layer]->header) + band.offset;
+		if (band.size > slot_size)
+		{
+			// A single row does not fit, it goes straight from the cache data
+			waiting_bands.pop_front();
+			SetBandData(band, source);
+			FinishBand(band);
+			stats.bytes_uploaded += band.size;
+			stats.uploads++;
+			continue;
+		}
+
+		while (free_slot < slots.size() && slots[free_slot].state != SLOT_FREE)
+			free_slot++;
+		if (free_slot == slots.size())
+			break;
+
+		Slot &slot = slots[free_slot];
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+		void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, band.size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if (!mapped)
+			break;
+
+		waiting_bands.pop_front();
+		slot.band = band;
+		slot.state = SLOT_FILLING;
+		size_t index = free_slot;
+		size_t size = band.size;
+		std::shared_ptr<StreamedTexture> texture = band.texture;
+		pool.Submit([this, index, mapped, source, size, texture](unsigned) {
+			memcpy(mapped, source, size);
+
+			lock_guard<std::mutex> lock(state_mutex);
+			filled_slots.push_back(index);
+		});
+	}
+
+	// Upload the filled slots within the budget
+	for (;;)
+	{
+		size_t index;
+		{
+			lock_guard<std::mutex> lock(state_mutex);
+			if (filled_slots.empty())
+				break;
+			index = filled_slots.front();
+			if (stats.bytes_uploaded > 0 && stats.bytes_uploaded + slots[index].band.size > byte_budget)
+			{
+				stats.deferred_uploads = unsigned(filled_slots.size());
+				break;
+			}
+			filled_slots.pop_front();
+		}
+
+		Slot &slot = slots[index];
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+		if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_FALSE)
+		{
+			// The contents were lost (e.g. a display mode change), copy the band again
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			waiting_bands.push_front(slot.band);
+			slot.band.texture.reset();
+			slot.state = SLOT_FREE;
+			continue;
+		}
+		SetBandData(slot.band, nullptr);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.state = SLOT_IN_FLIGHT;
+		FinishBand(slot.band);
+		stats.bytes_uploaded += slot.band.size;
+		stats.uploads++;
+	}
+
+	// Forget fully resident and failed textures
+	{
+		lock_guard<std::mutex> lock(state_mutex);
+		std::vector<std::shared_ptr<StreamedTexture>> streaming;
+		for (size_t i = 0; i < textures.size(); i++)
+			if (!textures[i]->failed && !(textures[i]->started && textures[i]->base_level == 0))
+				streaming.push_back(textures[i]);
+		textures.swap(streaming);
+	}
+
+	for (size_t i = 0; i < slots.size(); i++)
+		if (slots[i].state != SLOT_FREE)
+			stats.busy_slots++;
+	stats.streaming_textures = unsigned(textures.size());
+	last_stats = stats;
+}
+
+void TextureStreamer::WaitUntilUsable()
+{
+	for (;;)
+	{
+		Update(std::numeric_limits<size_t>::max());
+
+		bool usable = true;
+		for (size_t i = 0; i < textures.size(); i++)
+			if (!textures[i]->started || textures[i]->base_level == textures[i]->data.header->level_count)
+				usable = false;
+		if (usable)
+			return;
+
+		// The workers are preparing caches or copying bands
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+bool TextureStreamer::IsIdle() const
+{
+	return textures.empty();
+}
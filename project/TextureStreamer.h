@@ -0,0 +1,161 @@
+#pragma once
+#ifndef INCLUDED_TEXTURE_STREAMER_H
+#define INCLUDED_TEXTURE_STREAMER_H
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "PV112.h"
+#include "TextureArray.h"
+#include "TextureCache.h"
+#include "ThreadPool.h"
+
+/// Default number of pixel buffer slots of the upload ring
+static const unsigned int TEXTURE_STREAM_SLOT_COUNT = 8;
+
+/// Default size of one slot, levels larger than this are uploaded in bands of rows
+static const size_t TEXTURE_STREAM_SLOT_SIZE = 1 << 20;
+
+/// Default number of bytes uploaded to textures per frame
+static const size_t TEXTURE_STREAM_FRAME_BUDGET = 4 << 20;
+
+/// Counters of one TextureStreamer::Update call
+struct TextureStreamStats
+{
+	size_t bytes_uploaded;
+	unsigned int uploads;
+	// Filled slots left for the next frames because of the budget
+	unsigned int deferred_uploads;
+	// Slots being filled, filled or waiting for their fence
+	unsigned int busy_slots;
+	unsigned int streaming_textures;
+};
+
+/// Streams textures and texture arrays from their texture cache (see PrepareTextureCache) through a ring of pixel
+/// buffer objects.
+///
+/// The cache files are prepared on worker threads, which also copy the levels into mapped pixel buffer slots.
+/// Update, called once per frame on the GL thread, unmaps the filled slots and sets them to the textures by
+/// glTexSubImage2D (or glCompressedTexSubImage2D) from the buffer, at most the given number of bytes per frame.
+/// A fence after each upload tells when the slot can be mapped again, so the driver never has to wait for the GPU.
+///
+/// The levels are streamed from the smallest one. GL_TEXTURE_BASE_LEVEL of each texture is the largest level
+/// whose smaller levels are all resident, so the texture can be used right away and gets sharper as the frames go.
+/// Until the smallest level arrives the texture is incomplete.
+///
+/// All methods must be called on the GL thread.
+class TextureStreamer
+{
+public:
+	/// Creates the pixel buffers, requires a current OpenGL context
+	explicit TextureStreamer(unsigned int slot_count = TEXTURE_STREAM_SLOT_COUNT, size_t slot_size = TEXTURE_STREAM_SLOT_SIZE,
+		unsigned int thread_count = ThreadPool::DefaultThreadCount());
+
+	/// Waits for the workers and deletes the pixel buffers and fences, the textures are kept
+	~TextureStreamer();
+
+	/// Creates a GL_TEXTURE_2D texture object and starts streaming the image into it. The object is returned right
+	/// away, so its parameters can be set, the levels are allocated when the cache is prepared.
+	/// TEXTURE_COMPRESS_COLOR falls back to uncompressed levels when the context does not support S3TC.
+	GLuint StreamTexture(const maybewchar *file_name, TextureCompression compression = TEXTURE_COMPRESS_COLOR);
+
+	/// Creates a GL_TEXTURE_2D_ARRAY texture object with a layer for each file and starts streaming the layers
+	/// into it like StreamTexture. The layers are prepared by PrepareTextureArray.
+	GLuint StreamTextureArray(const std::vector<std::basic_string<maybewchar>> &file_names, TextureCompression compression = TEXTURE_COMPRESS_COLOR);
+
+	/// Allocates the textures whose cache is prepared, recycles slots whose fences are signaled, hands free slots
+	/// to the workers and uploads filled slots until 'byte_budget' is reached. At least one slot is uploaded if any
+	/// is filled, so levels larger than the budget make progress too.
+	void Update(size_t byte_budget = TEXTURE_STREAM_FRAME_BUDGET);
+
+	/// Updates without a budget until every requested texture has at least its smallest level resident or failed
+	void WaitUntilUsable();
+
+	/// Returns true when all requested textures are fully resident
+	bool IsIdle() const;
+
+	/// Counters of the last Update
+	const TextureStreamStats &LastStats() const { return last_stats; }
+
+private:
+	TextureStreamer(const TextureStreamer &);
+	TextureStreamer &operator =(const TextureStreamer &);
+
+	struct StreamedTexture
+	{
+		GLuint texture;
+		// GL_TEXTURE_2D or GL_TEXTURE_2D_ARRAY
+		GLenum target;
+		std::vector<std::basic_string<maybewchar>> file_names;
+		TextureCompression compression;
+		// Filled by a worker, a single layer for GL_TEXTURE_2D
+		TextureArrayData data;
+		bool prepared;
+		bool failed;
+		// Set on the GL thread when the levels are allocated
+		bool started;
+		// Number of bands of each level not uploaded yet
+		std::vector<unsigned int> remaining_bands;
+		// GL_TEXTURE_BASE_LEVEL, level_count until the smallest level is resident
+		unsigned int base_level;
+	};
+
+	// Rows of one level of one layer that fit into a slot
+	struct UploadBand
+	{
+		std::shared_ptr<StreamedTexture> texture;
+		unsigned int layer;
+		unsigned int level;
+		unsigned int y;
+		unsigned int height;
+		size_t offset;
+		size_t size;
+	};
+
+	enum SlotState
+	{
+		SLOT_FREE,
+		SLOT_FILLING,
+		SLOT_IN_FLIGHT
+	};
+
+	struct Slot
+	{
+		GLuint buffer;
+		SlotState state;
+		GLsync fence;
+		UploadBand band;
+	};
+
+	// Creates the texture object and submits the job preparing its layers
+	GLuint Stream(GLenum target, const std::vector<std::basic_string<maybewchar>> &file_names, TextureCompression compression);
+
+	// Called on the GL thread when the cache of a texture is ready, allocates its levels and queues the bands
+	void StartTexture(const std::shared_ptr<StreamedTexture> &texture);
+
+	// Sets the band to its texture, 'pixels' is an offset into the bound pixel buffer or a pointer to the data
+	void SetBandData(const UploadBand &band, const void *pixels);
+
+	// Marks the band uploaded and moves the base level of its texture
+	void FinishBand(const UploadBand &band);
+
+	size_t slot_size;
+	std::vector<Slot> slots;
+	// Bands waiting for a free slot, smallest levels first
+	std::deque<UploadBand> waiting_bands;
+	// Textures being prepared or streamed
+	std::vector<std::shared_ptr<StreamedTexture>> textures;
+	TextureStreamStats last_stats;
+
+	// Guards the 'prepared' and 'failed' flags of the textures and the list below
+	mutable std::mutex state_mutex;
+	// Slots filled by the workers, in the order they were finished
+	std::deque<size_t> filled_slots;
+
+	// Its jobs prepare the textures and fill the mapped slots, ~TextureStreamer waits for them before unmapping
+	ThreadPool pool;
+};
+
+#endif	// INCLUDED_TEXTURE_STREAMER_H
@@ -0,0 +1,138 @@
+#include "ThreadPool.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+unsigned ThreadPool::DefaultThreadCount()
+{
+	unsigned hardware_threads = std::thread::hardware_concurrency();
+	return std::max(hardware_threads, 2u) - 1;
+}
+
+ThreadPool::ThreadPool(unsigned thread_count) : running_jobs(0), stopping(false)
+{
+	thread_count = std::max(thread_count, 1u);
+	for (unsigned i = 0; i < thread_count; i++)
+		threads.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	job_condition.notify_all();
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+void ThreadPool::Submit(std::function<void(unsigned)> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(std::move(job));
+	}
+	job_condition.notify_one();
+}
+
+void ThreadPool::WaitIdle()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	idle_condition.wait(lock, [this] { return jobs.empty() && running_jobs == 0; });
+}
+
+void ThreadPool::WorkerLoop(unsigned worker)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		job_condition.wait(lock, [this] { return stopping || !jobs.empty(); });
+		// Remaining jobs are finished before stopping
+		if (jobs.empty())
+			return;
+
+		std::function<void(unsigned)> job = std::move(jobs.front());
+		jobs.pop_front();
+		running_jobs++;
+
+		lock.unlock();
+		{
+			PROFILE_SCOPE("worker job");
+			job(worker);
+		}
+		lock.lock();
+
+		running_jobs--;
+		if (jobs.empty() && running_jobs == 0)
+			idle_condition.notify_all();
+	}
+}
+
+// State of one ParallelFor call shared with the helper jobs, which may start after the call has returned
+struct ParallelForState
+{
+	ParallelForState(size_t count, size_t range_size, const std::function<void(size_t, size_t)> *body)
+		: count(count), range_size(range_size), body(body), next(0), active_helpers(0) {}
+
+	// Runs ranges until there are none left
+	void RunRanges()
+	{
+		for (;;)
+		{
+			size_t begin = next.fetch_add(range_size);
+			if (begin >= count)
+				return;
+			(*body)(begin, std::min(begin + range_size, count));
+		}
+	}
+
+	const size_t count;
+	const size_t range_size;
+	// Only used while some range is left, so it never outlives the call
+	const std::function<void(size_t, size_t)> *body;
+	std::atomic<size_t> next;
+
+	std::mutex mutex;
+	std::condition_variable done_condition;
+	unsigned active_helpers;
+};
+
+void ParallelFor(ThreadPool *pool, size_t count, const std::function<void(size_t, size_t)> &body)
+{
+	if (count == 0)
+		return;
+	unsigned thread_count = pool ? pool->ThreadCount() + 1 : 1;
+	if (thread_count == 1)
+	{
+		body(0, count);
+		return;
+	}
+
+	// A few ranges per thread balance uneven ranges
+	size_t range_size = std::max<size_t>(count / (thread_count * 4), 1);
+	std::shared_ptr<ParallelForState> state = std::make_shared<ParallelForState>(count, range_size, &body);
+
+	for (unsigned i = 1; i < thread_count; i++)
+	{
+		pool->Submit([state](unsigned) {
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->active_helpers++;
+			}
+			state->RunRanges();
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->active_helpers--;
+			}
+			state->done_condition.notify_all();
+		});
+	}
+
+	// Helpers that start after all ranges are taken find nothing to do, so only the active ones are waited for
+	state->RunRanges();
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->done_condition.wait(lock, [&state] { return state->active_helpers == 0; });
+}
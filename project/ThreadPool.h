@@ -0,0 +1,54 @@
+#pragma once
+#ifndef INCLUDED_THREAD_POOL_H
+#define INCLUDED_THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed set of worker threads running submitted jobs in the order of submission
+class ThreadPool
+{
+public:
+	/// Returns the number of hardware threads minus one for the main thread, at least one
+	static unsigned DefaultThreadCount();
+
+	explicit ThreadPool(unsigned thread_count = DefaultThreadCount());
+
+	/// Finishes all submitted jobs and joins the threads
+	~ThreadPool();
+
+	/// Queues a job, it receives the index of the worker thread running it
+	void Submit(std::function<void(unsigned)> job);
+
+	/// Blocks until all submitted jobs are finished
+	void WaitIdle();
+
+	unsigned ThreadCount() const { return unsigned(threads.size()); }
+
+private:
+	ThreadPool(const ThreadPool &);
+	ThreadPool &operator =(const ThreadPool &);
+
+	void WorkerLoop(unsigned worker);
+
+	std::vector<std::thread> threads;
+	std::deque<std::function<void(unsigned)>> jobs;
+	std::mutex mutex;
+	// Signals new jobs and stopping to the workers
+	std::condition_variable job_condition;
+	// Signals finished jobs to WaitIdle
+	std::condition_variable idle_condition;
+	unsigned running_jobs;
+	bool stopping;
+};
+
+/// Splits [0, count) into ranges and calls 'body(begin, end)' for each of them on the pool threads and on the calling
+/// thread, returns when all ranges are done. Runs everything on the calling thread if 'pool' is null. The caller works
+/// on the ranges as well, so it can be called from a job of the same pool without waiting for free workers.
+void ParallelFor(ThreadPool *pool, size_t count, const std::function<void(size_t, size_t)> &body);
+
+#endif	// INCLUDED_THREAD_POOL_H
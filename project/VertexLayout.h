@@ -0,0 +1,345 @@
+#pragma once
+#ifndef INCLUDED_VERTEX_LAYOUT_H
+#define INCLUDED_VERTEX_LAYOUT_H
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "PV112.h"
+
+//-----------------------------------------
+//----         PACKING HELPERS         ----
+//-----------------------------------------
+
+/// Converts a float to a half float, rounding to the nearest value. Values too small for a normalized half are
+/// flushed to zero, values too large become infinity.
+inline unsigned short PackHalf(float value)
+{
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	unsigned int sign = (bits >> 16) & 0x8000;
+	int exponent = int((bits >> 23) & 0xFF) - 127 + 15;
+	unsigned int mantissa = bits & 0x7FFFFF;
+
+	if (exponent <= 0)
+		return static_cast<unsigned short>(sign);
+	if (exponent >= 31)
+		return static_cast<unsigned short>(sign | 0x7C00 | ((bits & 0x7FFFFFFF) > 0x7F800000 ? 0x200 : 0));
+
+	unsigned int half = sign | (unsigned(exponent) << 10) | (mantissa >> 13);
+	// Round to nearest, a carry into the exponent is correct too
+	if (mantissa & 0x1000)
+		half++;
+	return static_cast<unsigned short>(half);
+}
+
+/// Converts a value in [-1, 1] to a signed normalized integer with the given maximum (127, 511, 32767)
+inline int PackSnorm(float value, int max_value)
+{
+	float c = std::min(std::max(value, -1.0f), 1.0f);
+	return int(floorf(c * float(max_value) + 0.5f));
+}
+
+/// Converts a value in [0, 1] to an unsigned normalized integer with the given maximum (255, 65535)
+inline unsigned int PackUnorm(float value, unsigned int max_value)
+{
+	float c = std::min(std::max(value, 0.0f), 1.0f);
+	return unsigned(floorf(c * float(max_value) + 0.5f));
+}
+
+//-----------------------------------------
+//----          VERTEX FORMATS         ----
+//-----------------------------------------
+
+// Each format describes how one attribute is stored: the arguments of glVertexAttribPointer, its size in bytes,
+// and Pack, which writes the first 'Components' components of the value. All sizes are multiples of 4 bytes,
+// so attributes in an interleaved vertex stay aligned.
+
+/// Two 32-bit floats
+struct float2
+{
+	static const GLint Components = 2;
+	static const GLenum Type = GL_FLOAT;
+	static const GLboolean Normalized = GL_FALSE;
+	static const size_t Size = 8;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		float v[2] = { value.x, value.y };
+		memcpy(out, v, sizeof(v));
+	}
+};
+
+/// Three 32-bit floats
+struct float3
+{
+	static const GLint Components = 3;
+	static const GLenum Type = GL_FLOAT;
+	static const GLboolean Normalized = GL_FALSE;
+	static const size_t Size = 12;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		float v[3] = { value.x, value.y, value.z };
+		memcpy(out, v, sizeof(v));
+	}
+};
+
+/// Four 32-bit floats
+struct float4
+{
+	static const GLint Components = 4;
+	static const GLenum Type = GL_FLOAT;
+	static const GLboolean Normalized = GL_FALSE;
+	static const size_t Size = 16;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		float v[4] = { value.x, value.y, value.z, value.w };
+		memcpy(out, v, sizeof(v));
+	}
+};
+
+/// Two 16-bit floats
+struct half2
+{
+	static const GLint Components = 2;
+	static const GLenum Type = GL_HALF_FLOAT;
+	static const GLboolean Normalized = GL_FALSE;
+	static const size_t Size = 4;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		unsigned short v[2] = { PackHalf(value.x), PackHalf(value.y) };
+		memcpy(out, v, sizeof(v));
+	}
+};
+
+/// Four 16-bit floats, there is no three component variant as it would not be aligned
+struct half4
+{
+	static const GLint Components = 4;
+	static const GLenum Type = GL_HALF_FLOAT;
+	static const GLboolean Normalized = GL_FALSE;
+	static const size_t Size = 8;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		unsigned short v[4] = { PackHalf(value.x), PackHalf(value.y), PackHalf(value.z), PackHalf(value.w) };
+		memcpy(out, v, sizeof(v));
+	}
+};
+
+/// Four signed normalized bytes, values in [-1, 1]
+struct snorm8x4
+{
+	static const GLint Components = 4;
+	static const GLenum Type = GL_BYTE;
+	static const GLboolean Normalized = GL_TRUE;
+	static const size_t Size = 4;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		signed char v[4];
+		for (int i = 0; i < 4; i++)
+			v[i] = static_cast<signed char>(PackSnorm(value[i], 127));
+		memcpy(out, v, sizeof(v));
+	}
+};
+
+/// Two signed normalized shorts, values in [-1, 1]
+struct snorm16x2
+{
+	static const GLint Components = 2;
+	static const GLenum Type = GL_SHORT;
+	static const GLboolean Normalized = GL_TRUE;
+	static const size_t Size = 4;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		short v[2] = { static_cast<short>(PackSnorm(value.x, 32767)), static_cast<short>(PackSnorm(value.y, 32767)) };
+		memcpy(out, v, sizeof(v));
+	}
+};
+
+/// Four signed normalized shorts, values in [-1, 1]
+struct snorm16x4
+{
+	static const GLint Components = 4;
+	static const GLenum Type = GL_SHORT;
+	static const GLboolean Normalized = GL_TRUE;
+	static const size_t Size = 8;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		short v[4];
+		for (int i = 0; i < 4; i++)
+			v[i] = static_cast<short>(PackSnorm(value[i], 32767));
+		memcpy(out, v, sizeof(v));
+	}
+};
+
+/// Two unsigned normalized shorts, values in [0, 1]
+struct unorm16x2
+{
+	static const GLint Components = 2;
+	static const GLenum Type = GL_UNSIGNED_SHORT;
+	static const GLboolean Normalized = GL_TRUE;
+	static const size_t Size = 4;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		unsigned short v[2] = { static_cast<unsigned short>(PackUnorm(value.x, 65535)), static_cast<unsigned short>(PackUnorm(value.y, 65535)) };
+		memcpy(out, v, sizeof(v));
+	}
+};
+
+/// Three signed normalized 10-bit values in GL_INT_2_10_10_10_REV, the 2-bit w is 0. Meant for unit vectors.
+struct snorm10x3
+{
+	static const GLint Components = 4;
+	static const GLenum Type = GL_INT_2_10_10_10_REV;
+	static const GLboolean Normalized = GL_TRUE;
+	static const size_t Size = 4;
+	static void Pack(unsigned char *out, const glm::vec4 &value)
+	{
+		unsigned int packed = 0;
+		for (int i = 0; i < 3; i++)
+			packed |= (unsigned(PackSnorm(value[i], 511)) & 0x3FF) << (i * 10);
+		memcpy(out, &packed, sizeof(packed));
+	}
+};
+
+//-----------------------------------------
+//----            SEMANTICS            ----
+//-----------------------------------------
+
+/// Meaning of a vertex attribute, selects which value is packed into it and which attribute location it uses
+enum VertexSemantic
+{
+	VERTEX_POSITION,
+	VERTEX_NORMAL,
+	VERTEX_TEX_COORD,
+	VERTEX_SEMANTIC_COUNT
+};
+
+/// Position attribute stored in 'Format'. Positions are packed with w = 1.
+template<class FormatType> struct Position
+{
+	typedef FormatType Format;
+	static const VertexSemantic Semantic = VERTEX_POSITION;
+};
+
+/// Normal attribute stored in 'Format'
+template<class FormatType> struct Normal
+{
+	typedef FormatType Format;
+	static const VertexSemantic Semantic = VERTEX_NORMAL;
+};
+
+/// Texture coordinate attribute stored in 'Format'
+template<class FormatType> struct TexCoord
+{
+	typedef FormatType Format;
+	static const VertexSemantic Semantic = VERTEX_TEX_COORD;
+};
+
+//-----------------------------------------
+//----          VERTEX LAYOUT          ----
+//-----------------------------------------
+
+/// Attributes of an interleaved vertex starting at byte 'Offset', used by VertexLayout
+template<size_t Offset, class... Attributes> struct VertexAttributeList;
+
+template<size_t Offset> struct VertexAttributeList<Offset>
+{
+	static const size_t Size = 0;
+	static void Pack(unsigned char *, const glm::vec4 *) {}
+	static void Setup(const GLint *, GLsizei) {}
+};
+
+template<size_t Offset, class Attribute, class... Rest> struct VertexAttributeList<Offset, Attribute, Rest...>
+{
+	typedef typename Attribute::Format Format;
+	typedef VertexAttributeList<Offset + Format::Size, Rest...> Next;
+
+	static_assert(Format::Size % 4 == 0, "Vertex attributes must be aligned to 4 bytes");
+
+	static const size_t Size = Format::Size + Next::Size;
+
+	static void Pack(unsigned char *vertex, const glm::vec4 *values)
+	{
+		Format::Pack(vertex + Offset, values[Attribute::Semantic]);
+		Next::Pack(vertex, values);
+	}
+
+	static void Setup(const GLint *locations, GLsizei stride)
+	{
+		GLint location = locations[Attribute::Semantic];
+		if (location >= 0)
+		{
+			glEnableVertexAttribArray(location);
+			glVertexAttribPointer(location, Format::Components, Format::Type, Format::Normalized, stride, (const void *)Offset);
+		}
+		Next::Setup(locations, stride);
+	}
+};
+
+/// Compile-time description of an interleaved vertex, for example
+///
+///     typedef VertexLayout<Position<float3>, Normal<snorm10x3>, TexCoord<half2>> MyLayout;
+///
+/// The attributes are stored in the given order without gaps. The offsets, the stride, the packing code and the
+/// glVertexAttribPointer calls are all derived from the description, so changing the format of an attribute
+/// changes only the type in the typedef. Semantics missing in the layout are ignored when packing and their
+/// attribute locations are left disabled.
+template<class... Attributes> struct VertexLayout
+{
+	typedef VertexAttributeList<0, Attributes...> List;
+
+	/// Size of one vertex in bytes
+	static const size_t Stride = List::Size;
+
+	/// Packs one vertex to 'out', which must have at least Stride bytes
+	static void PackVertex(unsigned char *out, const glm::vec3 &position, const glm::vec3 &normal, const glm::vec2 &tex_coord)
+	{
+		glm::vec4 values[VERTEX_SEMANTIC_COUNT] = { glm::vec4(position, 1.0f), glm::vec4(normal, 0.0f), glm::vec4(tex_coord, 0.0f, 0.0f) };
+		List::Pack(out, values);
+	}
+
+	/// Packs the vertices (given as parallel arrays, 'normals' and 'tex_coords' may be empty) into a new buffer
+	static std::vector<unsigned char> PackVertices(const std::vector<glm::vec3> &positions, const std::vector<glm::vec3> &normals,
+		const std::vector<glm::vec2> &tex_coords)
+	{
+		std::vector<unsigned char> data(positions.size() * Stride);
+		for (size_t i = 0; i < positions.size(); i++)
+		{
+			PackVertex(&data[i * Stride], positions[i],
+				i < normals.size() ? normals[i] : glm::vec3(0.0f, 1.0f, 0.0f),
+				i < tex_coords.size() ? tex_coords[i] : glm::vec2(0.0f, 0.0f));
+		}
+		return data;
+	}
+
+	/// Enables and sets the attribute pointers of the bound VAO for the bound GL_ARRAY_BUFFER. Locations
+	/// with -1 are ignored.
+	static void SetupAttributes(GLint position_location, GLint normal_location, GLint tex_coord_location)
+	{
+		GLint locations[VERTEX_SEMANTIC_COUNT] = { position_location, normal_location, tex_coord_location };
+		List::Setup(locations, GLsizei(Stride));
+	}
+};
+
+/// Full precision, 32 bytes per vertex
+typedef VertexLayout<Position<float3>, Normal<float3>, TexCoord<float2>> FloatVertexLayout;
+
+/// Half float positions and texture coordinates and 10-bit normals, 16 bytes per vertex. Used for loaded meshes.
+typedef VertexLayout<Position<half4>, Normal<snorm10x3>, TexCoord<half2>> CompactVertexLayout;
+
+/// Normalized integers for geometry that fits into the [-1, 1] cube with texture coordinates in [0, 1],
+/// 16 bytes per vertex. Used for the cube and the grid.
+typedef VertexLayout<Position<snorm16x4>, Normal<snorm10x3>, TexCoord<unorm16x2>> UnitVertexLayout;
+
+/// Creates an indexed Geometry with a single interleaved vertex buffer in the given layout. 'vertices' must
+/// contain 'vertex_count' * Layout::Stride bytes, they are passed to glBufferData without a copy.
+template<class Layout>
+PV112::Geometry CreateLayoutGeometry(const void *vertices, size_t vertex_count, const unsigned int *indices, size_t index_count,
+	GLenum mode, GLint position_location, GLint normal_location, GLint tex_coord_location)
+{
+	return PV112::CreateInterleavedGeometry(vertices, vertex_count * Layout::Stride, indices, index_count, mode,
+		&Layout::SetupAttributes, position_location, normal_location, tex_coord_location);
+}
+
+#endif	// INCLUDED_VERTEX_LAYOUT_H
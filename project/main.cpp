@@ -2,10 +2,37 @@
 
 #include "PV112.h"
 #include "HeightmapTerrain.h"
-
+#include "MeshLOD.h"
+#include "MeshCache.h"
+#include "AssetLoader.h"
+#include "ImageDecoder.h"
+#include "TextureCache.h"
+#include "TextureStreamer.h"
+#include "GLStateCache.h"
+#include "RenderQueue.h"
+#include "MaterialBuffer.h"
+#include "DynamicUniformBuffer.h"
+#include "Frustum.h"
+#include "FrameLoop.h"
+#include "Profiler.h"
+#include "HeadlessContext.h"
+#include "Benchmark.h"
+#include "InputRecording.h"
+#include "PerfCounters.h"
+#include "TextOverlay.h"
+#include "ClusteredLights.h"
+#include "ShaderCache.h"
+#include "TerrainLighting.h"
+
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <random>
 #include <sstream>
+#include <stdexcept>
+#include <fstream>
+#include <limits>
+#include <string>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -47,8 +74,8 @@ typedef char maybewchar;
 int win_width = 1920;
 int win_height = 1080;
 
-// Buffer structures
-static const int LIGHT_COUNT = 2;
+// Buffer structures, the directional lights are in the uniform buffer and the point lights in the clusters
+static const int LIGHT_COUNT = 1;
 struct Light
 {
 	glm::vec4 position;
@@ -62,7 +89,25 @@ struct Lights
 	Light lights[LIGHT_COUNT];
 };
 Lights lights;
-GLuint lights_ubo;
+
+// Lamps along the paths around the lake, the first one is the lamp at lampPosition. Each lamp has a point light,
+// binned into the clusters of each pass. The lamps are drawn instanced, LampData of the lamp programs holds up to
+// MAX_LAMP_COUNT positions (16 kB, the smallest uniform block size).
+static const float PATH_LAMP_SPACING = 5.0f;
+static const float PATH_LAMP_MIN_SPACING = 1.0f;
+static const float PATH_LAMP_RANGE = 8.0f;
+static const int MAX_LAMP_COUNT = 1024;
+int lamp_count = 200;
+std::vector<glm::vec3> lamp_positions;
+// Model matrices of the lamps for sorting them by their level of detail
+std::vector<glm::mat4> lamp_instances;
+std::vector<PointLight> point_lights;
+ClusteredLights *main_clusters = nullptr;
+ClusteredLights *reflection_clusters = nullptr;
+// Threads of the light binning and the terrain bake
+ThreadPool *worker_pool = nullptr;
+PerfCounterId visible_lights_counter = 0;
+PerfCounterId cluster_indices_counter = 0;
 
 struct Camera
 {
@@ -71,7 +116,9 @@ struct Camera
 	glm::vec3 eye_position;
 };
 Camera camera;
-GLuint camera_ubo;
+
+// Ranges of the lights and of the camera of each pass are allocated from it every frame
+DynamicUniformBuffer *dynamic_uniforms = nullptr;
 
 struct Material
 {
@@ -80,8 +127,12 @@ struct Material
 	glm::vec4 specular_color;
 	float shininess;
 };
-Material material;
-GLuint material_ubo;
+// Materials of the objects, registered once in init, a draw binds the range of its material
+MaterialBuffer *material_buffer = nullptr;
+unsigned int terrain_material;
+unsigned int lamp_material;
+unsigned int vegetation_material;
+unsigned int water_material;
 
 static const int TREE_COUNT = 100;
 static const int GRASS_COUNT = 1000;
@@ -90,40 +141,126 @@ struct TreeData
 	glm::mat4 tree_model_matrix[GRASS_COUNT];
 };
 TreeData tree_data;
-GLuint tree_data_ubo;
-GLuint bush_data_ubo;
+
+// Variants of the programs drawn in both passes, the reflection variants clip the vertices at the water plane
+enum PassVariant
+{
+	PASS_MAIN,
+	PASS_REFLECTION,
+	PASS_VARIANT_COUNT
+};
+
+// Instances and levels of detail selected for one pass, the instances of trees, bushes and lamps are sorted by
+// their level of detail into the buffers of the pass every frame
+struct PassObjects
+{
+	GLuint tree_data_ubo;
+	GLuint bush_data_ubo;
+	GLuint lamp_data_ubo;
+	std::vector<int> tree_lod_counts;
+	std::vector<int> bush_lod_counts;
+	std::vector<int> lamp_lod_counts;
+	int terrain_lod;
+	bool draw_grass;
+	// Variant of the programs of the pass
+	PassVariant variant;
+	// Objects outside are not submitted, contains everything if it has no planes
+	Frustum frustum;
+};
+PassObjects main_objects;
+PassObjects reflection_objects;
+
+// Model matrices of trees and bushes
+std::vector<glm::mat4> tree_instances;
+std::vector<glm::mat4> bush_instances;
 GLuint long_grass_data_ubo[12];
 
-GLuint reflection_framebuffer;
-GLuint reflection_tex;
-GLuint reflection_depth;
+// What the reflection pass draws. The waves blur and distort the reflection, so it is rendered at a lower
+// resolution and with less detail than the main pass.
+struct ReflectionPolicy
+{
+	// Size of the reflection targets relative to the window
+	float resolution_scale;
+	// Level of detail of the terrain
+	int terrain_lod;
+	// Levels added to the levels of detail of the trees, bushes and lamps
+	int lod_bias;
+	// Trees and bushes farther from the eye are not reflected
+	float draw_distance;
+	bool draw_grass;
+};
+ReflectionPolicy reflection_policy = { 0.5f, 1, 1, 150.0f, false };
 
-// Terrain
-GLuint terrain_program;
+// Framebuffer of the main pass, 0 is the window
+GLuint main_framebuffer = 0;
 
-Terrain terrain_geometry;
+GLuint reflection_framebuffer = 0;
+GLuint reflection_tex = 0;
+GLuint reflection_depth = 0;
+int reflection_width;
+int reflection_height;
 
-GLuint terrain_grass_tex;
-GLuint terrain_rocks_tex;
-GLint terrain_grass_tex_loc;
-GLint terrain_rocks_tex_loc;
-GLint terrain_model_matrix_loc;
+// Specialization of the shaders, set as definitions of the program variants
+static const float TRIPLANAR_BLEND_SHARPNESS = 1.0f;
+// The depth pre-pass writes only the nearly opaque texels of the vegetation
+static const float VEGETATION_DEPTH_ALPHA_CUTOFF = 0.95f;
 
-// Tree
-GLuint tree_program;
+// Creates the program variants, loads and stores their binaries unless disabled by --shader-cache off
+ShaderCache shader_cache;
+bool shader_binary_cache = true;
+
+// Terrain program or its depth pre-pass and the locations of its uniforms
+struct TerrainProgram
+{
+	GLuint program;
+	GLint model_matrix_loc;
+	// Only the lamp programs have instances
+	GLint instance_offset_loc;
+};
+TerrainProgram terrain_programs[PASS_VARIANT_COUNT];
+// The lamps are shaded like the terrain without the baked lighting of the terrain, instanced
+TerrainProgram lamp_programs[PASS_VARIANT_COUNT];
+
+Terrain terrain_geometry;
+
+// Texture array with the terrain materials, the layer of each material is set to the program once
+static const int TERRAIN_GRASS_LAYER = 0;
+static const int TERRAIN_ROCKS_LAYER = 1;
+GLuint terrain_tex_array;
+// Baked normal map and ambient occlusion of the terrain, see TerrainLighting.h
+GLuint terrain_lighting_tex;
+// Level of detail of the terrain in the main pass, set by --terrain-lod
+int main_terrain_lod = 0;
+
+// Depth pre-pass of the terrain and the lamps, with the vertex shaders of terrain_programs and lamp_programs
+TerrainProgram terrain_depth_programs[PASS_VARIANT_COUNT];
+TerrainProgram lamp_depth_programs[PASS_VARIANT_COUNT];
+
+// Vegetation program or its depth pre-pass and the locations of its uniforms
+struct VegetationProgram
+{
+	GLuint program;
+	GLint model_matrix_loc;
+	GLint wind_height_loc;
+	GLint app_time_loc;
+	GLint tex_layer_loc;
+	GLint instance_offset_loc;
+};
+VegetationProgram tree_programs[PASS_VARIANT_COUNT];
 
 PV112::Geometry tree_geometry;
 PV112::Geometry bush_geometry;
 PV112::Geometry long_grass_geometry[12];
 PV112::Geometry lamp_geometry;
 
-GLuint tree_tex;
-GLuint bush_tex;
-GLuint long_grass_tex;
-GLint tree_tex_loc;
-GLint tree_model_matrix_loc;
-GLint tree_wind_height_loc;
-GLint tree_app_time_loc;
+// Texture array with the vegetation materials, all species share one binding and only switch the layer
+static const int TREE_LAYER = 0;
+static const int BUSH_LAYER = 1;
+static const int LONG_GRASS_LAYER = 2;
+GLuint vegetation_tex_array;
+
+// Depth pre-pass of the vegetation, with the vertex shaders of tree_programs
+VegetationProgram tree_depth_programs[PASS_VARIANT_COUNT];
 
 // Water
 GLuint water_program;
@@ -131,10 +268,86 @@ GLuint water_program;
 PV112::Geometry water_geometry;
 
 GLuint water_normal_tex;
-GLint water_normal_tex_loc;
 GLint water_model_matrix_loc;
 GLint water_app_time_loc;
-GLint water_reflection_tex_loc;
+GLint water_viewport_size_loc;
+
+// Streams the textures, created in init and kept until the process exits like the other OpenGL objects
+TextureStreamer *texture_streamer = nullptr;
+
+// Filters the redundant state changes of the render passes
+GLStateCache gl_state;
+
+// Kinds of objects in the render queue, they select the uniforms of a packet
+enum RenderObject
+{
+	OBJECT_TERRAIN,
+	OBJECT_LAMP,
+	OBJECT_TREES,
+	OBJECT_BUSHES,
+	OBJECT_LONG_GRASS,
+	OBJECT_WATER
+};
+
+// Collects the draws of a pass, reused by both passes
+RenderQueue render_queue;
+
+// Position of the lamp standing on the terrain
+glm::vec3 lampPosition()
+{
+	return glm::vec3(-10.0f, terrain_geometry.height[103][103] * TERRAIN_HEIGHT - 2.0f, -10.0f);
+}
+
+// Places 'count' lamps, the lamp at lampPosition and then lamps along circular paths around the lake on the dry land.
+// The paths start PATH_LAMP_SPACING apart with the lamps spaced by it. While there are fewer lamps than 'count', the
+// spacing is halved down to PATH_LAMP_MIN_SPACING, which adds paths between the previous ones and lamps between
+// their lamps.
+void placeLamps(int count)
+{
+	float size = float(terrain_geometry.height.size());
+	lamp_positions.assign(1, lampPosition());
+	for (float spacing = PATH_LAMP_SPACING; spacing >= PATH_LAMP_MIN_SPACING && int(lamp_positions.size()) < count; spacing *= 0.5f)
+	{
+		for (float radius = 12.0f; radius < 48.0f && int(lamp_positions.size()) < count; radius += spacing * 1.2f)
+		{
+			for (float angle = 0.0f; angle < 6.28f && int(lamp_positions.size()) < count; angle += spacing / radius)
+			{
+				float x = radius * cos(angle);
+				float z = radius * sin(angle);
+				float y = terrain_geometry.height[int((x + 50) * size / 100)][int((z + 50) * size / 100)] * TERRAIN_HEIGHT - 2.0f;
+				if (y <= 0.5f)
+					continue;
+
+				// Skips the places of the lamps of the previous paths
+				bool taken = false;
+				for (size_t i = 0; i < lamp_positions.size() && !taken; i++)
+					taken = glm::distance(glm::vec2(x, z), glm::vec2(lamp_positions[i].x, lamp_positions[i].z)) < spacing * 0.5f;
+				if (!taken)
+					lamp_positions.push_back(glm::vec3(x, y, z));
+			}
+		}
+	}
+	if (int(lamp_positions.size()) < count)
+		std::cout << "Placed " << lamp_positions.size() << " of " << count << " lamps, the paths have no room for more" << std::endl;
+
+	lamp_instances.resize(lamp_positions.size());
+	for (size_t i = 0; i < lamp_positions.size(); i++)
+		lamp_instances[i] = glm::translate(glm::mat4(1.0f), lamp_positions[i]);
+}
+
+// Model matrix of the terrain, scales the unit square of the heightmap to the world
+glm::mat4 terrainModelMatrix()
+{
+	glm::mat4 model_matrix = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 0.0f));
+	return glm::scale(model_matrix, glm::vec3(100.0f, TERRAIN_HEIGHT, 100.0f));
+}
+
+// Bounding sphere of the terrain in world space
+glm::vec4 terrainBounds()
+{
+	glm::vec3 half_size(50.0f, TERRAIN_HEIGHT * 0.5f, 50.0f);
+	return glm::vec4(0.0f, half_size.y - 2.0f, 0.0f, glm::length(half_size));
+}
 
 // Simple camera that allows us to look at the object from different views
 BlinkCamera my_camera;
@@ -143,12 +356,165 @@ BlinkCamera my_camera;
 float app_time = 0.0f;
 float animation_speed = 0.020f;
 
+// Runs the simulation in fixed steps and paces the frames
+FrameLoop frame_loop;
+
+// Simulated state of the last two steps, frames are rendered between them
+struct SimulationState
+{
+	float app_time;
+	glm::vec3 eye_position;
+};
+SimulationState previous_state;
+SimulationState current_state;
+
+// State interpolated for the current frame, used by the rendering instead of the simulated one
+float render_app_time = 0.0f;
+glm::vec3 render_eye_position;
+glm::vec3 render_look_position;
+
+// Measures the GPU time of the passes
+GpuProfiler *gpu_profiler = nullptr;
+
+// Draws of the current frame, summed over the passes
+RenderQueueStats frame_render_stats;
+
+// Headless benchmark run instead of the window, see runBenchmark
+BenchmarkSettings benchmark_settings;
+
+// Seed of the generator that places the trees and the grass, random unless it is given or replayed
+unsigned int scene_seed = std::random_device()();
+std::mt19937 scene_random;
+
+// Number of simulation steps so far, the recorded input is tagged with it
+unsigned int simulation_tick = 0;
+
+// Input and camera of the session are recorded into the file when the application exits, if it is not empty
+std::string recording_file;
+InputRecording input_recording;
+
+// Feeds the recorded input back instead of the live input, null if not replaying
+InputRecording replay_recording;
+InputReplay *input_replay = nullptr;
+
+// Counters of the state changes issued in each pass, registered in init
+PerfCounterId reflection_state_changes_counter = 0;
+PerfCounterId main_state_changes_counter = 0;
+
+// Draws the depth of the terrain, the lamps and the vegetation before shading them, so hidden surfaces are not
+// shaded. Switched by 'z' and --depth-prepass.
+bool depth_prepass = false;
+PerfCounterId depth_prepass_draws_counter = 0;
+
+// Draws the counters of the last frame over the frame
+TextOverlay *text_overlay = nullptr;
+bool show_overlay = false;
+
+// Writes the input recording, if any
+void saveInputRecording()
+{
+	if (recording_file.empty())
+		return;
+	if (input_recording.Save(recording_file))
+		std::cout << "Input recording of " << input_recording.TickCount() << " steps written to " << recording_file << std::endl;
+}
+
+// Applies input that changes the simulation, both the live and the replayed one
+void applyInput(const InputEvent &event)
+{
+	if (event.type == INPUT_MOUSE_MOVED) {
+		my_camera.OnMouseMoved(event.dx, event.dy);
+		return;
+	}
+
+	bool pressed = event.type == INPUT_KEY_DOWN;
+	switch (event.key)
+	{
+	case '+':
+		if (pressed)
+			animation_speed += 0.1;
+		break;
+	case '-':
+		if (pressed)
+			animation_speed -= 0.1;
+		break;
+
+	case 'w':
+		my_camera.vel_w = pressed;
+		break;
+	case 's':
+		my_camera.vel_s = pressed;
+		break;
+	case 'a':
+		my_camera.vel_a = pressed;
+		break;
+	case 'd':
+		my_camera.vel_d = pressed;
+		break;
+	}
+}
+
+// Records the live input, if recording, and applies it. The live input is ignored while replaying.
+void handleInput(unsigned char type, unsigned char key, int dx, int dy)
+{
+	if (input_replay)
+		return;
+	// The other keys do not change the simulation
+	if (type != INPUT_MOUSE_MOVED && !strchr("+-wsad", key))
+		return;
+
+	InputEvent event;
+	event.tick = simulation_tick;
+	event.type = type;
+	event.key = key;
+	event.dx = short(glm::clamp(dx, -32768, 32767));
+	event.dy = short(glm::clamp(dy, -32768, 32767));
+	if (!recording_file.empty())
+		input_recording.events.push_back(event);
+	applyInput(event);
+}
+
+// Prints the rolling percentiles of the profiler scopes
+void printProfile()
+{
+	std::vector<ProfileScopeStats> scopes = Profiler::Instance().ComputeStats();
+	std::ostringstream log;
+	log << "Profiler scopes (p50 / p95 / p99 in ms):" << std::endl;
+	for (size_t i = 0; i < scopes.size(); i++)
+		log << "  " << (scopes[i].gpu ? "GPU " : "CPU ") << scopes[i].name << ": " << scopes[i].p50 << " / " << scopes[i].p95 << " / "
+			<< scopes[i].p99 << " (" << scopes[i].samples << " samples)" << std::endl;
+	std::cout << log.str();
+}
+
+// Prints the frame times of the last frames
+void printFrameTimes()
+{
+	FrameTimeStats stats = frame_loop.ComputeStats();
+	std::ostringstream log;
+	log << "Frame times of the last " << stats.frame_count << " frames (" << PresentModeName(frame_loop.GetPresentMode()) << "): "
+		<< stats.average << " ms average, " << stats.minimum << " ms min, " << stats.maximum << " ms max, "
+		<< stats.percentile_99 << " ms 99th percentile" << std::endl;
+	std::cout << log.str();
+}
+
+// Prints the state changes of the last frame, issued and filtered by gl_state
+void printGLStateStats()
+{
+	const GLStateStats &stats = gl_state.LastFrameStats();
+	std::ostringstream log;
+	log << "GL state changes of the last frame: " << stats.TotalIssued() << " issued, " << stats.TotalFiltered() << " filtered" << std::endl;
+	for (int i = 0; i < STATE_CALL_KIND_COUNT; i++)
+		log << "  " << StateCallKindName(StateCallKind(i)) << ": " << stats.issued[i] << " issued, " << stats.filtered[i] << " filtered" << std::endl;
+	std::cout << log.str();
+}
+
 // Called when the user presses a key
 void key_down(unsigned char key, int mouseX, int mouseY)
 {
 	switch (key)
 	{
 	case 27: // Escape
+		saveInputRecording();
 		exit(0);
 		break;
 	case 'l':
@@ -162,48 +528,49 @@ void key_down(unsigned char key, int mouseX, int mouseY)
 	case 't':
 		glutFullScreenToggle();
 		break;
-
-	case '+':
-		animation_speed += 0.1;
+	case 'g':
+		printGLStateStats();
 		break;
-	case '-':
-		animation_speed -= 0.1;
+	case 'p':
+		printFrameTimes();
 		break;
-
-	case 'w':
-		my_camera.vel_w = true;
+	case 'r':
+		printProfile();
 		break;
-	case 's':
-		my_camera.vel_s = true;
+	case 'c':
+		if (Profiler::Instance().ExportChromeTrace("profile_trace.json"))
+			std::cout << "Profiler trace written to profile_trace.json" << std::endl;
 		break;
-	case 'a':
-		my_camera.vel_a = true;
+	case 'z':
+		depth_prepass = !depth_prepass;
+		std::cout << "Depth pre-pass: " << (depth_prepass ? "on" : "off") << std::endl;
 		break;
-	case 'd':
-		my_camera.vel_d = true;
+	case 'o':
+		show_overlay = !show_overlay;
 		break;
-	}
-}
-
-void key_up(unsigned char key, int mouseX, int mouseY)
-{
-	switch (key)
-	{
-	case 'w':
-		my_camera.vel_w = false;
+	case 'k':
+		if (PerfCounters::Instance().ExportCSV("perf_counters.csv") && PerfCounters::Instance().ExportJSON("perf_counters.json"))
+			std::cout << "Performance counters written to perf_counters.csv and perf_counters.json" << std::endl;
 		break;
-	case 's':
-		my_camera.vel_s = false;
+	case 'x':
+		PerfCounters::Instance().TraceNextFrame("gl_trace.txt");
 		break;
-	case 'a':
-		my_camera.vel_a = false;
+	case 'v':
+		frame_loop.SetPresentMode(PresentMode((frame_loop.GetPresentMode() + 1) % PRESENT_MODE_COUNT));
+		std::cout << "Present mode: " << PresentModeName(frame_loop.GetPresentMode()) << std::endl;
 		break;
-	case 'd':
-		my_camera.vel_d = false;
+
+	default:
+		handleInput(INPUT_KEY_DOWN, key, 0, 0);
 		break;
 	}
 }
 
+void key_up(unsigned char key, int mouseX, int mouseY)
+{
+	handleInput(INPUT_KEY_UP, key, 0, 0);
+}
+
 
 // Called when the user presses a mouse button
 void mouse_button_changed(int button, int state, int x, int y)
@@ -223,102 +590,261 @@ void mouse_moved(int x, int y)
 
 	int cx = win_width / 2;
 	int cy = win_height / 2;
-	my_camera.OnMouseMoved(x - cx, y - cy);
+	handleInput(INPUT_MOUSE_MOVED, 0, x - cx, y - cy);
 	
 	glutWarpPointer(cx, cy);
 	just_warped = true;
 }
 
-// Initializes OpenGL stuff
-void init()
+// Creates the reflection framebuffer with its color texture and depth buffer at the reflection resolution, the
+// previous ones are deleted
+void createReflectionTargets()
 {
-	glClearColor(0.33f, 0.38f, 0.45f, 1.0f);
-	glClearDepth(1.0);
-	glEnable(GL_DEPTH_TEST);
+	glDeleteFramebuffers(1, &reflection_framebuffer);
+	glDeleteTextures(1, &reflection_tex);
+	glDeleteRenderbuffers(1, &reflection_depth);
 
-	int position_loc = 0;
-	int normal_loc = 1;
-	int tex_coord_loc = 2;
+	reflection_width = std::max(int(win_width * reflection_policy.resolution_scale), 1);
+	reflection_height = std::max(int(win_height * reflection_policy.resolution_scale), 1);
 
-	// Create geometries
-	terrain_geometry = LoadHeightmapTerrain(MAYBEWIDE("resources/heightmap.png"), position_loc, normal_loc, tex_coord_loc);
-	tree_geometry = PV112::LoadOBJ("resources/tree1.obj", position_loc, normal_loc, tex_coord_loc);
-	bush_geometry = PV112::LoadOBJ("resources/bush.obj", position_loc, normal_loc, tex_coord_loc);
-	water_geometry = PV112::CreateGrid(200, position_loc, normal_loc, tex_coord_loc);
-	for (int i = 0; i < 12; ++i) {
-		std::ostringstream buffer;
-		buffer << "resources/grass" << std::to_string(i + 1) << ".obj";
-		long_grass_geometry[i] = PV112::LoadOBJ(buffer.str().c_str(), position_loc, normal_loc, tex_coord_loc);
-	}
-	lamp_geometry = PV112::LoadOBJ("resources/lamp.obj", position_loc, normal_loc, tex_coord_loc);
+	glGenFramebuffers(1, &reflection_framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, reflection_framebuffer);
 
-	my_camera = BlinkCamera(&terrain_geometry, 0.0f, 0.0f);
+	// The reflection is magnified when its resolution is lower than the window
+	glGenTextures(1, &reflection_tex);
+	glBindTexture(GL_TEXTURE_2D, reflection_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, reflection_width, reflection_height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); //GL_MIRRORED_REPEAT
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	
+	glGenRenderbuffers(1, &reflection_depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, reflection_depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, reflection_width, reflection_height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, reflection_depth);
+	
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, reflection_tex, 0);
+	GLenum DrawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
+	glDrawBuffers(1, DrawBuffers);
 
-	// Create terrain program
-	terrain_program = PV112::CreateAndLinkProgram("shaders/terrain_vertex.glsl", "shaders/terrain_fragment.glsl",
-		position_loc, "position", normal_loc, "normal", tex_coord_loc, "tex_coord");
-	if (0 == terrain_program)
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
 		PV112::WaitForEnterAndExit();
 
-	int terrain_light_loc = glGetUniformBlockIndex(terrain_program, "LightData");
-	glUniformBlockBinding(terrain_program, terrain_light_loc, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, main_framebuffer);
 
-	int terrain_camera_loc = glGetUniformBlockIndex(terrain_program, "CameraData");
-	glUniformBlockBinding(terrain_program, terrain_camera_loc, 1);
+	// The old texture may have been bound and its name reused
+	gl_state.InvalidateTextures();
+}
 
-	int terrain_material_loc = glGetUniformBlockIndex(terrain_program, "MaterialData");
-	glUniformBlockBinding(terrain_program, terrain_material_loc, 2);
+// Binds the uniform block of the program to the binding, the depth pre-pass programs do not have all blocks
+void bindUniformBlock(GLuint program, const char *name, GLuint binding)
+{
+	GLuint index = glGetUniformBlockIndex(program, name);
+	if (index != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, index, binding);
+}
 
-	terrain_grass_tex_loc = glGetUniformLocation(terrain_program, "grass_tex");
-	terrain_rocks_tex_loc = glGetUniformLocation(terrain_program, "rocks_tex");
+// Binds the cluster block and the cluster buffer textures of a program that shades with the point lights
+void setClusterBindings(GLuint program)
+{
+	bindUniformBlock(program, "ClusterData", CLUSTER_UNIFORMS_BINDING);
 
-	terrain_model_matrix_loc = glGetUniformLocation(terrain_program, "model_matrix");
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "cluster_lights_tex"), CLUSTER_LIGHTS_UNIT);
+	glUniform1i(glGetUniformLocation(program, "cluster_grid_tex"), CLUSTER_GRID_UNIT);
+	glUniform1i(glGetUniformLocation(program, "cluster_indices_tex"), CLUSTER_INDICES_UNIT);
+	glUseProgram(0);
+}
 
-	// Create tree program
-	tree_program = PV112::CreateAndLinkProgram("shaders/tree_vertex.glsl", "shaders/tree_fragment.glsl",
-		position_loc, "position", normal_loc, "normal", tex_coord_loc, "tex_coord");
-	if (0 == tree_program)
-		PV112::WaitForEnterAndExit();
+// Binds the blocks and the samplers of a terrain or lamp program, the shading or the depth pre-pass one, and looks up
+// its uniforms
+TerrainProgram setupTerrainProgram(GLuint program)
+{
+	bindUniformBlock(program, "LightData", 0);
+	bindUniformBlock(program, "CameraData", 1);
+	bindUniformBlock(program, "MaterialData", 2);
+	bindUniformBlock(program, "LampData", 3);
+
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "terrain_tex"), 0);
+	glUniform1i(glGetUniformLocation(program, "grass_layer"), TERRAIN_GRASS_LAYER);
+	glUniform1i(glGetUniformLocation(program, "rocks_layer"), TERRAIN_ROCKS_LAYER);
+	glUniform1i(glGetUniformLocation(program, "terrain_lighting_tex"), 1);
+	glUseProgram(0);
 
-	int tree_light_loc = glGetUniformBlockIndex(tree_program, "LightData");
-	glUniformBlockBinding(tree_program, tree_light_loc, 0);
+	TerrainProgram terrain;
+	terrain.program = program;
+	terrain.model_matrix_loc = glGetUniformLocation(program, "model_matrix");
+	terrain.instance_offset_loc = glGetUniformLocation(program, "instance_offset");
+	return terrain;
+}
 
-	int tree_camera_loc = glGetUniformBlockIndex(tree_program, "CameraData");
-	glUniformBlockBinding(tree_program, tree_camera_loc, 1);
+// Binds the blocks and the sampler of a vegetation program, the shading or the depth pre-pass one, and looks up its
+// uniforms
+VegetationProgram setupVegetationProgram(GLuint program)
+{
+	bindUniformBlock(program, "LightData", 0);
+	bindUniformBlock(program, "CameraData", 1);
+	bindUniformBlock(program, "MaterialData", 2);
+	bindUniformBlock(program, "TreeData", 3);
 
-	int tree_material_loc = glGetUniformBlockIndex(tree_program, "MaterialData");
-	glUniformBlockBinding(tree_program, tree_material_loc, 2);
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "tree_tex"), 0);
+	glUseProgram(0);
 
-	int tree_tree_data_loc = glGetUniformBlockIndex(tree_program, "TreeData");
-	glUniformBlockBinding(tree_program, tree_tree_data_loc, 3);
+	VegetationProgram vegetation;
+	vegetation.program = program;
+	vegetation.model_matrix_loc = glGetUniformLocation(program, "model_matrix");
+	vegetation.wind_height_loc = glGetUniformLocation(program, "wind_height");
+	vegetation.app_time_loc = glGetUniformLocation(program, "app_time");
+	vegetation.tex_layer_loc = glGetUniformLocation(program, "tree_tex_layer");
+	vegetation.instance_offset_loc = glGetUniformLocation(program, "instance_offset");
+	return vegetation;
+}
 
-	tree_tex_loc = glGetUniformLocation(tree_program, "tree_tex");
+// Initializes OpenGL stuff
+void init()
+{
+	PROFILE_SCOPE("init");
 
-	tree_model_matrix_loc = glGetUniformLocation(tree_program, "model_matrix");
+	glClearColor(0.33f, 0.38f, 0.45f, 1.0f);
+	glClearDepth(1.0);
+	glEnable(GL_DEPTH_TEST);
 
-	tree_wind_height_loc = glGetUniformLocation(tree_program, "wind_height");
+	int position_loc = 0;
+	int normal_loc = 1;
+	int tex_coord_loc = 2;
 
-	tree_app_time_loc = glGetUniformLocation(tree_program, "app_time");
+	// Request all files up front, they are read and decoded on worker threads while the programs are compiled
+	AssetLoader loader;
+	Asset<Terrain> terrain_asset = loader.LoadHeightmapTerrain(MAYBEWIDE("resources/heightmap.png"), position_loc, normal_loc, tex_coord_loc);
+	Asset<PV112::Geometry> tree_asset = loader.LoadOBJ("resources/tree1.obj", position_loc, normal_loc, tex_coord_loc);
+	Asset<PV112::Geometry> bush_asset = loader.LoadOBJ("resources/bush.obj", position_loc, normal_loc, tex_coord_loc);
+	Asset<PV112::Geometry> long_grass_assets[12];
+	for (int i = 0; i < 12; ++i) {
+		std::ostringstream buffer;
+		buffer << "resources/grass" << std::to_string(i + 1) << ".obj";
+		long_grass_assets[i] = loader.LoadOBJ(buffer.str().c_str(), position_loc, normal_loc, tex_coord_loc);
+	}
+	Asset<PV112::Geometry> lamp_asset = loader.LoadOBJ("resources/lamp.obj", position_loc, normal_loc, tex_coord_loc);
+
+	// Textures are streamed through pixel buffers, their levels keep arriving during the first frames
+	texture_streamer = new TextureStreamer();
+	std::vector<std::basic_string<maybewchar>> terrain_layers(2);
+	terrain_layers[TERRAIN_GRASS_LAYER] = MAYBEWIDE("resources/grass.png");
+	terrain_layers[TERRAIN_ROCKS_LAYER] = MAYBEWIDE("resources/rocks.png");
+	terrain_tex_array = texture_streamer->StreamTextureArray(terrain_layers);
+	std::vector<std::basic_string<maybewchar>> vegetation_layers(3);
+	vegetation_layers[TREE_LAYER] = MAYBEWIDE("resources/tree1.png");
+	vegetation_layers[BUSH_LAYER] = MAYBEWIDE("resources/bush.tga");
+	vegetation_layers[LONG_GRASS_LAYER] = MAYBEWIDE("resources/long_grass.tga");
+	vegetation_tex_array = texture_streamer->StreamTextureArray(vegetation_layers);
+	water_normal_tex = texture_streamer->StreamTexture(MAYBEWIDE("resources/water_normal.png"), TEXTURE_COMPRESS_NORMAL_MAP);
 
-	// Create water program
-	water_program = PV112::CreateAndLinkProgram("shaders/water_vertex.glsl", "shaders/water_fragment.glsl",
-		position_loc, "position", normal_loc, "normal", tex_coord_loc, "tex_coord");
-	if (0 == water_program)
-		PV112::WaitForEnterAndExit();
+	water_geometry = PV112::CreateGrid(200, position_loc, normal_loc, tex_coord_loc);
 
-	int water_light_loc = glGetUniformBlockIndex(water_program, "LightData");
-	glUniformBlockBinding(water_program, water_light_loc, 0);
+	// Create the programs, the variants are specialized by their definitions. The programs of the passes differ in
+	// the clipping at the water plane, the depth pre-pass programs share the vertex shaders of the shading programs.
+	size_t terrain_variants[PASS_VARIANT_COUNT];
+	size_t lamp_variants[PASS_VARIANT_COUNT];
+	size_t terrain_depth_variants[PASS_VARIANT_COUNT];
+	size_t lamp_depth_variants[PASS_VARIANT_COUNT];
+	size_t tree_variants[PASS_VARIANT_COUNT];
+	size_t tree_depth_variants[PASS_VARIANT_COUNT];
+	size_t water_variant;
+	{
+		PROFILE_SCOPE("create programs");
+		auto meshVariant = [&](const char *vertex_shader, const char *fragment_shader, const ShaderDefines &defines) {
+			return ProgramVariant(vertex_shader, fragment_shader, defines)
+				.BindAttribute(position_loc, "position").BindAttribute(normal_loc, "normal").BindAttribute(tex_coord_loc, "tex_coord");
+		};
+
+		for (int v = 0; v < PASS_VARIANT_COUNT; ++v) {
+			ShaderDefines clip;
+			clip.Set("CLIP_PLANE", v == PASS_REFLECTION ? 1 : 0);
+			ShaderDefines lit = clip;
+			lit.Set("LIGHTS_COUNT", LIGHT_COUNT);
+
+			ShaderDefines terrain = lit;
+			terrain.Set("TRIPLANAR_BLEND_SHARPNESS", TRIPLANAR_BLEND_SHARPNESS).Set("BAKED_LIGHTING", 1);
+			terrain_variants[v] = shader_cache.Add(meshVariant("shaders/terrain_vertex.glsl", "shaders/terrain_fragment.glsl", terrain));
+			terrain_depth_variants[v] = shader_cache.Add(meshVariant("shaders/terrain_vertex.glsl", "shaders/depth_fragment.glsl", clip));
+
+			ShaderDefines lamp = terrain;
+			lamp.Set("BAKED_LIGHTING", 0).Set("LAMP_COUNT", MAX_LAMP_COUNT);
+			lamp_variants[v] = shader_cache.Add(meshVariant("shaders/terrain_vertex.glsl", "shaders/terrain_fragment.glsl", lamp));
+			ShaderDefines lamp_depth = clip;
+			lamp_depth.Set("LAMP_COUNT", MAX_LAMP_COUNT);
+			lamp_depth_variants[v] = shader_cache.Add(meshVariant("shaders/terrain_vertex.glsl", "shaders/depth_fragment.glsl", lamp_depth));
+
+			// The alpha test of the shading pass matches the coverage kept by the mip levels of the texture cache
+			ShaderDefines tree = lit;
+			tree.Set("TREE_COUNT", GRASS_COUNT).Set("ALPHA_CUTOFF", TEXTURE_CACHE_ALPHA_TEST_REFERENCE);
+			tree_variants[v] = shader_cache.Add(meshVariant("shaders/tree_vertex.glsl", "shaders/tree_fragment.glsl", tree));
+			ShaderDefines tree_depth = clip;
+			tree_depth.Set("TREE_COUNT", GRASS_COUNT).Set("ALPHA_CUTOFF", VEGETATION_DEPTH_ALPHA_CUTOFF);
+			tree_depth_variants[v] = shader_cache.Add(meshVariant("shaders/tree_vertex.glsl", "shaders/depth_alpha_fragment.glsl", tree_depth));
+		}
+
+		// The water is not reflected
+		ShaderDefines water;
+		water.Set("CLIP_PLANE", 0).Set("LIGHTS_COUNT", LIGHT_COUNT);
+		water_variant = shader_cache.Add(meshVariant("shaders/water_vertex.glsl", "shaders/water_fragment.glsl", water));
+
+		shader_cache.SetBinaryCacheEnabled(shader_binary_cache);
+		if (!shader_cache.Build())
+			PV112::WaitForEnterAndExit();
+		const ShaderCacheStats &shader_stats = shader_cache.Stats();
+		std::cout << "Programs: " << shader_stats.programs_loaded << " loaded from the cache, " << shader_stats.programs_compiled <<
+			" compiled in " << shader_stats.build_ms << " ms" << std::endl;
+	}
 
-	int water_camera_loc = glGetUniformBlockIndex(water_program, "CameraData");
-	glUniformBlockBinding(water_program, water_camera_loc, 1);
+	for (int v = 0; v < PASS_VARIANT_COUNT; ++v) {
+		terrain_programs[v] = setupTerrainProgram(shader_cache.Program(terrain_variants[v]));
+		setClusterBindings(terrain_programs[v].program);
+		lamp_programs[v] = setupTerrainProgram(shader_cache.Program(lamp_variants[v]));
+		setClusterBindings(lamp_programs[v].program);
+		terrain_depth_programs[v] = setupTerrainProgram(shader_cache.Program(terrain_depth_variants[v]));
+		lamp_depth_programs[v] = setupTerrainProgram(shader_cache.Program(lamp_depth_variants[v]));
+		tree_programs[v] = setupVegetationProgram(shader_cache.Program(tree_variants[v]));
+		setClusterBindings(tree_programs[v].program);
+		tree_depth_programs[v] = setupVegetationProgram(shader_cache.Program(tree_depth_variants[v]));
+	}
 
-	int water_material_loc = glGetUniformBlockIndex(water_program, "MaterialData");
-	glUniformBlockBinding(water_program, water_material_loc, 2);
+	water_program = shader_cache.Program(water_variant);
+	bindUniformBlock(water_program, "LightData", 0);
+	bindUniformBlock(water_program, "CameraData", 1);
+	bindUniformBlock(water_program, "MaterialData", 2);
+	setClusterBindings(water_program);
 
 	water_model_matrix_loc = glGetUniformLocation(water_program, "model_matrix");
 	water_app_time_loc = glGetUniformLocation(water_program, "app_time");
-	water_normal_tex_loc = glGetUniformLocation(water_program, "water_normal_tex");
-	water_reflection_tex_loc = glGetUniformLocation(water_program, "reflection_tex");
+	water_viewport_size_loc = glGetUniformLocation(water_program, "viewport_size");
+
+	glUseProgram(water_program);
+	glUniform1i(glGetUniformLocation(water_program, "water_normal_tex"), 0);
+	glUniform1i(glGetUniformLocation(water_program, "reflection_tex"), 1);
+	glUseProgram(0);
+
+	// Create geometries
+	{
+		PROFILE_SCOPE("wait for assets");
+		loader.Finish();
+	}
+	terrain_geometry = terrain_asset.Get();
+	tree_geometry = tree_asset.Get();
+	bush_geometry = bush_asset.Get();
+	for (int i = 0; i < 12; ++i) {
+		long_grass_geometry[i] = long_grass_assets[i].Get();
+	}
+	lamp_geometry = lamp_asset.Get();
+
+	my_camera = BlinkCamera(&terrain_geometry, 0.0f, 0.0f);
+	current_state.app_time = app_time;
+	current_state.eye_position = my_camera.GetEyePosition();
+	previous_state = current_state;
 
 	// Light
 	for (int i = 0; i < LIGHT_COUNT; ++i) {
@@ -328,110 +854,117 @@ void init()
 		lights.lights[i].specular_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
 	}
 
-	glGenBuffers(1, &lights_ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, lights_ubo);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(Lights), &lights, GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
 	// Camera
 	camera.view_matrix = glm::mat4(1.0f);
 	camera.projection_matrix = glm::mat4(1.0f);
 	camera.eye_position = glm::vec3(0.0f);
 
-	glGenBuffers(1, &camera_ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, camera_ubo);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(Camera), &camera, GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	dynamic_uniforms = new DynamicUniformBuffer();
+	gpu_profiler = new GpuProfiler();
+
+	// Performance counters
+	reflection_state_changes_counter = PerfCounters::Instance().Register("state changes reflection pass");
+	main_state_changes_counter = PerfCounters::Instance().Register("state changes main pass");
+	visible_lights_counter = PerfCounters::Instance().Register("visible point lights");
+	cluster_indices_counter = PerfCounters::Instance().Register("cluster light indices");
+	depth_prepass_draws_counter = PerfCounters::Instance().Register("depth pre-pass draws");
+	text_overlay = new TextOverlay(gl_state);
+
+	// Materials
+	material_buffer = new MaterialBuffer(sizeof(Material));
+	Material material;
 
-	// Material
 	material.ambient_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
 	material.diffuse_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
 	material.specular_color = glm::vec4(0.1f, 0.1f, 0.1f, 0.1f);
 	material.shininess = 1.0f;
+	terrain_material = material_buffer->Add(&material);
 
-	glGenBuffers(1, &material_ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, material_ubo);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(Material), &material, GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	material.specular_color = glm::vec4(0.5f, 0.5f, 0.5f, 0.5f);
+	material.shininess = 6.0f;
+	lamp_material = material_buffer->Add(&material);
 
-	// Tree locations buffer
-	RandomTrees(terrain_geometry, tree_data.tree_model_matrix, TREE_COUNT, [](float x, float y, float z) { return y < 0.2 ? 0.0 : y; });
-	glGenBuffers(1, &tree_data_ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, tree_data_ubo);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(tree_data), &tree_data, GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	material.specular_color = glm::vec4(0.1f, 0.1f, 0.1f, 0.1f);
+	material.shininess = 1.0f;
+	vegetation_material = material_buffer->Add(&material);
 
-	RandomTrees(terrain_geometry, tree_data.tree_model_matrix, TREE_COUNT, [](float x, float y, float z) { return y < 0.3 ? 0.0f : 1.0; });
-	glGenBuffers(1, &bush_data_ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, bush_data_ubo);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(tree_data), &tree_data, GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	material.ambient_color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	material.diffuse_color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	material.specular_color = glm::vec4(8.0f, 8.0f, 8.0f, 1.0f);
+	material.shininess = 200.0f;
+	water_material = material_buffer->Add(&material);
 
-	for (int i = 0; i < 12; ++i) {
-		RandomTrees(terrain_geometry, tree_data.tree_model_matrix, GRASS_COUNT, [](float x, float y, float z) { return y < 0.15 ? 0.02 : 1 - y/2; });
-		glGenBuffers(1, &long_grass_data_ubo[i]);
-		glBindBuffer(GL_UNIFORM_BUFFER, long_grass_data_ubo[i]);
-		glBufferData(GL_UNIFORM_BUFFER, sizeof(tree_data), &tree_data, GL_STATIC_DRAW);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
-	}
+	material_buffer->Upload();
 
-	// Grass texture
-	terrain_grass_tex = PV112::CreateAndLoadTexture(MAYBEWIDE("resources/grass.png"));
-	glBindTexture(GL_TEXTURE_2D, terrain_grass_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	// Tree locations buffer, the same seed places the same trees
+	scene_random.seed(scene_seed);
+	RandomTrees(terrain_geometry, tree_data.tree_model_matrix, TREE_COUNT, [](float x, float y, float z) { return y < 0.2 ? 0.0 : y; }, scene_random);
+	tree_instances.assign(tree_data.tree_model_matrix, tree_data.tree_model_matrix + TREE_COUNT);
+	RandomTrees(terrain_geometry, tree_data.tree_model_matrix, TREE_COUNT, [](float x, float y, float z) { return y < 0.3 ? 0.0f : 1.0; }, scene_random);
+	bush_instances.assign(tree_data.tree_model_matrix, tree_data.tree_model_matrix + TREE_COUNT);
 
-	// Rocks texture
-	terrain_rocks_tex = PV112::CreateAndLoadTexture(MAYBEWIDE("resources/rocks.png"));
-	glBindTexture(GL_TEXTURE_2D, terrain_rocks_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	// Lamps and the clusters of their lights
+	placeLamps(lamp_count);
+	main_clusters = new ClusteredLights(gl_state);
+	reflection_clusters = new ClusteredLights(gl_state);
+	worker_pool = new ThreadPool();
 
-	// Tree texture
-	tree_tex = PV112::CreateAndLoadTexture(MAYBEWIDE("resources/tree1.png"));
-	glBindTexture(GL_TEXTURE_2D, tree_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	// Normal map and ambient occlusion of the terrain, the coarse levels of detail keep the lighting of the heightmap
+	{
+		PROFILE_SCOPE("bake terrain lighting");
+		TerrainLightingMap terrain_lighting;
+		BakeTerrainLighting(terrain_geometry.height, glm::vec3(100.0f, TERRAIN_HEIGHT, 100.0f), TERRAIN_BAKE_SCALE, worker_pool,
+			terrain_lighting);
+		terrain_lighting_tex = CreateTerrainLightingTexture(terrain_lighting);
+	}
 
-	// Bush texture
-	bush_tex = PV112::CreateAndLoadTexture(MAYBEWIDE("resources/bush.tga"));
-	glBindTexture(GL_TEXTURE_2D, bush_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	// Each pass has its own buffers with the sorted instances. The binds go through gl_state, which tracks the
+	// uniform buffer binding.
+	PassObjects *passes[] = { &main_objects, &reflection_objects };
+	for (PassObjects *objects : passes) {
+		glGenBuffers(1, &objects->tree_data_ubo);
+		gl_state.BindBuffer(GL_UNIFORM_BUFFER, objects->tree_data_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(tree_data), &tree_data, GL_DYNAMIC_DRAW);
+		glGenBuffers(1, &objects->bush_data_ubo);
+		gl_state.BindBuffer(GL_UNIFORM_BUFFER, objects->bush_data_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(tree_data), &tree_data, GL_DYNAMIC_DRAW);
+		glGenBuffers(1, &objects->lamp_data_ubo);
+		gl_state.BindBuffer(GL_UNIFORM_BUFFER, objects->lamp_data_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, MAX_LAMP_COUNT * sizeof(glm::vec4), nullptr, GL_DYNAMIC_DRAW);
+	}
+	main_objects.terrain_lod = std::min(main_terrain_lod, std::max(int(terrain_geometry.LODs.size()) - 1, 0));
+	main_objects.draw_grass = true;
+	main_objects.variant = PASS_MAIN;
+	reflection_objects.terrain_lod = reflection_policy.terrain_lod;
+	reflection_objects.draw_grass = reflection_policy.draw_grass;
+	reflection_objects.variant = PASS_REFLECTION;
 
-	// Long grass texture
-	long_grass_tex = PV112::CreateAndLoadTexture(MAYBEWIDE("resources/long_grass.tga"));
-	glBindTexture(GL_TEXTURE_2D, long_grass_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	for (int i = 0; i < 12; ++i) {
+		RandomTrees(terrain_geometry, tree_data.tree_model_matrix, GRASS_COUNT, [](float x, float y, float z) { return y < 0.15 ? 0.02 : 1 - y/2; }, scene_random);
+		glGenBuffers(1, &long_grass_data_ubo[i]);
+		gl_state.BindBuffer(GL_UNIFORM_BUFFER, long_grass_data_ubo[i]);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(tree_data), &tree_data, GL_STATIC_DRAW);
+	}
+
+	// Terrain texture array
+	glBindTexture(GL_TEXTURE_2D_ARRAY, terrain_tex_array);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	// Vegetation texture array
+	glBindTexture(GL_TEXTURE_2D_ARRAY, vegetation_tex_array);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 
 	// Water normal texture
-	water_normal_tex = PV112::CreateAndLoadTexture(MAYBEWIDE("resources/water_normal.png"));
 	glBindTexture(GL_TEXTURE_2D, water_normal_tex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -439,30 +972,16 @@ void init()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
-	// Reflection texture
-	glGenFramebuffers(1, &reflection_framebuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, reflection_framebuffer);
+	loader.PrintTimeline(std::cout);
 
-	glGenTextures(1, &reflection_tex);
-	glBindTexture(GL_TEXTURE_2D, reflection_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, win_width, win_height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); //GL_MIRRORED_REPEAT
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	
-	
-	glGenRenderbuffers(1, &reflection_depth);
-	glBindRenderbuffer(GL_RENDERBUFFER, reflection_depth);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, win_width, win_height);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, reflection_depth);
-	
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, reflection_tex, 0);
-	GLenum DrawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
-	glDrawBuffers(1, DrawBuffers);
+	// Do not show the first frame with incomplete textures
+	{
+		PROFILE_SCOPE("wait for textures");
+		texture_streamer->WaitUntilUsable();
+	}
 
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-		PV112::WaitForEnterAndExit();
+	// Reflection texture
+	createReflectionTargets();
 
 
 	// Skybox cube texture
@@ -475,72 +994,138 @@ void init()
 }
 
 //Forward-declaration of functions
-void renderTerrain();
-void renderLamp();
-void renderTrees();
-void renderWater();
+void simulate();
+void renderFrame();
+void executeRenderQueue(GpuProfiler *profiler);
+void updateInstanceLODs(PassObjects &objects, const glm::vec3 &eye_position, int viewport_height, int lod_bias, float max_distance);
+void updateClusters(ClusteredLights *clusters, const glm::mat4 &view_matrix, const glm::mat4 &projection_matrix, int viewport_width, int viewport_height);
+bool waterVisible(const Frustum &frustum);
+void setFrameUniforms();
+void setMaterial(unsigned int material_id);
+void setDynamicUniforms(GLuint binding, const void *data, size_t size);
+void submitTerrain(RenderQueue &queue, const PassObjects &objects, const glm::vec3 &eye_position);
+void submitLamp(RenderQueue &queue, const PassObjects &objects, const glm::vec3 &eye_position);
+void submitVegetation(RenderQueue &queue, const PassObjects &objects, const glm::vec3 &eye_position);
+void submitWater(RenderQueue &queue, const glm::vec3 &eye_position);
 
 // Called when the window needs to be rerendered
 void render()
 {
-	float day_time = 1 - pow(sin(app_time / 120.0f), 4.0f);
+	// Simulate the steps elapsed since the last frame and render the state between the last two of them
+	int steps = frame_loop.BeginFrame();
+	for (int i = 0; i < steps; i++)
+		simulate();
+	float alpha = frame_loop.InterpolationAlpha();
+	render_app_time = glm::mix(previous_state.app_time, current_state.app_time, alpha);
+	render_eye_position = glm::mix(previous_state.eye_position, current_state.eye_position, alpha);
+	// The view direction follows the mouse immediately
+	render_look_position = render_eye_position + my_camera.GetLookPosition() - my_camera.GetEyePosition();
+
+	renderFrame();
+}
+
+// Renders and presents one frame of the interpolated state
+void renderFrame()
+{
+	PROFILE_SCOPE("frame");
+	frame_render_stats.draw_calls = 0;
+	frame_render_stats.instances = 0;
+
+	gpu_profiler->BeginFrame();
+
+	// Upload the next texture levels within the per frame budget
+	{
+		PROFILE_SCOPE("texture streaming");
+		texture_streamer->Update();
+		gl_state.InvalidateTextures();
+	}
+
+	float day_time = 1 - pow(sin(render_app_time / 120.0f), 4.0f);
 
 	glClearColor(0.66f * day_time, 0.76f * day_time, 0.90f * day_time, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	glBindBufferBase(GL_UNIFORM_BUFFER, 0, lights_ubo);
-	glBindBufferBase(GL_UNIFORM_BUFFER, 1, camera_ubo);
-	glBindBufferBase(GL_UNIFORM_BUFFER, 2, material_ubo);
-	
+	dynamic_uniforms->BeginFrame();
+
 	// Light position, with a simple animation
 	lights.lights[0].position =
-		glm::rotate(glm::mat4(1.0f), app_time * 0.1f, glm::vec3(0.0f, 1.0f, 0.0f)) *
+		glm::rotate(glm::mat4(1.0f), render_app_time * 0.1f, glm::vec3(0.0f, 1.0f, 0.0f)) *
 		glm::translate(glm::mat4(1.0f), glm::vec3(50.0f, 20.0f, 0.0f)) *
 		glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
 	lights.lights[0].diffuse_color = glm::vec4(1.2f, 1.2f, 1.2f, 1.0f) * day_time;
 	lights.lights[0].ambient_color = glm::vec4(0.4f, 0.4f, 0.4f, 1.0f) * day_time;
 	lights.lights[0].size = glm::vec4(10000.0f, 10000.0f, 10000.0f, 1.0f);
 	
-	lights.lights[1].position = glm::vec4(-10.0f, terrain_geometry.height[103][103] * TERRAIN_HEIGHT - 2.0f + 5.6f, -10.0f, 1.0f);
-	lights.lights[1].diffuse_color = glm::vec4(3 * 1.00f, 3 * 0.98f, 3 * 0.56f, 1.0f) * (1 - day_time);
-	lights.lights[1].ambient_color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f) * (1 - day_time);
-	lights.lights[1].size = glm::vec4(20.0f, 20.0f, 20.0f, 1.0f);
-	
-	glBindBuffer(GL_UNIFORM_BUFFER, lights_ubo);
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Lights), &lights);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	setDynamicUniforms(0, &lights, sizeof(Lights));
+
+	// Lights of the lamps, in the bulb of the lamp, the first lamp is brighter and reaches farther
+	point_lights.resize(lamp_positions.size());
+	for (size_t i = 0; i < lamp_positions.size(); i++) {
+		float intensity = i == 0 ? 3.0f : 1.5f;
+		point_lights[i].position = lamp_positions[i] + glm::vec3(0.0f, 5.6f, 0.0f);
+		point_lights[i].range = i == 0 ? 20.0f : PATH_LAMP_RANGE;
+		point_lights[i].ambient_color = glm::vec3(0.0f);
+		point_lights[i].diffuse_color = glm::vec3(1.00f, 0.98f, 0.56f) * intensity * (1 - day_time);
+		point_lights[i].specular_color = glm::vec3(1.0f) * (1 - day_time);
+	}
+
+	// Camera of the main pass, the reflection pass mirrors its view by the water plane
+	glm::mat4 projection_matrix = glm::perspective(glm::radians(45.0f), float(win_width) / float(win_height), 0.1f, 1000.0f);
+	glm::mat4 view_matrix = glm::lookAt(render_eye_position, render_look_position, glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 reflected_view_matrix = glm::scale(view_matrix, glm::vec3(1.0, -1.0, 1.0));
+	glm::vec3 reflected_eye = render_eye_position * glm::vec3(1.0f, -1.0f, 1.0f);
+
+	// Levels of detail of the main pass
+	updateInstanceLODs(main_objects, render_eye_position, win_height, 0, std::numeric_limits<float>::max());
+	setFrameUniforms();
 
 	/*
 		Reflection rendering
 	*/
 
-	glBindFramebuffer(GL_FRAMEBUFFER, reflection_framebuffer);
-	glViewport(0, 0, win_width, win_height);
+	// The reflection is seen only on the water, the pass is skipped when no water is in the view. GPU timer queries
+	// do not nest, so the pass is measured as a whole.
+	if (waterVisible(Frustum(projection_matrix * view_matrix))) {
+		PROFILE_SCOPE("reflection pass");
+		GpuProfileScope gpu_scope(gpu_profiler, "reflection");
+		PerfCounters::Instance().TraceCall("reflection pass");
+		unsigned int state_changes = gl_state.FrameStats().TotalIssued();
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		// Objects entirely below the water are clipped by the shaders, they are culled here with the mirrored view
+		reflection_objects.frustum = Frustum(projection_matrix * reflected_view_matrix);
+		reflection_objects.frustum.AddPlane(glm::vec4(0.0f, 1.0f, 0.0f, 0.0f));
+		updateInstanceLODs(reflection_objects, reflected_eye, reflection_height, reflection_policy.lod_bias, reflection_policy.draw_distance);
 
-	glEnable(GL_CLIP_DISTANCE0);
+		// Lights binned for the mirrored view and the reflection resolution
+		updateClusters(reflection_clusters, reflected_view_matrix, projection_matrix, reflection_width, reflection_height);
 
-	// Camera matrices and eye position
-	camera.projection_matrix = glm::perspective(glm::radians(45.0f), float(win_width) / float(win_height), 0.1f, 1000.0f);
-	camera.view_matrix = glm::lookAt(my_camera.GetEyePosition(), my_camera.GetLookPosition(), glm::vec3(0.0f, 1.0f, 0.0f));
-	camera.eye_position = my_camera.GetEyePosition();
+		glBindFramebuffer(GL_FRAMEBUFFER, reflection_framebuffer);
+		glViewport(0, 0, reflection_width, reflection_height);
 
-	camera.view_matrix = glm::scale(camera.view_matrix, glm::vec3(1.0, -1.0, 1.0));
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	glBindBuffer(GL_UNIFORM_BUFFER, camera_ubo);
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Camera), &camera);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		gl_state.Enable(GL_CLIP_DISTANCE0);
 
-	// Geometries
-	renderTerrain();
-	renderLamp();
-	renderTrees();
-	
-	glDisable(GL_CLIP_DISTANCE0);
+		// Camera matrices and eye position
+		camera.projection_matrix = projection_matrix;
+		camera.view_matrix = reflected_view_matrix;
+		camera.eye_position = render_eye_position;
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glViewport(0, 0, win_width, win_height);
+		setDynamicUniforms(1, &camera, sizeof(Camera));
+
+		// Geometries, sorted from the mirrored eye
+		render_queue.Clear();
+		submitTerrain(render_queue, reflection_objects, reflected_eye);
+		submitLamp(render_queue, reflection_objects, reflected_eye);
+		submitVegetation(render_queue, reflection_objects, reflected_eye);
+		executeRenderQueue(nullptr);
+
+		gl_state.Disable(GL_CLIP_DISTANCE0);
+		PerfCounters::Instance().Add(reflection_state_changes_counter, gl_state.FrameStats().TotalIssued() - state_changes);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, main_framebuffer);
+		glViewport(0, 0, win_width, win_height);
+	}
 
 	//glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -548,205 +1133,375 @@ void render()
 		Main rendering
 	*/
 
-	// Camera matrices and eye position
-	camera.projection_matrix = glm::perspective(glm::radians(45.0f), float(win_width) / float(win_height), 0.1f, 1000.0f);
-	camera.view_matrix = glm::lookAt(my_camera.GetEyePosition(), my_camera.GetLookPosition(), glm::vec3(0.0f, 1.0f, 0.0f));
-	camera.eye_position = my_camera.GetEyePosition();
-
-	glBindBuffer(GL_UNIFORM_BUFFER, camera_ubo);
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Camera), &camera);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	{
+		PROFILE_SCOPE("main pass");
+		PerfCounters::Instance().TraceCall("main pass");
+		unsigned int state_changes = gl_state.FrameStats().TotalIssued();
+
+		// Camera matrices and eye position
+		camera.projection_matrix = projection_matrix;
+		camera.view_matrix = view_matrix;
+		camera.eye_position = render_eye_position;
+
+		setDynamicUniforms(1, &camera, sizeof(Camera));
+		updateClusters(main_clusters, view_matrix, projection_matrix, win_width, win_height);
+
+		// Geometries, the GPU time is measured for each object
+		render_queue.Clear();
+		submitTerrain(render_queue, main_objects, camera.eye_position);
+		submitLamp(render_queue, main_objects, camera.eye_position);
+		submitVegetation(render_queue, main_objects, camera.eye_position);
+		submitWater(render_queue, camera.eye_position);
+		executeRenderQueue(gpu_profiler);
+		PerfCounters::Instance().Add(main_state_changes_counter, gl_state.FrameStats().TotalIssued() - state_changes);
+	}
 
-	// Geometries
-	renderTerrain();
-	renderLamp();
-	renderTrees();
-	renderWater();
-	
-	glBindVertexArray(0);
-	glUseProgram(0);
+	// The counters shown are of the previous frame, this one is not finished yet
+	if (show_overlay)
+		text_overlay->Draw(gl_state, PerfCounters::Instance().FormatLastFrame(), 8, 8, 2, win_width, win_height);
 
-	glutSwapBuffers();
+	gpu_profiler->EndFrame();
+	dynamic_uniforms->EndFrame();
+	{
+		PROFILE_SCOPE("swap buffers");
+		// The headless benchmark has no window, it waits for the frame, so the frame time includes the GPU work
+		if (benchmark_settings.enabled)
+			glFinish();
+		else
+			glutSwapBuffers();
+	}
+	gl_state.EndFrame();
+	PerfCounters::Instance().EndFrame();
+	Profiler::Instance().EndFrame();
 }
 
-void renderTerrain() {
-	
-	glUseProgram(terrain_program);
-
-	glBindVertexArray(terrain_geometry.VAO);
-
-	material.ambient_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-	material.diffuse_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-	material.specular_color = glm::vec4(0.1f, 0.1f, 0.1f, 0.1f);
-	material.shininess = 1.0f;
-
-	glBindBuffer(GL_UNIFORM_BUFFER, material_ubo);
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Material), &material);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-	glm::mat4 model_matrix(1.0f);
-	model_matrix = glm::translate(model_matrix, glm::vec3(0.0f, -2.0f, 0.0f));
-	model_matrix = glm::scale(model_matrix, glm::vec3(100.0f, TERRAIN_HEIGHT, 100.0f));
-	glUniformMatrix4fv(terrain_model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
-
-	glUniform1i(terrain_grass_tex_loc, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, terrain_grass_tex);
-
-	glUniform1i(terrain_rocks_tex_loc, 1);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, terrain_rocks_tex);
-
-	glEnable(GL_PRIMITIVE_RESTART);
-	glPrimitiveRestartIndex(4294967295U);
-	PV112::DrawGeometry(terrain_geometry);
-	glDisable(GL_PRIMITIVE_RESTART);
+// Selects the level of detail of each tree, bush and lamp of a pass from its projected size and uploads the
+// instances sorted by it. 'lod_bias' levels are added to the selected ones, trees and bushes farther than
+// 'max_distance' and all instances outside of the frustum of the pass are left out.
+void updateInstanceLODs(PassObjects &objects, const glm::vec3 &eye_position, int viewport_height, int lod_bias, float max_distance) {
+	PROFILE_SCOPE("update LODs");
+	const float fovy = glm::radians(45.0f);
+	glm::mat4 model_matrix = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 0.0f));
+	std::vector<glm::mat4> sorted;
+
+	SortInstancesByLOD(tree_geometry, tree_instances, model_matrix, eye_position, fovy, viewport_height, sorted, objects.tree_lod_counts,
+		lod_bias, max_distance, &objects.frustum);
+	gl_state.BindBuffer(GL_UNIFORM_BUFFER, objects.tree_data_ubo);
+	Counted::BufferSubData(GL_UNIFORM_BUFFER, 0, sorted.size() * sizeof(glm::mat4), sorted.data());
+
+	SortInstancesByLOD(bush_geometry, bush_instances, model_matrix, eye_position, fovy, viewport_height, sorted, objects.bush_lod_counts,
+		lod_bias, max_distance, &objects.frustum);
+	gl_state.BindBuffer(GL_UNIFORM_BUFFER, objects.bush_data_ubo);
+	Counted::BufferSubData(GL_UNIFORM_BUFFER, 0, sorted.size() * sizeof(glm::mat4), sorted.data());
+
+	// The lamps light the paths, they are drawn at any distance. Only their positions are uploaded.
+	SortInstancesByLOD(lamp_geometry, lamp_instances, glm::mat4(1.0f), eye_position, fovy, viewport_height, sorted, objects.lamp_lod_counts,
+		lod_bias, std::numeric_limits<float>::max(), &objects.frustum);
+	std::vector<glm::vec4> sorted_positions(sorted.size());
+	for (size_t i = 0; i < sorted.size(); i++)
+		sorted_positions[i] = sorted[i][3];
+	gl_state.BindBuffer(GL_UNIFORM_BUFFER, objects.lamp_data_ubo);
+	Counted::BufferSubData(GL_UNIFORM_BUFFER, 0, sorted_positions.size() * sizeof(glm::vec4), sorted_positions.data());
 }
 
-void renderLamp() {
-
-	glUseProgram(terrain_program);
+// Bins the lights of the lamps for the view of a pass, binds the clusters and their uniforms
+void updateClusters(ClusteredLights *clusters, const glm::mat4 &view_matrix, const glm::mat4 &projection_matrix, int viewport_width, int viewport_height) {
+	clusters->Update(point_lights, view_matrix, projection_matrix, 0.1f, 1000.0f, viewport_width, viewport_height, worker_pool);
+	clusters->Bind(gl_state);
+	setDynamicUniforms(CLUSTER_UNIFORMS_BINDING, &clusters->Grid().Uniforms(), sizeof(ClusterUniforms));
 
-	glBindVertexArray(lamp_geometry.VAO);
-
-	material.ambient_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-	material.diffuse_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-	material.specular_color = glm::vec4(0.5f, 0.5f, 0.5f, 0.5f);
-	material.shininess = 6.0f;
-
-	glBindBuffer(GL_UNIFORM_BUFFER, material_ubo);
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Material), &material);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-	glm::mat4 model_matrix(1.0f);
-	model_matrix = glm::translate(model_matrix, glm::vec3(-10.0f, terrain_geometry.height[103][103] * TERRAIN_HEIGHT - 2.0f, -10.0f));
-	model_matrix = glm::scale(model_matrix, glm::vec3(1.0f, 1.0f, 1.0f));
-	glUniformMatrix4fv(terrain_model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+	const ClusterStats &stats = clusters->Grid().Stats();
+	PerfCounters::Instance().Add(visible_lights_counter, stats.visible_lights);
+	PerfCounters::Instance().Add(cluster_indices_counter, stats.light_indices);
+}
 
-	glUniform1i(terrain_grass_tex_loc, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, terrain_grass_tex);
+// Returns the bounding box of the terrain chunk in world space
+void terrainChunkBounds(const TerrainChunk &chunk, glm::vec3 &out_min, glm::vec3 &out_max) {
+	glm::mat4 model_matrix = terrainModelMatrix();
+	out_min = glm::vec3(model_matrix * glm::vec4(chunk.bounds_min, 1.0f));
+	out_max = glm::vec3(model_matrix * glm::vec4(chunk.bounds_max, 1.0f));
+}
 
-	glUniform1i(terrain_rocks_tex_loc, 1);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, terrain_rocks_tex);
+// Returns true if some water may be seen in the frustum. The water covers the terrain at height 0, it can be seen
+// only over the chunks of the terrain that reach below it.
+bool waterVisible(const Frustum &frustum) {
+	if (terrain_geometry.chunks.empty())
+		return true;
+
+	// Margin for the waves
+	const float wave_height = 0.1f;
+	for (size_t i = 0; i < terrain_geometry.chunks.size(); i++) {
+		glm::vec3 chunk_min, chunk_max;
+		terrainChunkBounds(terrain_geometry.chunks[i], chunk_min, chunk_max);
+		if (chunk_min.y > wave_height)
+			continue;
+		if (frustum.IntersectsBox(glm::vec3(chunk_min.x, -wave_height, chunk_min.z), glm::vec3(chunk_max.x, wave_height, chunk_max.z)))
+			return true;
+	}
+	return false;
+}
 
-	PV112::DrawGeometry(lamp_geometry);
+// Sorts and draws the render queue, adds its draws to the frame
+void executeRenderQueue(GpuProfiler *profiler) {
+	render_queue.Sort();
+	if (depth_prepass) {
+		PROFILE_SCOPE("depth pre-pass");
+		if (profiler)
+			profiler->Begin("depth pre-pass");
+		render_queue.ExecuteDepthPrePass(gl_state);
+		PerfCounters::Instance().Add(depth_prepass_draws_counter, render_queue.LastStats().depth_draw_calls);
+	}
+	render_queue.Execute(gl_state, setMaterial, profiler);
+	frame_render_stats.draw_calls += render_queue.LastStats().draw_calls;
+	frame_render_stats.instances += render_queue.LastStats().instances;
 }
 
+// Sets the uniforms that change once per frame
+void setFrameUniforms() {
+	for (int v = 0; v < PASS_VARIANT_COUNT; ++v) {
+		gl_state.UseProgram(tree_programs[v].program);
+		glUniform1f(tree_programs[v].app_time_loc, render_app_time);
+		gl_state.UseProgram(tree_depth_programs[v].program);
+		glUniform1f(tree_depth_programs[v].app_time_loc, render_app_time);
+	}
 
-void renderTrees() {
-	glUseProgram(tree_program);
+	gl_state.UseProgram(water_program);
+	glUniform1f(water_app_time_loc, render_app_time * 0.05f);
+	glUniform2f(water_viewport_size_loc, float(win_width), float(win_height));
+}
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+// Copies the data to a new range of the dynamic uniform buffer and binds it
+void setDynamicUniforms(GLuint binding, const void *data, size_t size) {
+	DynamicUniformRange range;
+	if (dynamic_uniforms->Allocate(data, size, range))
+		dynamic_uniforms->Bind(gl_state, binding, range);
+}
 
-	glUniform1f(tree_app_time_loc, app_time);
+// Binds the range of the material, called by the render queue when the material changes
+void setMaterial(unsigned int material_id) {
+	material_buffer->Bind(gl_state, 2, material_id);
+}
 
-	material.ambient_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-	material.diffuse_color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-	material.specular_color = glm::vec4(0.1f, 0.1f, 0.1f, 0.1f);
-	material.shininess = 1.0f;
+// Returns the variant whose program is bound for the packet
+template <typename T>
+const T &programVariant(const T (&variants)[PASS_VARIANT_COUNT], GLuint program) {
+	return variants[PASS_REFLECTION].program == program ? variants[PASS_REFLECTION] : variants[PASS_MAIN];
+}
 
-	glBindBuffer(GL_UNIFORM_BUFFER, material_ubo);
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Material), &material);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+void setTerrainUniforms(const RenderPacket &packet) {
+	glm::mat4 model_matrix = terrainModelMatrix();
+	glUniformMatrix4fv(programVariant(terrain_programs, packet.program).model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+}
 
+void setTerrainDepthUniforms(const RenderPacket &packet) {
+	glm::mat4 model_matrix = terrainModelMatrix();
+	glUniformMatrix4fv(programVariant(terrain_depth_programs, packet.depth_program).model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+}
 
+// Sets the uniforms of the lamp packet to the program, the instances are moved by their positions in LampData
+void setLampUniformsAt(const RenderPacket &packet, const TerrainProgram &program) {
 	glm::mat4 model_matrix(1.0f);
-	model_matrix = glm::translate(model_matrix, glm::vec3(0.0f, -2.0f, 0.0f));
-	model_matrix = glm::scale(model_matrix, glm::vec3(1.0f, 1.0f, 1.0f));
-	glUniformMatrix4fv(tree_model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+	glUniformMatrix4fv(program.model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+	glUniform1i(program.instance_offset_loc, packet.first_instance);
+}
 
-	glBindVertexArray(tree_geometry.VAO);
+void setLampUniforms(const RenderPacket &packet) {
+	setLampUniformsAt(packet, programVariant(lamp_programs, packet.program));
+}
 
-	glUniform1f(tree_wind_height_loc, 15.0);
+void setLampDepthUniforms(const RenderPacket &packet) {
+	setLampUniformsAt(packet, programVariant(lamp_depth_programs, packet.depth_program));
+}
 
-	glUniform1i(tree_tex_loc, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, tree_tex);
+// Sets the uniforms of the vegetation packet to the program, the shading and the depth programs share the vertex
+// shader
+void setVegetationUniformsAt(const RenderPacket &packet, const VegetationProgram &program) {
+	glm::mat4 model_matrix = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 0.0f));
+	glUniformMatrix4fv(program.model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
 
-	glBindBufferBase(GL_UNIFORM_BUFFER, 3, tree_data_ubo);
+	switch (packet.object) {
+	case OBJECT_TREES:
+		glUniform1f(program.wind_height_loc, 15.0);
+		glUniform1i(program.tex_layer_loc, TREE_LAYER);
+		break;
+	case OBJECT_BUSHES:
+		glUniform1f(program.wind_height_loc, 10.0);
+		glUniform1i(program.tex_layer_loc, BUSH_LAYER);
+		break;
+	case OBJECT_LONG_GRASS:
+		glUniform1f(program.wind_height_loc, 2.0);
+		glUniform1i(program.tex_layer_loc, LONG_GRASS_LAYER);
+		break;
+	}
+	glUniform1i(program.instance_offset_loc, packet.first_instance);
+}
 
-	PV112::DrawGeometryInstanced(tree_geometry, TREE_COUNT);
-	
-	
-	glBindVertexArray(bush_geometry.VAO);
+void setVegetationUniforms(const RenderPacket &packet) {
+	setVegetationUniformsAt(packet, programVariant(tree_programs, packet.program));
+}
 
-	glUniform1f(tree_wind_height_loc, 10.0);
+void setVegetationDepthUniforms(const RenderPacket &packet) {
+	setVegetationUniformsAt(packet, programVariant(tree_depth_programs, packet.depth_program));
+}
 
-	glUniform1i(tree_tex_loc, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, bush_tex);
+void setWaterUniforms(const RenderPacket &packet) {
+	glm::mat4 model_matrix = glm::scale(glm::mat4(1.0f), glm::vec3(100.0f, 0.2f, 100.0f));
+	glUniformMatrix4fv(water_model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
+}
 
-	glBindBufferBase(GL_UNIFORM_BUFFER, 3, bush_data_ubo);
+void submitTerrain(RenderQueue &queue, const PassObjects &objects, const glm::vec3 &eye_position) {
+	RenderPacket packet;
+	packet.program = terrain_programs[objects.variant].program;
+	packet.depth_program = terrain_depth_programs[objects.variant].program;
+	packet.vertex_array = terrain_geometry.VAO;
+	packet.material = terrain_material;
+	packet.texture_targets[0] = GL_TEXTURE_2D_ARRAY;
+	packet.textures[0] = terrain_tex_array;
+	packet.textures[1] = terrain_lighting_tex;
+	packet.primitive_restart = true;
+	packet.geometry = &terrain_geometry;
+	packet.lod = terrain_geometry.LODs.empty() ? -1 : objects.terrain_lod;
+	packet.set_uniforms = setTerrainUniforms;
+	packet.set_depth_uniforms = setTerrainDepthUniforms;
+	packet.object = OBJECT_TERRAIN;
+	packet.gpu_scope = "terrain";
+
+	if (objects.frustum.PlaneCount() == 0 || terrain_geometry.chunks.empty() || packet.lod < 0) {
+		packet.depth = PacketDepth(terrainBounds(), eye_position);
+		queue.Submit(packet);
+		return;
+	}
 
-	PV112::DrawGeometryInstanced(bush_geometry, TREE_COUNT);
+	// Only the chunks in the frustum are drawn, the chunks of a level follow each other in the index buffer, so
+	// neighbouring visible chunks are drawn at once
+	packet.index_count = 0;
+	packet.depth = RENDER_QUEUE_FAR_DEPTH;
+	for (size_t i = 0; i < terrain_geometry.chunks.size(); i++) {
+		const PV112::GeometryLOD &range = terrain_geometry.chunks[i].lods[packet.lod];
+		glm::vec3 chunk_min, chunk_max;
+		terrainChunkBounds(terrain_geometry.chunks[i], chunk_min, chunk_max);
+		if (!objects.frustum.IntersectsBox(chunk_min, chunk_max))
+			continue;
+
+		if (packet.index_count > 0 && packet.first_index + packet.index_count != range.FirstIndex) {
+			queue.Submit(packet);
+			packet.index_count = 0;
+			packet.depth = RENDER_QUEUE_FAR_DEPTH;
+		}
+		if (packet.index_count == 0)
+			packet.first_index = range.FirstIndex;
+		packet.index_count += range.Count;
+
+		glm::vec3 center = (chunk_min + chunk_max) * 0.5f;
+		packet.depth = std::min(packet.depth, PacketDepth(glm::vec4(center, glm::distance(center, chunk_max)), eye_position));
+	}
+	if (packet.index_count > 0)
+		queue.Submit(packet);
+}
 
+// Submits one packet for each level of detail of the instances, the instances of a level follow each other
+void submitInstancesByLOD(RenderQueue &queue, const RenderPacket &packet, const std::vector<int> &lod_counts) {
+	RenderPacket lod_packet = packet;
+	for (size_t lod = 0; lod < lod_counts.size(); lod++) {
+		if (lod_counts[lod] == 0)
+			continue;
+		lod_packet.lod = packet.geometry->LODs.empty() ? -1 : int(lod);
+		lod_packet.instance_count = lod_counts[lod];
+		queue.Submit(lod_packet);
+		lod_packet.first_instance += lod_counts[lod];
+	}
+}
 
-	glUniform1f(tree_wind_height_loc, 2.0);
+void submitLamp(RenderQueue &queue, const PassObjects &objects, const glm::vec3 &eye_position) {
+	RenderPacket packet;
+	packet.program = lamp_programs[objects.variant].program;
+	packet.depth_program = lamp_depth_programs[objects.variant].program;
+	packet.vertex_array = lamp_geometry.VAO;
+	packet.material = lamp_material;
+	packet.texture_targets[0] = GL_TEXTURE_2D_ARRAY;
+	packet.textures[0] = terrain_tex_array;
+	packet.instance_buffer = objects.lamp_data_ubo;
+	packet.geometry = &lamp_geometry;
+	// The lamps are spread along the paths around the lake
+	packet.depth = PacketDepth(terrainBounds(), eye_position);
+	packet.set_uniforms = setLampUniforms;
+	packet.set_depth_uniforms = setLampDepthUniforms;
+	packet.object = OBJECT_LAMP;
+	packet.gpu_scope = "lamps";
+	submitInstancesByLOD(queue, packet, objects.lamp_lod_counts);
+}
 
-	glUniform1i(tree_tex_loc, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, long_grass_tex);
+void submitVegetation(RenderQueue &queue, const PassObjects &objects, const glm::vec3 &eye_position) {
+	RenderPacket packet;
+	packet.layer = RENDER_LAYER_ALPHA_TESTED;
+	packet.program = tree_programs[objects.variant].program;
+	packet.depth_program = tree_depth_programs[objects.variant].program;
+	packet.material = vegetation_material;
+	packet.texture_targets[0] = GL_TEXTURE_2D_ARRAY;
+	packet.textures[0] = vegetation_tex_array;
+	// The instances are spread over the whole terrain
+	packet.depth = PacketDepth(terrainBounds(), eye_position);
+	packet.set_uniforms = setVegetationUniforms;
+	packet.set_depth_uniforms = setVegetationDepthUniforms;
+
+	packet.vertex_array = tree_geometry.VAO;
+	packet.instance_buffer = objects.tree_data_ubo;
+	packet.geometry = &tree_geometry;
+	packet.object = OBJECT_TREES;
+	packet.gpu_scope = "trees";
+	submitInstancesByLOD(queue, packet, objects.tree_lod_counts);
+
+	packet.vertex_array = bush_geometry.VAO;
+	packet.instance_buffer = objects.bush_data_ubo;
+	packet.geometry = &bush_geometry;
+	packet.object = OBJECT_BUSHES;
+	packet.gpu_scope = "trees";
+	submitInstancesByLOD(queue, packet, objects.bush_lod_counts);
+
+	if (!objects.draw_grass)
+		return;
 
+	packet.object = OBJECT_LONG_GRASS;
+	packet.gpu_scope = "grass";
+	packet.instance_count = GRASS_COUNT;
 	for (int i = 0; i < 12; ++i) {
-		glBindVertexArray(long_grass_geometry[i].VAO);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 3, long_grass_data_ubo[i]);
-		PV112::DrawGeometryInstanced(long_grass_geometry[i], GRASS_COUNT);
+		packet.vertex_array = long_grass_geometry[i].VAO;
+		packet.instance_buffer = long_grass_data_ubo[i];
+		packet.geometry = &long_grass_geometry[i];
+		queue.Submit(packet);
 	}
-
-	glDisable(GL_BLEND);
 }
 
-void renderWater() {
-	glm::mat4 model_matrix;
-
-	glUseProgram(water_program);
-
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-	glBindVertexArray(water_geometry.VAO);
-
-	material.ambient_color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-	material.diffuse_color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-	material.specular_color = glm::vec4(8.0f, 8.0f, 8.0f, 1.0f);
-	material.shininess = 200.0f;
-
-	glBindBuffer(GL_UNIFORM_BUFFER, material_ubo);
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Material), &material);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-	model_matrix = glm::scale(glm::mat4(1.0f), glm::vec3(100.0f, 0.2f, 100.0f));
-	glUniformMatrix4fv(water_model_matrix_loc, 1, GL_FALSE, glm::value_ptr(model_matrix));
-
-	glUniform1f(water_app_time_loc, app_time * 0.05f);
-
-	glUniform1i(water_normal_tex_loc, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, water_normal_tex);
-
-	glUniform1i(water_reflection_tex_loc, 1);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, reflection_tex);
-
-	glEnable(GL_PRIMITIVE_RESTART);
-	glPrimitiveRestartIndex(4294967295U);
-	PV112::DrawGeometry(water_geometry);
-	glDisable(GL_PRIMITIVE_RESTART);
-
-	glDisable(GL_BLEND);
+void submitWater(RenderQueue &queue, const glm::vec3 &eye_position) {
+	RenderPacket packet;
+	packet.layer = RENDER_LAYER_TRANSPARENT;
+	packet.program = water_program;
+	packet.vertex_array = water_geometry.VAO;
+	packet.material = water_material;
+	packet.textures[0] = water_normal_tex;
+	packet.textures[1] = reflection_tex;
+	packet.primitive_restart = true;
+	packet.geometry = &water_geometry;
+	packet.depth = PacketDepth(glm::vec4(0.0f, 0.0f, 0.0f, terrainBounds().w), eye_position);
+	packet.set_uniforms = setWaterUniforms;
+	packet.object = OBJECT_WATER;
+	packet.gpu_scope = "water";
+	queue.Submit(packet);
 }
 
 // Called when the window changes its size
 void reshape(int width, int height)
 {
+	bool resized = width != win_width || height != win_height;
 	win_width = width;
 	win_height = height;
 
 	// Set the area into which we render
 	glViewport(0, 0, win_width, win_height);
+
+	// The reflection targets follow the size of the window
+	if (resized)
+		createReflectionTargets();
 }
 
 // Callback function to be called when we make an error in OpenGL
@@ -765,20 +1520,253 @@ void GLAPIENTRY simple_debug_callback(GLenum source, GLenum type, GLuint id,
 	}
 }
 
-// Simple timer function for animations
-void timer(int)
+// Advances the animations and the camera by one step of the frame loop
+void simulate()
 {
+	previous_state = current_state;
+
+	// The replayed input arrives right before the step it arrived before when it was recorded
+	InputEvent event;
+	while (input_replay && input_replay->NextEvent(simulation_tick, event))
+		applyInput(event);
+
 	app_time += animation_speed;
 	my_camera.Move();
-	glutTimerFunc(20, timer, 0);
+	current_state.app_time = app_time;
+	current_state.eye_position = my_camera.GetEyePosition();
+
+	CameraSample sample;
+	for (int i = 0; i < 3; i++)
+		sample.eye_position[i] = current_state.eye_position[i];
+	sample.direction = my_camera.GetDirection();
+	sample.elevation = my_camera.GetElevation();
+	if (!recording_file.empty())
+		input_recording.samples.push_back(sample);
+	if (input_replay)
+		input_replay->CheckSample(simulation_tick, sample);
+	simulation_tick++;
+}
+
+// Called when there are no events, the next frame is rendered right away and paced by the frame loop
+void idle()
+{
 	glutPostRedisplay();
 }
 
+// Renders the frames of the benchmark from the scripted camera path without a window and writes the report
+int runBenchmark()
+{
+	HeadlessContext context;
+	if (!context.Create())
+		return 1;
+
+	// Initialize GLEW
+	glewExperimental = GL_TRUE;
+	glewInit();
+
+	// The recorded input is replayed on the scene it was recorded in
+	if (!benchmark_settings.replay_file.empty()) {
+		if (!replay_recording.Load(benchmark_settings.replay_file))
+			return 1;
+		scene_seed = replay_recording.seed;
+		input_replay = new InputReplay(replay_recording);
+	}
+
+	win_width = benchmark_settings.width;
+	win_height = benchmark_settings.height;
+	if (!context.CreateFramebuffer(win_width, win_height))
+		return 1;
+	main_framebuffer = context.Framebuffer();
+
+	// Initialize DevIL library
+	ilInit();
+
+	init();
+	glViewport(0, 0, win_width, win_height);
+
+	// Primitives are counted by the GPU, so strips and levels of detail need no bookkeeping. The query spans the
+	// whole frame, the count is the total of all passes.
+	GLuint primitives_query;
+	glGenQueries(1, &primitives_query);
+
+	BenchmarkReport report;
+	int measured_frames = input_replay ? int(input_replay->TickCount()) : benchmark_settings.frames;
+	int frame_count = benchmark_settings.warmup_frames + measured_frames;
+	for (int frame = 0; frame < frame_count; frame++) {
+		// The warmup frames show the first frame, then each frame is one simulation step, so all runs render the
+		// same frames
+		bool warmup = frame < benchmark_settings.warmup_frames;
+		if (!input_replay) {
+			int path_frame = std::max(frame - benchmark_settings.warmup_frames, 0);
+			BenchmarkCameraPose pose = BenchmarkCameraPath(float(path_frame) / float(std::max(benchmark_settings.frames, 1)));
+			my_camera.SetView(pose.x, pose.z, pose.direction, pose.elevation);
+		}
+		if (!warmup)
+			simulate();
+		render_app_time = app_time;
+		render_eye_position = my_camera.GetEyePosition();
+		render_look_position = my_camera.GetLookPosition();
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		glBeginQuery(GL_PRIMITIVES_GENERATED, primitives_query);
+		renderFrame();
+		glEndQuery(GL_PRIMITIVES_GENERATED);
+		double frame_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		GLuint64 primitives = 0;
+		glGetQueryObjectui64v(primitives_query, GL_QUERY_RESULT, &primitives);
+
+		if (warmup)
+			continue;
+		BenchmarkFrame measured;
+		measured.frame_time = frame_time;
+		measured.draw_calls = frame_render_stats.draw_calls;
+		measured.instances = frame_render_stats.instances;
+		measured.triangles_all_passes = primitives;
+		report.AddFrame(measured);
+	}
+	glDeleteQueries(1, &primitives_query);
+
+	if (input_replay && input_replay->DivergentTicks() > 0)
+		std::cout << "The replay diverged from the recording in " << input_replay->DivergentTicks() << " steps, first at step "
+			<< input_replay->FirstDivergentTick() << std::endl;
+	if (!benchmark_settings.trace_file.empty() && !report.WriteTrace(benchmark_settings.trace_file))
+		return 1;
+
+	std::string renderer = reinterpret_cast<const char *>(glGetString(GL_RENDERER));
+	if (benchmark_settings.report_file.empty()) {
+		report.Write(std::cout, benchmark_settings, renderer, Profiler::Instance().ComputeStats());
+		return 0;
+	}
+	std::ofstream report_file(benchmark_settings.report_file.c_str());
+	report.Write(report_file, benchmark_settings, renderer, Profiler::Instance().ComputeStats());
+	if (!report_file) {
+		std::cout << "Cannot write the benchmark report " << benchmark_settings.report_file << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
 int main(int argc, char ** argv)
 {
 	//std::string line;
 	//std::cin >> line;
 
+	// Offline conversion of OBJ files to the binary mesh cache, no window is needed
+	if (argc > 1 && std::string(argv[1]) == "--convert-meshes")
+	{
+		bool success = true;
+		for (int i = 2; i < argc; ++i)
+			success = ConvertOBJToMeshCache(argv[i]) && success;
+		return success ? 0 : 1;
+	}
+
+	// Offline conversion of images to the texture cache, files after --normal-map are converted as normal maps
+	if (argc > 1 && std::string(argv[1]) == "--convert-textures")
+	{
+		ThreadPool pool;
+		TextureCompression compression = TEXTURE_COMPRESS_COLOR;
+		bool success = true;
+		for (int i = 2; i < argc; ++i)
+		{
+			std::string argument = argv[i];
+			if (argument == "--normal-map")
+				compression = TEXTURE_COMPRESS_NORMAL_MAP;
+			else
+				success = ConvertTextureToCache(std::basic_string<maybewchar>(argument.begin(), argument.end()).c_str(), compression, &pool) && success;
+		}
+		return success ? 0 : 1;
+	}
+
+	// Compares the frame times of two benchmark traces, for example of two builds replaying one recording
+	if (argc == 4 && std::string(argv[1]) == "--compare-traces")
+	{
+		std::vector<BenchmarkFrame> baseline, candidate;
+		if (!LoadBenchmarkTrace(argv[2], baseline) || !LoadBenchmarkTrace(argv[3], candidate))
+			return 1;
+		CompareBenchmarkTraces(baseline, candidate, std::cout);
+		return 0;
+	}
+
+	// Measures the throughput of the image decoder on the given files with increasing thread counts
+	if (argc > 1 && std::string(argv[1]) == "--benchmark-images")
+	{
+		std::vector<std::string> files(argv + 2, argv + argc);
+		BenchmarkImageDecoding(files, 10, std::cout);
+		return 0;
+	}
+
+	// Measures the bake of the terrain lighting of the scene with increasing thread counts
+	if (argc > 1 && std::string(argv[1]) == "--benchmark-terrain-bake")
+	{
+		TerrainData terrain;
+		try {
+			BuildHeightmapTerrain(MAYBEWIDE("resources/heightmap.png"), terrain);
+		}
+		catch (const std::logic_error &error) {
+			std::cout << error.what() << std::endl;
+			return 1;
+		}
+		BenchmarkTerrainBake(terrain.height, glm::vec3(100.0f, TERRAIN_HEIGHT, 100.0f), TERRAIN_BAKE_SCALE, 5, std::cout);
+		return 0;
+	}
+
+	// Resolution of the water reflection relative to the window, how the frames are presented
+	PresentMode present_mode = PRESENT_VSYNC;
+	bool seed_given = false;
+	for (int i = 1; i + 1 < argc; ++i)
+	{
+		if (std::string(argv[i]) == "--reflection-scale")
+			reflection_policy.resolution_scale = glm::clamp(float(atof(argv[i + 1])), 0.1f, 1.0f);
+		else if (std::string(argv[i]) == "--present" && !ParsePresentMode(argv[i + 1], present_mode))
+			std::cout << "Unknown present mode " << argv[i + 1] << ", use vsync, uncapped or paced" << std::endl;
+		else if (std::string(argv[i]) == "--target-fps")
+			frame_loop.SetTargetFrameRate(atof(argv[i + 1]));
+		else if (std::string(argv[i]) == "--benchmark-frames")
+			benchmark_settings.frames = std::max(atoi(argv[i + 1]), 1);
+		else if (std::string(argv[i]) == "--benchmark-warmup")
+			benchmark_settings.warmup_frames = std::max(atoi(argv[i + 1]), 0);
+		else if (std::string(argv[i]) == "--benchmark-size" && !ParseBenchmarkSize(argv[i + 1], benchmark_settings.width, benchmark_settings.height))
+			std::cout << "Invalid benchmark size " << argv[i + 1] << ", use WIDTHxHEIGHT" << std::endl;
+		else if (std::string(argv[i]) == "--benchmark-report")
+			benchmark_settings.report_file = argv[i + 1];
+		else if (std::string(argv[i]) == "--benchmark-trace")
+			benchmark_settings.trace_file = argv[i + 1];
+		else if (std::string(argv[i]) == "--replay")
+			benchmark_settings.replay_file = argv[i + 1];
+		else if (std::string(argv[i]) == "--depth-prepass")
+			depth_prepass = std::string(argv[i + 1]) == "on";
+		else if (std::string(argv[i]) == "--shader-cache")
+			shader_binary_cache = std::string(argv[i + 1]) != "off";
+		else if (std::string(argv[i]) == "--terrain-lod")
+			main_terrain_lod = std::max(atoi(argv[i + 1]), 0);
+		else if (std::string(argv[i]) == "--lamps")
+			lamp_count = glm::clamp(atoi(argv[i + 1]), 1, MAX_LAMP_COUNT);
+		else if (std::string(argv[i]) == "--record")
+			recording_file = argv[i + 1];
+		else if (std::string(argv[i]) == "--seed")
+		{
+			scene_seed = unsigned(strtoul(argv[i + 1], nullptr, 10));
+			seed_given = true;
+		}
+	}
+
+	// Headless benchmark on an offscreen context, no window is opened. A replay runs the benchmark on the recorded
+	// frames.
+	for (int i = 1; i < argc; ++i)
+		benchmark_settings.enabled = benchmark_settings.enabled || std::string(argv[i]) == "--benchmark";
+	benchmark_settings.enabled = benchmark_settings.enabled || !benchmark_settings.replay_file.empty();
+	if (benchmark_settings.enabled)
+	{
+		benchmark_settings.depth_prepass = depth_prepass;
+		if (!seed_given)
+			scene_seed = BENCHMARK_SCENE_SEED;
+		// The camera of the benchmark does not follow the input, there is nothing to record
+		recording_file.clear();
+		return runBenchmark();
+	}
+	input_recording.seed = scene_seed;
+
 	// Initialize GLUT
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGBA);
@@ -807,13 +1795,14 @@ int main(int argc, char ** argv)
 
 	// Initialize our OpenGL stuff
 	init();
+	frame_loop.SetPresentMode(present_mode);
 
 	// Register callbacks
 	glutDisplayFunc(render);
 	glutReshapeFunc(reshape);
 	glutKeyboardFunc(key_down);
 	glutKeyboardUpFunc(key_up);
-	glutTimerFunc(20, timer, 0);
+	glutIdleFunc(idle);
 	glutMouseFunc(mouse_button_changed);
 	glutMotionFunc(mouse_moved);
 	glutPassiveMotionFunc(mouse_moved);
@@ -822,6 +1811,7 @@ int main(int argc, char ** argv)
 
 	// Run the main loop
 	glutMainLoop();
+	saveInputRecording();
 
 	return 0;
 }
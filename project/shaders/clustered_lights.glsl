@@ -0,0 +1,51 @@
+// Point lights binned into the clusters of the view, see ClusteredLights. Included by the fragment shaders through
+// ShaderCache after their CameraData block, clusterIndex needs its view_matrix.
+
+uniform ClusterData
+{
+	vec4 cluster_scale;
+	ivec4 cluster_size;
+};
+
+// Position and range, ambient, diffuse and specular color of each light
+uniform samplerBuffer cluster_lights_tex;
+// Offset and count of the lights of each cluster in cluster_indices_tex
+uniform usamplerBuffer cluster_grid_tex;
+uniform usamplerBuffer cluster_indices_tex;
+
+int clusterIndex(vec3 position_ws)
+{
+	float view_depth = max(-(view_matrix * vec4(position_ws, 1.0)).z, 1e-4);
+	ivec3 cell = ivec3(ivec2(gl_FragCoord.xy * cluster_scale.xy), int(floor(log(view_depth) * cluster_scale.z + cluster_scale.w)));
+	cell = clamp(cell, ivec3(0), cluster_size.xyz - 1);
+	return (cell.z * cluster_size.y + cell.y) * cluster_size.x + cell.x;
+}
+
+// Light of the point lights of the cluster of the fragment, with the same model as the directional lights
+vec4 clusterLights(vec3 position_ws, vec3 N, vec3 Eye, vec4 mat_ambient, vec4 mat_diffuse, vec4 mat_specular, float shininess)
+{
+	vec4 light = vec4(0.0, 0.0, 0.0, 0.0);
+
+	uvec2 cluster_lights = texelFetch(cluster_grid_tex, clusterIndex(position_ws)).rg;
+	for (uint i = 0u; i < cluster_lights.y; i++) {
+		int texel = int(texelFetch(cluster_indices_tex, int(cluster_lights.x + i)).r) * 4;
+		vec4 light_position = texelFetch(cluster_lights_tex, texel);
+
+		float d = distance(position_ws, light_position.xyz);
+		float Ipow = max(0, 1 - (d / light_position.w));
+		if (Ipow == 0.0)
+			continue;
+
+		vec3 L = (light_position.xyz - position_ws) / max(d, 1e-4);
+		vec3 H = normalize(L + Eye);
+
+		float Idiff = max(dot(N, L), 0.0);
+		float Ispec = Idiff * pow(max(dot(N, H), 0.0), shininess);
+
+		light += mat_ambient * texelFetch(cluster_lights_tex, texel + 1) * Ipow +
+			mat_diffuse * texelFetch(cluster_lights_tex, texel + 2) * Idiff * Ipow +
+			mat_specular * texelFetch(cluster_lights_tex, texel + 3) * Ispec * Ipow;
+	}
+
+	return light;
+}
@@ -0,0 +1,23 @@
+#version 330
+
+in VertexData
+{
+	vec3 normal_ws;
+	vec3 position_ws;
+	vec2 tex_coord;
+} inData;
+
+uniform sampler2DArray tree_tex;
+uniform int tree_tex_layer;
+
+// Depth pre-pass of the vegetation. Only the texels that are nearly opaque write the depth, the blended edges are
+// left to the shading pass, which blends them over what is behind them.
+#ifndef ALPHA_CUTOFF
+#define ALPHA_CUTOFF 0.95
+#endif
+
+void main()
+{
+	if (texture(tree_tex, vec3(inData.tex_coord, tree_tex_layer)).a < ALPHA_CUTOFF)
+		discard;
+}
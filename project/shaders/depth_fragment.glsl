@@ -0,0 +1,6 @@
+#version 330
+
+// Depth pre-pass of opaque geometry, only the depth is written
+void main()
+{
+}
@@ -0,0 +1,15 @@
+#version 330
+
+out vec4 final_color;
+
+in vec2 vs_tex_coord;
+
+uniform sampler2D font_tex;
+uniform vec4 color;
+
+void main()
+{
+	if (texture(font_tex, vs_tex_coord).r < 0.5)
+		discard;
+	final_color = color;
+}
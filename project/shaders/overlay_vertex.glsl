@@ -0,0 +1,17 @@
+#version 330
+
+// Position in pixels from the top left corner of the viewport
+in vec2 position;
+in vec2 tex_coord;
+
+uniform vec2 viewport_size;
+uniform vec2 offset;
+
+out vec2 vs_tex_coord;
+
+void main()
+{
+	vec2 ndc = (position + offset) / viewport_size * 2.0 - 1.0;
+	vs_tex_coord = tex_coord;
+	gl_Position = vec4(ndc.x, -ndc.y, 0.0, 1.0);
+}
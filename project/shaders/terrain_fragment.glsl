@@ -1,10 +1,22 @@
 #version 330
 
-const int LIGHTS_COUNT = 2;
+// Directional lights, the point lights are clustered. The definitions are set by the program variant, these are
+// their defaults.
+#ifndef LIGHTS_COUNT
+#define LIGHTS_COUNT 1
+#endif
 
 out vec4 final_color;
 
-const float triplanar_blend_sharpness = 1.0;
+#ifndef TRIPLANAR_BLEND_SHARPNESS
+#define TRIPLANAR_BLEND_SHARPNESS 1.0
+#endif
+
+// Whether the normal and the ambient occlusion come from the baked maps of the terrain, the lamp uses the vertex
+// normals
+#ifndef BAKED_LIGHTING
+#define BAKED_LIGHTING 0
+#endif
 
 in VertexData
 {
@@ -34,6 +46,8 @@ uniform LightData
 	Light lights[LIGHTS_COUNT];
 };
 
+#include "clustered_lights.glsl"
+
 uniform MaterialData
 {
 	uniform vec4 material_ambient_color;
@@ -42,42 +56,52 @@ uniform MaterialData
 	uniform float material_shininess;
 };
 
-uniform sampler2D grass_tex;
-uniform sampler2D rocks_tex;
+uniform sampler2DArray terrain_tex;
+uniform int grass_layer;
+uniform int rocks_layer;
+
+#if BAKED_LIGHTING
+// Normal in the space of the vertex normals in rgb and the ambient occlusion in alpha, see TerrainLighting.h
+uniform sampler2D terrain_lighting_tex;
+#endif
 
 void main()
 {
+#if BAKED_LIGHTING
+	// The texel centers of the maps are at the vertices of the finest level of detail
+	vec4 baked = texture(terrain_lighting_tex, inData.tex_coord + 0.5 / vec2(textureSize(terrain_lighting_tex, 0)));
+	vec3 normal = baked.rgb * 2.0 - 1.0;
+	float occlusion = baked.a;
+#else
+	vec3 normal = inData.normal_ws;
+	float occlusion = 1.0;
+#endif
 	
 	// Difuse
     vec3 tex_color_x, tex_color_y, tex_color_z;
 	vec2 texture_scale = vec2(1.0, 1.0);
 	
-	float m = 1 - dot(inData.normal_ws, vec3(0, 1, 0));
+	float m = 1 - dot(normal, vec3(0, 1, 0));
 
 	if(inData.position_ws.y < 0.1) {
 		m = 1;
 	}
 
-	if (m < 0.7) {
-		tex_color_y = texture(grass_tex, inData.position_ws.xz * texture_scale).rgb;
-		tex_color_x = texture(grass_tex, inData.position_ws.zy * texture_scale).rgb;
-		tex_color_z = texture(grass_tex, inData.position_ws.xy * texture_scale).rgb;
-	} else {
-		tex_color_y = texture(rocks_tex, inData.position_ws.xz * texture_scale).rgb;
-		tex_color_x = texture(rocks_tex, inData.position_ws.zy * texture_scale).rgb;
-		tex_color_z = texture(rocks_tex, inData.position_ws.xy * texture_scale).rgb;
-	}
+	float layer = float(m < 0.7 ? grass_layer : rocks_layer);
+	tex_color_y = texture(terrain_tex, vec3(inData.position_ws.xz * texture_scale, layer)).rgb;
+	tex_color_x = texture(terrain_tex, vec3(inData.position_ws.zy * texture_scale, layer)).rgb;
+	tex_color_z = texture(terrain_tex, vec3(inData.position_ws.xy * texture_scale, layer)).rgb;
 
-	vec3 blendWeights = pow(abs(inData.normal_ws), vec3(triplanar_blend_sharpness, triplanar_blend_sharpness, triplanar_blend_sharpness));
+	vec3 blendWeights = pow(abs(normal), vec3(TRIPLANAR_BLEND_SHARPNESS));
 	blendWeights = blendWeights / (blendWeights.x + blendWeights.y + blendWeights.z);
 
 	vec4 tex_color = vec4(tex_color_x * blendWeights.x + tex_color_y * blendWeights.y + tex_color_z * blendWeights.z, 1.0);
 	
 	// Lights
-    vec3 N = normalize(inData.normal_ws);
+    vec3 N = normalize(normal);
 	vec3 Eye = normalize(eye_position - inData.position_ws);
 
-	vec4 mat_ambient = material_ambient_color * tex_color;
+	vec4 mat_ambient = material_ambient_color * tex_color * occlusion;
 	vec4 mat_diffuse = material_diffuse_color * tex_color;
 	vec4 mat_specular = material_specular_color;
 
@@ -105,6 +129,9 @@ void main()
 			mat_specular * lights[l].light_specular_color * Ispec * Ipow;
 	}
 
+	// Point lights of the cluster
+	light += clusterLights(inData.position_ws, N, Eye, mat_ambient, mat_diffuse, mat_specular, material_shininess);
+
 	// Final
 	final_color = vec4(light.rgb, tex_color.a);
 }
@@ -1,11 +1,31 @@
 #version 330
 
+// Whether the vertices are clipped at the water plane, only the reflection pass enables the clip distance
+#ifndef CLIP_PLANE
+#define CLIP_PLANE 1
+#endif
+
+// Size of LampData, the lamps share this shader and are drawn instanced, 0 for the terrain
+#ifndef LAMP_COUNT
+#define LAMP_COUNT 0
+#endif
+
 in vec4 position;
 in vec3 normal;
 in vec2 tex_coord;
 
 uniform mat4 model_matrix;
 
+#if LAMP_COUNT
+// Index of the first instance of this draw call in lamp_positions
+uniform int instance_offset;
+
+uniform LampData
+{
+	vec4 lamp_positions[LAMP_COUNT];
+};
+#endif
+
 uniform CameraData
 {
 	mat4 view_matrix;
@@ -20,16 +40,25 @@ out VertexData
 	vec2 tex_coord;
 } outData;
 
+// The depth pre-pass links the same shader, both programs have to compute exactly the same depth
+invariant gl_Position;
+
 void main()
 {
-	outData.position_ws = vec3(model_matrix * position);
+	vec4 position_ws = model_matrix * position;
+#if LAMP_COUNT
+	position_ws.xyz += lamp_positions[instance_offset + gl_InstanceID].xyz;
+#endif
+	outData.position_ws = vec3(position_ws);
 	
 	// No transformations applied!
 	outData.normal_ws = normal;
 
+#if CLIP_PLANE
 	gl_ClipDistance[0] = outData.position_ws.y;
+#endif
 
 	outData.tex_coord = tex_coord;
 
-	gl_Position = projection_matrix * view_matrix * model_matrix * position;
+	gl_Position = projection_matrix * view_matrix * position_ws;
 }
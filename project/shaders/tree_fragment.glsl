@@ -1,6 +1,15 @@
 #version 330
 
-const int LIGHTS_COUNT = 2;
+// Directional lights, the point lights are clustered. The definitions are set by the program variant, these are
+// their defaults.
+#ifndef LIGHTS_COUNT
+#define LIGHTS_COUNT 1
+#endif
+
+// Texels with a lower alpha are discarded
+#ifndef ALPHA_CUTOFF
+#define ALPHA_CUTOFF 0.1
+#endif
 
 out vec4 final_color;
 
@@ -32,6 +41,8 @@ uniform LightData
 	Light lights[LIGHTS_COUNT];
 };
 
+#include "clustered_lights.glsl"
+
 uniform MaterialData
 {
 	uniform vec4 material_ambient_color;
@@ -40,14 +51,15 @@ uniform MaterialData
 	uniform float material_shininess;
 };
 
-uniform sampler2D tree_tex;
+uniform sampler2DArray tree_tex;
+uniform int tree_tex_layer;
 
 void main()
 {
 
 	// Difuse
-    vec4 tex_color = texture(tree_tex, inData.tex_coord);
-	if (tex_color.a < 0.1) {
+    vec4 tex_color = texture(tree_tex, vec3(inData.tex_coord, tree_tex_layer));
+	if (tex_color.a < ALPHA_CUTOFF) {
 		discard;
 	}
 	
@@ -83,6 +95,9 @@ void main()
 			mat_specular * lights[l].light_specular_color * Ispec * Ipow;
 	}
 
+	// Point lights of the cluster
+	light += clusterLights(inData.position_ws, N, Eye, mat_ambient, mat_diffuse, mat_specular, material_shininess);
+
 	// Final
 	final_color = vec4(light.rgb, tex_color.a);
 }
@@ -1,6 +1,14 @@
 #version 330
 
-const int TREE_COUNT = 1000;
+// Instances in TreeData, the definitions are set by the program variant, these are their defaults
+#ifndef TREE_COUNT
+#define TREE_COUNT 1000
+#endif
+
+// Whether the vertices are clipped at the water plane, only the reflection pass enables the clip distance
+#ifndef CLIP_PLANE
+#define CLIP_PLANE 1
+#endif
 
 in vec4 position;
 in vec3 normal;
@@ -9,6 +17,8 @@ in vec2 tex_coord;
 uniform mat4 model_matrix;
 uniform float wind_height;
 uniform float app_time;
+// Index of the first instance of this draw call in tree_model_matrix
+uniform int instance_offset;
 
 uniform TreeData
 {
@@ -29,11 +39,17 @@ out VertexData
 	vec2 tex_coord;
 } outData;
 
+// The depth pre-pass links the same shader, both programs have to compute exactly the same depth
+invariant gl_Position;
+
 void main()
 {
-	vec4 instance_pos = tree_model_matrix[gl_InstanceID] * model_matrix * position;
+	mat4 instance_matrix = tree_model_matrix[instance_offset + gl_InstanceID];
+	vec4 instance_pos = instance_matrix * model_matrix * position;
 	
-	float w = pow(position.y / wind_height, 3) * max(0.1, sin(gl_InstanceID / 17.0));
+	// Instances are reordered by their level of detail, so the wind phase comes from their position
+	float phase = dot(instance_matrix[3].xz, vec2(0.37, 0.61));
+	float w = pow(position.y / wind_height, 3) * max(0.1, sin(phase));
 	float wx = w * sin(app_time * 0.7) * cos(app_time * 0.01);
 	float wy = w * cos(app_time * 0.3) * sin(app_time * 0.43);
 	instance_pos += vec4(wx, 0.0, wy, 0.0);
@@ -44,7 +60,9 @@ void main()
 	// This is correct as long as the transformation contains only translations and rotations.
 	outData.normal_ws = normalize(mat3(model_matrix) * normal);
 	
+#if CLIP_PLANE
 	gl_ClipDistance[0] = outData.position_ws.y;
+#endif
 
 	outData.tex_coord = tex_coord;
 
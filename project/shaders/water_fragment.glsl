@@ -1,6 +1,10 @@
 #version 330
 
-const int LIGHTS_COUNT = 2;
+// Directional lights, the point lights are clustered. The definitions are set by the program variant, these are
+// their defaults.
+#ifndef LIGHTS_COUNT
+#define LIGHTS_COUNT 1
+#endif
 
 out vec4 final_color;
 
@@ -32,6 +36,8 @@ uniform LightData
 	Light lights[LIGHTS_COUNT];
 };
 
+#include "clustered_lights.glsl"
+
 uniform MaterialData
 {
 	uniform vec4 material_ambient_color;
@@ -41,13 +47,15 @@ uniform MaterialData
 };
 
 uniform sampler2D reflection_tex;
+// Size of the window, the reflection may have a lower resolution
+uniform vec2 viewport_size;
 
 void main()
 {
 	// Reflection
 	vec2 reflectOffset = inData.normal_ws.xz * 0.1;
 
-	vec4 tex_color = texture(reflection_tex, (gl_FragCoord.xy) / textureSize(reflection_tex, 0) + reflectOffset);
+	vec4 tex_color = texture(reflection_tex, (gl_FragCoord.xy) / viewport_size + reflectOffset);
 	tex_color.a = 0.5;
 
 	// Lights
@@ -81,7 +89,10 @@ void main()
 			mat_diffuse * lights[l].light_diffuse_color * Idiff * Ipow +
 			mat_specular * lights[l].light_specular_color * Ispec * Ipow;
 	}
-	
+
+	// Point lights of the cluster
+	light += clusterLights(inData.position_ws, N, Eye, mat_ambient, mat_diffuse, mat_specular, material_shininess);
+
 	// Final
 	final_color = vec4(max(tex_color.rgb, light.rgb), tex_color.a);
 }
@@ -1,5 +1,10 @@
 #version 330
 
+// Whether the vertices are clipped at the water plane, only the reflection pass enables the clip distance
+#ifndef CLIP_PLANE
+#define CLIP_PLANE 1
+#endif
+
 in vec4 position;
 in vec3 normal;
 in vec2 tex_coord;
@@ -25,13 +30,18 @@ uniform sampler2D water_normal_tex;
 
 void main()
 {	
-	vec3 moved_normal = texture(water_normal_tex, tex_coord.st * 10 + vec2(app_time, app_time)).rbg - vec3(0.5, 0.5, 0.5);
+	// The normal map is BC5 compressed with only red and green, the blue is reconstructed from the unit length
+	vec2 normal_rg = texture(water_normal_tex, tex_coord.st * 10 + vec2(app_time, app_time)).rg * 2.0 - 1.0;
+	float normal_b = sqrt(max(1.0 - dot(normal_rg, normal_rg), 0.0));
+	vec3 moved_normal = vec3(normal_rg.x, normal_b, normal_rg.y) * 0.5;
 	vec4 moved_pos = position + vec4(moved_normal * 0.3, 0.0) * 0.05;
 	
 	outData.position_ws = vec3(model_matrix * moved_pos);
 	outData.normal_ws = moved_normal;
 	
+#if CLIP_PLANE
 	gl_ClipDistance[0] = outData.position_ws.y;
+#endif
 	
 	outData.tex_coord = tex_coord;
 